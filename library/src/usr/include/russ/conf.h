@@ -74,6 +74,7 @@ int russ_conf_read(struct russ_conf *, const char *);
 int russ_conf_readfd(struct russ_conf *, int);
 int russ_conf_remove_option(struct russ_conf *, const char *, const char *);
 int russ_conf_remove_section(struct russ_conf *, const char *);
+int russ_conf_reserve(struct russ_conf *, int);
 void russ_conf_sarray0_free(char **);
 char **russ_conf_sections(struct russ_conf *);
 int russ_conf_set(struct russ_conf *, const char *, const char *, const char *);
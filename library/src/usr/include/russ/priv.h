@@ -39,12 +39,18 @@ extern "C" {
 #include "russ/russ.h"
 
 #define RUSS_REQ_BUF_MAX	262144
+
+/* answer header for protocol 0011: nsysfds, statuses, nfds, statuses */
+#define RUSS_ANSWER_BATCH_SIZE	(4+RUSS_CONN_NSYSFDS+4+RUSS_CONN_NFDS)
+/* answer header nsysfds for a refused request (no fds follow) */
+#define RUSS_ANSWER_REFUSED	(-1)
 #define RUSS_LISTEN_BACKLOG	1024
 
 /* args.c */
 char **__russ_variadic_to_argv(int, int, int *, va_list);
 
 /* cconn.c */
+int russ_cconn_load_fds_batch(struct russ_cconn *, char *, int *, int);
 int russ_cconn_send_req(struct russ_cconn *, russ_deadline, struct russ_req *);
 
 /* encdec.c */
@@ -81,10 +87,21 @@ void russ_fds_close(int *, int);
 int russ_make_pipes(int, int *, int *);
 int russ_poll_deadline(russ_deadline, struct pollfd *, int);
 
+/* relay.c */
+int russ_relay_nextwait(struct russ_relay *, int, int *);
+int russ_relay_start(struct russ_relay *, int);
+int russ_relay_step(struct russ_relay *, int);
+void russ_relay_stop(struct russ_relay *);
+
 /* req.c */
 struct russ_req *russ_req_new(const char *, const char *, const char *, char **, char **);
 struct russ_req *russ_req_free(struct russ_req *);
 
+/* sconn.c */
+int russ_sconn_recv_handoff(struct russ_sconn *, russ_deadline);
+void russ_sconn_release_sd(struct russ_sconn *);
+void russ_sconn_set_protocol(struct russ_sconn *, struct russ_req *);
+
 /* sess.c */
 struct russ_sess *russ_sess_free(struct russ_sess *);
 struct russ_sess *russ_sess_new(struct russ_svr *, struct russ_sconn *, struct russ_req *, char *);
@@ -95,13 +112,23 @@ int russ_connect_deadline(russ_deadline, int, struct sockaddr *, socklen_t);
 int russ_connectunix_deadline(russ_deadline, char *);
 int russ_get_creds(int, struct russ_creds *);
 int russ_recv_fd(int, int *);
+int russ_recv_fds(int, char *, int, int *, int, int *);
 int russ_send_fd(int, int);
+int russ_send_fds(int, char *, int, int *, int);
 
 /* start.c */
 char *russ_ruspawn(char *);
 
 /* svr-fork.c */
 void russ_svr_loop_fork(struct russ_svr *);
+void russ_svr_loop_prefork(struct russ_svr *);
+
+/* svr-intake.c */
+struct russ_svr_intake;
+
+struct russ_svr_intake *russ_svr_intake_free(struct russ_svr_intake *);
+struct russ_svr_intake *russ_svr_intake_new(struct russ_svr *);
+struct russ_sconn *russ_svr_intake_next(struct russ_svr_intake *);
 
 /* svr-pthread.c */
 void russ_svr_loop_thread(struct russ_svr *);
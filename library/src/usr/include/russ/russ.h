@@ -52,6 +52,12 @@ extern "C" {
 #define RUSS__MIN( a,b )	(( (a) < (b) ) ? (a) : (b))
 #define RUSS__MAX( a,b )	(( (a) > (b) ) ? (a) : (b))
 
+/* buffer pool */
+#define RUSS_BUFPOOL_MINCAP	(1<<10)
+#define RUSS_BUFPOOL_MAXCAP	(1<<18)
+#define RUSS_BUFPOOL_MAXFREE	16
+#define RUSS_BUFPOOL_NCLASSES	9
+
 #define RUSS_CONN_NFDS		32
 #define RUSS_CONN_STD_NFDS	3
 #define RUSS_CONN_FD_STDIN	0
@@ -85,6 +91,7 @@ extern "C" {
 #define RUSS_MSG_NOSWITCHUSER	"error: service cannot switch user"
 #define RUSS_MSG_UNDEFSERVICE	"warning: undefined service"
 #define RUSS_MSG_BADUSER	"error: bad user"
+#define RUSS_MSG_BUSY		"error: server busy"
 
 #define RUSS_OPNUM_NOTSET	0
 #define RUSS_OPNUM_EXTENSION	1
@@ -94,11 +101,34 @@ extern "C" {
 #define RUSS_OPNUM_INFO		5
 #define RUSS_OPNUM_LIST		6
 
+/* fd handoff: client sends its own fds with the request */
+#define RUSS_FDHANDOFF_ATTR_PREFIX	"RUSS_FDHANDOFF="
+
 /* request */
 #define RUSS_REQ_ARGS_MAX	1024
 #define RUSS_REQ_ATTRS_MAX	1024
 #define RUSS_REQ_SPATH_MAX	65536
-#define RUSS_REQ_PROTOCOLSTRING	"0010"
+#define RUSS_REQ_PROTOCOLSTRING	"0011"
+#define RUSS_REQ_PROTOCOLSTRING_0010	"0010"
+#define RUSS_REQ_PROTOCOLSTRING_SESSION	"0012"
+
+/* shared memory ring (see lib/shmring.c) */
+#define RUSS_SHMRING_ATTR	"RUSS_SHMRING=1"
+#define RUSS_SHMRING_CAP_DEFAULT	(1<<20)
+#define RUSS_SHMRING_FDIDX	3
+#define RUSS_SHMRING_NFDS	3
+
+/* striped transfer (see lib/stripe.c) */
+#define RUSS_STRIPE_ATTR_PREFIX	"RUSS_STRIPES="
+#define RUSS_STRIPE_CHUNKSIZE	(1<<18)
+#define RUSS_STRIPE_FDIDX	6	/* after the shmring fds */
+#define RUSS_STRIPE_HDRSIZE	12
+#define RUSS_STRIPE_MAX		16
+#define RUSS_STRIPE_READ	0
+#define RUSS_STRIPE_WRITE	1
+
+/* spath */
+#define RUSS_SPATHCACHE_TTL	10000
 
 /* start */
 #define RUSS_STARTTYPE_START	1
@@ -108,8 +138,19 @@ extern "C" {
 #define RUSS_SVR_LIS_SD_DEFAULT	3
 #define RUSS_SVR_TIMEOUT_ACCEPT	INT_MAX
 #define RUSS_SVR_TIMEOUT_AWAIT	15000
+#define RUSS_SVR_TIMEOUT_SESSION	0
 #define RUSS_SVR_TYPE_FORK	1
 #define RUSS_SVR_TYPE_THREAD	2
+#define RUSS_SVR_TYPE_PREFORK	3
+
+#define RUSS_SVR_PREFORK_NWORKERS	4
+#define RUSS_SVR_PREFORK_MAXSESSIONS	1000
+#define RUSS_SVR_PREFORK_RESPAWN_NEVER	0
+#define RUSS_SVR_PREFORK_RESPAWN_ALWAYS	1
+#define RUSS_SVR_PREFORK_RETRYMAX	30
+
+#define RUSS_SVR_THREAD_POOLSIZE	16
+#define RUSS_SVR_THREAD_QUEUEMAX	64
 
 #define RUSS_SERVICES_DIR	"/var/run/russ/bb/system/services"
 
@@ -124,6 +165,7 @@ extern "C" {
 #define __RUSS_WAITPIDFD_PID	2
 
 typedef uint32_t	russ_opnum;
+typedef int64_t		russ_deadline;
 
 /**
 * Buffer object.
@@ -180,13 +222,18 @@ struct russ_sconn {
 	int			sd;		/**< socket descriptor */
 	int			fds[RUSS_CONN_NFDS];		/**< array of fds */
 	int			sysfds[RUSS_CONN_NSYSFDS];	/**< array of system fds */
+	struct russ_req		*req;		/**< request read ahead (by intake) */
+	int			fdbatch;	/**< answer fds in one message (protocol 0011) */
+	int			keepalive;	/**< keep sd after answer (session) */
+	int			keepsd;		/**< control socket kept after answer */
+	int			nhandoff;	/**< # of fds handed off by client */
+	russ_deadline		awaitdeadline;	/**< deadline for the request (and handed off fds) */
 };
 
 /* declare here, defined below */
 struct russ_sess;
 
 typedef void (*russ_svchandler)(struct russ_sess *);
-typedef int64_t russ_deadline;
 
 typedef struct russ_sconn *(*russ_accepthandler)(russ_deadline, int);
 typedef int (*russ_answerhandler)(struct russ_sconn *);
@@ -205,6 +252,40 @@ struct russ_svcnode {
 	int			wildcard;
 };
 
+/**
+* Frozen service node tree (see russ_svcnode_freeze()). Nodes are
+* stored in one array with the children of a node contiguous; each
+* node has an open addressing child table in slots.
+*/
+struct russ_svcindexnode {
+	struct russ_svcnode	*node;
+	unsigned int		hash;		/**< hash of node name */
+	int			namelen;
+	int			rank;		/**< position among siblings */
+	int			nchildren;
+	int			slot0;		/**< start of child table in slots */
+	int			slotmask;	/**< child table size - 1 */
+	int			wildcard;	/**< first wildcard child; -1 if none */
+	char			*prewildcard;	/**< last non-wildcard child name before wildcard */
+};
+
+struct russ_svcindex {
+	struct russ_svcindexnode	*nodes;
+	int				nnodes;
+	int				*slots;
+	int				nslots;
+};
+
+/**
+* Relay stream settings applied by stream index (see
+* russ_relay_set_defaults()).
+*/
+struct russ_relaydefaults {
+	int	rate;		/**< max bytes/sec read; 0 for no limit */
+	int	burst;		/**< token bucket size (bytes); 0 for default */
+	int	weight;		/**< scheduling weight; 0 for unweighted */
+};
+
 /**
 * Server object.
 */
@@ -224,6 +305,15 @@ struct russ_svr {
 	int			autoswitchuser;
 	int			matchclientuser;
 	char			*help;
+	int			preforknworkers;
+	int			preforkmaxsessions;
+	int			preforkrespawn;
+	int			threadpoolsize;
+	int			threadqueuemax;
+	int			intake;
+	struct russ_svcindex	*svcindex;
+	int			sessiontimeout;
+	struct russ_relaydefaults	relaydefaults[RUSS_CONN_STD_NFDS];
 };
 
 /**
@@ -238,6 +328,54 @@ struct russ_sess {
 	char			**options;
 };
 
+/**
+* Pre-resolved dial target.
+*/
+struct russ_target {
+	char			*saddr;		/**< socket address */
+	char			*spath;		/**< service path (passed to server) */
+};
+
+/**
+* Non-blocking dial (opaque; see russ_dial_start()).
+*/
+struct russ_dial;
+
+/**
+* Request for concurrent dials (see russ_dialv_many()).
+*/
+struct russ_dialreq;
+
+typedef void (*russ_dialreq_callback)(struct russ_dialreq *, void *);
+typedef void (*russ_dialreq_outcallback)(struct russ_dialreq *, int, char *, int, void *);
+
+struct russ_dialreq {
+	const char	*op;		/**< operation string */
+	const char	*spath;		/**< service path */
+	char		**attrv;	/**< attributes (may be NULL) */
+	char		**argv;		/**< arguments (may be NULL) */
+	struct russ_buf	*rbufs[3];	/**< in, out, err (may be NULL) */
+	int		timeout;	/**< timeout (ms) from start; <= 0 for none */
+	russ_dialreq_outcallback	outcb;	/**< out/err callback (may be NULL) */
+	int		wrv;		/**< wait return value (RUSS_WAIT_*) */
+	int		exitst;		/**< exit status */
+	void		*data;		/**< caller data */
+};
+
+/**
+* Client session (keep-alive control socket) to a service.
+*/
+struct russ_csession {
+	struct russ_target	*targ;		/**< dial target */
+	int			sd;		/**< kept control socket */
+	int			nosession;	/**< server lacks session support */
+};
+
+/**
+* Pool of buffers (opaque; see lib/bufpool.c).
+*/
+struct russ_bufpool;
+
 /**
 * Relay and support objects.
 */
@@ -261,15 +399,96 @@ struct russ_relaystream {
 	unsigned long	nwbytes;
 	unsigned long	nreads;
 	unsigned long	nwrites;
+
+	/* zero-copy (splice) */
+	int		zerocopy;	/**< move data with splice() if fds allow (rbuf unused); see russ_relay_set_zerocopy() */
+	int		pipefds[2];	/**< intermediate pipe */
+	int		npipe;		/**< bytes held in pipe */
+
+	/* engine */
+	int		rready;		/**< rfd known readable (until EAGAIN) */
+	int		wready;		/**< wfd known writable (until EAGAIN) */
+	int		queued;		/**< on relay ready queue */
+	int		reof;		/**< EOF seen on rfd */
+	int		rpolled;	/**< rfd left blocking (stdio): one read per readiness */
+	int		wpolled;	/**< wfd left blocking (stdio): one write per readiness */
+
+	/* ring buffer (see russ_relay_set_ring()) */
+	int		ring;		/**< overlap reads and writes; rbuf used as a ring */
+	int		highwater;	/**< stop reading at this many bytes held; 0 for buffer size */
+	int		rhead;		/**< offset of first held byte (ring) */
+	int		nheld;		/**< # of bytes held (ring) */
+
+	/* write coalescing (see russ_relay_set_coalesce()) */
+	int		minbatch;	/**< hold data until this many bytes; 0 to disable */
+	int		maxhold;	/**< max time (usec) to hold data */
+	int64_t		holdstart;	/**< time (usec) held data started waiting */
+	int		timed;		/**< on relay timer queue */
+
+	/* adaptive buffer (see russ_relay_set_bufsizes()) */
+	struct russ_bufpool	*bufpool;	/**< source of rbuf (NULL for shared) */
+	int		mincap;		/**< min buffer capacity; 0 for fixed */
+	int		maxcap;		/**< max buffer capacity */
+	int		nfull;		/**< # of consecutive reads that filled the room */
+	int64_t		idlestart;	/**< time (usec) stream went idle */
+
+	/* rate limit (see russ_relay_set_rate()) */
+	int		rate;		/**< max bytes/sec read; 0 for no limit */
+	int		burst;		/**< token bucket size (bytes) */
+	int64_t		tokens;		/**< bytes that may be read now */
+	int64_t		tokenstamp;	/**< time (usec) of last token refill */
+
+	/* scheduling (see russ_relay_set_weight()) */
+	int		weight;		/**< share of reads per turn; 0 for unweighted */
+	int64_t		deficit;	/**< bytes left in current share */
 };
 
+/**
+* Per-fd relay lookup entry (opaque; see lib/relay.c).
+*/
+struct russ_relayfd;
+
 struct russ_relay {
 	int				nstreams;
 	int				exitfd;
 	struct russ_relaystream		**streams;
 	struct pollfd			*pollfds;
+
+	/* engine */
+	int				epfd;		/**< epoll fd; -1 to use poll() */
+	struct russ_relayfd		*fdmap;		/**< streams by fd */
+	int				nfdmap;		/**< size of fdmap */
+	int				*readyq;	/**< indexes of streams with pending work */
+	int				nreadyq;	/**< # of queued streams */
+	int				*timerq;	/**< indexes of streams holding data */
+	int				ntimerq;	/**< # of timed streams */
+	int				nactive;	/**< # of fds (streams and exitfd) being served */
+	struct epoll_event		*evs;		/**< event list while serving */
+	int				nevs;		/**< size of evs */
+	int				timerfd;	/**< timed work signal (reactor); -1 otherwise */
+
+	struct russ_bufpool		*bufpool;	/**< source of stream buffers */
+	struct russ_relaydefaults	defaults[RUSS_CONN_STD_NFDS];	/**< for streams added at these indexes */
 };
 
+/**
+* Reactor serving many relays from one or a few threads (opaque;
+* see lib/reactor.c).
+*/
+struct russ_reactor;
+
+typedef void (*russ_reactor_callback)(struct russ_relay *, int, void *);
+
+/**
+* Shared memory ring (opaque; see lib/shmring.c).
+*/
+struct russ_shmring;
+
+/**
+* Striped transfer over several fds (opaque; see lib/stripe.c).
+*/
+struct russ_stripe;
+
 /* buf.c */
 int russ_buf_load(struct russ_buf *, char *, int, int);
 int russ_buf_init(struct russ_buf *, char *, int, int);
@@ -282,14 +501,29 @@ void russ_buf_reset(struct russ_buf *);
 int russ_buf_resize(struct russ_buf *, int);
 int russ_buf_set(struct russ_buf *, char *buf, int count);
 
+/* bufpool.c */
+struct russ_bufpool *russ_bufpool_new(int, int);
+struct russ_bufpool *russ_bufpool_free(struct russ_bufpool *);
+struct russ_buf *russ_bufpool_get(struct russ_bufpool *, int);
+struct russ_buf *russ_bufpool_put(struct russ_bufpool *, struct russ_buf *);
+struct russ_bufpool *russ_bufpool_shared(void);
+int russ_bufpool_trim(struct russ_bufpool *, int);
+
 /* cconn.c */
 struct russ_cconn *russ_cconn_free(struct russ_cconn *);
 struct russ_cconn *russ_cconn_new(void);
 void russ_cconn_close(struct russ_cconn *);
 void russ_cconn_close_fd(struct russ_cconn *, int);
+struct russ_shmring *russ_cconn_shmring(struct russ_cconn *);
+struct russ_stripe *russ_cconn_stripe(struct russ_cconn *, int, int);
 int russ_cconn_wait(struct russ_cconn *, russ_deadline, int *);
 struct russ_cconn *russ_dialv(russ_deadline, const char *, const char *, char **, char **);
+struct russ_cconn *russ_dialv_target(russ_deadline, const char *, struct russ_target *, char **, char **);
 struct russ_cconn *russ_diall(russ_deadline, const char *, const char *, char **, ...);
+struct russ_cconn *russ_dialv_handoff(russ_deadline, const char *, const char *, char **, char **, int, int *);
+struct russ_csession *russ_csession_free(struct russ_csession *);
+struct russ_csession *russ_csession_new(const char *);
+struct russ_cconn *russ_csession_dialv(struct russ_csession *, russ_deadline, const char *, char **, char **);
 
 /* convenience.c */
 struct russ_cconn *russ_dialv_timeout(int, const char *, const char *, char **, char **);
@@ -300,6 +534,17 @@ int russ_dialv_wait_inouterr_timeout(int, const char *, const char *, char **, c
 int russ_dialv_wait_inouterr3(russ_deadline, const char *, const char *, char **, char **, int *, struct russ_buf *, struct russ_buf *, struct russ_buf *);
 struct russ_svr *russ_init(struct russ_conf *);
 
+/* dial.c */
+struct russ_dial *russ_dial_free(struct russ_dial *);
+struct russ_dial *russ_dial_start(russ_deadline, const char *, const char *, char **, char **);
+struct russ_dial *russ_dial_start_target(russ_deadline, const char *, struct russ_target *, char **, char **);
+int russ_dial_advance(struct russ_dial *);
+struct russ_cconn *russ_dial_finish(struct russ_dial *);
+int russ_dial_pollfd(struct russ_dial *, int *);
+int russ_dial_timeout(struct russ_dial *);
+int russ_dial_set_handoff(struct russ_dial *, int, int *);
+int russ_dialv_many(russ_deadline, struct russ_dialreq *, int, int, russ_dialreq_callback, void *);
+
 /* env.c */
 int russ_env_clear(void);
 int russ_env_reset(void);
@@ -339,6 +584,13 @@ int russ_write_exit(int, int);
 const char *russ_optable_find_op(struct russ_optable *, russ_opnum);
 russ_opnum russ_optable_find_opnum(struct russ_optable *, const char *);
 
+/* reactor.c */
+struct russ_reactor *russ_reactor_new(void);
+struct russ_reactor *russ_reactor_free(struct russ_reactor *);
+int russ_reactor_add(struct russ_reactor *, struct russ_relay *, int, russ_reactor_callback, void *);
+int russ_reactor_count(struct russ_reactor *);
+int russ_reactor_serve(struct russ_reactor *, int);
+
 /* relay.c */
 struct russ_relay *russ_relay_new(int);
 struct russ_relay *russ_relay_free(struct russ_relay *);
@@ -350,6 +602,13 @@ int russ_relay_loop(int, int, int *, int *, int *, int *, int);
 int russ_relay_remove(struct russ_relay *, int, int);
 int russ_relay_poll(struct russ_relay *, int);
 int russ_relay_serve(struct russ_relay *, int, int);
+int russ_relay_set_bufsizes(struct russ_relay *, int, int, int);
+int russ_relay_set_coalesce(struct russ_relay *, int, int, int);
+int russ_relay_set_defaults(struct russ_relay *, int, int, int, int);
+int russ_relay_set_rate(struct russ_relay *, int, int, int);
+int russ_relay_set_ring(struct russ_relay *, int, int);
+int russ_relay_set_weight(struct russ_relay *, int, int);
+int russ_relay_set_zerocopy(struct russ_relay *, int, int);
 
 /* sarray0.c */
 char **russ_sarray0_new(int, ...);
@@ -375,15 +634,27 @@ struct russ_sconn *russ_sconn_accept(russ_deadline, int);
 struct russ_sconn *russ_sconn_accepthandler(russ_deadline, int);
 int russ_sconn_answer(struct russ_sconn *, int, int *);
 int russ_sconn_answerhandler(struct russ_sconn *);
+int russ_sconn_answershmring(struct russ_sconn *, struct russ_req *, int, struct russ_shmring **);
+int russ_sconn_answerstripes(struct russ_sconn *, struct russ_req *, int);
 struct russ_req *russ_sconn_await_req(struct russ_sconn *, russ_deadline);
 void russ_sconn_close(struct russ_sconn *);
 void russ_sconn_close_fd(struct russ_sconn *, int);
 int russ_sconn_exit(struct russ_sconn *, int);
 int russ_sconn_fatal(struct russ_sconn *, const char *, int);
 int russ_sconn_redialandsplice(struct russ_sconn *, russ_deadline, struct russ_req *);
+int russ_sconn_refuse(struct russ_sconn *);
 int russ_sconn_send_fds(struct russ_sconn *, int, int *);
 int russ_sconn_splice(struct russ_sconn *, struct russ_cconn *);
 
+/* shmring.c */
+struct russ_shmring *russ_shmring_attach(int *);
+void russ_shmring_close(struct russ_shmring *);
+int russ_shmring_dupfds(struct russ_shmring *, int *);
+struct russ_shmring *russ_shmring_free(struct russ_shmring *);
+struct russ_shmring *russ_shmring_new(int);
+ssize_t russ_shmring_read(struct russ_shmring *, void *, size_t, russ_deadline);
+ssize_t russ_shmring_write(struct russ_shmring *, const void *, size_t, russ_deadline);
+
 /* socket.c */
 int russ_announce(char *, mode_t, uid_t, gid_t);
 int russ_unlink(const char *);
@@ -397,6 +668,10 @@ char *russ_spath_resolve(const char *);
 char *russ_spath_resolvewithuid(const char *, uid_t *, int);
 int russ_spath_split(const char *, char **, char **);
 char *russ_spath_stripoptions(const char *);
+void russ_spathcache_clear(void);
+int russ_spathcache_set_ttl(int);
+struct russ_target *russ_target_free(struct russ_target *);
+struct russ_target *russ_target_new(const char *);
 
 /* start.c */
 char *russ_start(int, struct russ_conf *);
@@ -408,11 +683,20 @@ int russ_str_get_comp(const char *, char, int, char *, int);
 char *russ_str_replace_char(char *, char, char);
 char *russ_str_resolve(const char *s, char **vars);
 
+/* stripe.c */
+struct russ_stripe *russ_stripe_free(struct russ_stripe *);
+struct russ_stripe *russ_stripe_new(int, int, int *, int);
+ssize_t russ_stripe_read(struct russ_stripe *, void *, size_t);
+ssize_t russ_stripe_write(struct russ_stripe *, const void *, size_t);
+
 /* svcnode.c */
 struct russ_svcnode *russ_svcnode_new(const char *, russ_svchandler);
 struct russ_svcnode *russ_svcnode_free(struct russ_svcnode *);
 struct russ_svcnode *russ_svcnode_add(struct russ_svcnode *, const char *, russ_svchandler);
 struct russ_svcnode *russ_svcnode_find(struct russ_svcnode *, const char *, char *, int);
+struct russ_svcindex *russ_svcnode_freeze(struct russ_svcnode *);
+struct russ_svcindex *russ_svcindex_free(struct russ_svcindex *);
+struct russ_svcnode *russ_svcindex_find(struct russ_svcindex *, const char *, char *, int);
 int russ_svcnode_set_autoanswer(struct russ_svcnode *, int);
 int russ_svcnode_set_handler(struct russ_svcnode *, russ_svchandler);
 int russ_svcnode_set_virtual(struct russ_svcnode *, int);
@@ -424,6 +708,7 @@ struct russ_svr *russ_svr_free(struct russ_svr *);
 struct russ_sconn *russ_svr_accept(struct russ_svr *, russ_deadline);
 void russ_svr_handler(struct russ_svr *, struct russ_sconn *);
 void russ_svr_loop(struct russ_svr *);
+int russ_svr_apply_relaydefaults(struct russ_svr *, struct russ_relay *);
 int russ_svr_set_accepthandler(struct russ_svr *, russ_accepthandler);
 int russ_svr_set_accepttimeout(struct russ_svr *, int);
 int russ_svr_set_allowrootuser(struct russ_svr *, int);
@@ -431,13 +716,22 @@ int russ_svr_set_answerhandler(struct russ_svr *, russ_answerhandler);
 int russ_svr_set_autoswitchuser(struct russ_svr *, int);
 int russ_svr_set_closeonaccept(struct russ_svr *, int);
 int russ_svr_set_help(struct russ_svr *, const char *);
+int russ_svr_set_intake(struct russ_svr *, int);
 int russ_svr_set_matchclientuser(struct russ_svr *, int);
+int russ_svr_set_preforkmaxsessions(struct russ_svr *, int);
+int russ_svr_set_preforknworkers(struct russ_svr *, int);
+int russ_svr_set_preforkrespawn(struct russ_svr *, int);
 int russ_svr_set_root(struct russ_svr *, struct russ_svcnode *);
 int russ_svr_set_lisd(struct russ_svr *, int);
+int russ_svr_set_threadpoolsize(struct russ_svr *, int);
+int russ_svr_set_threadqueuemax(struct russ_svr *, int);
+int russ_svr_set_sessiontimeout(struct russ_svr *, int);
+int russ_svr_set_relaydefaults(struct russ_svr *, int, int, int, int);
 int russ_svr_set_type(struct russ_svr *, int);
 
 /* time.c */
 russ_deadline russ_gettime(void); /* internal */
+int64_t russ_gettime_us(void); /* internal */
 russ_deadline russ_to_deadline(int);
 russ_deadline russ_to_deadlinediff(russ_deadline);
 int russ_to_timeout(russ_deadline);
@@ -0,0 +1,218 @@
+/*
+* lib/bufpool.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Size-classed pool of russ_buf objects.
+*
+* Capacities are rounded up to a power of 2 class (from
+* RUSS_BUFPOOL_MINCAP) so that buffers freed by one user can be
+* reused by another without going through malloc/free. Buffers
+* larger than the pool's maximum class are not pooled, and at most
+* RUSS_BUFPOOL_MAXFREE free buffers are kept per class (see
+* russ_bufpool_trim() to release them). Access is serialized with a
+* mutex so that a pool can be shared by threads (e.g., sessions of a
+* threaded server); no allocation or free is done while holding it.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <russ/priv.h>
+
+struct russ_bufpool {
+	pthread_mutex_t		lock;
+	int			maxcap;		/**< largest pooled capacity */
+	int			maxfree;	/**< max free buffers kept per class */
+	struct russ_buf		*free[RUSS_BUFPOOL_NCLASSES][RUSS_BUFPOOL_MAXFREE];
+	int			nfree[RUSS_BUFPOOL_NCLASSES];
+};
+
+/* process-wide pool (see russ_bufpool_shared()) */
+static struct russ_bufpool	__russ_bufpool_shared = {
+	PTHREAD_MUTEX_INITIALIZER, RUSS_BUFPOOL_MAXCAP, RUSS_BUFPOOL_MAXFREE, { { NULL } }, { 0 },
+};
+
+/**
+* Return class index for capacity.
+*
+* @param self		russ_bufpool object
+* @param cap		capacity
+* @return		class index; -1 if not pooled
+*/
+static int
+__russ_bufpool_class(struct russ_bufpool *self, int cap) {
+	int	i, ccap;
+
+	for (i = 0, ccap = RUSS_BUFPOOL_MINCAP; (i < RUSS_BUFPOOL_NCLASSES) && (ccap <= self->maxcap); i++, ccap <<= 1) {
+		if (cap <= ccap) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+* Return the process-wide pool. It is always available and must not
+* be freed.
+*
+* @return		russ_bufpool object
+*/
+struct russ_bufpool *
+russ_bufpool_shared(void) {
+	return &__russ_bufpool_shared;
+}
+
+/**
+* Create a new pool.
+*
+* @param maxcap		largest capacity to pool (at most
+*			RUSS_BUFPOOL_MAXCAP)
+* @param maxfree	max free buffers kept per class (at most
+*			RUSS_BUFPOOL_MAXFREE)
+* @return		russ_bufpool object; NULL on failure
+*/
+struct russ_bufpool *
+russ_bufpool_new(int maxcap, int maxfree) {
+	struct russ_bufpool	*self = NULL;
+	int			i;
+
+	if ((self = russ_malloc(sizeof(struct russ_bufpool))) == NULL) {
+		return NULL;
+	}
+	if (pthread_mutex_init(&self->lock, NULL) != 0) {
+		return russ_free(self);
+	}
+	self->maxcap = RUSS__MIN(maxcap, RUSS_BUFPOOL_MAXCAP);
+	self->maxfree = RUSS__MAX(RUSS__MIN(maxfree, RUSS_BUFPOOL_MAXFREE), 0);
+	for (i = 0; i < RUSS_BUFPOOL_NCLASSES; i++) {
+		self->nfree[i] = 0;
+	}
+	return self;
+}
+
+/**
+* Free pool and the free buffers it holds. Buffers in use are not
+* affected (and will be freed when put back).
+*
+* @param self		russ_bufpool object
+* @return		NULL
+*/
+struct russ_bufpool *
+russ_bufpool_free(struct russ_bufpool *self) {
+	if ((self) && (self != &__russ_bufpool_shared)) {
+		russ_bufpool_trim(self, 0);
+		pthread_mutex_destroy(&self->lock);
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+/**
+* Get an empty buffer with at least the requested capacity.
+*
+* @param self		russ_bufpool object (NULL for shared)
+* @param cap		minimum capacity
+* @return		russ_buf object; NULL on failure
+*/
+struct russ_buf *
+russ_bufpool_get(struct russ_bufpool *self, int cap) {
+	struct russ_buf	*buf = NULL;
+	int		i;
+
+	self = (self) ? self : &__russ_bufpool_shared;
+	if ((i = __russ_bufpool_class(self, cap)) < 0) {
+		return russ_buf_new(cap);
+	}
+	pthread_mutex_lock(&self->lock);
+	if (self->nfree[i] > 0) {
+		buf = self->free[i][--self->nfree[i]];
+	}
+	pthread_mutex_unlock(&self->lock);
+	if (buf == NULL) {
+		return russ_buf_new(RUSS_BUFPOOL_MINCAP<<i);
+	}
+	russ_buf_reset(buf);
+	return buf;
+}
+
+/**
+* Put buffer back into pool (or free it if the pool does not take
+* it).
+*
+* @param self		russ_bufpool object (NULL for shared)
+* @param buf		russ_buf object
+* @return		NULL
+*/
+struct russ_buf *
+russ_bufpool_put(struct russ_bufpool *self, struct russ_buf *buf) {
+	int	i;
+
+	if (buf == NULL) {
+		return NULL;
+	}
+	self = (self) ? self : &__russ_bufpool_shared;
+	if (((i = __russ_bufpool_class(self, buf->cap)) < 0)
+		|| ((RUSS_BUFPOOL_MINCAP<<i) != buf->cap)) {
+		/* not pool sized */
+		return russ_buf_free(buf);
+	}
+	pthread_mutex_lock(&self->lock);
+	if (self->nfree[i] < self->maxfree) {
+		self->free[i][self->nfree[i]++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&self->lock);
+	return russ_buf_free(buf);
+}
+
+/**
+* Release free buffers held by the pool, e.g., after a burst of
+* activity.
+*
+* @param self		russ_bufpool object (NULL for shared)
+* @param keep		max free buffers to keep per class
+* @return		# of buffers freed
+*/
+int
+russ_bufpool_trim(struct russ_bufpool *self, int keep) {
+	struct russ_buf	*bufs[RUSS_BUFPOOL_MAXFREE];
+	int		i, j, n, nfreed;
+
+	self = (self) ? self : &__russ_bufpool_shared;
+	keep = RUSS__MAX(keep, 0);
+	nfreed = 0;
+	for (i = 0; i < RUSS_BUFPOOL_NCLASSES; i++) {
+		n = 0;
+		pthread_mutex_lock(&self->lock);
+		while (self->nfree[i] > keep) {
+			bufs[n++] = self->free[i][--self->nfree[i]];
+		}
+		pthread_mutex_unlock(&self->lock);
+		for (j = 0; j < n; j++) {
+			russ_buf_free(bufs[j]);
+		}
+		nfreed += n;
+	}
+	return nfreed;
+}
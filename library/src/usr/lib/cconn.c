@@ -39,6 +39,10 @@
 
 #include "russ/priv.h"
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
 /**
 * Free client connection object.
 *
@@ -84,35 +88,138 @@ russ_cconn_close_fd(struct russ_cconn *self, int index) {
 }
 
 /**
-* Receive fds from client connection.
+* Attach to the shared memory ring answered by the server (see
+* russ_sconn_answershmring()).
+*
+* The ring is only answered if the dial had the RUSS_SHMRING_ATTR
+* attribute and the server supports it; otherwise, NULL is returned
+* and stdio should be used. The ring fds are taken over by the ring.
 *
 * @param self		client connection object
-* @param deadline	deadline for operation
-* @param nfds		size of fds array
-* @param fds		array for descriptors
-* @return		0 on success; -1 on error
+* @return		russ_shmring object; NULL if not available
 */
-static int
-russ_cconn_recv_fds(struct russ_cconn *self, russ_deadline deadline, int nfds, int *fds) {
-	char	buf[32+RUSS_CONN_MAX_NFDS];
-	char	*bp = NULL, *bend = NULL;
-	int	recvnfds, i;
-
-	/* recv count of fds and fd statuses */
-	if ((russ_readn_deadline(deadline, self->sd, buf, 4) < 4)
-		|| (russ_dec_int32(buf, &recvnfds) == NULL)
-		|| (recvnfds > nfds)
-		|| (russ_readn_deadline(deadline, self->sd, buf, recvnfds) < recvnfds)) {
-		return -1;
+struct russ_shmring *
+russ_cconn_shmring(struct russ_cconn *self) {
+	return russ_shmring_attach(&self->fds[RUSS_SHMRING_FDIDX]);
+}
+
+/**
+* Set up a striped transfer over the lane fds answered by the server
+* (see russ_sconn_answerstripes()).
+*
+* Lanes are only answered if the dial had a RUSS_STRIPE_ATTR_PREFIX
+* attribute and the server supports it; otherwise, NULL is returned
+* and stdio should be used. The lane fds are taken over by the
+* stripe.
+*
+* @param self		client connection object
+* @param mode		RUSS_STRIPE_READ or RUSS_STRIPE_WRITE
+* @param chunksize	chunk size (<= 0 for default; must match server)
+* @return		russ_stripe object; NULL if not available
+*/
+struct russ_stripe *
+russ_cconn_stripe(struct russ_cconn *self, int mode, int chunksize) {
+	int	n;
+
+	for (n = 0; (n < RUSS_STRIPE_MAX) && (RUSS_STRIPE_FDIDX+n < RUSS_CONN_NFDS)
+		&& (self->fds[RUSS_STRIPE_FDIDX+n] >= 0); n++);
+	if (n == 0) {
+		return NULL;
 	}
+	return russ_stripe_new(mode, n, &self->fds[RUSS_STRIPE_FDIDX], chunksize);
+}
 
-	/* (assume initialization) recv fds and load */
-	for (i = 0; i < recvnfds; i++) {
-		if ((buf[i]) && (russ_recv_fd(self->sd, &fds[i]) < 0)) {
-			return -1;
+/**
+* Load sysfds and fds received in one message (protocol 0011).
+*
+* The answer header (counts and statuses) is decoded and received
+* descriptors are assigned in order. On failure, all received
+* descriptors are closed.
+*
+* @param self		client connection object
+* @param buf		answer header (RUSS_ANSWER_BATCH_SIZE bytes)
+* @param recvfds	received descriptors
+* @param nrecvfds	number of received descriptors
+* @return		0 on success; -1 on error
+*/
+int
+russ_cconn_load_fds_batch(struct russ_cconn *self, char *buf, int *recvfds, int nrecvfds) {
+	char	*bp = NULL;
+	int	nsysfds, nfds, i, j;
+
+	/* decode counts and statuses; load fds in order */
+	j = 0;
+	if (((bp = russ_dec_int32(buf, &nsysfds)) == NULL)
+		|| (nsysfds < 0) || (nsysfds > RUSS_CONN_NSYSFDS)) {
+		goto close_fds;
+	}
+	for (i = 0; i < nsysfds; i++) {
+		if (bp[i]) {
+			if (j == nrecvfds) {
+				goto close_fds;
+			}
+			self->sysfds[i] = recvfds[j++];
 		}
 	}
+	if (((bp = russ_dec_int32(bp+RUSS_CONN_NSYSFDS, &nfds)) == NULL)
+		|| (nfds < 0) || (nfds > RUSS_CONN_NFDS)) {
+		goto close_fds;
+	}
+	for (i = 0; i < nfds; i++) {
+		if (bp[i]) {
+			if (j == nrecvfds) {
+				goto close_fds;
+			}
+			self->fds[i] = recvfds[j++];
+		}
+	}
+	if (j != nrecvfds) {
+		goto close_fds;
+	}
 	return 0;
+
+close_fds:
+	russ_fds_close(self->sysfds, RUSS_CONN_NSYSFDS);
+	russ_fds_close(self->fds, RUSS_CONN_NFDS);
+	for (; j < nrecvfds; j++) {
+		russ_fds_close(&recvfds[j], 1);
+	}
+	return -1;
+}
+
+/**
+* Receive sysfds and fds from client connection in one message
+* (protocol 0011).
+*
+* @param self		client connection object
+* @param deadline	deadline for operation
+* @return		0 on success; -1 on error; -2 if the server
+*			closed the connection without answering (e.g.,
+*			it does not support protocol 0011)
+*/
+static int
+russ_cconn_recv_fds_batch(struct russ_cconn *self, russ_deadline deadline) {
+	struct pollfd	pollfds[1];
+	char		buf[RUSS_ANSWER_BATCH_SIZE];
+	int		recvfds[RUSS_CONN_NSYSFDS+RUSS_CONN_NFDS];
+	int		nrecvfds, n;
+
+	pollfds[0].fd = self->sd;
+	pollfds[0].events = POLLIN;
+	if (russ_poll_deadline(deadline, pollfds, 1) <= 0) {
+		return -1;
+	}
+	if ((n = russ_recv_fds(self->sd, buf, sizeof(buf), recvfds, RUSS_CONN_NSYSFDS+RUSS_CONN_NFDS, &nrecvfds)) < 0) {
+		return -1;
+	} else if (n == 0) {
+		return -2;
+	}
+	if ((n < sizeof(buf))
+		&& (russ_readn_deadline(deadline, self->sd, buf+n, sizeof(buf)-n) < sizeof(buf)-n)) {
+		russ_fds_close(recvfds, nrecvfds);
+		return -1;
+	}
+	return russ_cconn_load_fds_batch(self, buf, recvfds, nrecvfds);
 }
 
 /**
@@ -217,100 +324,133 @@ russ_cconn_send_req(struct russ_cconn *self, russ_deadline deadline, struct russ
 }
 
 /**
-* Dial service.
+* Run a dial to completion (blocking).
 *
-* Connect to a service, send request information, and get fds.
-* Received fds are saved to the client connection object.
+* @param dial		dial object (freed)
+* @param deadline	deadline to complete dial
+* @return		client connection object; NULL on failure
+*/
+static struct russ_cconn *
+__russ_dial_run(struct russ_dial *dial, russ_deadline deadline) {
+	struct pollfd		pollfds[1];
+	russ_deadline		pdeadline;
+	int			events, timeout, rv;
+
+	while (russ_dial_advance(dial) == 0) {
+		pollfds[0].fd = russ_dial_pollfd(dial, &events);
+		pollfds[0].events = events;
+		pdeadline = deadline;
+		if ((timeout = russ_dial_timeout(dial)) >= 0) {
+			/* connect retry is due first */
+			pdeadline = RUSS__MIN(deadline, russ_to_deadline(timeout));
+		}
+		if (((rv = russ_poll_deadline(pdeadline, pollfds, 1)) < 0)
+			|| ((rv == 0) && (pdeadline == deadline))) {
+			if (RUSS_DEBUG_russ_dialv) {
+				fprintf(stderr, "RUSS_DEBUG_russ_dialv:russ_poll_deadline() <= 0\n");
+			}
+			break;
+		}
+	}
+	return russ_dial_finish(dial);
+}
+
+/**
+* Dial a pre-resolved target.
+*
+* Connect to the target socket, send request information, and get
+* fds. Received fds are saved to the client connection object.
+*
+* This is the blocking form of russ_dial_start_target(),
+* russ_dial_advance(), and russ_dial_finish().
 *
 * @param deadline	deadline to complete operation
 * @param op		operation string
-* @param spath		service path
+* @param targ		target object (see russ_target_new())
 * @param attrv		NULL-terminated array of attributes ("name=value" strings)
 * @param argv		NULL-terminated array of arguments
 * @return		client connection object; NULL on failure
 */
 struct russ_cconn *
-russ_dialv(russ_deadline deadline, const char *op, const char *spath, char **attrv, char **argv) {
-	struct russ_cconn	*cconn = NULL;
-	struct russ_req		*req = NULL;
-	struct russ_target	*targ = NULL;
-	char			*caddr = NULL;
-	char			*saddr = NULL, *spath2 = NULL;
+russ_dialv_target(russ_deadline deadline, const char *op, struct russ_target *targ, char **attrv, char **argv) {
+	struct russ_dial	*dial = NULL;
 
-	if (russ_spath_split(spath, &saddr, &spath2) < 0) {
+	if ((dial = russ_dial_start_target(deadline, op, targ, attrv, argv)) == NULL) {
 		if (RUSS_DEBUG_russ_dialv) {
-			fprintf(stderr, "RUSS_DEBUG_russ_dialv:russ_spath_split() < 0\n");
+			fprintf(stderr, "RUSS_DEBUG_russ_dialv:russ_dial_start_target() == NULL\n");
 		}
 		return NULL;
-	} else {
-		if (RUSS_DEBUG_russ_dialv) {
-			fprintf(stderr, "RUSS_DEBUG_russ_dialv:saddr == %s\n", saddr);
-			fprintf(stderr, "RUSS_DEBUG_russ_dialv:spath2 == %s\n", spath2);
-		}
 	}
-	if (russ_is_conffile(saddr)) {
-		/* saddr points to configuration */
-		caddr = realpath(saddr, NULL);
-		saddr = russ_free(saddr);
+	return __russ_dial_run(dial, deadline);
+}
 
-		/* use saddr to point to spawned socket */
-		saddr = russ_ruspawn(caddr);
-		caddr = russ_free(caddr);
-		if (saddr == NULL) {
-			if (RUSS_DEBUG_russ_dialv) {
-				fprintf(stderr, "RUSS_DEBUG_russ_dialv:saddr == NULL\n");
-			}
-			goto free_saddr;
-		}
-	}
+/**
+* Dial service, handing off fds to the server (see
+* russ_dial_set_handoff()).
+*
+* If the server uses the fds directly, the returned client
+* connection object has no fds (all -1) and only the exit fd is of
+* interest; otherwise, it is as for russ_dialv().
+*
+* @param deadline	deadline to complete operation
+* @param op		operation string
+* @param spath		service path
+* @param attrv		NULL-terminated array of attributes ("name=value" strings)
+* @param argv		NULL-terminated array of arguments
+* @param nfds		# of fds to hand off
+* @param fds		array of fds to hand off (e.g., stdin, stdout, stderr)
+* @return		client connection object; NULL on failure
+*/
+struct russ_cconn *
+russ_dialv_handoff(russ_deadline deadline, const char *op, const char *spath, char **attrv, char **argv,
+	int nfds, int *fds) {
+	struct russ_dial	*dial = NULL;
 
-	if ((cconn = russ_cconn_new()) == NULL) {
-		if (RUSS_DEBUG_russ_dialv) {
-			fprintf(stderr, "RUSS_DEBUG_russ_dialv:russ_cconn_new() == NULL\n");
-		}
-		goto free_saddr;
+	if ((dial = russ_dial_start(deadline, op, spath, attrv, argv)) == NULL) {
+		return NULL;
 	}
-	if ((cconn->sd = russ_connectunix_deadline(deadline, saddr)) < 0) {
-		if (RUSS_DEBUG_russ_dialv) {
-			fprintf(stderr, "RUSS_DEBUG_russ_dialv:russ_to_timeout() = %d\n", russ_to_timeout(deadline));
-			fprintf(stderr, "RUSS_DEBUG_russ_dialv:russ_gettime() = %ld\n", russ_gettime());
-			fprintf(stderr, "RUSS_DEBUG_russ_dialv:russ_connectunix_deadline(%ld, \"%s\") < 0\n", deadline, saddr);
-		}
-		goto close_cconn;
+	if (russ_dial_set_handoff(dial, nfds, fds) < 0) {
+		russ_dial_free(dial);
+		return NULL;
 	}
+	return __russ_dial_run(dial, deadline);
+}
 
-	russ_fds_init(cconn->sysfds, RUSS_CONN_NSYSFDS, -1);
-	russ_fds_init(cconn->fds, RUSS_CONN_NFDS, -1);
 
-	if ((req = russ_req_new(RUSS_REQ_PROTOCOLSTRING, op, spath2, attrv, argv)) == NULL) {
+/**
+* Dial service.
+*
+* Connect to a service, send request information, and get fds.
+* Received fds are saved to the client connection object.
+*
+* To dial the same service repeatedly, see russ_target_new() and
+* russ_dialv_target().
+*
+* @param deadline	deadline to complete operation
+* @param op		operation string
+* @param spath		service path
+* @param attrv		NULL-terminated array of attributes ("name=value" strings)
+* @param argv		NULL-terminated array of arguments
+* @return		client connection object; NULL on failure
+*/
+struct russ_cconn *
+russ_dialv(russ_deadline deadline, const char *op, const char *spath, char **attrv, char **argv) {
+	struct russ_cconn	*cconn = NULL;
+	struct russ_target	*targ = NULL;
+
+	if ((targ = russ_target_new(spath)) == NULL) {
 		if (RUSS_DEBUG_russ_dialv) {
-			fprintf(stderr, "RUSS_DEBUG_russ_dialv:req == NULL\n");
+			fprintf(stderr, "RUSS_DEBUG_russ_dialv:russ_target_new() == NULL\n");
 		}
-		goto close_cconn;
+		return NULL;
 	}
-	if ((russ_cconn_send_req(cconn, deadline, req) < 0)
-		|| (russ_cconn_recv_fds(cconn, deadline, RUSS_CONN_NSYSFDS, cconn->sysfds) < 0)
-		|| (russ_cconn_recv_fds(cconn, deadline, RUSS_CONN_NFDS, cconn->fds) < 0)) {
-		if (RUSS_DEBUG_russ_dialv) {
-			fprintf(stderr, "RUSS_DEBUG_russ_dialv:russ_cconn_send_req() < 0\n");
-		}
-		goto free_request;
+	if (RUSS_DEBUG_russ_dialv) {
+		fprintf(stderr, "RUSS_DEBUG_russ_dialv:saddr == %s\n", targ->saddr);
+		fprintf(stderr, "RUSS_DEBUG_russ_dialv:spath2 == %s\n", targ->spath);
 	}
-	saddr = russ_free(saddr);
-	spath2 = russ_free(spath2);
-	russ_fds_close(&cconn->sd, 1);	/* sd not needed anymore */
-	russ_req_free(req);
+	cconn = russ_dialv_target(deadline, op, targ, attrv, argv);
+	targ = russ_target_free(targ);
 	return cconn;
-
-free_request:
-	russ_req_free(req);
-close_cconn:
-	russ_cconn_close(cconn);
-	cconn = russ_free(cconn);
-free_saddr:
-	saddr = russ_free(saddr);
-	spath2 = russ_free(spath2);
-	return NULL;
 }
 
 /**
@@ -357,3 +497,181 @@ russ_diall(russ_deadline deadline, const char *op, const char *spath, char **att
 
 	return cconn;
 }
+
+/**
+* Free client session object.
+*
+* The kept control socket, if any, is closed; this ends the session
+* at the server.
+*
+* @param self		client session object
+* @return		NULL value
+*/
+struct russ_csession *
+russ_csession_free(struct russ_csession *self) {
+	if (self) {
+		russ_fds_close(&self->sd, 1);
+		self->targ = russ_target_free(self->targ);
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+/**
+* Create client session object for a service.
+*
+* A session keeps the control socket to the server open between
+* requests, so that repeated dials of the service skip the connect
+* and server accept/dispatch. No connection is made until the first
+* dial.
+*
+* @param spath		service path
+* @return		client session object; NULL on failure
+*/
+struct russ_csession *
+russ_csession_new(const char *spath) {
+	struct russ_csession	*self = NULL;
+
+	if ((self = russ_malloc(sizeof(struct russ_csession))) == NULL) {
+		return NULL;
+	}
+	self->sd = -1;
+	self->nosession = 0;
+	if ((self->targ = russ_target_new(spath)) == NULL) {
+		self = russ_free(self);
+		return NULL;
+	}
+	return self;
+}
+
+/**
+* Send request on session socket without raising SIGPIPE.
+*
+* @param self		client session object
+* @param deadline	deadline to complete operation
+* @param req		request object
+* @return		0 on success; -2 if the server closed the
+*			socket; -1 on other failure
+*/
+static int
+__russ_csession_send_req(struct russ_csession *self, russ_deadline deadline, struct russ_req *req) {
+	struct pollfd	pollfds[1];
+	char		buf[RUSS_REQ_BUF_MAX];
+	char		*bp = NULL, *bend = NULL;
+	ssize_t		n;
+
+	if ((bend = russ_enc_req(buf, buf+sizeof(buf), req)) == NULL) {
+		return -1;
+	}
+	pollfds[0].fd = self->sd;
+	pollfds[0].events = POLLOUT;
+	for (bp = buf; bp < bend; bp += n) {
+		if (russ_poll_deadline(deadline, pollfds, 1) <= 0) {
+			return -1;
+		}
+		if ((n = send(self->sd, bp, bend-bp, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			} else if ((errno == EPIPE) || (errno == ECONNRESET)) {
+				return -2;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+* Dial service over a session.
+*
+* The request is sent over the kept control socket if there is one
+* (otherwise a new one is connected) and the server is asked to
+* keep it after answering. The returned client connection object
+* is used as for russ_dialv(); its sd is not set.
+*
+* If the kept socket was closed by the server (e.g., idle timeout,
+* handler exited), the dial is retried once on a new connection.
+* Servers without session support are dialed with russ_dialv_target().
+*
+* @param self		client session object
+* @param deadline	deadline to complete operation
+* @param op		operation string
+* @param attrv		NULL-terminated array of attributes ("name=value" strings)
+* @param argv		NULL-terminated array of arguments
+* @return		client connection object; NULL on failure
+*/
+struct russ_cconn *
+russ_csession_dialv(struct russ_csession *self, russ_deadline deadline, const char *op, char **attrv, char **argv) {
+	struct russ_cconn	*cconn = NULL;
+	struct russ_req		*req = NULL;
+	struct pollfd		pollfds[1];
+	int			i, reused, rv;
+
+	if (self == NULL) {
+		return NULL;
+	}
+	if (self->nosession) {
+		return russ_dialv_target(deadline, op, self->targ, attrv, argv);
+	}
+
+	if ((req = russ_req_new(RUSS_REQ_PROTOCOLSTRING_SESSION, op, self->targ->spath, attrv, argv)) == NULL) {
+		return NULL;
+	}
+	if ((cconn = russ_cconn_new()) == NULL) {
+		goto free_request;
+	}
+
+	for (i = 0; i < 2; i++) {
+		/* kept socket must be idle; anything readable is EOF/junk */
+		if (self->sd >= 0) {
+			pollfds[0].fd = self->sd;
+			pollfds[0].events = POLLIN;
+			if (poll(pollfds, 1, 0) != 0) {
+				russ_fds_close(&self->sd, 1);
+			}
+		}
+		if ((reused = (self->sd >= 0)) == 0) {
+			if ((self->sd = russ_connectunix_deadline(deadline, self->targ->saddr)) < 0) {
+				if (RUSS_DEBUG_russ_dialv) {
+					fprintf(stderr, "RUSS_DEBUG_russ_dialv:russ_connectunix_deadline(%ld, \"%s\") < 0\n", deadline, self->targ->saddr);
+				}
+				goto free_cconn;
+			}
+		}
+
+		russ_fds_init(cconn->sysfds, RUSS_CONN_NSYSFDS, -1);
+		russ_fds_init(cconn->fds, RUSS_CONN_NFDS, -1);
+		cconn->sd = self->sd;
+		if ((rv = __russ_csession_send_req(self, deadline, req)) == 0) {
+			rv = russ_cconn_recv_fds_batch(cconn, deadline);
+		}
+		cconn->sd = -1;
+
+		if (rv == 0) {
+			req = russ_req_free(req);
+			return cconn;
+		}
+		russ_fds_close(&self->sd, 1);
+		if (rv != -2) {
+			goto free_cconn;
+		}
+		if (!reused) {
+			/* fresh connection not answered: no session support */
+			if (RUSS_DEBUG_russ_dialv) {
+				fprintf(stderr, "RUSS_DEBUG_russ_dialv:no session support; dialing without\n");
+			}
+			self->nosession = 1;
+			russ_req_free(req);
+			russ_free(cconn);
+			return russ_dialv_target(deadline, op, self->targ, attrv, argv);
+		}
+	}
+
+free_cconn:
+	russ_cconn_close(cconn);
+	cconn = russ_free(cconn);
+free_request:
+	russ_req_free(req);
+	return NULL;
+}
@@ -73,6 +73,208 @@ cleanup:
 	return rv;
 }
 
+/*
+** private state
+**
+** The public structs (see conf.h) are part of the ABI. Hashes,
+** parsed values and indexes are kept in private structs which embed
+** the public struct as their first member. Items, sections and
+** russ_conf objects are only allocated here.
+*/
+
+/* arrays longer than this are hash indexed */
+#define RUSS_CONF_INDEX_MINLEN		8
+
+/* item flags: value parsed as int/float */
+#define RUSS_CONFITEM_FLAG_INT		1
+#define RUSS_CONFITEM_FLAG_FLOAT	2
+
+/**
+* Open addressing hash index of positions into a sections or items
+* array. Slots hold positions; -1 for empty.
+*/
+struct russ_confindex {
+	int	*slots;
+	int	cap;
+};
+
+struct __russ_confitem {
+	struct russ_confitem	pub;
+	unsigned int		hash;
+	int			flags;
+	long			ivalue;
+	double			fvalue;
+};
+
+struct __russ_confsection {
+	struct russ_confsection	pub;
+	unsigned int		hash;
+	struct russ_confindex	index;
+};
+
+struct __russ_conf {
+	struct russ_conf	pub;
+	struct russ_confindex	index;
+};
+
+#define __RUSS_CONFITEM(x)	((struct __russ_confitem *)(x))
+#define __RUSS_CONFSECTION(x)	((struct __russ_confsection *)(x))
+#define __RUSS_CONF(x)		((struct __russ_conf *)(x))
+
+/*
+** index
+*/
+
+typedef char *(*__russ_confindex_keyfn)(void *, unsigned int *);
+
+/**
+* Hash a name (FNV-1a).
+*
+* @param s		name
+* @return		hash value
+*/
+static unsigned int
+__russ_conf_hash(const char *s) {
+	unsigned int	h = 2166136261u;
+
+	for (; *s != '\0'; s++) {
+		h = (h^(unsigned char)*s)*16777619u;
+	}
+	return h;
+}
+
+/**
+* Drop index. Lookups fall back to a linear search.
+*
+* @param self		index object
+*/
+static void
+__russ_confindex_clear(struct russ_confindex *self) {
+	self->slots = russ_free(self->slots);
+	self->cap = 0;
+}
+
+/**
+* (Re)build index for an array of elements. The index is sized for
+* at least size elements.
+*
+* @param self		index object
+* @param elems		array of items or sections
+* @param len		# of elements in array
+* @param size		# of elements to size for
+* @param keyfn		function to get element name and hash
+* @return		0 on success; -1 on failure
+*/
+static int
+__russ_confindex_build(struct russ_confindex *self, void **elems, int len, int size, __russ_confindex_keyfn keyfn) {
+	unsigned int	hash;
+	int		*slots = NULL;
+	int		cap, i, j;
+
+	size = RUSS__MAX(len, size);
+	for (cap = 16; cap < 2*size; cap <<= 1);
+	if ((slots = russ_malloc(sizeof(int)*cap)) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < cap; i++) {
+		slots[i] = -1;
+	}
+	for (i = 0; i < len; i++) {
+		keyfn(elems[i], &hash);
+		for (j = hash&(cap-1); slots[j] >= 0; j = (j+1)&(cap-1));
+		slots[j] = i;
+	}
+	russ_free(self->slots);
+	self->slots = slots;
+	self->cap = cap;
+	return 0;
+}
+
+/**
+* Update index for the element just appended to the array (at
+* len-1). Short arrays are not indexed.
+*
+* Note: the index is only an accelerator; if it cannot be grown, it
+* is dropped.
+*
+* @param self		index object
+* @param elems		array of items or sections
+* @param len		# of elements in array
+* @param keyfn		function to get element name and hash
+*/
+static void
+__russ_confindex_append(struct russ_confindex *self, void **elems, int len, __russ_confindex_keyfn keyfn) {
+	unsigned int	hash;
+	int		j;
+
+	if (self->slots == NULL) {
+		if (len > RUSS_CONF_INDEX_MINLEN) {
+			__russ_confindex_build(self, elems, len, 2*len, keyfn);
+		}
+		return;
+	}
+	if (2*len > self->cap) {
+		if (__russ_confindex_build(self, elems, len, 2*len, keyfn) < 0) {
+			__russ_confindex_clear(self);
+		}
+		return;
+	}
+	keyfn(elems[len-1], &hash);
+	for (j = hash&(self->cap-1); self->slots[j] >= 0; j = (j+1)&(self->cap-1));
+	self->slots[j] = len-1;
+}
+
+/**
+* Reset index after elements were removed/moved.
+*
+* @param self		index object
+* @param elems		array of items or sections
+* @param len		# of elements in array
+* @param keyfn		function to get element name and hash
+*/
+static void
+__russ_confindex_reset(struct russ_confindex *self, void **elems, int len, __russ_confindex_keyfn keyfn) {
+	if ((self->slots != NULL)
+		&& (__russ_confindex_build(self, elems, len, len, keyfn) < 0)) {
+		__russ_confindex_clear(self);
+	}
+}
+
+/**
+* Find element position by name.
+*
+* @param self		index object
+* @param elems		array of items or sections
+* @param len		# of elements in array
+* @param name		element name
+* @param keyfn		function to get element name and hash
+* @return		index into array; -1 if not found
+*/
+static int
+__russ_confindex_find(struct russ_confindex *self, void **elems, int len, const char *name, __russ_confindex_keyfn keyfn) {
+	unsigned int	hash, ehash;
+	char		*ename = NULL;
+	int		i, j;
+
+	hash = __russ_conf_hash(name);
+	if (self->slots == NULL) {
+		for (i = 0; i < len; i++) {
+			ename = keyfn(elems[i], &ehash);
+			if ((ehash == hash) && (strcmp(ename, name) == 0)) {
+				return i;
+			}
+		}
+		return -1;
+	}
+	for (j = hash&(self->cap-1); (i = self->slots[j]) >= 0; j = (j+1)&(self->cap-1)) {
+		ename = keyfn(elems[i], &ehash);
+		if ((ehash == hash) && (strcmp(ename, name) == 0)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
 /*
 ** item
 */
@@ -96,6 +298,9 @@ __russ_confitem_free(struct russ_confitem *self) {
 /**
 * Create item object.
 *
+* The value is parsed once, here, as int and float for
+* russ_conf_getint() and russ_conf_getfloat().
+*
 * @param option		name
 * @param value		value
 * @return		item object; NULL on failure
@@ -103,22 +308,47 @@ __russ_confitem_free(struct russ_confitem *self) {
 static struct russ_confitem *
 __russ_confitem_new(const char *option, const char *value) {
 	struct russ_confitem	*self = NULL;
+	char			*end = NULL;
+
+	struct __russ_confitem	*priv = NULL;
 
-	if ((self = russ_malloc(sizeof(struct russ_confitem))) == NULL) {
+	if ((priv = russ_malloc(sizeof(struct __russ_confitem))) == NULL) {
 		return NULL;
 	}
+	self = &priv->pub;
 	self->option = NULL;
 	self->value = NULL;
 	if (((self->option = strdup(option)) == NULL) ||
 		((self->value = strdup(value)) == NULL)) {
 		goto free_all;
 	}
+	priv->hash = __russ_conf_hash(option);
+	priv->flags = 0;
+	priv->ivalue = strtol(value, &end, 0);
+	if (end != value) {
+		priv->flags |= RUSS_CONFITEM_FLAG_INT;
+	}
+	priv->fvalue = strtod(value, &end);
+	if (end != value) {
+		priv->flags |= RUSS_CONFITEM_FLAG_FLOAT;
+	}
 	return self;
 free_all:
 	__russ_confitem_free(self);
 	return NULL;
 }
 
+/**
+* Index key function for items.
+*/
+static char *
+__russ_confitem_key(void *elem, unsigned int *hashp) {
+	struct russ_confitem	*self = elem;
+
+	*hashp = __RUSS_CONFITEM(self)->hash;
+	return self->option;
+}
+
 /*
 ** section
 */
@@ -131,15 +361,20 @@ free_all:
 */
 static struct russ_confsection *
 __russ_confsection_new(const char *section_name) {
-	struct russ_confsection	*self = NULL;
+	struct __russ_confsection	*priv = NULL;
+	struct russ_confsection		*self = NULL;
 
-	if ((self = russ_malloc(sizeof(struct russ_confsection))) == NULL) {
+	if ((priv = russ_malloc(sizeof(struct __russ_confsection))) == NULL) {
 		return NULL;
 	}
+	self = &priv->pub;
 	self->name = NULL;
 	self->items = NULL;
 	self->len = 0;
 	self->cap = 10;
+	priv->hash = __russ_conf_hash(section_name);
+	priv->index.slots = NULL;
+	priv->index.cap = 0;
 	if (((self->name = strdup(section_name)) == NULL)
 		|| ((self->items = russ_malloc(sizeof(struct russ_confitem *)*self->cap)) == NULL)) {
 		goto free_all;
@@ -167,6 +402,7 @@ __russ_confsection_free(struct russ_confsection *self) {
 		}
 		self->name = russ_free(self->name);
 		self->items = russ_free(self->items);
+		__russ_confindex_clear(&__RUSS_CONFSECTION(self)->index);
 		self = russ_free(self);
 	}
 	return NULL;
@@ -181,13 +417,7 @@ __russ_confsection_free(struct russ_confsection *self) {
 */
 static int
 __russ_confsection_find_item_pos(struct russ_confsection *self, const char *option) {
-	int	i;
-	for (i = 0; i < self->len; i++) {
-		if (strcmp(self->items[i]->option, option) == 0) {
-			return i;
-		}
-	}
-	return -1;
+	return __russ_confindex_find(&__RUSS_CONFSECTION(self)->index, (void **)self->items, self->len, option, __russ_confitem_key);
 }
 
 /**
@@ -206,6 +436,47 @@ __russ_confsection_find_item(struct russ_confsection *self, const char *option)
 	return self->items[i];
 }
 
+/**
+* Make room for at least cap items.
+*
+* @param self		section object
+* @param cap		# of items
+* @return		0 on success; -1 on failure
+*/
+static int
+__russ_confsection_reserve(struct russ_confsection *self, int cap) {
+	struct russ_confitem	**items = NULL;
+
+	if (cap > self->cap) {
+		if ((items = realloc(self->items, sizeof(struct russ_confitem *)*cap)) == NULL) {
+			return -1;
+		}
+		self->items = items;
+		self->cap = cap;
+	}
+	return 0;
+}
+
+/**
+* Append item to section items array. The option must not already
+* exist.
+*
+* @param self		section object
+* @param item		item object
+* @return		0 on success; -1 on failure
+*/
+static int
+__russ_confsection_append(struct russ_confsection *self, struct russ_confitem *item) {
+	if ((self->len == self->cap)
+		&& (__russ_confsection_reserve(self, 2*self->cap) < 0)) {
+		return -1;
+	}
+	self->items[self->len] = item;
+	self->len++;
+	__russ_confindex_append(&__RUSS_CONFSECTION(self)->index, (void **)self->items, self->len, __russ_confitem_key);
+	return 0;
+}
+
 /**
 * Set/add item in section items array.
 *
@@ -216,7 +487,7 @@ __russ_confsection_find_item(struct russ_confsection *self, const char *option)
 */
 static struct russ_confitem *
 __russ_confsection_set(struct russ_confsection *self, const char *option, const char *value) {
-	struct russ_confitem	**items = NULL, *item = NULL;
+	struct russ_confitem	*item = NULL;
 	int			item_pos;
 
 	if ((item = __russ_confitem_new(option, value)) == NULL) {
@@ -226,18 +497,11 @@ __russ_confsection_set(struct russ_confsection *self, const char *option, const
 	item_pos = __russ_confsection_find_item_pos(self, option);
 	if (item_pos < 0) {
 		/* add */
-		if (self->len == self->cap) {
-			/* resize */
-			if ((items = realloc(self->items, sizeof(struct russ_confitem *)*(self->cap+10))) == NULL) {
-				goto free_item;
-			}
-			self->items = items;
-			self->cap += 10;
+		if (__russ_confsection_append(self, item) < 0) {
+			goto free_item;
 		}
-		self->items[self->len] = item;
-		self->len++;
 	} else {
-		/* replace */
+		/* replace (same option: index unchanged) */
 		__russ_confitem_free(self->items[item_pos]);
 		self->items[item_pos] = item;
 	}
@@ -247,6 +511,59 @@ free_item:
 	return NULL;
 }
 
+/**
+* Set items of another section in section items array.
+*
+* Bulk-load path: if the section is new (empty), the items are
+* appended without lookups (options of the other section are
+* unique).
+*
+* @param self		section object
+* @param other		section object from which to get items
+* @return		0 on success; -1 on failure
+*/
+static int
+__russ_confsection_update(struct russ_confsection *self, struct russ_confsection *other) {
+	struct russ_confitem	*item = NULL;
+	int			i;
+
+	if (self->len > 0) {
+		for (i = 0; i < other->len; i++) {
+			item = other->items[i];
+			if (__russ_confsection_set(self, item->option, item->value) == NULL) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	if (__russ_confsection_reserve(self, other->len) < 0) {
+		return -1;
+	}
+	for (i = 0; i < other->len; i++) {
+		item = other->items[i];
+		if ((item = __russ_confitem_new(item->option, item->value)) == NULL) {
+			return -1;
+		}
+		if (__russ_confsection_append(self, item) < 0) {
+			__russ_confitem_free(item);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+* Index key function for sections.
+*/
+static char *
+__russ_confsection_key(void *elem, unsigned int *hashp) {
+	struct russ_confsection	*self = elem;
+
+	*hashp = __RUSS_CONFSECTION(self)->hash;
+	return self->name;
+}
+
 /*
 ** russ_conf
 */
@@ -259,13 +576,17 @@ free_item:
 */
 struct russ_conf *
 russ_conf_new(void) {
+	struct __russ_conf	*priv = NULL;
 	struct russ_conf	*self = NULL;
 
-	if ((self = russ_malloc(sizeof(struct russ_conf))) == NULL) {
+	if ((priv = russ_malloc(sizeof(struct __russ_conf))) == NULL) {
 		return NULL;
 	}
+	self = &priv->pub;
 	self->len = 0;
 	self->cap = 10;
+	priv->index.slots = NULL;
+	priv->index.cap = 0;
 	if ((self->sections = russ_malloc(sizeof(struct russ_confsection *)*self->cap)) == NULL) {
 		goto free_all;
 	}
@@ -290,6 +611,7 @@ russ_conf_free(struct russ_conf *self) {
 			__russ_confsection_free(self->sections[i]);
 		}
 		self->sections = russ_free(self->sections);
+		__russ_confindex_clear(&__RUSS_CONF(self)->index);
 		self = russ_free(self);
 	}
 	return NULL;
@@ -400,14 +722,7 @@ russ_conf_init(int *argc, char **argv) {
 */
 static int
 __russ_conf_find_section_pos(struct russ_conf *self, const char *section_name) {
-	int	i;
-
-	for (i = 0; i < self->len; i++) {
-		if (strcmp(self->sections[i]->name, section_name) == 0) {
-			return i;
-		}
-	}
-	return -1;
+	return __russ_confindex_find(&__RUSS_CONF(self)->index, (void **)self->sections, self->len, section_name, __russ_confsection_key);
 }
 
 /**
@@ -463,17 +778,18 @@ russ_conf_add_section(struct russ_conf *self, const char *section_name) {
 		return -1;
 	}
 	if (self->len == self->cap) {
-		if ((sections = realloc(self->sections, sizeof(struct russ_confsection *)*(self->cap+10))) == NULL) {
+		if ((sections = realloc(self->sections, sizeof(struct russ_confsection *)*(2*self->cap))) == NULL) {
 			return -1;
 		}
 		self->sections = sections;
-		self->cap += 10;
+		self->cap *= 2;
 	}
 	if ((section = __russ_confsection_new(section_name)) == NULL) {
 		return -1;
 	}
 	self->sections[self->len] = section;
 	self->len++;
+	__russ_confindex_append(&__RUSS_CONF(self)->index, (void **)self->sections, self->len, __russ_confsection_key);
 	return self->len-1;
 }
 
@@ -486,27 +802,20 @@ russ_conf_add_section(struct russ_conf *self, const char *section_name) {
 struct russ_conf *
 russ_conf_dup(struct russ_conf *self) {
 	struct russ_conf	*copy = NULL;
-	struct russ_confsection	**sections = NULL, *section = NULL, *csection = NULL;
-	struct russ_confitem	**items = NULL, *item = NULL;
-	int			i, ci, j;
+	struct russ_confsection	*section = NULL;
+	int			i, ci;
 
-	if ((copy = russ_conf_new()) == NULL) {
-		return NULL;
+	if (((copy = russ_conf_new()) == NULL)
+		|| (russ_conf_reserve(copy, self->len) < 0)) {
+		goto fail;
 	}
 
 	for (i = 0; i < self->len; i++) {
 		section = self->sections[i];
-		if ((ci = russ_conf_add_section(copy, section->name)) < 0) {
+		if (((ci = russ_conf_add_section(copy, section->name)) < 0)
+			|| (__russ_confsection_update(copy->sections[ci], section) < 0)) {
 			goto fail;
 		}
-		csection = copy->sections[ci];
-
-		for (j = 0; j < section->len; j++) {
-			item = section->items[j];
-			if (__russ_confsection_set(csection, item->option, item->value) == NULL) {
-				goto fail;
-			}
-		}
 	}
 	return copy;
 
@@ -604,6 +913,7 @@ russ_conf_remove_option(struct russ_conf *self, const char *section_name, const
 		section->items[pos] = section->items[(section->len-1)];
 	}
 	section->len--;
+	__russ_confindex_reset(&__RUSS_CONFSECTION(section)->index, (void **)section->items, section->len, __russ_confitem_key);
 	return 0;
 }
 
@@ -628,6 +938,38 @@ russ_conf_remove_section(struct russ_conf *self, const char *section_name) {
 		self->sections[pos] = self->sections[(self->len-1)];
 	}
 	self->len--;
+	__russ_confindex_reset(&__RUSS_CONF(self)->index, (void **)self->sections, self->len, __russ_confsection_key);
+	return 0;
+}
+
+/**
+* Make room for at least nsections sections (e.g., before loading
+* many sections).
+*
+* Note: the index is only an accelerator; if it cannot be built, it
+* is dropped and lookups fall back to a linear search.
+*
+* @param self		russ_conf object
+* @param nsections	# of sections
+* @return		0 on success; -1 on failure
+*/
+int
+russ_conf_reserve(struct russ_conf *self, int nsections) {
+	struct russ_confindex	*index = &__RUSS_CONF(self)->index;
+	struct russ_confsection	**sections = NULL;
+
+	if (nsections > self->cap) {
+		if ((sections = realloc(self->sections, sizeof(struct russ_confsection *)*nsections)) == NULL) {
+			return -1;
+		}
+		self->sections = sections;
+		self->cap = nsections;
+	}
+	if ((nsections > RUSS_CONF_INDEX_MINLEN)
+		&& (nsections*2 > index->cap)
+		&& (__russ_confindex_build(index, (void **)self->sections, self->len, nsections, __russ_confsection_key) < 0)) {
+		__russ_confindex_clear(index);
+	}
 	return 0;
 }
 
@@ -670,13 +1012,12 @@ russ_conf_get(struct russ_conf *self, const char *section_name, const char *opti
 long
 russ_conf_getint(struct russ_conf *self, const char *section_name, const char *option, long dvalue) {
 	struct russ_confitem	*item = NULL;
-	long			value;
 
 	if (((item = __russ_conf_get_item(self, section_name, option)) == NULL)
-		|| (sscanf(item->value, "%li", &value) == 0)) {
+		|| (!(__RUSS_CONFITEM(item)->flags & RUSS_CONFITEM_FLAG_INT))) {
 		return dvalue;
 	}
-	return value;
+	return __RUSS_CONFITEM(item)->ivalue;
 }
 
 /**
@@ -692,13 +1033,12 @@ russ_conf_getint(struct russ_conf *self, const char *section_name, const char *o
 double
 russ_conf_getfloat(struct russ_conf *self, const char *section_name, const char *option, double dvalue) {
 	struct russ_confitem	*item = NULL;
-	double			value;
 
 	if (((item = __russ_conf_get_item(self, section_name, option)) == NULL)
-		|| (sscanf(item->value, "%lf", &value) == 0)) {
+		|| (!(__RUSS_CONFITEM(item)->flags & RUSS_CONFITEM_FLAG_FLOAT))) {
 		return dvalue;
 	}
-	return value;
+	return __RUSS_CONFITEM(item)->fvalue;
 }
 
 /**
@@ -950,28 +1290,23 @@ russ_conf_set2(struct russ_conf *self, const char *section_name, const char *opt
 */
 int
 russ_conf_update(struct russ_conf *self, struct russ_conf *other) {
-	struct russ_confsection	*osection = NULL, *ssection = NULL;
-	struct russ_confitem	*item = NULL;
-	int			i, j, pos;
+	struct russ_confsection	*osection = NULL;
+	int			i, pos;
 
 	if (self == other) {
 		return 0;
 	}
 
+	if (russ_conf_reserve(self, self->len+other->len) < 0) {
+		return -1;
+	}
 	for (i = 0; i < other->len; i++) {
 		osection = other->sections[i];
-		if (((pos = __russ_conf_find_section_pos(self, osection->name)) < 0)
-			&& ((pos = russ_conf_add_section(self, osection->name)) < 0)) {
+		if ((((pos = __russ_conf_find_section_pos(self, osection->name)) < 0)
+				&& ((pos = russ_conf_add_section(self, osection->name)) < 0))
+			|| (__russ_confsection_update(self->sections[pos], osection) < 0)) {
 			return -1;
 		}
-		ssection = self->sections[pos];
-
-		for (j = 0; j < osection->len; j++) {
-			item = osection->items[j];
-			if (__russ_confsection_set(ssection, item->option, item->value) < 0) {
-				return -1;
-			}
-		}
 	}
 	return 0;
 }
@@ -987,9 +1322,8 @@ russ_conf_update(struct russ_conf *self, struct russ_conf *other) {
 */
 int
 russ_conf_update_section(struct russ_conf *self, char *ssecname, struct russ_conf *other, char *osecname) {
-	struct russ_confsection	*osection = NULL, *ssection = NULL;
-	struct russ_confitem	*item = NULL;
-	int			i, pos;
+	struct russ_confsection	*osection = NULL;
+	int			pos;
 
 	if ((self == other) && (strcmp(ssecname, osecname) == 0)) {
 		/* source and destination */
@@ -1001,18 +1335,11 @@ russ_conf_update_section(struct russ_conf *self, char *ssecname, struct russ_con
 		return 0;
 	}
 
-	if (((pos = __russ_conf_find_section_pos(self, ssecname)) < 0)
-		&& ((pos = russ_conf_add_section(self, ssecname)) < 0)) {
+	if ((((pos = __russ_conf_find_section_pos(self, ssecname)) < 0)
+			&& ((pos = russ_conf_add_section(self, ssecname)) < 0))
+		|| (__russ_confsection_update(self->sections[pos], osection) < 0)) {
 		return -1;
 	}
-	ssection = self->sections[pos];
-
-	for (i = 0; i < osection->len; i++) {
-		item = osection->items[i];
-		if (__russ_confsection_set(ssection, item->option, item->value) < 0) {
-			return -1;
-		}
-	}
 	return 0;
 }
 
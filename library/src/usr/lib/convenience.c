@@ -24,6 +24,7 @@
 
 #include <poll.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -221,6 +222,10 @@ russ_dialv_wait_inouterr3(russ_deadline deadline, const char *op, const char *sp
 * a russ_svr object initialized with a default root russ_svcnode
 * and NULL handler.
 *
+* Relay stream settings by stream index are loaded from the
+* [relay] section (rate<i>, burst<i>, weight<i>; see
+* russ_svr_set_relaydefaults()).
+*
 * @param conf		russ_conf object
 * @return		russ_svr object; NULL on failure
 */
@@ -229,7 +234,11 @@ russ_init(struct russ_conf *conf) {
 	struct russ_svr		*svr = NULL;
 	struct russ_svcnode	*root = NULL;
 	int			sd;
-	int			accepttimeout, closeonaccept;
+	int			accepttimeout, closeonaccept, intake, sessiontimeout;
+	int			preforkmaxsessions, preforknworkers, preforkrespawn;
+	int			threadpoolsize, threadqueuemax;
+	char			key[32];
+	int			i, rate, burst, weight;
 
 	if (conf == NULL) {
 		return NULL;
@@ -242,12 +251,40 @@ russ_init(struct russ_conf *conf) {
 	sd = (int)russ_conf_getint(conf, "main", "sd", RUSS_SVR_LIS_SD_DEFAULT);
 	accepttimeout = (int)russ_conf_getint(conf, "main", "accepttimeout", RUSS_SVR_TIMEOUT_ACCEPT);
 	closeonaccept = (int)russ_conf_getint(conf, "main", "closeonaccept", 0);
+	intake = (int)russ_conf_getint(conf, "main", "intake", 0);
+	preforkmaxsessions = (int)russ_conf_getint(conf, "main", "preforkmaxsessions", RUSS_SVR_PREFORK_MAXSESSIONS);
+	preforknworkers = (int)russ_conf_getint(conf, "main", "preforknworkers", RUSS_SVR_PREFORK_NWORKERS);
+	preforkrespawn = (int)russ_conf_getint(conf, "main", "preforkrespawn", RUSS_SVR_PREFORK_RESPAWN_ALWAYS);
+	threadpoolsize = (int)russ_conf_getint(conf, "main", "threadpoolsize", RUSS_SVR_THREAD_POOLSIZE);
+	threadqueuemax = (int)russ_conf_getint(conf, "main", "threadqueuemax", RUSS_SVR_THREAD_QUEUEMAX);
+	sessiontimeout = (int)russ_conf_getint(conf, "main", "sessiontimeout", RUSS_SVR_TIMEOUT_SESSION);
+
 	if (((root = russ_svcnode_new("", NULL)) == NULL)
 		|| ((svr = russ_svr_new(root, 0, sd)) == NULL)
 		|| (russ_svr_set_accepttimeout(svr, accepttimeout) < 0)
-		|| (russ_svr_set_closeonaccept(svr, closeonaccept) < 0)) {
+		|| (russ_svr_set_closeonaccept(svr, closeonaccept) < 0)
+		|| (russ_svr_set_intake(svr, intake) < 0)
+		|| (russ_svr_set_preforkmaxsessions(svr, preforkmaxsessions) < 0)
+		|| (russ_svr_set_preforknworkers(svr, preforknworkers) < 0)
+		|| (russ_svr_set_preforkrespawn(svr, preforkrespawn) < 0)
+		|| (russ_svr_set_threadpoolsize(svr, threadpoolsize) < 0)
+		|| (russ_svr_set_threadqueuemax(svr, threadqueuemax) < 0)
+		|| (russ_svr_set_sessiontimeout(svr, sessiontimeout) < 0)) {
 		goto fail;
 	}
+
+	/* relay stream defaults */
+	for (i = 0; i < RUSS_CONN_STD_NFDS; i++) {
+		snprintf(key, sizeof(key), "rate%d", i);
+		rate = (int)russ_conf_getint(conf, "relay", key, 0);
+		snprintf(key, sizeof(key), "burst%d", i);
+		burst = (int)russ_conf_getint(conf, "relay", key, 0);
+		snprintf(key, sizeof(key), "weight%d", i);
+		weight = (int)russ_conf_getint(conf, "relay", key, 0);
+		if (russ_svr_set_relaydefaults(svr, i, rate, burst, weight) < 0) {
+			goto fail;
+		}
+	}
 	return svr;
 fail:
 	root = russ_svcnode_free(root);
@@ -0,0 +1,977 @@
+/*
+* lib/dial.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Non-blocking dial.
+*
+* A dial is driven as a small state machine over a single socket:
+* connect, send request, receive answer (sysfds and fds). Each call
+* to russ_dial_advance() does as much as it can without blocking;
+* the caller waits on the descriptor and events returned by
+* russ_dial_pollfd() (with poll, epoll, etc.), for at most
+* russ_dial_timeout() msec, between calls.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "russ/priv.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+#define RUSS_DIAL_STATE_CONNECT		0
+#define RUSS_DIAL_STATE_CONNECTING	1
+#define RUSS_DIAL_STATE_SEND		2
+#define RUSS_DIAL_STATE_RECV		3
+#define RUSS_DIAL_STATE_RECV_0010	4
+#define RUSS_DIAL_STATE_READY		5
+#define RUSS_DIAL_STATE_FAILED		6
+
+/* connect retries (listen queue full) and max backoff (msec) */
+#define RUSS_DIAL_CONNECT_RETRIES	8
+#define RUSS_DIAL_CONNECT_BACKOFFMAX	64
+
+struct russ_dial {
+	russ_deadline		deadline;
+	struct russ_target	*targ;		/**< target */
+	int			owntarg;	/**< free targ with dial */
+	struct russ_req		*req;		/**< request */
+	struct russ_cconn	*cconn;		/**< connection being set up */
+	int			state;
+	int			events;		/**< events to wait for */
+	int			nretries;	/**< connect retries so far */
+	russ_deadline		retryat;	/**< connect retry time (0 for none) */
+
+	/* encoded request */
+	char			*sbuf;
+	int			nsbuf;
+	int			soff;
+
+	/* answer (protocol 0011) */
+	char			abuf[RUSS_ANSWER_BATCH_SIZE];
+	int			naread;
+	int			recvfds[RUSS_CONN_NSYSFDS+RUSS_CONN_NFDS];
+	int			nrecvfds;
+
+	/* fds handed off to the server after the request */
+	int			hfds[RUSS_CONN_NFDS];
+	int			nhfds;
+	int			hsent;
+
+	/* answer (protocol 0010): count, statuses, then one fd per message */
+	int			stage;		/**< 0 for sysfds, 1 for fds */
+	char			hbuf[4+RUSS_CONN_MAX_NFDS];
+	int			nhread;
+	int			nstatuses;
+	int			index;
+};
+
+/**
+* Encode the request for sending.
+*
+* @param self		dial object
+* @return		0 on success; -1 on failure
+*/
+static int
+__russ_dial_encode(struct russ_dial *self) {
+	char	buf[RUSS_REQ_BUF_MAX];
+	char	*bp = NULL;
+
+	self->sbuf = russ_free(self->sbuf);
+	if (((bp = russ_enc_req(buf, buf+sizeof(buf), self->req)) == NULL)
+		|| ((self->sbuf = russ_malloc(bp-buf)) == NULL)) {
+		return -1;
+	}
+	memcpy(self->sbuf, buf, bp-buf);
+	self->nsbuf = bp-buf;
+	self->soff = 0;
+	return 0;
+}
+
+/**
+* Restart the dial with protocol 0010 after the server hung up
+* without answering.
+*
+* Servers supporting protocol 0011 never do that once they have
+* read the request: they answer or refuse explicitly (see
+* russ_sconn_refuse()). Servers which only support protocol 0010
+* hang up right after reading a request with an unknown protocol,
+* without running anything.
+*
+* @param self		dial object
+* @return		0 on success; -1 on failure
+*/
+static int
+__russ_dial_fallback(struct russ_dial *self) {
+	char	*protocolstring = NULL;
+
+	if (RUSS_DEBUG_russ_dialv) {
+		fprintf(stderr, "RUSS_DEBUG_russ_dialv:no answer; retrying with protocol %s\n", RUSS_REQ_PROTOCOLSTRING_0010);
+	}
+	if ((protocolstring = strdup(RUSS_REQ_PROTOCOLSTRING_0010)) == NULL) {
+		return -1;
+	}
+	russ_free(self->req->protocolstring);
+	self->req->protocolstring = protocolstring;
+	if (__russ_dial_encode(self) < 0) {
+		return -1;
+	}
+	russ_fds_close(self->cconn->sysfds, RUSS_CONN_NSYSFDS);
+	russ_fds_close(self->cconn->fds, RUSS_CONN_NFDS);
+	self->naread = 0;
+	self->nrecvfds = 0;
+	self->hsent = 0;
+	self->state = RUSS_DIAL_STATE_CONNECT;
+	return 0;
+}
+
+/**
+* Start connecting the socket.
+*
+* The new socket is created before any previous one is closed so
+* that its descriptor number differs (see russ_dial_pollfd()).
+*
+* A full listen queue is retried, with backoff, up to
+* RUSS_DIAL_CONNECT_RETRIES times. The retry time is recorded (see
+* russ_dial_timeout()); this never sleeps.
+*
+* @param self		dial object
+* @return		0 on success (connected, in progress, or to be
+*			retried); -1 on failure
+*/
+static int
+__russ_dial_connect(struct russ_dial *self) {
+	struct sockaddr_un	servaddr;
+	int			sd, flags;
+
+	bzero(&servaddr, sizeof(servaddr));
+	servaddr.sun_family = AF_UNIX;
+	if (strlen(self->targ->saddr) >= sizeof(servaddr.sun_path)) {
+		return -1;
+	}
+	strcpy(servaddr.sun_path, self->targ->saddr);
+
+	if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	russ_fds_close(&self->cconn->sd, 1);
+	self->cconn->sd = sd;
+	if (((flags = fcntl(sd, F_GETFL)) < 0)
+		|| (fcntl(sd, F_SETFL, flags|O_NONBLOCK) < 0)) {
+		return -1;
+	}
+
+	while (connect(sd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+		if (errno == EINTR) {
+			continue;
+		} else if (errno == EINPROGRESS) {
+			self->state = RUSS_DIAL_STATE_CONNECTING;
+			self->events = POLLOUT;
+			return 0;
+		} else if (errno == EAGAIN) {
+			/*
+			* SUSv3: listen queue full; retry later. The
+			* unconnected socket cannot be waited on, so the
+			* caller waits for the retry time instead.
+			*/
+			if (self->nretries >= RUSS_DIAL_CONNECT_RETRIES) {
+				return -1;
+			}
+			self->retryat = russ_to_deadline(RUSS__MIN(1<<self->nretries, RUSS_DIAL_CONNECT_BACKOFFMAX));
+			self->events = 0;
+			self->nretries++;
+			return 0;
+		}
+		if (RUSS_DEBUG_russ_connectunix_deadline) {
+			fprintf(stderr, "RUSS_DEBUG_russ_connectunix_deadline:errno = %d\n", errno);
+		}
+		return -1;
+	}
+	self->state = RUSS_DIAL_STATE_SEND;
+	return 0;
+}
+
+/**
+* Receive protocol 0010 answer: for sysfds, then fds, a count,
+* statuses, and one descriptor per message.
+*
+* @param self		dial object
+* @return		1 if complete; 0 if would block; -1 on failure
+*/
+static int
+__russ_dial_recv_0010(struct russ_dial *self) {
+	int	*fds = NULL;
+	int	nfds, need, n;
+
+	while (self->stage < 2) {
+		if (self->stage == 0) {
+			fds = self->cconn->sysfds;
+			nfds = RUSS_CONN_NSYSFDS;
+		} else {
+			fds = self->cconn->fds;
+			nfds = RUSS_CONN_NFDS;
+		}
+
+		/* count and statuses; read exactly (fds follow) */
+		need = (self->nhread < 4) ? 4 : 4+self->nstatuses;
+		if (self->nhread < need) {
+			if ((n = read(self->cconn->sd, self->hbuf+self->nhread, need-self->nhread)) < 0) {
+				return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+			} else if (n == 0) {
+				return -1;
+			}
+			if ((self->nhread += n) == 4) {
+				if ((russ_dec_int32(self->hbuf, &self->nstatuses) == NULL)
+					|| (self->nstatuses < 0) || (self->nstatuses > nfds)) {
+					return -1;
+				}
+				self->index = 0;
+			}
+			continue;
+		}
+
+		/* descriptors */
+		for (; self->index < self->nstatuses; self->index++) {
+			if (self->hbuf[4+self->index]) {
+				errno = 0;
+				if (russ_recv_fd(self->cconn->sd, &fds[self->index]) < 0) {
+					return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+				}
+			}
+		}
+		self->stage++;
+		self->nhread = 0;
+		self->nstatuses = 0;
+	}
+	return 1;
+}
+
+/**
+* Free dial object.
+*
+* An unfinished dial is abandoned; its connection is closed.
+*
+* @param self		dial object
+* @return		NULL value
+*/
+struct russ_dial *
+russ_dial_free(struct russ_dial *self) {
+	if (self) {
+		if (self->cconn) {
+			russ_cconn_close(self->cconn);
+			self->cconn = russ_cconn_free(self->cconn);
+		}
+		russ_fds_close(self->recvfds, self->nrecvfds);
+		self->req = russ_req_free(self->req);
+		self->sbuf = russ_free(self->sbuf);
+		if (self->owntarg) {
+			self->targ = russ_target_free(self->targ);
+		}
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+/**
+* Start a non-blocking dial of a pre-resolved target.
+*
+* The target must remain valid until the dial is finished.
+*
+* Usage:
+*	dial = russ_dial_start_target(...);
+*	while (russ_dial_advance(dial) == 0) {
+*		fd = russ_dial_pollfd(dial, &events);
+*		timeout = russ_dial_timeout(dial);
+*		wait for events on fd, up to timeout (poll, epoll, ...)
+*	}
+*	cconn = russ_dial_finish(dial);
+*
+* @param deadline	deadline to complete dial
+* @param op		operation string
+* @param targ		target object (see russ_target_new())
+* @param attrv		NULL-terminated array of attributes ("name=value" strings)
+* @param argv		NULL-terminated array of arguments
+* @return		dial object; NULL on failure
+*/
+struct russ_dial *
+russ_dial_start_target(russ_deadline deadline, const char *op, struct russ_target *targ, char **attrv, char **argv) {
+	struct russ_dial	*self = NULL;
+
+	if ((targ == NULL)
+		|| ((self = russ_malloc(sizeof(struct russ_dial))) == NULL)) {
+		return NULL;
+	}
+	self->deadline = deadline;
+	self->targ = targ;
+	self->owntarg = 0;
+	self->req = NULL;
+	self->cconn = NULL;
+	self->state = RUSS_DIAL_STATE_CONNECT;
+	self->events = 0;
+	self->nretries = 0;
+	self->retryat = 0;
+	self->sbuf = NULL;
+	self->nsbuf = 0;
+	self->soff = 0;
+	self->naread = 0;
+	self->nrecvfds = 0;
+	self->nhfds = 0;
+	self->hsent = 0;
+	self->stage = 0;
+	self->nhread = 0;
+	self->nstatuses = 0;
+	self->index = 0;
+
+	if (((self->cconn = russ_cconn_new()) == NULL)
+		|| ((self->req = russ_req_new(RUSS_REQ_PROTOCOLSTRING, op, targ->spath, attrv, argv)) == NULL)
+		|| (__russ_dial_encode(self) < 0)) {
+		return russ_dial_free(self);
+	}
+	russ_fds_init(self->cconn->sysfds, RUSS_CONN_NSYSFDS, -1);
+	russ_fds_init(self->cconn->fds, RUSS_CONN_NFDS, -1);
+	return self;
+}
+
+/**
+* Start a non-blocking dial of a service.
+*
+* See russ_dial_start_target(). The service path is resolved
+* (blocking) before returning.
+*
+* @param deadline	deadline to complete dial
+* @param op		operation string
+* @param spath		service path
+* @param attrv		NULL-terminated array of attributes ("name=value" strings)
+* @param argv		NULL-terminated array of arguments
+* @return		dial object; NULL on failure
+*/
+struct russ_dial *
+russ_dial_start(russ_deadline deadline, const char *op, const char *spath, char **attrv, char **argv) {
+	struct russ_dial	*self = NULL;
+	struct russ_target	*targ = NULL;
+
+	if ((targ = russ_target_new(spath)) == NULL) {
+		return NULL;
+	}
+	if ((self = russ_dial_start_target(deadline, op, targ, attrv, argv)) == NULL) {
+		russ_target_free(targ);
+		return NULL;
+	}
+	self->owntarg = 1;
+	return self;
+}
+
+/**
+* Hand off fds to the server with the request.
+*
+* The fds are sent to the server after the request (with a
+* RUSS_FDHANDOFF_ATTR_PREFIX attribute) so that a server which
+* supports it uses them directly as its connection fds instead of
+* creating socketpairs. In that case, no fds are answered (the
+* cconn fds are all -1) and the caller only waits for the exit
+* status. Otherwise, the usual fds are answered. The caller keeps
+* its fds either way.
+*
+* Must be called before the first russ_dial_advance().
+*
+* @param self		dial object
+* @param nfds		# of fds (e.g., RUSS_CONN_STD_NFDS)
+* @param fds		array of fds (e.g., stdin, stdout, stderr)
+* @return		0 on success; -1 on failure
+*/
+int
+russ_dial_set_handoff(struct russ_dial *self, int nfds, int *fds) {
+	char	attr[64];
+	int	i;
+
+	if ((self->state != RUSS_DIAL_STATE_CONNECT) || (self->soff > 0)
+		|| (nfds < 1) || (nfds > RUSS_CONN_NFDS)
+		|| (self->nhfds > 0)) {
+		return -1;
+	}
+	for (i = 0; i < nfds; i++) {
+		if (fds[i] < 0) {
+			return -1;
+		}
+		self->hfds[i] = fds[i];
+	}
+	if ((russ_snprintf(attr, sizeof(attr), "%s%d", RUSS_FDHANDOFF_ATTR_PREFIX, nfds) < 0)
+		|| (russ_sarray0_append(&self->req->attrv, attr, NULL) < 0)
+		|| (__russ_dial_encode(self) < 0)) {
+		return -1;
+	}
+	self->nhfds = nfds;
+	return 0;
+}
+
+/**
+* Get the descriptor and events to wait for before the next call
+* to russ_dial_advance().
+*
+* The descriptor may be replaced from one step to the next (e.g.,
+* when falling back to an older protocol); a replacement always has
+* a different number. Event loops should compare it after each
+* russ_dial_advance() and, if changed, register the new one (the
+* old one is already closed).
+*
+* While waiting to retry a connect, there is no descriptor to wait
+* on; see russ_dial_timeout().
+*
+* @param self		dial object
+* @param[out] events	poll events (POLLIN, POLLOUT)
+* @return		descriptor; -1 if the dial is finished or
+*			waiting to retry
+*/
+int
+russ_dial_pollfd(struct russ_dial *self, int *events) {
+	if ((self == NULL)
+		|| (self->state == RUSS_DIAL_STATE_READY)
+		|| (self->state == RUSS_DIAL_STATE_FAILED)
+		|| (self->retryat > 0)) {
+		*events = 0;
+		return -1;
+	}
+	*events = self->events;
+	return self->cconn->sd;
+}
+
+/**
+* Get the longest time to wait (on russ_dial_pollfd()) before the
+* next call to russ_dial_advance().
+*
+* A dial waiting to retry a connect (listen queue full) must be
+* advanced at its retry time, whatever the descriptor events.
+*
+* @param self		dial object
+* @return		timeout (msec); -1 for no limit (other than
+*			the dial deadline)
+*/
+int
+russ_dial_timeout(struct russ_dial *self) {
+	if ((self == NULL) || (self->retryat == 0)) {
+		return -1;
+	}
+	return russ_to_timeout(RUSS__MIN(self->retryat, self->deadline));
+}
+
+/**
+* Advance the dial as far as possible without blocking.
+*
+* @param self		dial object
+* @return		1 if ready (see russ_dial_finish()); 0 if in
+*			progress (wait on russ_dial_pollfd()); -1 on
+*			failure (including deadline expiry)
+*/
+int
+russ_dial_advance(struct russ_dial *self) {
+	socklen_t	errlen;
+	int		err, n, rv;
+
+	if (self == NULL) {
+		return -1;
+	}
+
+	while (1) {
+		switch (self->state) {
+		case RUSS_DIAL_STATE_READY:
+			return 1;
+
+		case RUSS_DIAL_STATE_FAILED:
+			return -1;
+
+		case RUSS_DIAL_STATE_CONNECT:
+			if (self->retryat > 0) {
+				if (russ_to_deadlinediff(self->retryat) > 0) {
+					goto wait;
+				}
+				self->retryat = 0;
+			}
+			if (__russ_dial_connect(self) < 0) {
+				goto fail;
+			}
+			if (self->state == RUSS_DIAL_STATE_CONNECT) {
+				goto wait;
+			}
+			break;
+
+		case RUSS_DIAL_STATE_CONNECTING:
+			errlen = sizeof(err);
+			if (getsockopt(self->cconn->sd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+				goto fail;
+			} else if (err == EINPROGRESS) {
+				goto wait;
+			} else if (err != 0) {
+				goto fail;
+			}
+			self->state = RUSS_DIAL_STATE_SEND;
+			break;
+
+		case RUSS_DIAL_STATE_SEND:
+			while (self->soff < self->nsbuf) {
+				if ((n = send(self->cconn->sd, self->sbuf+self->soff, self->nsbuf-self->soff, MSG_NOSIGNAL)) < 0) {
+					if (errno == EINTR) {
+						continue;
+					} else if (errno == EAGAIN) {
+						self->events = POLLOUT;
+						goto wait;
+					}
+					goto fail;
+				}
+				self->soff += n;
+			}
+			if (self->state != RUSS_DIAL_STATE_SEND) {
+				break;
+			}
+			if ((self->nhfds > 0) && (!self->hsent)) {
+				if (russ_send_fds(self->cconn->sd, "", 1, self->hfds, self->nhfds) < 0) {
+					if ((errno == EINTR) || (errno == EAGAIN)) {
+						self->events = POLLOUT;
+						goto wait;
+					}
+					goto fail;
+				}
+				self->hsent = 1;
+			}
+			if (strcmp(self->req->protocolstring, RUSS_REQ_PROTOCOLSTRING) == 0) {
+				self->state = RUSS_DIAL_STATE_RECV;
+			} else {
+				self->state = RUSS_DIAL_STATE_RECV_0010;
+			}
+			self->events = POLLIN;
+			break;
+
+		case RUSS_DIAL_STATE_RECV:
+			if (self->naread == 0) {
+				/* descriptors arrive with the first byte */
+				if ((n = russ_recv_fds(self->cconn->sd, self->abuf, sizeof(self->abuf),
+					self->recvfds, RUSS_CONN_NSYSFDS+RUSS_CONN_NFDS, &self->nrecvfds)) < 0) {
+					if (errno == EAGAIN) {
+						goto wait;
+					} else if (errno == ECONNRESET) {
+						n = 0;
+					} else {
+						goto fail;
+					}
+				}
+				if (n == 0) {
+					if (__russ_dial_fallback(self) < 0) {
+						goto fail;
+					}
+					break;
+				}
+				self->naread = n;
+			}
+			while (self->naread < sizeof(self->abuf)) {
+				if ((n = read(self->cconn->sd, self->abuf+self->naread, sizeof(self->abuf)-self->naread)) < 0) {
+					if (errno == EINTR) {
+						continue;
+					} else if (errno == EAGAIN) {
+						goto wait;
+					}
+					goto fail;
+				} else if (n == 0) {
+					goto fail;
+				}
+				self->naread += n;
+			}
+			if ((russ_dec_int32(self->abuf, &n) != NULL) && (n == RUSS_ANSWER_REFUSED)) {
+				errno = ECONNREFUSED;
+				goto fail;
+			}
+			rv = russ_cconn_load_fds_batch(self->cconn, self->abuf, self->recvfds, self->nrecvfds);
+			self->nrecvfds = 0;
+			if (rv < 0) {
+				goto fail;
+			}
+			self->state = RUSS_DIAL_STATE_READY;
+			break;
+
+		case RUSS_DIAL_STATE_RECV_0010:
+			if ((rv = __russ_dial_recv_0010(self)) < 0) {
+				goto fail;
+			} else if (rv == 0) {
+				goto wait;
+			}
+			self->state = RUSS_DIAL_STATE_READY;
+			break;
+		}
+	}
+
+wait:
+	if (russ_to_timeout(self->deadline) == 0) {
+		goto fail;
+	}
+	return 0;
+
+fail:
+	if (RUSS_DEBUG_russ_dialv) {
+		fprintf(stderr, "RUSS_DEBUG_russ_dialv:dial failed in state %d (errno %d)\n", self->state, errno);
+	}
+	self->state = RUSS_DIAL_STATE_FAILED;
+	russ_cconn_close(self->cconn);
+	russ_fds_close(self->recvfds, self->nrecvfds);
+	self->nrecvfds = 0;
+	return -1;
+}
+
+/**
+* Finish dial and free the dial object.
+*
+* @param self		dial object
+* @return		client connection object if the dial is ready;
+*			NULL otherwise
+*/
+struct russ_cconn *
+russ_dial_finish(struct russ_dial *self) {
+	struct russ_cconn	*cconn = NULL;
+
+	if (self == NULL) {
+		return NULL;
+	}
+	if (self->state == RUSS_DIAL_STATE_READY) {
+		cconn = self->cconn;
+		self->cconn = NULL;
+		russ_fds_close(&cconn->sd, 1);	/* sd not needed anymore */
+	}
+	russ_dial_free(self);
+	return cconn;
+}
+
+/*
+* Concurrent dials (russ_dialv_many).
+*/
+
+#define POLLHEN		(POLLHUP|POLLERR|POLLNVAL)
+#define POLLIHEN	(POLLIN|POLLHUP|POLLERR|POLLNVAL)
+
+struct russ_dialslot {
+	struct russ_dialreq	*req;
+	struct russ_dial	*dial;
+	struct russ_cconn	*cconn;
+	russ_deadline		deadline;	/**< request deadline */
+	int			nopen;		/**< open fds (in, out, err, exit) */
+	int			kick;		/**< dial needs advancing */
+};
+
+/**
+* Complete request of a slot and free the slot for reuse.
+*
+* @param slot		slot object
+* @param wrv		wait return value (if not already set)
+* @param cb		completion callback (may be NULL)
+* @param cbarg		callback argument
+*/
+static void
+__russ_dialslot_done(struct russ_dialslot *slot, int wrv, russ_dialreq_callback cb, void *cbarg) {
+	struct russ_dialreq	*req = slot->req;
+
+	if (req->wrv == RUSS_WAIT_UNSET) {
+		req->wrv = wrv;
+	}
+	slot->dial = russ_dial_free(slot->dial);
+	if (slot->cconn) {
+		russ_cconn_close(slot->cconn);
+		slot->cconn = russ_cconn_free(slot->cconn);
+	}
+	slot->req = NULL;
+	slot->nopen = 0;
+	if (cb) {
+		cb(req, cbarg);
+	}
+}
+
+/**
+* Do I/O for a ready connection of a slot (as for
+* russ_dialv_wait_inouterr()).
+*
+* If the request has an outcb, stdout and stderr data are passed
+* to it as read rather than saved to rbufs.
+*
+* @param slot		slot object
+* @param pollfds	4 pollfd objects for in, out, err, exit
+* @param cbarg		callback argument
+*/
+static void
+__russ_dialslot_io(struct russ_dialslot *slot, struct pollfd *pollfds, void *cbarg) {
+	struct russ_cconn	*cconn = slot->cconn;
+	struct russ_buf		*rbuf = NULL;
+	char			dbuf[1<<16];
+	char			*buf = NULL;
+	int			i, n, wrv;
+
+	for (i = 0; i < 3; i++) {
+		if ((cconn->fds[i] < 0) || (pollfds[i].revents == 0)) {
+			continue;
+		}
+		rbuf = slot->req->rbufs[i];
+		if (pollfds[i].revents & POLLIN) {
+			if (slot->req->outcb) {
+				if ((n = read(cconn->fds[i], dbuf, sizeof(dbuf))) <= 0) {
+					if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+						continue;
+					}
+					goto close_fd;
+				}
+				slot->req->outcb(slot->req, i, dbuf, n, cbarg);
+				continue;
+			}
+			if ((rbuf) && (rbuf->cap > 0)) {
+				n = rbuf->cap-rbuf->len;
+				buf = &rbuf->data[rbuf->len];
+			} else {
+				n = sizeof(dbuf);
+				buf = dbuf;
+			}
+			if ((n == 0)
+				|| ((n = read(cconn->fds[i], buf, n)) <= 0)) {
+				if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+					continue;
+				}
+				goto close_fd;
+			}
+			if ((rbuf) && (rbuf->cap > 0)) {
+				rbuf->len += n;
+			}
+		} else if (pollfds[i].revents & POLLOUT) {
+			n = (rbuf) ? RUSS__MIN(rbuf->len-rbuf->off, 1<<16) : 0;
+			if ((n == 0)
+				|| ((n = write(cconn->fds[i], &rbuf->data[rbuf->off], n)) <= 0)) {
+				if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+					continue;
+				}
+				goto close_fd;
+			}
+			rbuf->off += n;
+		} else if (pollfds[i].revents & POLLHEN) {
+close_fd:
+			russ_fds_close(&cconn->fds[i], 1);
+			slot->nopen--;
+		}
+	}
+
+	/* exit fd */
+	if ((cconn->sysfds[RUSS_CONN_SYSFD_EXIT] >= 0) && (pollfds[3].revents & POLLIHEN)) {
+		wrv = russ_cconn_wait(cconn, slot->deadline, &slot->req->exitst);
+		if (wrv != RUSS_WAIT_OK) {
+			russ_fds_close(&cconn->sysfds[RUSS_CONN_SYSFD_EXIT], 1);
+		}
+		slot->req->wrv = wrv;
+		slot->nopen--;
+	}
+}
+
+/**
+* Dial many services concurrently, with I/O and exit status
+* collection, in the calling thread.
+*
+* Each request is dialed and its I/O done as for
+* russ_dialv_wait_inouterr(): rbufs[0] is written to the service
+* stdin; stdout and stderr are read into rbufs[1] and rbufs[2] (up
+* to cap; NULL or cap == 0 discards). On completion, the request
+* wrv (RUSS_WAIT_*) and exitst (valid if wrv == RUSS_WAIT_OK) are
+* set and the callback, if any, is called; a callback may consume
+* and free the request buffers.
+*
+* At most maxconcurrent requests are in progress at any time, so
+* fan-out to many services uses a bounded number of descriptors. A
+* request with a timeout must complete within it (from when it is
+* started) or it is finished with wrv == RUSS_WAIT_TIMEOUT.
+*
+* @param deadline	deadline for all requests
+* @param reqs		array of request objects
+* @param nreqs		number of requests
+* @param maxconcurrent	maximum number of requests in progress (> 0)
+* @param cb		completion callback (may be NULL)
+* @param cbarg		callback argument
+* @return		number of requests with wrv == RUSS_WAIT_OK;
+*			-1 on failure
+*/
+int
+russ_dialv_many(russ_deadline deadline, struct russ_dialreq *reqs, int nreqs, int maxconcurrent,
+	russ_dialreq_callback cb, void *cbarg) {
+	struct russ_dialslot	*slots = NULL;
+	struct russ_dialslot	*slot = NULL;
+	struct pollfd		*pollfds = NULL;
+	struct pollfd		*pfds = NULL;
+	russ_deadline		pdeadline;
+	int			nslots, nactive, next, nok;
+	int			events, fd, i, j, rv, timeout;
+
+	if ((reqs == NULL) || (nreqs < 0) || (maxconcurrent <= 0)) {
+		return -1;
+	}
+	nslots = RUSS__MIN(nreqs, maxconcurrent);
+	if (((slots = russ_malloc(sizeof(struct russ_dialslot)*(nslots+1))) == NULL)
+		|| ((pollfds = russ_malloc(sizeof(struct pollfd)*4*(nslots+1))) == NULL)) {
+		slots = russ_free(slots);
+		return -1;
+	}
+	for (i = 0; i < nslots; i++) {
+		slots[i].req = NULL;
+		slots[i].dial = NULL;
+		slots[i].cconn = NULL;
+		slots[i].nopen = 0;
+		slots[i].kick = 0;
+	}
+	for (i = 0; i < nreqs; i++) {
+		reqs[i].wrv = RUSS_WAIT_UNSET;
+	}
+
+	next = 0;
+	nactive = 0;
+	while ((next < nreqs) || (nactive > 0)) {
+		/* fill free slots */
+		for (i = 0; (i < nslots) && (next < nreqs); i++) {
+			slot = &slots[i];
+			if (slot->req != NULL) {
+				continue;
+			}
+			slot->req = &reqs[next++];
+			slot->kick = 1;
+			slot->deadline = deadline;
+			if (slot->req->timeout > 0) {
+				slot->deadline = RUSS__MIN(deadline, russ_to_deadline(slot->req->timeout));
+			}
+			nactive++;
+			if ((slot->dial = russ_dial_start(slot->deadline, slot->req->op, slot->req->spath,
+				slot->req->attrv, slot->req->argv)) == NULL) {
+				__russ_dialslot_done(slot, RUSS_WAIT_FAILURE, cb, cbarg);
+				nactive--;
+				i--;
+			}
+		}
+
+		/* advance dials; set up poll entries */
+		pdeadline = deadline;
+		for (i = 0; i < nslots; i++) {
+			slot = &slots[i];
+			pfds = &pollfds[i*4];
+			for (j = 0; j < 4; j++) {
+				pfds[j].fd = -1;
+				pfds[j].revents = 0;
+			}
+			if (slot->req == NULL) {
+				continue;
+			}
+			pdeadline = RUSS__MIN(pdeadline, slot->deadline);
+			if (slot->dial != NULL) {
+				rv = (slot->kick) ? russ_dial_advance(slot->dial) : 0;
+				slot->kick = 0;
+				if (rv < 0) {
+					__russ_dialslot_done(slot, RUSS_WAIT_FAILURE, cb, cbarg);
+					nactive--;
+					continue;
+				} else if (rv == 0) {
+					fd = russ_dial_pollfd(slot->dial, &events);
+					pfds[0].fd = fd;
+					pfds[0].events = events;
+					if ((timeout = russ_dial_timeout(slot->dial)) >= 0) {
+						pdeadline = RUSS__MIN(pdeadline, russ_to_deadline(timeout));
+					}
+					continue;
+				}
+				slot->cconn = russ_dial_finish(slot->dial);
+				slot->dial = NULL;
+				slot->nopen = 4;
+				if ((slot->req->rbufs[0] == NULL) || (slot->req->rbufs[0]->len == slot->req->rbufs[0]->off)) {
+					/* nothing to send */
+					russ_fds_close(&slot->cconn->fds[0], 1);
+					slot->nopen--;
+				} else {
+					fcntl(slot->cconn->fds[0], F_SETFL, fcntl(slot->cconn->fds[0], F_GETFL)|O_NONBLOCK);
+				}
+			}
+			pfds[0].fd = slot->cconn->fds[0];
+			pfds[0].events = POLLOUT;
+			pfds[1].fd = slot->cconn->fds[1];
+			pfds[1].events = POLLIN;
+			pfds[2].fd = slot->cconn->fds[2];
+			pfds[2].events = POLLIN;
+			pfds[3].fd = slot->cconn->sysfds[RUSS_CONN_SYSFD_EXIT];
+			pfds[3].events = POLLIN;
+		}
+		if (nactive == 0) {
+			continue;
+		}
+
+		if (((rv = russ_poll_deadline(pdeadline, pollfds, 4*nslots)) < 0)
+			|| ((rv == 0) && (russ_to_deadlinediff(deadline) <= 0))) {
+			/* expired (or failed): finish all in progress */
+			for (i = 0; i < nslots; i++) {
+				if (slots[i].req != NULL) {
+					__russ_dialslot_done(&slots[i], (rv == 0) ? RUSS_WAIT_TIMEOUT : RUSS_WAIT_FAILURE, cb, cbarg);
+				}
+			}
+			for (; next < nreqs; next++) {
+				reqs[next].wrv = (rv == 0) ? RUSS_WAIT_TIMEOUT : RUSS_WAIT_FAILURE;
+				if (cb) {
+					cb(&reqs[next], cbarg);
+				}
+			}
+			nactive = 0;
+			break;
+		}
+
+		/* I/O for ready connections; mark dials to advance */
+		for (i = 0; i < nslots; i++) {
+			slot = &slots[i];
+			if (slot->req == NULL) {
+				continue;
+			} else if (slot->dial != NULL) {
+				slot->kick = (pollfds[i*4].revents != 0) || (russ_dial_timeout(slot->dial) == 0);
+			} else {
+				__russ_dialslot_io(slot, &pollfds[i*4], cbarg);
+				if (slot->nopen == 0) {
+					__russ_dialslot_done(slot, RUSS_WAIT_FAILURE, cb, cbarg);
+					nactive--;
+					continue;
+				}
+			}
+			if ((slot->deadline < deadline) && (russ_to_deadlinediff(slot->deadline) <= 0)) {
+				/* request expired */
+				__russ_dialslot_done(slot, RUSS_WAIT_TIMEOUT, cb, cbarg);
+				nactive--;
+			}
+		}
+	}
+
+	nok = 0;
+	for (i = 0; i < nreqs; i++) {
+		if (reqs[i].wrv == RUSS_WAIT_OK) {
+			nok++;
+		}
+	}
+	slots = russ_free(slots);
+	pollfds = russ_free(pollfds);
+	return nok;
+}
@@ -263,7 +263,9 @@ russ_dec_req(char *b, struct russ_req **v) {
 	}
 	if (((b = russ_dec_int32(b, &sz)) == NULL)
 		|| ((b = russ_dec_s(b, &(req->protocolstring))) == NULL)
-		|| (strcmp(RUSS_REQ_PROTOCOLSTRING, req->protocolstring) != 0)
+		|| ((strcmp(RUSS_REQ_PROTOCOLSTRING, req->protocolstring) != 0)
+			&& (strcmp(RUSS_REQ_PROTOCOLSTRING_SESSION, req->protocolstring) != 0)
+			&& (strcmp(RUSS_REQ_PROTOCOLSTRING_0010, req->protocolstring) != 0))
 		|| ((b = russ_dec_bytes(b, &dummy)) == NULL)
 		|| ((b = russ_dec_s(b, &(req->spath))) == NULL)
 		|| ((b = russ_dec_s(b, &(req->op))) == NULL)
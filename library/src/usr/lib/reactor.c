@@ -0,0 +1,302 @@
+/*
+* lib/reactor.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Relay reactor.
+*
+* Relays from many sessions are served by whichever thread(s) call
+* russ_reactor_serve(), instead of one russ_relay_serve() loop per
+* session. Each relay keeps its own epoll fd (see lib/relay.c); the
+* reactor watches those epoll fds in its own epoll set. Relay epoll
+* fds are registered one-shot so that a relay is only ever served by
+* one thread at a time. Pending and timed work of a relay (e.g.,
+* coalescing, idle buffers) is signalled with a per-relay timerfd
+* in the relay's epoll set.
+*/
+
+#ifdef __RUSS_LINUX__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif /* __RUSS_LINUX__ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <russ/priv.h>
+
+struct russ_reactor {
+	int			epfd;		/**< epoll fd for relay epoll fds */
+	pthread_mutex_t		lock;		/**< protects nrelays */
+	int			nrelays;	/**< # of relays registered */
+};
+
+/**
+* Registered relay.
+*/
+struct russ_reactor_entry {
+	struct russ_relay	*relay;
+	russ_reactor_callback	cb;
+	void			*cbarg;
+};
+
+#ifdef __RUSS_LINUX__
+/**
+* Set relay timerfd to fire at its next timed event, or right away
+* if work is pending.
+*
+* @param relay		relay object
+*/
+static void
+russ_reactor_settimer(struct russ_relay *relay) {
+	struct itimerspec	its;
+	int			wait, bytimer;
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 0;
+	its.it_value.tv_sec = 0;
+	its.it_value.tv_nsec = 0;
+	if ((wait = russ_relay_nextwait(relay, -1, &bytimer)) == 0) {
+		its.it_value.tv_nsec = 1;
+	} else if (wait > 0) {
+		its.it_value.tv_sec = wait/1000;
+		its.it_value.tv_nsec = (wait%1000)*1000000;
+	}
+	timerfd_settime(relay->timerfd, 0, &its, NULL);
+}
+
+/**
+* Release relay timerfd.
+*
+* @param relay		relay object
+*/
+static void
+russ_reactor_cleartimer(struct russ_relay *relay) {
+	struct epoll_event	ev;
+
+	if (relay->timerfd >= 0) {
+		epoll_ctl(relay->epfd, EPOLL_CTL_DEL, relay->timerfd, &ev);
+		close(relay->timerfd);
+		relay->timerfd = -1;
+	}
+}
+#endif /* __RUSS_LINUX__ */
+
+/**
+* Free reactor.
+*
+* Relays still registered are no longer served and their callbacks
+* are not called; no thread may be serving the reactor.
+*
+* @param self		reactor object
+* @return		NULL
+*/
+struct russ_reactor *
+russ_reactor_free(struct russ_reactor *self) {
+	if (self) {
+		if (self->epfd >= 0) {
+			close(self->epfd);
+		}
+		pthread_mutex_destroy(&self->lock);
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+/**
+* Create new reactor.
+*
+* Only supported on Linux (epoll).
+*
+* @return		reactor object; NULL on failure
+*/
+struct russ_reactor *
+russ_reactor_new(void) {
+#ifdef __RUSS_LINUX__
+	struct russ_reactor	*self = NULL;
+
+	if ((self = russ_malloc(sizeof(struct russ_reactor))) == NULL) {
+		return NULL;
+	}
+	self->nrelays = 0;
+	pthread_mutex_init(&self->lock, NULL);
+	if ((self->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		return russ_reactor_free(self);
+	}
+	return self;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif /* __RUSS_LINUX__ */
+}
+
+/**
+* Register relay to be served by the reactor.
+*
+* The relay is served as with russ_relay_serve() (with no timeout)
+* until its streams are done. Then, it is unregistered and cb is
+* called, from the serving thread, with the russ_relay_serve()
+* return value; the relay is the caller's again (e.g., to free) from
+* that point.
+*
+* @param self		reactor object
+* @param relay		relay object (with streams added)
+* @param exitfd		exit fd
+* @param cb		completion callback (may be NULL)
+* @param cbarg		callback argument
+* @return		0 on success; -1 on failure
+*/
+int
+russ_reactor_add(struct russ_reactor *self, struct russ_relay *relay, int exitfd,
+	russ_reactor_callback cb, void *cbarg) {
+#ifdef __RUSS_LINUX__
+	struct russ_reactor_entry	*entry = NULL;
+	struct epoll_event		ev;
+
+	if ((relay->epfd < 0)
+		|| ((entry = russ_malloc(sizeof(struct russ_reactor_entry))) == NULL)) {
+		return -1;
+	}
+	entry->relay = relay;
+	entry->cb = cb;
+	entry->cbarg = cbarg;
+
+	if ((relay->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0) {
+		goto free_entry;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = relay->timerfd;
+	if ((epoll_ctl(relay->epfd, EPOLL_CTL_ADD, relay->timerfd, &ev) < 0)
+		|| (russ_relay_start(relay, exitfd) < 0)) {
+		goto clear_timer;
+	}
+	russ_reactor_settimer(relay);
+
+	pthread_mutex_lock(&self->lock);
+	self->nrelays++;
+	pthread_mutex_unlock(&self->lock);
+
+	ev.events = EPOLLIN|EPOLLONESHOT;
+	ev.data.ptr = entry;
+	if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, relay->epfd, &ev) < 0) {
+		pthread_mutex_lock(&self->lock);
+		self->nrelays--;
+		pthread_mutex_unlock(&self->lock);
+		russ_relay_stop(relay);
+		goto clear_timer;
+	}
+	return 0;
+
+clear_timer:
+	russ_reactor_cleartimer(relay);
+free_entry:
+	entry = russ_free(entry);
+	return -1;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif /* __RUSS_LINUX__ */
+}
+
+/**
+* Return number of relays registered.
+*
+* @param self		reactor object
+* @return		# of relays
+*/
+int
+russ_reactor_count(struct russ_reactor *self) {
+	int	n;
+
+	pthread_mutex_lock(&self->lock);
+	n = self->nrelays;
+	pthread_mutex_unlock(&self->lock);
+	return n;
+}
+
+/**
+* Serve registered relays.
+*
+* May be called from several threads at once; each ready relay is
+* given one step (see russ_relay_step()) and then put back so that
+* busy relays do not starve the others.
+*
+* @param self		reactor object
+* @param timeout	time (ms) to wait for activity; -1 for no limit
+* @return		RUSS_WAIT_TIMEOUT when idle for timeout;
+*			RUSS_WAIT_FAILURE on error
+*/
+int
+russ_reactor_serve(struct russ_reactor *self, int timeout) {
+#ifdef __RUSS_LINUX__
+	struct russ_reactor_entry	*entry = NULL;
+	struct russ_relay		*relay = NULL;
+	struct epoll_event		ev;
+	int				n, bytimer, rv;
+
+	while (1) {
+		if ((n = epoll_wait(self->epfd, &ev, 1, timeout)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return RUSS_WAIT_FAILURE;
+		} else if (n == 0) {
+			return RUSS_WAIT_TIMEOUT;
+		}
+
+		entry = ev.data.ptr;
+		relay = entry->relay;
+		russ_relay_nextwait(relay, 0, &bytimer);
+		rv = RUSS_WAIT_OK;
+		if (russ_relay_step(relay, 0) < 0) {
+			rv = RUSS_WAIT_FAILURE;
+		}
+		if ((rv == RUSS_WAIT_OK) && (relay->nactive > 0)) {
+			russ_reactor_settimer(relay);
+			ev.events = EPOLLIN|EPOLLONESHOT;
+			ev.data.ptr = entry;
+			if (epoll_ctl(self->epfd, EPOLL_CTL_MOD, relay->epfd, &ev) == 0) {
+				continue;
+			}
+			rv = RUSS_WAIT_FAILURE;
+		}
+
+		/* done */
+		epoll_ctl(self->epfd, EPOLL_CTL_DEL, relay->epfd, &ev);
+		russ_reactor_cleartimer(relay);
+		russ_relay_stop(relay);
+		pthread_mutex_lock(&self->lock);
+		self->nrelays--;
+		pthread_mutex_unlock(&self->lock);
+		if (entry->cb) {
+			entry->cb(relay, rv, entry->cbarg);
+		}
+		entry = russ_free(entry);
+	}
+#else
+	errno = ENOSYS;
+	return RUSS_WAIT_FAILURE;
+#endif /* __RUSS_LINUX__ */
+}
@@ -22,14 +22,50 @@
 # license--end
 */
 
+#ifdef __RUSS_LINUX__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <sys/epoll.h>
+#endif /* __RUSS_LINUX__ */
+
+#include <errno.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include <russ/priv.h>
 
 #define POLLHEN	(POLLHUP|POLLERR|POLLNVAL)
 
+/* max I/O operations per stream per turn (see russ_relaystream_pump()) */
+#define RUSS_RELAY_BURST	16
+
+/* adaptive buffers: grow after consecutive full reads; shrink when idle (usec) */
+#define RUSS_RELAY_NFULL	2
+#define RUSS_RELAY_IDLE		1000000
+
+/* rate limits: min tokens (bytes) to resume reading */
+#define RUSS_RELAY_RATEMIN	(1<<10)
+
+/* weighted scheduling: bytes read per turn per unit of weight */
+#define RUSS_RELAY_QUANTUM	(1<<16)
+
+/**
+* Per-fd lookup entry; indexed by fd in russ_relay.fdmap.
+*/
+struct russ_relayfd {
+	int	rstream;	/**< index of stream reading fd; -1 if none */
+	int	wstream;	/**< index of stream writing fd; -1 if none */
+	int	flags;		/**< saved file status flags; -1 if unsaved */
+	int	armed;		/**< set up for (epoll) serving */
+	int	always;		/**< not pollable (e.g., regular file); always ready */
+	int	oneshot;	/**< left blocking (stdio); rearmed after each turn */
+};
+
 /**
 * Initialize existing relaystream.
 *
@@ -53,6 +89,7 @@ russ_relaystream_init(struct russ_relaystream *self, int rfd, int wfd, int bufsi
 		self->rbuf = russ_buf_free(self->rbuf);
 	}
 	self->rbuf = rbuf;
+	self->bufpool = NULL;
 	self->rfd = rfd;
 	self->wfd = wfd;
 	self->closeonexit = closeonexit;
@@ -66,6 +103,39 @@ russ_relaystream_init(struct russ_relaystream *self, int rfd, int wfd, int bufsi
 	self->nreads = 0;
 	self->nwrites = 0;
 
+	self->zerocopy = 0;
+	russ_fds_init(self->pipefds, 2, -1);
+	self->npipe = 0;
+
+	self->rready = 0;
+	self->wready = 0;
+	self->queued = 0;
+	self->reof = 0;
+	self->rpolled = 0;
+	self->wpolled = 0;
+
+	self->ring = 0;
+	self->highwater = 0;
+	self->rhead = 0;
+	self->nheld = 0;
+
+	self->minbatch = 0;
+	self->maxhold = 0;
+	self->holdstart = 0;
+	self->timed = 0;
+
+	self->mincap = 0;
+	self->maxcap = 0;
+	self->nfull = 0;
+	self->idlestart = 0;
+
+	self->rate = 0;
+	self->burst = 0;
+	self->tokens = 0;
+	self->tokenstamp = 0;
+	self->weight = 0;
+	self->deficit = 0;
+
 	return 0;
 }
 
@@ -79,23 +149,23 @@ struct russ_relaystream *
 russ_relaystream_free(struct russ_relaystream *self) {
 	if (self) {
 		/* own copy */
-		self->rbuf = russ_buf_free(self->rbuf);
+		self->rbuf = russ_bufpool_put(self->bufpool, self->rbuf);
+		russ_fds_close(self->pipefds, 2);
 		self = russ_free(self);
 	}
 	return NULL;
 }
 
 /**
-* Create relaystream.
+* Create relaystream with buffer from a pool.
 *
-* @param rfd		read fd
-* @param wfd		write fd
-* @param bufsize	buffer size
-* @param closeonexit	close on exit flag
-* @return		relaystream on success; NULL on failure
+* @see russ_relaystream_new()
+*
+* @param bufpool	buffer pool (NULL for shared)
 */
-struct russ_relaystream *
-russ_relaystream_new(int rfd, int wfd, int bufsize, int closeonexit, russ_relaystream_callback cb, void *cbarg) {
+static struct russ_relaystream *
+__russ_relaystream_new(int rfd, int wfd, int bufsize, int closeonexit, russ_relaystream_callback cb, void *cbarg,
+	struct russ_bufpool *bufpool) {
 	struct russ_relaystream	*self = NULL;
 
 	if ((rfd < 0) || (wfd < 0)) {
@@ -110,10 +180,11 @@ russ_relaystream_new(int rfd, int wfd, int bufsize, int closeonexit, russ_relays
 		return NULL;
 	}
 	if (((self = russ_malloc(sizeof(struct russ_relaystream))) == NULL)
-		|| ((self->rbuf = russ_buf_new(bufsize)) == NULL)) {
+		|| ((self->rbuf = russ_bufpool_get(bufpool, bufsize)) == NULL)) {
 		self = russ_free(self);
 		return NULL;
 	}
+	self->bufpool = bufpool;
 
 	self->rfd = rfd;
 	self->wfd = wfd;
@@ -130,28 +201,291 @@ russ_relaystream_new(int rfd, int wfd, int bufsize, int closeonexit, russ_relays
 	self->nreads = 0;
 	self->nwrites = 0;
 
+	self->zerocopy = 0;
+	russ_fds_init(self->pipefds, 2, -1);
+	self->npipe = 0;
+
+	self->rready = 0;
+	self->wready = 0;
+	self->queued = 0;
+	self->reof = 0;
+	self->rpolled = 0;
+	self->wpolled = 0;
+
+	self->ring = 0;
+	self->highwater = 0;
+	self->rhead = 0;
+	self->nheld = 0;
+
+	self->minbatch = 0;
+	self->maxhold = 0;
+	self->holdstart = 0;
+	self->timed = 0;
+
+	self->mincap = 0;
+	self->maxcap = 0;
+	self->nfull = 0;
+	self->idlestart = 0;
+
+	self->rate = 0;
+	self->burst = 0;
+	self->tokens = 0;
+	self->tokenstamp = 0;
+	self->weight = 0;
+	self->deficit = 0;
+
 	return self;
 }
 
+/**
+* Create relaystream.
+*
+* The buffer comes from the shared pool (see russ_bufpool_shared()).
+*
+* @param rfd		read fd
+* @param wfd		write fd
+* @param bufsize	buffer size
+* @param closeonexit	close on exit flag
+* @return		relaystream on success; NULL on failure
+*/
+struct russ_relaystream *
+russ_relaystream_new(int rfd, int wfd, int bufsize, int closeonexit, russ_relaystream_callback cb, void *cbarg) {
+	return __russ_relaystream_new(rfd, wfd, bufsize, closeonexit, cb, cbarg, NULL);
+}
+
+/**
+* Return number of bytes held (unwritten) by the stream.
+*
+* @param self		russ_relaystream object
+* @return		number of bytes held
+*/
+static int
+russ_relaystream_nheld(struct russ_relaystream *self) {
+	if (self->ring) {
+		return self->npipe+self->nheld;
+	}
+	return self->npipe+russ_buf_repos(self->rbuf, 0);
+}
+
+/**
+* Test for data held (unwritten) by the stream.
+*
+* @param self		russ_relaystream object
+* @return		1 if data is held; 0 otherwise
+*/
+static int
+russ_relaystream_isheld(struct russ_relaystream *self) {
+	return russ_relaystream_nheld(self) > 0;
+}
+
+/**
+* Return number of bytes that may be read now.
+*
+* A linear buffer is only read into when empty; a ring buffer is
+* read into until the high-water mark is reached. A rate-limited
+* stream is also limited by its tokens (see
+* russ_relaystream_refill()).
+*
+* @param self		russ_relaystream object
+* @return		number of bytes; <= 0 if none
+*/
+static int
+russ_relaystream_room(struct russ_relaystream *self) {
+	int	hw, n;
+
+	if (!self->ring) {
+		n = russ_relaystream_isheld(self) ? 0 : self->rbuf->cap;
+	} else {
+		hw = ((self->highwater > 0) && (self->highwater < self->rbuf->cap)) ? self->highwater : self->rbuf->cap;
+		n = hw-russ_relaystream_nheld(self);
+	}
+	if ((self->rate > 0) && (n > 0)) {
+		if (self->tokens < RUSS__MIN(self->burst, RUSS_RELAY_RATEMIN)) {
+			n = 0;
+		} else if (self->tokens < n) {
+			n = (int)self->tokens;
+		}
+	}
+	return n;
+}
+
+/**
+* Test if held data is due to be written.
+*
+* Without coalescing, data is always due. Otherwise, it is due once
+* minbatch bytes are held, no more can be read (full or EOF), or the
+* oldest held data has waited maxhold usecs.
+*
+* @param self		russ_relaystream object
+* @return		1 if due; 0 otherwise
+*/
+static int
+russ_relaystream_isdue(struct russ_relaystream *self) {
+	return (self->minbatch <= 0)
+		|| (self->reof)
+		|| (russ_relaystream_nheld(self) >= self->minbatch)
+		|| (russ_relaystream_room(self) <= 0)
+		|| (russ_gettime_us()-self->holdstart >= self->maxhold);
+}
+
+#ifdef __RUSS_LINUX__
+/**
+* Move data from the intermediate pipe to the buffer and disable
+* zero-copy for the stream.
+*
+* The buffer is unused (empty) while zero-copy is active.
+*
+* @param self		russ_relaystream object
+* @return		0 on success; -1 on failure
+*/
+static int
+russ_relaystream_unsplice(struct russ_relaystream *self) {
+	int	n;
+
+	if ((n = self->npipe) > 0) {
+		russ_buf_reset(self->rbuf);
+		if (russ_readn(self->pipefds[0], self->rbuf->data, n) != n) {
+			return -1;
+		}
+		if (self->ring) {
+			self->rhead = 0;
+			self->nheld = n;
+		} else {
+			russ_buf_adjlen(self->rbuf, n);
+		}
+	}
+	self->zerocopy = 0;
+	self->npipe = 0;
+	russ_fds_close(self->pipefds, 2);
+	return 0;
+}
+
+/**
+* Read input into intermediate pipe with splice().
+*
+* If the fds do not support splice(), zero-copy is disabled for the
+* stream.
+*
+* @param self		russ_relaystream object
+* @return		number of bytes read; 0 on EOF; -1 on failure
+*			(errno EAGAIN if nothing to read); -2 if splice()
+*			is not supported
+*/
+static int
+russ_relaystream_splicein(struct russ_relaystream *self) {
+	ssize_t	cnt;
+
+	if (self->pipefds[0] < 0) {
+		if (pipe(self->pipefds) < 0) {
+			return -2;
+		}
+#ifdef F_SETPIPE_SZ
+		/* best effort: match buffer size */
+		fcntl(self->pipefds[1], F_SETPIPE_SZ, self->rbuf->cap);
+#endif
+	}
+	while (((cnt = splice(self->rfd, NULL, self->pipefds[1], NULL, russ_relaystream_room(self),
+		SPLICE_F_MOVE|SPLICE_F_NONBLOCK)) < 0) && (errno == EINTR));
+	if ((cnt < 0) && ((errno == EINVAL) || (errno == ENOSYS))) {
+		/* fd type not supported */
+		if (russ_relaystream_unsplice(self) < 0) {
+			return -1;
+		}
+		return -2;
+	}
+	if (cnt > 0) {
+		self->npipe += cnt;
+	}
+	return (int)cnt;
+}
+
+/**
+* Write output from intermediate pipe with splice().
+*
+* If wfd does not support splice(), data in the pipe is moved to
+* the buffer and zero-copy is disabled for the stream.
+*
+* @param self		russ_relaystream object
+* @return		number of bytes written; -1 on failure (errno
+*			EAGAIN if wfd is full); -2 if splice() is not
+*			supported
+*/
+static int
+russ_relaystream_spliceout(struct russ_relaystream *self) {
+	ssize_t	cnt;
+
+	while (((cnt = splice(self->pipefds[0], NULL, self->wfd, NULL, self->npipe,
+		SPLICE_F_MOVE|SPLICE_F_NONBLOCK)) < 0) && (errno == EINTR));
+	if ((cnt < 0) && ((errno == EINVAL) || (errno == ENOSYS))) {
+		/* fd type not supported; fall back with pipe contents */
+		if (russ_relaystream_unsplice(self) < 0) {
+			return -1;
+		}
+		return -2;
+	}
+	if (cnt > 0) {
+		self->npipe -= cnt;
+	}
+	return (int)cnt;
+}
+#endif /* __RUSS_LINUX__ */
+
 /**
 * Read input into buffer.
 *
+* In zero-copy mode, data is moved into the stream's pipe instead
+* (see russ_relaystream.zerocopy); stats and callback are the same.
+* In ring mode, data is read into the free space following the
+* held data (see russ_relaystream.ring).
+*
+* Unlike russ_read(), EAGAIN is not retried so that nonblocking fds
+* can be served.
+*
 * @param self		russ_relaystream object
-* @return		number of bytes read; -1 on failure
+* @return		number of bytes read; 0 on EOF; -1 on failure
+*			(errno EAGAIN if nothing to read)
 */
 int
 russ_relaystream_read(struct russ_relaystream *self) {
 	struct russ_buf	*rbuf = NULL;
 	char		*p = NULL;
-	int		cap, cnt;
+	int		cap, cnt, tail;
 
 	rbuf = self->rbuf;
-	p = russ_buf_getp(rbuf, NULL, &cap);
-	if ((cnt = russ_read(self->rfd, p, cap)) > 0) {
-		russ_buf_adjlen(rbuf, cnt);
+	cap = russ_relaystream_room(self);
+	cnt = -2;
+#ifdef __RUSS_LINUX__
+	if (self->zerocopy) {
+		cnt = russ_relaystream_splicein(self);
+	}
+#endif /* __RUSS_LINUX__ */
+	if (cnt == -2) {
+		if (self->ring) {
+			/* contiguous free space only */
+			tail = (self->rhead+self->nheld) % rbuf->cap;
+			p = rbuf->data+tail;
+			cap = rbuf->cap-tail;
+			if (cap > russ_relaystream_room(self)) {
+				cap = russ_relaystream_room(self);
+			}
+		} else {
+			p = russ_buf_getp(rbuf, NULL, &cap);
+			cap = RUSS__MIN(cap, russ_relaystream_room(self));
+		}
+		while (((cnt = read(self->rfd, p, cap)) < 0) && (errno == EINTR));
+		if (cnt > 0) {
+			if (self->ring) {
+				self->nheld += cnt;
+			} else {
+				russ_buf_adjlen(rbuf, cnt);
+			}
+		}
+	}
+	if (cnt > 0) {
 		self->rlast = russ_gettime();
 		self->nrbytes += cnt;
 		self->nreads++;
+		self->nfull = (cnt >= cap) ? self->nfull+1 : 0;
 
 		if (self->cb) {
 			self->cb(self, 0, self->cbarg);
@@ -163,19 +497,47 @@ russ_relaystream_read(struct russ_relaystream *self) {
 /**
 * Write from buffer to output.
 *
+* In zero-copy mode, data is moved from the stream's pipe. In ring
+* mode, wrapped data is written with a single writev().
+*
 * @param self		russ_relaystream object
-* @retrun		number of bytes written; -1 on failure
+* @retrun		number of bytes written; -1 on failure (errno
+*			EAGAIN if wfd is full)
 */
 int
 russ_relaystream_write(struct russ_relaystream *self) {
 	struct russ_buf	*rbuf = NULL;
+	struct iovec	iov[2];
 	char		*p = NULL;
 	int		cnt, navail;
 
 	rbuf = self->rbuf;
-	p = russ_buf_getp(rbuf, &navail, NULL);
-	if ((cnt = russ_write(self->wfd, p, navail)) > 0) {
-		navail = russ_buf_repos(rbuf, cnt);
+	cnt = -2;
+#ifdef __RUSS_LINUX__
+	if (self->npipe > 0) {
+		cnt = russ_relaystream_spliceout(self);
+	}
+#endif /* __RUSS_LINUX__ */
+	if ((cnt == -2) && (self->ring)) {
+		iov[0].iov_base = rbuf->data+self->rhead;
+		iov[0].iov_len = (self->nheld < rbuf->cap-self->rhead) ? self->nheld : rbuf->cap-self->rhead;
+		iov[1].iov_base = rbuf->data;
+		iov[1].iov_len = self->nheld-iov[0].iov_len;
+		while (((cnt = writev(self->wfd, iov, (iov[1].iov_len > 0) ? 2 : 1)) < 0) && (errno == EINTR));
+		if (cnt > 0) {
+			self->rhead = (self->rhead+cnt) % rbuf->cap;
+			if ((self->nheld -= cnt) == 0) {
+				self->rhead = 0;
+			}
+		}
+	} else if (cnt == -2) {
+		p = russ_buf_getp(rbuf, &navail, NULL);
+		while (((cnt = write(self->wfd, p, navail)) < 0) && (errno == EINTR));
+		if (cnt > 0) {
+			navail = russ_buf_repos(rbuf, cnt);
+		}
+	}
+	if (cnt > 0) {
 		self->wlast = russ_gettime();
 		self->nwbytes += cnt;
 		self->nwrites++;
@@ -187,6 +549,210 @@ russ_relaystream_write(struct russ_relaystream *self) {
 	return cnt;
 }
 
+/**
+* Replace the (empty) buffer with one of another capacity from the
+* stream's pool.
+*
+* @param self		russ_relaystream object
+* @param cap		new capacity
+* @return		0 on success; -1 on failure (buffer unchanged)
+*/
+static int
+russ_relaystream_setcap(struct russ_relaystream *self, int cap) {
+	struct russ_buf	*rbuf = NULL;
+
+	if (cap == self->rbuf->cap) {
+		return 0;
+	}
+	if ((rbuf = russ_bufpool_get(self->bufpool, cap)) == NULL) {
+		return -1;
+	}
+	russ_bufpool_put(self->bufpool, self->rbuf);
+	self->rbuf = rbuf;
+	self->rhead = 0;
+#if defined(__RUSS_LINUX__) && defined(F_SETPIPE_SZ)
+	if (self->pipefds[1] >= 0) {
+		fcntl(self->pipefds[1], F_SETPIPE_SZ, rbuf->cap);
+	}
+#endif
+	return 0;
+}
+
+/**
+* Grow an empty adaptive buffer after reads have repeatedly filled
+* it.
+*
+* @param self		russ_relaystream object
+*/
+static void
+russ_relaystream_grow(struct russ_relaystream *self) {
+	if ((self->mincap > 0) && (self->nfull >= RUSS_RELAY_NFULL)
+		&& (self->rbuf->cap < self->maxcap) && (!russ_relaystream_isheld(self))) {
+		russ_relaystream_setcap(self, RUSS__MIN(self->rbuf->cap*2, self->maxcap));
+		self->nfull = 0;
+	}
+}
+
+/**
+* Shrink an idle adaptive buffer to its minimum and release the
+* splice pipe.
+*
+* @param self		russ_relaystream object
+*/
+static void
+russ_relaystream_shrink(struct russ_relaystream *self) {
+	russ_relaystream_setcap(self, self->mincap);
+	if (self->npipe == 0) {
+		russ_fds_close(self->pipefds, 2);
+	}
+	self->nfull = 0;
+	self->idlestart = 0;
+}
+
+/**
+* Add tokens for the time elapsed, up to burst.
+*
+* Only whole tokens are added; the remainder is kept by advancing
+* tokenstamp by the time actually credited.
+*
+* @param self		russ_relaystream object
+* @param now		current time (usec)
+*/
+static void
+russ_relaystream_refill(struct russ_relaystream *self, int64_t now) {
+	int64_t	elapsed, n;
+
+	/* a full bucket is all that can be credited; avoids overflow */
+	elapsed = RUSS__MIN(now-self->tokenstamp, (int64_t)self->burst*1000000/self->rate+1);
+	n = elapsed*self->rate/1000000;
+	if (self->tokens+n >= self->burst) {
+		self->tokens = self->burst;
+		self->tokenstamp = now;
+	} else if (n > 0) {
+		self->tokens += n;
+		self->tokenstamp += n*1000000/self->rate;
+	}
+}
+
+/**
+* Return time of the stream's next timed event: held data reaching
+* maxhold (see russ_relaystream_isdue()), a rate-limited stream
+* having tokens to read again, or an idle adaptive buffer shrinking.
+* The time may have passed.
+*
+* @param self		russ_relaystream object
+* @return		time (usec); 0 if none
+*/
+static int64_t
+russ_relaystream_nexttimer(struct russ_relaystream *self) {
+	int64_t	due = 0, tdue;
+	int64_t	need;
+
+	if (russ_relaystream_isheld(self)) {
+		if ((self->minbatch > 0) && (self->holdstart > 0)) {
+			due = self->holdstart+self->maxhold;
+		}
+	} else if (self->idlestart > 0) {
+		due = self->idlestart+RUSS_RELAY_IDLE;
+	}
+	if ((self->rate > 0) && (self->rready) && (!self->reof)
+		&& ((need = RUSS__MIN(self->burst, RUSS_RELAY_RATEMIN)-self->tokens) > 0)) {
+		tdue = self->tokenstamp+(need*1000000+self->rate-1)/self->rate;
+		due = ((due == 0) || (tdue < due)) ? tdue : due;
+	}
+	return due;
+}
+
+/**
+* Move data through a stream while its fds are known to be ready.
+*
+* Each turn writes held data (if due; see russ_relaystream_isdue())
+* and reads as much as there is room for (see
+* russ_relaystream_room()); in ring mode, both happen while data is
+* held. At most RUSS_RELAY_BURST turns are taken per call so that a
+* busy stream does not starve the others; a weighted stream (see
+* russ_relay_set_weight()) reads at most its share per call. On EOF,
+* held data is written out before the stream is done. An adaptive
+* buffer is resized while empty.
+*
+* @param self		russ_relaystream object
+* @return		1 if more work is pending; 0 if blocked; -1 if
+*			done (EOF or error)
+*/
+static int
+russ_relaystream_pump(struct russ_relaystream *self) {
+	int	i, cnt, progress, starved;
+
+	if ((self->idlestart > 0) && (!russ_relaystream_isheld(self))
+		&& (russ_gettime_us()-self->idlestart >= RUSS_RELAY_IDLE)) {
+		russ_relaystream_shrink(self);
+	}
+	if (self->rate > 0) {
+		russ_relaystream_refill(self, russ_gettime_us());
+	}
+	if (self->weight > 0) {
+		self->deficit += (int64_t)self->weight*RUSS_RELAY_QUANTUM;
+	}
+	for (i = 0; i < RUSS_RELAY_BURST; i++) {
+		progress = 0;
+		starved = 0;
+		if ((self->wready) && (russ_relaystream_isheld(self)) && (russ_relaystream_isdue(self))) {
+			if (russ_relaystream_write(self) < 0) {
+				if (errno != EAGAIN) {
+					return -1;
+				}
+				self->wready = 0;
+			} else {
+				progress = 1;
+				/* a blocking wfd is only known writable once */
+				self->wready = (self->wpolled) ? 0 : self->wready;
+				if (!russ_relaystream_isheld(self)) {
+					russ_buf_reset(self->rbuf);
+					self->holdstart = 0;
+				}
+			}
+		}
+		if ((self->weight > 0) && (self->deficit <= 0)) {
+			/* share used up; let others go first */
+			starved = (self->rready) && (!self->reof);
+		} else if ((self->rready) && (!self->reof) && (russ_relaystream_room(self) > 0)) {
+			russ_relaystream_grow(self);
+			if ((cnt = russ_relaystream_read(self)) < 0) {
+				if (errno != EAGAIN) {
+					return -1;
+				}
+				if (self->npipe == 0) {
+					/* otherwise, may be the pipe that is full */
+					self->rready = 0;
+				}
+			} else if (cnt == 0) {
+				self->reof = 1;
+			} else {
+				progress = 1;
+				self->rready = (self->rpolled) ? 0 : self->rready;
+				self->idlestart = 0;
+				self->tokens -= (self->rate > 0) ? cnt : 0;
+				self->deficit -= (self->weight > 0) ? cnt : 0;
+				if ((self->minbatch > 0) && (self->holdstart == 0)) {
+					self->holdstart = russ_gettime_us();
+				}
+			}
+		}
+		if ((self->reof) && (!russ_relaystream_isheld(self))) {
+			return -1;
+		}
+		if (!progress) {
+			if (starved) {
+				return 1;
+			}
+			/* no backlog; do not bank unused share */
+			self->deficit = RUSS__MIN(self->deficit, 0);
+			return 0;
+		}
+	}
+	return 1;
+}
+
 /**
 * Free relay object.
 *
@@ -204,6 +770,13 @@ russ_relay_free(struct russ_relay *self) {
 			self->streams[i] = russ_relaystream_free(self->streams[i]);
 		}
 		self->streams = russ_free(self->streams);
+		self->fdmap = russ_free(self->fdmap);
+		self->readyq = russ_free(self->readyq);
+		self->timerq = russ_free(self->timerq);
+		self->evs = russ_free(self->evs);
+		if (self->epfd >= 0) {
+			close(self->epfd);
+		}
 		self = russ_free(self);
 	}
 	return NULL;
@@ -212,6 +785,9 @@ russ_relay_free(struct russ_relay *self) {
 /**
 * Create new relay object.
 *
+* On Linux, streams are served with epoll (see russ_relay_serve());
+* if epoll is not available, poll() is used.
+*
 * @param n		number of relaystreams to support
 * @return		relay object; NULL on failure
 */
@@ -226,10 +802,30 @@ russ_relay_new(int n) {
 
 	self->nstreams = n;
 	self->exitfd = -1;
+	self->streams = NULL;
 	self->pollfds = NULL;
+	self->epfd = -1;
+	self->fdmap = NULL;
+	self->nfdmap = 0;
+	self->readyq = NULL;
+	self->nreadyq = 0;
+	self->timerq = NULL;
+	self->ntimerq = 0;
+	self->nactive = 0;
+	self->evs = NULL;
+	self->nevs = 0;
+	self->timerfd = -1;
+	self->bufpool = russ_bufpool_shared();
+	for (i = 0; i < RUSS_CONN_STD_NFDS; i++) {
+		self->defaults[i].rate = 0;
+		self->defaults[i].burst = 0;
+		self->defaults[i].weight = 0;
+	}
 
 	if (((self->streams = russ_malloc(sizeof(struct russ_relaystream *)*n)) == NULL)
-		|| ((self->pollfds = russ_malloc(sizeof(struct pollfd)*(n+1))) == NULL)) {
+		|| ((self->pollfds = russ_malloc(sizeof(struct pollfd)*(n+1))) == NULL)
+		|| ((self->readyq = russ_malloc(sizeof(int)*(n+1))) == NULL)
+		|| ((self->timerq = russ_malloc(sizeof(int)*(n+1))) == NULL)) {
 		goto free_relay;
 	}
 	for (i = 0; i < n; i++) {
@@ -241,6 +837,10 @@ russ_relay_new(int n) {
 	self->pollfds[i].fd = -1;
 	self->pollfds[i].events = 0;
 
+#ifdef __RUSS_LINUX__
+	self->epfd = epoll_create1(EPOLL_CLOEXEC);
+#endif /* __RUSS_LINUX__ */
+
 	return self;
 
 free_relay:
@@ -248,6 +848,131 @@ free_relay:
 	return NULL;
 }
 
+/**
+* Get fd lookup entry.
+*
+* @param self		relay object
+* @param fd		fd
+* @param grow		1 to grow fdmap to hold fd
+* @return		entry; NULL if not found or on failure
+*/
+static struct russ_relayfd *
+russ_relay_getfd(struct russ_relay *self, int fd, int grow) {
+	struct russ_relayfd	*fdmap = NULL;
+	int			i, n;
+
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fd >= self->nfdmap) {
+		if (!grow) {
+			return NULL;
+		}
+		n = (fd+64) & ~63;
+		if ((fdmap = realloc(self->fdmap, sizeof(struct russ_relayfd)*n)) == NULL) {
+			return NULL;
+		}
+		for (i = self->nfdmap; i < n; i++) {
+			fdmap[i].rstream = -1;
+			fdmap[i].wstream = -1;
+			fdmap[i].flags = -1;
+			fdmap[i].armed = 0;
+			fdmap[i].always = 0;
+			fdmap[i].oneshot = 0;
+		}
+		self->fdmap = fdmap;
+		self->nfdmap = n;
+	}
+	return &self->fdmap[fd];
+}
+
+/**
+* Undo the serving setup of an fd: deregister from epoll and restore
+* the file status flags.
+*
+* @param self		relay object
+* @param fd		fd
+*/
+static void
+russ_relay_disarmfd(struct russ_relay *self, int fd) {
+#ifdef __RUSS_LINUX__
+	struct russ_relayfd	*ent = NULL;
+	struct epoll_event	ev;
+
+	if (((ent = russ_relay_getfd(self, fd, 0)) == NULL) || (!ent->armed)) {
+		return;
+	}
+	if (!ent->always) {
+		epoll_ctl(self->epfd, EPOLL_CTL_DEL, fd, &ev);
+	}
+	if (ent->flags >= 0) {
+		fcntl(fd, F_SETFL, ent->flags);
+	}
+	ent->flags = -1;
+	ent->armed = 0;
+	ent->always = 0;
+	ent->oneshot = 0;
+#endif /* __RUSS_LINUX__ */
+}
+
+/**
+* Queue stream for servicing.
+*
+* @param self		relay object
+* @param i		stream index
+*/
+static void
+russ_relay_enqueue(struct russ_relay *self, int i) {
+	if (!self->streams[i]->queued) {
+		self->streams[i]->queued = 1;
+		self->readyq[self->nreadyq++] = i;
+	}
+}
+
+/**
+* Put stream on the timer queue if it has a timed event pending
+* (see russ_relaystream_nexttimer()) and its held data, if any, is
+* not already due (it then waits for wfd instead). An empty
+* adaptive buffer starts its idle period here.
+*
+* @param self		relay object
+* @param i		stream index
+*/
+static void
+russ_relay_settimer(struct russ_relay *self, int i) {
+	struct russ_relaystream	*stream = self->streams[i];
+
+	if ((stream->mincap > 0) && (stream->idlestart == 0) && (!russ_relaystream_isheld(stream))
+		&& ((stream->rbuf->cap > stream->mincap) || (stream->pipefds[0] >= 0))) {
+		/* start idle period for a shrinkable buffer */
+		stream->idlestart = russ_gettime_us();
+	}
+	if ((!stream->timed) && (russ_relaystream_nexttimer(stream) > 0)
+		&& ((!russ_relaystream_isheld(stream)) || (!russ_relaystream_isdue(stream)))) {
+		stream->timed = 1;
+		self->timerq[self->ntimerq++] = i;
+	}
+}
+
+/**
+* Drop stream index from a queue.
+*
+* @param q		queue (array of stream indexes)
+* @param nq		(in/out) queue length
+* @param i		stream index
+*/
+static void
+russ_relay_unqueue(int *q, int *nq, int i) {
+	int	j, k;
+
+	for (j = 0, k = 0; j < *nq; j++) {
+		if (q[j] != i) {
+			q[k++] = q[j];
+		}
+	}
+	*nq = k;
+}
+
 /**
 * Register an fd pair to relay (rfd -> wfd).
 *
@@ -269,12 +994,26 @@ russ_relay_addwithcallback(struct russ_relay *self, int rfd, int wfd, int bufsiz
 	if (i == self->nstreams) {
 		return -1;
 	}
-	if ((self->streams[i] = russ_relaystream_new(rfd, wfd, bufsize, closeonexit, cb, cbarg)) == NULL) {
+	if ((rfd < 0) || (wfd < 0)
+		|| (russ_relay_getfd(self, (rfd > wfd) ? rfd : wfd, 1) == NULL)
+		|| (self->fdmap[rfd].rstream >= 0)
+		|| ((self->streams[i] = __russ_relaystream_new(rfd, wfd, bufsize, closeonexit, cb, cbarg, self->bufpool)) == NULL)) {
 		return -1;
 	}
+	self->fdmap[rfd].rstream = i;
+	self->fdmap[wfd].wstream = i;
 	self->pollfds[i].fd = rfd;
 	self->pollfds[i].events = POLLIN;
 
+	if (i < RUSS_CONN_STD_NFDS) {
+		/* validated by russ_relay_set_defaults() */
+		if (self->defaults[i].rate > 0) {
+			russ_relay_set_rate(self, i, self->defaults[i].rate, self->defaults[i].burst);
+		}
+		if (self->defaults[i].weight > 0) {
+			russ_relay_set_weight(self, i, self->defaults[i].weight);
+		}
+	}
 	return i;
 }
 
@@ -332,14 +1071,16 @@ russ_relay_add2(struct russ_relay *self, int fd0, int fd1, int bufsize, int clos
 */
 int
 russ_relay_find(struct russ_relay *self, int rfd, int wfd) {
-	int	i;
+	struct russ_relayfd	*ent = NULL;
+	int			i;
 
-	for (i = 0; i < self->nstreams; i++) {
-		if ((self->streams[i]) && (self->streams[i]->rfd == rfd) && (self->streams[i]->wfd == wfd)) {
-			return i;
-		}
+	if (((ent = russ_relay_getfd(self, rfd, 0)) == NULL)
+		|| ((i = ent->rstream) < 0)
+		|| (self->streams[i] == NULL)
+		|| (self->streams[i]->wfd != wfd)) {
+		return -1;
 	}
-	return -1;
+	return i;
 }
 
 /**
@@ -352,14 +1093,37 @@ russ_relay_find(struct russ_relay *self, int rfd, int wfd) {
 */
 int
 russ_relay_remove(struct russ_relay *self, int rfd, int wfd) {
-	int	i, j;
+	struct russ_relayfd	*rent = NULL, *went = NULL;
+	int			i;
 
 	if ((i = russ_relay_find(self, rfd, wfd)) < 0) {
 		return -1;
 	}
+	rent = &self->fdmap[rfd];
+	went = &self->fdmap[wfd];
+	rent->rstream = -1;
+	if (went->wstream == i) {
+		went->wstream = -1;
+	}
 	if (self->streams[i]->closeonexit) {
+		russ_relay_disarmfd(self, rfd);
+		russ_relay_disarmfd(self, wfd);
 		close(rfd);
 		close(wfd);
+	} else {
+		/* restore fds no longer relayed */
+		if (rent->wstream < 0) {
+			russ_relay_disarmfd(self, rfd);
+		}
+		if ((went->rstream < 0) && (went->wstream < 0)) {
+			russ_relay_disarmfd(self, wfd);
+		}
+	}
+	if (self->streams[i]->queued) {
+		russ_relay_unqueue(self->readyq, &self->nreadyq, i);
+	}
+	if (self->streams[i]->timed) {
+		russ_relay_unqueue(self->timerq, &self->ntimerq, i);
 	}
 	self->streams[i] = russ_relaystream_free(self->streams[i]);
 	self->pollfds[i].fd = -1;
@@ -380,14 +1144,232 @@ russ_relay_poll(struct russ_relay *self, int timeout) {
 }
 
 /**
-* Relay data between registered fds.
+* Size a stream's buffer adaptively.
+*
+* The buffer starts at (or is clamped to) the bounds, doubles when
+* reads fill it repeatedly (RUSS_RELAY_NFULL times), and returns to
+* mincap, releasing any zero-copy pipe, after RUSS_RELAY_IDLE usecs
+* without input. Buffers come from the relay's pool (see
+* russ_relay.bufpool). Resizing applies to the epoll engine (see
+* russ_relay_serve()). Must be set while no data is held.
+*
+* @param self		relay object
+* @param idx		stream index (see russ_relay_add())
+* @param mincap		minimum buffer size; <= 0 to disable
+* @param maxcap		maximum buffer size
+* @return		0 on success; -1 on failure
+*/
+int
+russ_relay_set_bufsizes(struct russ_relay *self, int idx, int mincap, int maxcap) {
+	struct russ_relaystream	*stream = NULL;
+
+	if ((idx < 0) || (idx >= self->nstreams)
+		|| ((stream = self->streams[idx]) == NULL)
+		|| (russ_relaystream_isheld(stream))) {
+		return -1;
+	}
+	if (mincap <= 0) {
+		stream->mincap = 0;
+		stream->maxcap = 0;
+		return 0;
+	}
+	maxcap = RUSS__MAX(mincap, maxcap);
+	if (russ_relaystream_setcap(stream, RUSS__MIN(RUSS__MAX(stream->rbuf->cap, mincap), maxcap)) < 0) {
+		return -1;
+	}
+	stream->mincap = mincap;
+	stream->maxcap = maxcap;
+	stream->nfull = 0;
+	stream->idlestart = 0;
+	return 0;
+}
+
+/**
+* Coalesce small writes of a stream.
+*
+* Data read is held until minbatch bytes are held or the oldest held
+* data has waited maxhold usecs, then written in one operation. The
+* stream is set up as a ring (see russ_relay_set_ring()) if it is not
+* already, so coalescing applies to the epoll engine.
+*
+* @param self		relay object
+* @param idx		stream index (see russ_relay_add())
+* @param minbatch	minimum # of bytes per write; <= 0 to disable
+* @param maxhold	maximum time (usec) to hold data
+* @return		0 on success; -1 on failure
+*/
+int
+russ_relay_set_coalesce(struct russ_relay *self, int idx, int minbatch, int maxhold) {
+	struct russ_relaystream	*stream = NULL;
+
+	if ((idx < 0) || (idx >= self->nstreams)
+		|| ((stream = self->streams[idx]) == NULL)
+		|| ((minbatch > 0) && (!stream->ring) && (russ_relay_set_ring(self, idx, 0) < 0))) {
+		return -1;
+	}
+	stream->minbatch = (minbatch > 0) ? minbatch : 0;
+	stream->maxhold = (maxhold > 0) ? maxhold : 0;
+	return 0;
+}
+
+/**
+* Set the settings for streams later added to the relay at the given
+* index (e.g., 0, 1, 2 for the stdin, stdout, stderr relays of a
+* server); see russ_relay_set_rate() and russ_relay_set_weight().
+* Servers usually load them from the [relay] section of the conf
+* (see russ_svr_apply_relaydefaults()).
+*
+* @param self		relay object
+* @param idx		stream index (< RUSS_CONN_STD_NFDS)
+* @param rate		max bytes/sec; <= 0 for no limit
+* @param burst		token bucket size (bytes); <= 0 for default
+* @param weight		scheduling weight; <= 0 for unweighted
+* @return		0 on success; -1 on failure (e.g., rate limit
+*			without the epoll engine)
+*/
+int
+russ_relay_set_defaults(struct russ_relay *self, int idx, int rate, int burst, int weight) {
+	if ((idx < 0) || (idx >= RUSS_CONN_STD_NFDS)
+		|| ((rate > 0) && (self->epfd < 0))) {
+		return -1;
+	}
+	self->defaults[idx].rate = (rate > 0) ? rate : 0;
+	self->defaults[idx].burst = (burst > 0) ? burst : 0;
+	self->defaults[idx].weight = (weight > 0) ? weight : 0;
+	return 0;
+}
+
+/**
+* Limit the rate at which a stream reads, with a token bucket.
+*
+* Up to burst bytes may be read at once; tokens are refilled at
+* rate bytes/sec. Requires the epoll engine (see russ_relay_serve()).
+*
+* @param self		relay object
+* @param idx		stream index (see russ_relay_add())
+* @param rate		max bytes/sec; <= 0 for no limit
+* @param burst		token bucket size (bytes); <= 0 for rate/10
+*			(at least RUSS_RELAY_RATEMIN)
+* @return		0 on success; -1 on failure
+*/
+int
+russ_relay_set_rate(struct russ_relay *self, int idx, int rate, int burst) {
+	struct russ_relaystream	*stream = NULL;
+
+	if ((idx < 0) || (idx >= self->nstreams)
+		|| ((stream = self->streams[idx]) == NULL)
+		|| ((rate > 0) && (self->epfd < 0))) {
+		return -1;
+	}
+	if (rate <= 0) {
+		stream->rate = 0;
+		return 0;
+	}
+	stream->rate = rate;
+	stream->burst = (burst > 0) ? burst : RUSS__MAX(rate/10, RUSS_RELAY_RATEMIN);
+	stream->tokens = stream->burst;
+	stream->tokenstamp = russ_gettime_us();
+	return 0;
+}
+
+/**
+* Use a stream's buffer as a ring so that reads and writes overlap.
+*
+* Reads fill free space while writes drain held data; reading stops
+* while highwater bytes are held. Overlap applies to the epoll
+* engine (see russ_relay_serve()); otherwise, the stream is served
+* as usual. Must be set before data is held.
+*
+* @param self		relay object
+* @param idx		stream index (see russ_relay_add())
+* @param highwater	high-water mark (bytes); <= 0 for buffer size
+* @return		0 on success; -1 on failure
+*/
+int
+russ_relay_set_ring(struct russ_relay *self, int idx, int highwater) {
+	struct russ_relaystream	*stream = NULL;
+
+	if ((idx < 0) || (idx >= self->nstreams)
+		|| ((stream = self->streams[idx]) == NULL)
+		|| (russ_relaystream_isheld(stream))) {
+		return -1;
+	}
+	russ_buf_reset(stream->rbuf);
+	stream->ring = 1;
+	stream->highwater = (highwater > 0) ? highwater : 0;
+	stream->rhead = 0;
+	stream->nheld = 0;
+	return 0;
+}
+
+/**
+* Give a stream a weighted share of reads.
+*
+* Each time the streams of a relay are serviced, a weighted stream
+* reads up to weight*RUSS_RELAY_QUANTUM bytes (deficit round robin)
+* before the others get their turn, so that a bulk stream cannot
+* starve an interactive one. Unweighted streams read up to
+* RUSS_RELAY_BURST buffers per turn. Weighting applies to the epoll
+* engine (see russ_relay_serve()).
+*
+* @param self		relay object
+* @param idx		stream index (see russ_relay_add())
+* @param weight		weight; <= 0 for unweighted
+* @return		0 on success; -1 on failure
+*/
+int
+russ_relay_set_weight(struct russ_relay *self, int idx, int weight) {
+	struct russ_relaystream	*stream = NULL;
+
+	if ((idx < 0) || (idx >= self->nstreams)
+		|| ((stream = self->streams[idx]) == NULL)) {
+		return -1;
+	}
+	stream->weight = (weight > 0) ? weight : 0;
+	stream->deficit = 0;
+	return 0;
+}
+
+/**
+* Move a stream's data with splice() through an intermediate pipe,
+* rather than through its buffer, when its fds allow (Linux).
+*
+* Disabled by default. The buffer holds no data in this mode, so it
+* cannot be enabled for a stream with a callback (which may look at
+* the buffer). Must be set before data is held.
+*
+* @param self		relay object
+* @param idx		stream index (see russ_relay_add())
+* @param value		1 to enable; 0 to disable
+* @return		0 on success; -1 on failure
+*/
+int
+russ_relay_set_zerocopy(struct russ_relay *self, int idx, int value) {
+	struct russ_relaystream	*stream = NULL;
+
+	if ((idx < 0) || (idx >= self->nstreams)
+		|| ((stream = self->streams[idx]) == NULL)
+		|| (russ_relaystream_isheld(stream))
+		|| ((value) && (stream->cb != NULL))) {
+		return -1;
+	}
+	stream->zerocopy = (value) ? 1 : 0;
+	if (!stream->zerocopy) {
+		russ_fds_close(stream->pipefds, 2);
+	}
+	return 0;
+}
+
+/**
+* Relay data between registered fds using poll().
 *
 * @param self		relay object
 * @param timeout	time (ms) to serve
+* @param exitfd		exit fd
 * @retrun		0 on success; < 0 on error
 */
-int
-russ_relay_serve(struct russ_relay *self, int timeout, int exitfd) {
+static int
+russ_relay_serve_poll(struct russ_relay *self, int timeout, int exitfd) {
 	struct pollfd		*pollfds = NULL, *pollfd = NULL;
 	struct russ_buf		*rbuf = NULL;
 	struct russ_relaystream	*stream = NULL, **streams = NULL;
@@ -438,7 +1420,12 @@ russ_relay_serve(struct russ_relay *self, int timeout, int exitfd) {
 			stream = streams[i];
 
 			if (revents & POLLIN) {
-				if (russ_relaystream_read(stream) <= 0) {
+				if ((cnt = russ_relaystream_read(stream)) <= 0) {
+					if ((cnt < 0) && (errno == EAGAIN)) {
+						/* nonblocking rfd; nothing after all */
+						nevents--;
+						continue;
+					}
 					/* EOF or error; unrecoverable */
 					goto disable_stream;
 				}
@@ -446,10 +1433,11 @@ russ_relay_serve(struct russ_relay *self, int timeout, int exitfd) {
 				pollfd->events = POLLOUT;
 			} else if (revents & POLLOUT) {
 				if (russ_relaystream_write(stream) < 0) {
-					/* error; unrecoverable */
-					goto disable_stream;
-				}
-				if (russ_buf_repos(stream->rbuf, 0) == 0) {
+					if (errno != EAGAIN) {
+						/* error; unrecoverable */
+						goto disable_stream;
+					}
+				} else if (!russ_relaystream_isheld(stream)) {
 					russ_buf_reset(stream->rbuf);
 					pollfd->fd = stream->rfd;
 					pollfd->events = POLLIN;
@@ -479,6 +1467,428 @@ disable_stream:
 	return RUSS_WAIT_OK;
 }
 
+#ifdef __RUSS_LINUX__
+/**
+* Register (again) a oneshot fd for the directions its streams are
+* waiting on.
+*
+* @param self		relay object
+* @param fd		fd
+* @param op		EPOLL_CTL_ADD or EPOLL_CTL_MOD
+* @return		0 on success; -1 on failure
+*/
+static int
+russ_relay_rearmfd(struct russ_relay *self, int fd, int op) {
+	struct russ_relaystream	*stream = NULL;
+	struct russ_relayfd	*ent = NULL;
+	struct epoll_event	ev;
+
+	if (((ent = russ_relay_getfd(self, fd, 0)) == NULL) || (!ent->oneshot)) {
+		return 0;
+	}
+	ev.events = EPOLLONESHOT;
+	if ((ent->rstream >= 0) && ((stream = self->streams[ent->rstream]) != NULL)
+		&& (!stream->rready) && (!stream->reof)) {
+		ev.events |= EPOLLIN;
+	}
+	if ((ent->wstream >= 0) && ((stream = self->streams[ent->wstream]) != NULL)
+		&& (!stream->wready)) {
+		ev.events |= EPOLLOUT;
+	}
+	ev.data.fd = fd;
+	return epoll_ctl(self->epfd, op, fd, &ev);
+}
+
+/**
+* Set up fds of all streams for serving with epoll.
+*
+* Each fd is made nonblocking and registered (once, edge-triggered)
+* for the directions it is relayed in. All file status flags are
+* saved before any are changed so that fds sharing an open file
+* description (e.g., stdout and stderr on a tty) are restored to the
+* original state. An fd that epoll does not support (e.g., regular
+* file) is treated as always ready.
+*
+* The stdio fds (0-2) usually share their open file description
+* with other processes (e.g., a terminal or a parent's pipe), which
+* would see the nonblocking flag too. They are left blocking and
+* served like with poll(): level-triggered, oneshot, with one I/O
+* operation per readiness (see russ_relaystream.rpolled).
+*
+* @param self		relay object
+*/
+static void
+russ_relay_arm(struct russ_relay *self) {
+	struct russ_relaystream	*stream = NULL;
+	struct russ_relayfd	*ent = NULL;
+	struct epoll_event	ev;
+	int			fds[2];
+	int			i, j;
+
+	for (i = 0; i < self->nstreams; i++) {
+		if ((stream = self->streams[i]) == NULL) {
+			continue;
+		}
+		fds[0] = stream->rfd;
+		fds[1] = stream->wfd;
+		for (j = 0; j < 2; j++) {
+			ent = &self->fdmap[fds[j]];
+			if ((!ent->armed) && (ent->flags < 0) && (fds[j] > STDERR_FILENO)) {
+				ent->flags = fcntl(fds[j], F_GETFL);
+			}
+		}
+	}
+
+	for (i = 0; i < self->nstreams; i++) {
+		if ((stream = self->streams[i]) == NULL) {
+			continue;
+		}
+		fds[0] = stream->rfd;
+		fds[1] = stream->wfd;
+		for (j = 0; j < 2; j++) {
+			ent = &self->fdmap[fds[j]];
+			if (ent->armed) {
+				continue;
+			}
+			ent->armed = 1;
+			if (fds[j] <= STDERR_FILENO) {
+				ent->oneshot = 1;
+				if (russ_relay_rearmfd(self, fds[j], EPOLL_CTL_ADD) < 0) {
+					ent->oneshot = 0;
+					ent->always = 1;
+				}
+				continue;
+			}
+			if (ent->flags >= 0) {
+				fcntl(fds[j], F_SETFL, ent->flags|O_NONBLOCK);
+			}
+			ev.events = EPOLLET;
+			ev.events |= (ent->rstream >= 0) ? EPOLLIN : 0;
+			ev.events |= (ent->wstream >= 0) ? EPOLLOUT : 0;
+			ev.data.fd = fds[j];
+			if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fds[j], &ev) < 0) {
+				ent->always = 1;
+			}
+		}
+	}
+
+	/* always ready fds; oneshot fds are polled */
+	for (i = 0; i < self->nstreams; i++) {
+		if ((stream = self->streams[i]) == NULL) {
+			continue;
+		}
+		stream->rpolled = self->fdmap[stream->rfd].oneshot;
+		stream->wpolled = self->fdmap[stream->wfd].oneshot;
+		if (self->fdmap[stream->rfd].always) {
+			stream->rready = 1;
+			russ_relay_enqueue(self, i);
+		}
+		if (self->fdmap[stream->wfd].always) {
+			stream->wready = 1;
+			russ_relay_enqueue(self, i);
+		}
+	}
+}
+
+/**
+* Undo russ_relay_arm() for remaining streams.
+*
+* The poll() state of each stream is updated to match so that
+* russ_relay_poll() may be used afterward.
+*
+* @param self		relay object
+*/
+static void
+russ_relay_disarm(struct russ_relay *self) {
+	struct russ_relaystream	*stream = NULL;
+	int			i;
+
+	for (i = 0; i < self->nstreams; i++) {
+		if ((stream = self->streams[i]) == NULL) {
+			continue;
+		}
+		russ_relay_disarmfd(self, stream->rfd);
+		russ_relay_disarmfd(self, stream->wfd);
+		stream->rready = 0;
+		stream->wready = 0;
+		stream->queued = 0;
+		stream->timed = 0;
+		if (russ_relaystream_isheld(stream)) {
+			self->pollfds[i].fd = stream->wfd;
+			self->pollfds[i].events = POLLOUT;
+		} else {
+			self->pollfds[i].fd = stream->rfd;
+			self->pollfds[i].events = POLLIN;
+		}
+	}
+	self->nreadyq = 0;
+	self->ntimerq = 0;
+}
+
+/**
+* Prepare relay for serving with epoll: arm stream fds (see
+* russ_relay_arm()) and watch exitfd.
+*
+* Used by russ_relay_serve() and by a reactor (see lib/reactor.c);
+* the relay is then advanced with russ_relay_nextwait() and
+* russ_relay_step() while nactive > 0, and finished with
+* russ_relay_stop().
+*
+* @param self		relay object
+* @param exitfd		exit fd
+* @return		0 on success; -1 on failure
+*/
+int
+russ_relay_start(struct russ_relay *self, int exitfd) {
+	struct epoll_event	ev;
+	int			i;
+
+	if (self->epfd < 0) {
+		return -1;
+	}
+	/* stream fds, exitfd, timerfd */
+	self->nevs = self->nstreams*2+2;
+	if ((self->evs = russ_malloc(sizeof(struct epoll_event)*self->nevs)) == NULL) {
+		return -1;
+	}
+
+	self->nactive = 0;
+	for (i = 0; i < self->nstreams; i++) {
+		if (self->streams[i]) {
+			self->nactive++;
+		}
+	}
+	russ_relay_arm(self);
+
+	self->exitfd = -1;
+	if (exitfd >= 0) {
+		ev.events = EPOLLIN|EPOLLET;
+		ev.data.fd = exitfd;
+		if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, exitfd, &ev) == 0) {
+			self->exitfd = exitfd;
+			self->nactive++;
+		}
+	}
+	return 0;
+}
+
+/**
+* Finish serving: stop watching exitfd and disarm remaining streams
+* (see russ_relay_disarm()).
+*
+* @param self		relay object
+*/
+void
+russ_relay_stop(struct russ_relay *self) {
+	struct epoll_event	ev;
+
+	if (self->exitfd >= 0) {
+		epoll_ctl(self->epfd, EPOLL_CTL_DEL, self->exitfd, &ev);
+		self->exitfd = -1;
+	}
+	russ_relay_disarm(self);
+	self->evs = russ_free(self->evs);
+	self->nevs = 0;
+	self->nactive = 0;
+}
+
+/**
+* Queue streams with due timed events and return how long to wait
+* for fd events.
+*
+* @param self		relay object
+* @param wait		maximum wait (ms); -1 for no limit
+* @param bytimer	set to 1 if the wait is limited by a timed
+*			event; 0 otherwise
+* @return		wait (ms); 0 if work is pending; -1 for no limit
+*/
+int
+russ_relay_nextwait(struct russ_relay *self, int wait, int *bytimer) {
+	struct russ_relaystream	*stream = NULL;
+	int64_t			now, due;
+	int			nqueued, twait;
+	int			i, k;
+
+	/* do not wait while work is pending or past a timed event */
+	wait = (self->nreadyq > 0) ? 0 : wait;
+	*bytimer = 0;
+	if (self->ntimerq > 0) {
+		now = russ_gettime_us();
+		nqueued = self->ntimerq;
+		self->ntimerq = 0;
+		for (k = 0; k < nqueued; k++) {
+			i = self->timerq[k];
+			stream = self->streams[i];
+			due = russ_relaystream_nexttimer(stream);
+			if (due == 0) {
+				stream->timed = 0;
+			} else if (due <= now) {
+				stream->timed = 0;
+				russ_relay_enqueue(self, i);
+				wait = 0;
+			} else {
+				self->timerq[self->ntimerq++] = i;
+				twait = (int)((due-now+999)/1000);
+				if ((wait < 0) || (twait < wait)) {
+					wait = twait;
+					*bytimer = 1;
+				}
+			}
+		}
+	}
+	return wait;
+}
+
+/**
+* Wait for fd events and give each ready stream one turn (see
+* russ_relaystream_pump()).
+*
+* Finished streams are removed and nactive is updated; when exitfd
+* hangs up, streams marked closeonexit are removed.
+*
+* @param self		relay object
+* @param wait		time (ms) to wait for events
+* @return		1 if there was work; 0 if none; -1 on failure
+*/
+int
+russ_relay_step(struct russ_relay *self, int wait) {
+	struct epoll_event	ev;
+	struct russ_relaystream	*stream = NULL;
+	struct russ_relayfd	*ent = NULL;
+	int			nevents, nqueued, exithup;
+	int			i, k, fd;
+
+	if ((nevents = epoll_wait(self->epfd, self->evs, self->nevs, wait)) < 0) {
+		return -1;
+	}
+	if ((nevents == 0) && (self->nreadyq == 0)) {
+		return 0;
+	}
+
+	exithup = 0;
+	for (k = 0; k < nevents; k++) {
+		fd = self->evs[k].data.fd;
+		if (fd == self->exitfd) {
+			if (self->evs[k].events & (EPOLLHUP|EPOLLERR)) {
+				exithup = 1;
+			}
+			continue;
+		}
+		if (fd == self->timerfd) {
+			/* rearmed by the reactor */
+			continue;
+		}
+		if ((ent = russ_relay_getfd(self, fd, 0)) == NULL) {
+			continue;
+		}
+		if ((self->evs[k].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) && ((i = ent->rstream) >= 0)) {
+			self->streams[i]->rready = 1;
+			russ_relay_enqueue(self, i);
+		}
+		if ((self->evs[k].events & (EPOLLOUT|EPOLLHUP|EPOLLERR)) && ((i = ent->wstream) >= 0)) {
+			self->streams[i]->wready = 1;
+			russ_relay_enqueue(self, i);
+		}
+	}
+
+	/* one turn for each queued stream; requeue if unfinished */
+	nqueued = self->nreadyq;
+	self->nreadyq = 0;
+	for (k = 0; k < nqueued; k++) {
+		i = self->readyq[k];
+		stream = self->streams[i];
+		stream->queued = 0;
+		switch (russ_relaystream_pump(stream)) {
+		case 1:
+			russ_relay_enqueue(self, i);
+			russ_relay_settimer(self, i);
+			russ_relay_rearmfd(self, stream->rfd, EPOLL_CTL_MOD);
+			russ_relay_rearmfd(self, stream->wfd, EPOLL_CTL_MOD);
+			break;
+		case 0:
+			russ_relay_settimer(self, i);
+			russ_relay_rearmfd(self, stream->rfd, EPOLL_CTL_MOD);
+			russ_relay_rearmfd(self, stream->wfd, EPOLL_CTL_MOD);
+			break;
+		case -1:
+			russ_relay_remove(self, stream->rfd, stream->wfd);
+			self->nactive--;
+			break;
+		}
+	}
+
+	if (exithup) {
+		epoll_ctl(self->epfd, EPOLL_CTL_DEL, self->exitfd, &ev);
+		self->exitfd = -1;
+		self->nactive--;
+		/* remove disable-on-exit streams */
+		for (i = 0; i < self->nstreams; i++) {
+			if ((self->streams[i]) && (self->streams[i]->closeonexit)) {
+				russ_relay_remove(self, self->streams[i]->rfd, self->streams[i]->wfd);
+				self->nactive--;
+			}
+		}
+	}
+	return 1;
+}
+
+/**
+* Relay data between registered fds using epoll.
+*
+* Only streams with a ready fd are visited; lookups from fd to
+* stream are direct (see russ_relay.fdmap).
+*
+* @param self		relay object
+* @param timeout	time (ms) to serve
+* @param exitfd		exit fd
+* @retrun		0 on success; < 0 on error
+*/
+static int
+russ_relay_serve_epoll(struct russ_relay *self, int timeout, int exitfd) {
+	int	wait, bytimer, rv, n;
+
+	if (russ_relay_start(self, exitfd) < 0) {
+		return RUSS_WAIT_FAILURE;
+	}
+
+	rv = RUSS_WAIT_OK;
+	while (self->nactive) {
+		wait = russ_relay_nextwait(self, timeout, &bytimer);
+		if (((n = russ_relay_step(self, wait)) < 0) || ((n == 0) && (!bytimer))) {
+			rv = RUSS_WAIT_TIMEOUT;
+			break;
+		}
+	}
+
+	russ_relay_stop(self);
+	return rv;
+}
+#endif /* __RUSS_LINUX__ */
+
+/**
+* Relay data between registered fds.
+*
+* Each stream is serviced until EOF or error; when exitfd hangs up,
+* streams marked closeonexit are removed. On Linux, epoll is used
+* (with edge-triggered, nonblocking fds, restored on return; see
+* russ_relay_arm() for the stdio fds);
+* otherwise, poll().
+*
+* @param self		relay object
+* @param timeout	time (ms) to serve
+* @param exitfd		exit fd
+* @retrun		0 on success; < 0 on error
+*/
+int
+russ_relay_serve(struct russ_relay *self, int timeout, int exitfd) {
+#ifdef __RUSS_LINUX__
+	if (self->epfd >= 0) {
+		return russ_relay_serve_epoll(self, timeout, exitfd);
+	}
+#endif /* __RUSS_LINUX__ */
+	return russ_relay_serve_poll(self, timeout, exitfd);
+}
+
 /*
 * High level loop to relay between multiple pairs of fds.
 *
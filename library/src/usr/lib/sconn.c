@@ -45,6 +45,7 @@
 struct russ_sconn *
 russ_sconn_free(struct russ_sconn *self) {
 	if (self) {
+		self->req = russ_req_free(self->req);
 		self = russ_free(self);
 	}
 	return NULL;
@@ -69,6 +70,12 @@ russ_sconn_new(void) {
 	russ_fds_init(sconn->sysfds, RUSS_CONN_NSYSFDS, -1);
 	russ_fds_init(sconn->fds, RUSS_CONN_NFDS, -1);
 	sconn->sd = -1;
+	sconn->req = NULL;
+	sconn->fdbatch = 0;
+	sconn->keepalive = 0;
+	sconn->keepsd = -1;
+	sconn->nhandoff = 0;
+	sconn->awaitdeadline = RUSS_DEADLINE_NEVER;
 
 	return sconn;
 }
@@ -185,6 +192,89 @@ russ_sconn_send_fds(struct russ_sconn *self, int nfds, int *cfds) {
 	return 0;
 }
 
+/**
+* Send sysfds and fds over the server connection in one message and
+* cleanup (protocol 0011).
+*
+* The fixed-size header (see RUSS_ANSWER_BATCH_SIZE) holds the
+* count and statuses of the sysfds and of the fds; all valid
+* descriptors are passed in a single control message. Sent cfds
+* are closed.
+*
+* @param self		server connection object
+* @param nsysfds	number of system fds to send (from index 0)
+* @param csysfds	client-side system descriptors
+* @param nfds		number of fds to send (from index 0)
+* @param cfds		client-side descriptors
+* @return		0 on success; -1 on error
+*/
+static int
+russ_sconn_send_fds_batch(struct russ_sconn *self, int nsysfds, int *csysfds, int nfds, int *cfds) {
+	char	buf[RUSS_ANSWER_BATCH_SIZE];
+	char	*bp = NULL;
+	int	sendfds[RUSS_CONN_NSYSFDS+RUSS_CONN_NFDS];
+	int	nsendfds, n, i;
+
+	/* find "real" nsysfds and nfds (where fd>=0) */
+	for (; (nsysfds > 0) && (csysfds[nsysfds-1] < 0); nsysfds--);
+	for (; (nfds > 0) && (cfds[nfds-1] < 0); nfds--);
+	if ((nsysfds > RUSS_CONN_NSYSFDS) || (nfds > RUSS_CONN_NFDS)) {
+		return -1;
+	}
+
+	/* encode counts and statuses; collect descriptors */
+	memset(buf, 0, sizeof(buf));
+	nsendfds = 0;
+	bp = russ_enc_int32(buf, buf+sizeof(buf), nsysfds);
+	for (i = 0; i < nsysfds; i++) {
+		if ((bp[i] = (char)(csysfds[i] >= 0))) {
+			sendfds[nsendfds++] = csysfds[i];
+		}
+	}
+	bp = russ_enc_int32(bp+RUSS_CONN_NSYSFDS, buf+sizeof(buf), nfds);
+	for (i = 0; i < nfds; i++) {
+		if ((bp[i] = (char)(cfds[i] >= 0))) {
+			sendfds[nsendfds++] = cfds[i];
+		}
+	}
+
+	if (((n = russ_send_fds(self->sd, buf, sizeof(buf), sendfds, nsendfds)) < 0)
+		|| ((n < sizeof(buf))
+			&& (russ_writen_deadline(RUSS_DEADLINE_NEVER, self->sd, buf+n, sizeof(buf)-n) < sizeof(buf)-n))) {
+		return -1;
+	}
+	russ_fds_close(csysfds, nsysfds);
+	russ_fds_close(cfds, nfds);
+	return 0;
+}
+
+/**
+* Refuse a request without answering it.
+*
+* Clients using protocol 0011 (or later) are sent an answer header
+* marked RUSS_ANSWER_REFUSED, without descriptors. This tells them
+* apart from servers which do not support the protocol (which hang
+* up without answering) so that they do not redial with protocol
+* 0010. Nothing is sent to protocol 0010 clients.
+*
+* @param self		server connection object
+* @return		0 on success; -1 on error
+*/
+int
+russ_sconn_refuse(struct russ_sconn *self) {
+	char	buf[RUSS_ANSWER_BATCH_SIZE];
+
+	if ((!self->fdbatch) || (self->sd < 0)) {
+		return 0;
+	}
+	memset(buf, 0, sizeof(buf));
+	if ((russ_enc_int32(buf, buf+sizeof(buf), RUSS_ANSWER_REFUSED) == NULL)
+		|| (russ_writen_deadline(RUSS_DEADLINE_NEVER, self->sd, buf, sizeof(buf)) < sizeof(buf))) {
+		return -1;
+	}
+	return 0;
+}
+
 /**
 * Answer request and close socket.
 *
@@ -200,7 +290,7 @@ russ_sconn_send_fds(struct russ_sconn *self, int nfds, int *cfds) {
 int
 russ_sconn_answer(struct russ_sconn *self, int nfds, int *cfds) {
 	int	csysfds[RUSS_CONN_NSYSFDS];
-	int	i;
+	int	i, rv = 0;
 
 	if (nfds < 0) {
 		return -1;
@@ -214,14 +304,51 @@ russ_sconn_answer(struct russ_sconn *self, int nfds, int *cfds) {
 		return -1;
 	}
 
-	if ((russ_sconn_send_fds(self, RUSS_CONN_NSYSFDS, csysfds) < 0)
+	if (self->fdbatch) {
+		rv = russ_sconn_send_fds_batch(self, RUSS_CONN_NSYSFDS, csysfds, nfds, cfds);
+	} else if ((russ_sconn_send_fds(self, RUSS_CONN_NSYSFDS, csysfds) < 0)
 		|| (russ_sconn_send_fds(self, nfds, cfds) < 0)) {
+		rv = -1;
+	}
+	if (rv < 0) {
 		russ_fds_close(csysfds, RUSS_CONN_NSYSFDS);
 		russ_fds_close(self->sysfds, RUSS_CONN_NSYSFDS);
 		russ_fds_close(&self->sd, 1);
 		return -1;
 	}
-	russ_fds_close(&self->sd, 1);
+	russ_sconn_release_sd(self);
+	return 0;
+}
+
+/**
+* Receive the fds handed off by the client (see
+* russ_dial_set_handoff()) into self->fds.
+*
+* The client sends them in a one byte message following the
+* request.
+*
+* @param self		server connection object
+* @param deadline	deadline to wait for the fds
+* @return		0 on success; -1 on failure
+*/
+int
+russ_sconn_recv_handoff(struct russ_sconn *self, russ_deadline deadline) {
+	struct pollfd	pollfds[1];
+	char		buf[1];
+	int		nhandoff, nrecvfds;
+
+	nhandoff = self->nhandoff;
+	self->nhandoff = 0;
+	pollfds[0].fd = self->sd;
+	pollfds[0].events = POLLIN;
+	if ((russ_poll_deadline(deadline, pollfds, 1) <= 0)
+		|| (russ_recv_fds(self->sd, buf, sizeof(buf), self->fds, nhandoff, &nrecvfds) != 1)) {
+		return -1;
+	}
+	if (nrecvfds != nhandoff) {
+		russ_fds_close(self->fds, nrecvfds);
+		return -1;
+	}
 	return 0;
 }
 
@@ -229,6 +356,11 @@ russ_sconn_answer(struct russ_sconn *self, int nfds, int *cfds) {
 * Default answer handler which sets up standard fds (stdin, stdout,
 * stderr) and answers the request.
 *
+* If the client handed off its own fds (see russ_dial_set_handoff()),
+* they are used directly by the server and no fds are answered. The
+* fds must arrive by the request deadline (see
+* russ_sconn.awaitdeadline).
+*
 * @param self		server connection object
 * @return		0 on success; -1 on failure
 */
@@ -239,6 +371,14 @@ russ_sconn_answerhandler(struct russ_sconn *self) {
 
 	russ_fds_init(cfds, RUSS_CONN_NFDS, -1);
 	russ_fds_init(self->fds, RUSS_CONN_NFDS, -1);
+	if ((self->nhandoff > 0) && (russ_sconn_recv_handoff(self, self->awaitdeadline) == 0)) {
+		/* use client fds as is; answer sysfds only */
+		if (russ_sconn_answer(self, 0, cfds) < 0) {
+			russ_fds_close(self->fds, RUSS_CONN_NFDS);
+			return -1;
+		}
+		return 0;
+	}
 	if (russ_make_pipes(RUSS_CONN_STD_NFDS, cfds, self->fds) < 0) {
 		fprintf(stderr, "error: cannot create pipes\n");
 		return -1;
@@ -256,6 +396,126 @@ russ_sconn_answerhandler(struct russ_sconn *self) {
 	return 0;
 }
 
+/**
+* Answer handler which, in addition to the standard fds, passes a
+* shared memory ring (see lib/shmring.c) at RUSS_SHMRING_FDIDX if
+* the client asked for one with the RUSS_SHMRING_ATTR attribute.
+*
+* Otherwise (or if the ring cannot be set up), only the standard
+* fds are answered and *ringp is set to NULL so that the service
+* falls back to stdio. Services using this must not autoanswer.
+*
+* @param self		server connection object
+* @param req		request object
+* @param cap		ring capacity (<= 0 for default)
+* @param[out] ringp	ring object; NULL if not used
+* @return		0 on success; -1 on failure
+*/
+int
+russ_sconn_answershmring(struct russ_sconn *self, struct russ_req *req, int cap, struct russ_shmring **ringp) {
+	struct russ_shmring	*ring = NULL;
+	int			cfds[RUSS_CONN_NFDS];
+	int			tmpfd;
+
+	*ringp = NULL;
+	if ((req == NULL)
+		|| (russ_sarray0_find(req->attrv, RUSS_SHMRING_ATTR) < 0)
+		|| ((ring = russ_shmring_new(cap)) == NULL)) {
+		return russ_sconn_answerhandler(self);
+	}
+
+	russ_fds_init(cfds, RUSS_CONN_NFDS, -1);
+	russ_fds_init(self->fds, RUSS_CONN_NFDS, -1);
+	if (russ_shmring_dupfds(ring, &cfds[RUSS_SHMRING_FDIDX]) < 0) {
+		ring = russ_shmring_free(ring);
+		return russ_sconn_answerhandler(self);
+	}
+	if (russ_make_pipes(RUSS_CONN_STD_NFDS, cfds, self->fds) < 0) {
+		fprintf(stderr, "error: cannot create pipes\n");
+		goto fail;
+	}
+	/* swap fds for stdin */
+	tmpfd = cfds[0];
+	cfds[0] = self->fds[0];
+	self->fds[0] = tmpfd;
+
+	if (russ_sconn_answer(self, RUSS_SHMRING_FDIDX+RUSS_SHMRING_NFDS, cfds) < 0) {
+		russ_fds_close(self->fds, RUSS_CONN_STD_NFDS);
+		goto fail;
+	}
+	*ringp = ring;
+	return 0;
+
+fail:
+	russ_fds_close(cfds, RUSS_SHMRING_FDIDX+RUSS_SHMRING_NFDS);
+	ring = russ_shmring_free(ring);
+	return -1;
+}
+
+/**
+* Answer handler which, in addition to the standard fds, passes
+* lane fds for a striped transfer (see lib/stripe.c) at
+* RUSS_STRIPE_FDIDX if the client asked for them with a
+* RUSS_STRIPE_ATTR_PREFIX attribute (e.g., "RUSS_STRIPES=4").
+*
+* The server side lane fds are left in self->fds (for
+* russ_stripe_new()). If the client did not ask, or maxstripes is 0
+* (the service setting to disable lanes), only the standard fds are
+* answered and 0 is returned so that the service falls back to
+* stdio. Services using this must not autoanswer.
+*
+* @param self		server connection object
+* @param req		request object
+* @param maxstripes	max # of lanes to answer (<= RUSS_STRIPE_MAX)
+* @return		# of lanes answered; -1 on failure
+*/
+int
+russ_sconn_answerstripes(struct russ_sconn *self, struct russ_req *req, int maxstripes) {
+	int	cfds[RUSS_CONN_NFDS];
+	int	pfds[2];
+	char	*s = NULL;
+	int	i, nstripes, tmpfd;
+
+	nstripes = 0;
+	if ((req != NULL) && ((s = russ_sarray0_get_suffix(req->attrv, RUSS_STRIPE_ATTR_PREFIX)) != NULL)) {
+		nstripes = atoi(s);
+	}
+	maxstripes = RUSS__MIN(maxstripes, RUSS_STRIPE_MAX);
+	nstripes = RUSS__MAX(RUSS__MIN(nstripes, maxstripes), 0);
+	if (nstripes == 0) {
+		return (russ_sconn_answerhandler(self) < 0) ? -1 : 0;
+	}
+
+	russ_fds_init(cfds, RUSS_CONN_NFDS, -1);
+	russ_fds_init(self->fds, RUSS_CONN_NFDS, -1);
+	if (russ_make_pipes(RUSS_CONN_STD_NFDS, cfds, self->fds) < 0) {
+		fprintf(stderr, "error: cannot create pipes\n");
+		return -1;
+	}
+	/* swap fds for stdin */
+	tmpfd = cfds[0];
+	cfds[0] = self->fds[0];
+	self->fds[0] = tmpfd;
+
+	for (i = RUSS_STRIPE_FDIDX; i < RUSS_STRIPE_FDIDX+nstripes; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pfds) < 0) {
+			goto fail;
+		}
+		cfds[i] = pfds[0];
+		self->fds[i] = pfds[1];
+	}
+
+	if (russ_sconn_answer(self, RUSS_STRIPE_FDIDX+nstripes, cfds) < 0) {
+		goto fail;
+	}
+	return nstripes;
+
+fail:
+	russ_fds_close(cfds, RUSS_CONN_NFDS);
+	russ_fds_close(self->fds, RUSS_CONN_NFDS);
+	return -1;
+}
+
 /**
 * Pass fds from a server to a client.
 *
@@ -273,7 +533,9 @@ russ_sconn_splice(struct russ_sconn *self, struct russ_cconn *dconn) {
 	int	ev = 0;
 
 	/* send sysfds and fds */
-	if ((russ_sconn_send_fds(self, RUSS_CONN_NSYSFDS, dconn->sysfds) < 0)
+	if (self->fdbatch) {
+		ev = russ_sconn_send_fds_batch(self, RUSS_CONN_NSYSFDS, dconn->sysfds, RUSS_CONN_NFDS, dconn->fds);
+	} else if ((russ_sconn_send_fds(self, RUSS_CONN_NSYSFDS, dconn->sysfds) < 0)
 		|| (russ_sconn_send_fds(self, RUSS_CONN_NFDS, dconn->fds) < 0)) {
 		ev = -1;
 	}
@@ -283,7 +545,11 @@ russ_sconn_splice(struct russ_sconn *self, struct russ_cconn *dconn) {
 
 	/* close sockets */
 	russ_fds_close(&dconn->sd, 1);
-	russ_fds_close(&self->sd, 1);
+	if (ev == 0) {
+		russ_sconn_release_sd(self);
+	} else {
+		russ_fds_close(&self->sd, 1);
+	}
 
 	return ev;
 }
@@ -292,7 +558,8 @@ russ_sconn_splice(struct russ_sconn *self, struct russ_cconn *dconn) {
 * Wait for the request.
 *
 * The request is waited for, and the connection object is updated
-* with the received information.
+* with the received information. The deadline is kept for what
+* follows the request (see russ_sconn_recv_handoff()).
 *
 * @param self		server connection object
 * @param deadline	deadline to wait
@@ -305,6 +572,7 @@ russ_sconn_await_req(struct russ_sconn *self, russ_deadline deadline) {
 	char			*bp = NULL;
 	int			size;
 
+	self->awaitdeadline = deadline;
 	/* need to get request size to load buffer */
 	if ((russ_readn_deadline(deadline, self->sd, buf, 4) < 0)
 		|| ((bp = russ_dec_int32(buf, &size)) == NULL)
@@ -313,9 +581,54 @@ russ_sconn_await_req(struct russ_sconn *self, russ_deadline deadline) {
 		/* TODO: what about the connection? */
 		return NULL;
 	}
+	russ_sconn_set_protocol(self, req);
 	return req;
 }
 
+/**
+* Set up connection according to the request protocol.
+*
+* Protocol 0011 answers fds in a single message. Protocol 0012 also
+* asks to keep the control socket open after the answer for further
+* requests (session).
+*
+* @param self		server connection object
+* @param req		request object
+*/
+void
+russ_sconn_set_protocol(struct russ_sconn *self, struct russ_req *req) {
+	int	i;
+
+	self->keepalive = (strcmp(req->protocolstring, RUSS_REQ_PROTOCOLSTRING_SESSION) == 0);
+	self->fdbatch = (self->keepalive)
+		|| (strcmp(req->protocolstring, RUSS_REQ_PROTOCOLSTRING) == 0);
+
+	/* handoff is per connection: do not pass it on (e.g., redialed requests) */
+	self->nhandoff = 0;
+	if ((i = russ_sarray0_find_prefix(req->attrv, RUSS_FDHANDOFF_ATTR_PREFIX)) >= 0) {
+		self->nhandoff = atoi(req->attrv[i]+strlen(RUSS_FDHANDOFF_ATTR_PREFIX));
+		self->nhandoff = RUSS__MAX(RUSS__MIN(self->nhandoff, RUSS_CONN_NFDS), 0);
+		russ_free(req->attrv[i]);
+		russ_sarray0_remove(req->attrv, i);
+	}
+}
+
+/**
+* Release the control socket after the answer: keep it for the
+* next request of a session; otherwise close it.
+*
+* @param self		server connection object
+*/
+void
+russ_sconn_release_sd(struct russ_sconn *self) {
+	if ((self->keepalive) && (self->keepsd < 0)) {
+		self->keepsd = self->sd;
+		self->sd = -1;
+	} else {
+		russ_fds_close(&self->sd, 1);
+	}
+}
+
 /**
 * Close server connection.
 *
@@ -329,6 +642,7 @@ russ_sconn_close(struct russ_sconn *self) {
 	russ_fds_close(self->sysfds, RUSS_CONN_NSYSFDS);
 	russ_fds_close(self->fds, RUSS_CONN_NFDS);
 	russ_fds_close(&self->sd, 1);
+	russ_fds_close(&self->keepsd, 1);
 }
 
 /**
@@ -0,0 +1,469 @@
+/*
+* lib/shmring.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Shared memory ring.
+*
+* A single producer/single consumer byte ring in a memfd mapped by
+* both the server and the client. It is passed as extra connection
+* fds (see RUSS_SHMRING_FDIDX): the memfd, a "data" eventfd (signalled
+* by the producer) and a "space" eventfd (signalled by the consumer).
+* Data is copied in and out of the mapping; an eventfd is only
+* written when the other side is waiting, so a busy ring moves data
+* without syscalls.
+*
+* Head (written) and tail (read) are free-running byte counts; each
+* is only written by one side and sits in its own cache line.
+*
+* The mapping is shared with a peer that is not trusted: the memfd
+* is sealed against resizing, the capacity is kept locally once
+* validated, and head-tail outside [0, cap] fails the operation
+* (EPROTO).
+*/
+
+#ifdef __RUSS_LINUX__
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif /* __RUSS_LINUX__ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <russ/priv.h>
+
+#define RUSS_SHMRING_MAGIC	0x72757373
+#define RUSS_SHMRING_HDRSIZE	4096
+
+#define RUSS_SHMRING_CLOSED_PRODUCER	1
+#define RUSS_SHMRING_CLOSED_CONSUMER	2
+
+#define RUSS_SHMRING_ROLE_NONE		0
+#define RUSS_SHMRING_ROLE_PRODUCER	1
+#define RUSS_SHMRING_ROLE_CONSUMER	2
+
+/**
+* Ring header at the start of the mapping.
+*/
+struct russ_shmringhdr {
+	uint32_t		magic;
+	uint32_t		cap;		/**< data size (power of 2) */
+	volatile uint32_t	closed;		/**< RUSS_SHMRING_CLOSED_* flags */
+	volatile uint64_t	head __attribute__((aligned(64)));	/**< bytes written */
+	volatile uint32_t	pwaiting;	/**< producer waits for space */
+	volatile uint64_t	tail __attribute__((aligned(64)));	/**< bytes read */
+	volatile uint32_t	cwaiting;	/**< consumer waits for data */
+};
+
+struct russ_shmring {
+	int			fds[RUSS_SHMRING_NFDS];
+	struct russ_shmringhdr	*hdr;
+	char			*data;
+	size_t			mapsize;
+	uint32_t		cap;		/**< data size (validated copy of hdr->cap) */
+	int			role;		/**< RUSS_SHMRING_ROLE_* (set on first use) */
+};
+
+#ifdef __RUSS_LINUX__
+/**
+* Signal eventfd.
+*
+* @param fd		eventfd
+*/
+static void
+__russ_shmring_signal(int fd) {
+	uint64_t	one = 1;
+
+	while ((write(fd, &one, sizeof(one)) < 0) && (errno == EINTR));
+}
+
+/**
+* Wait for eventfd to be signalled and reset it.
+*
+* @param deadline	deadline to wait
+* @param fd		eventfd
+* @return		0 on success; -1 on failure (errno ETIMEDOUT
+*			if deadline passed)
+*/
+static int
+__russ_shmring_wait(russ_deadline deadline, int fd) {
+	struct pollfd	pollfds[1];
+	uint64_t	cnt;
+	int		rv;
+
+	pollfds[0].fd = fd;
+	pollfds[0].events = POLLIN;
+	if ((rv = russ_poll_deadline(deadline, pollfds, 1)) <= 0) {
+		if (rv == 0) {
+			errno = ETIMEDOUT;
+		}
+		return -1;
+	}
+	while ((read(fd, &cnt, sizeof(cnt)) < 0) && (errno == EINTR));
+	return 0;
+}
+
+/**
+* Map ring memfd.
+*
+* @param self		russ_shmring object (fds set)
+* @param mapsize	size of mapping
+* @return		0 on success; -1 on failure
+*/
+static int
+__russ_shmring_map(struct russ_shmring *self, size_t mapsize) {
+	void	*p = NULL;
+
+	if ((p = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, self->fds[0], 0)) == MAP_FAILED) {
+		return -1;
+	}
+	self->hdr = p;
+	self->data = (char *)p+RUSS_SHMRING_HDRSIZE;
+	self->mapsize = mapsize;
+	return 0;
+}
+#endif /* __RUSS_LINUX__ */
+
+/**
+* Allocate ring object.
+*
+* @return		russ_shmring object; NULL on failure
+*/
+static struct russ_shmring *
+__russ_shmring_new(void) {
+	struct russ_shmring	*self = NULL;
+
+	if ((self = russ_malloc(sizeof(struct russ_shmring))) == NULL) {
+		return NULL;
+	}
+	russ_fds_init(self->fds, RUSS_SHMRING_NFDS, -1);
+	self->hdr = NULL;
+	self->data = NULL;
+	self->mapsize = 0;
+	self->cap = 0;
+	self->role = RUSS_SHMRING_ROLE_NONE;
+	return self;
+}
+
+/**
+* Free ring. The ring is closed (see russ_shmring_close()) first.
+*
+* @param self		russ_shmring object
+* @return		NULL
+*/
+struct russ_shmring *
+russ_shmring_free(struct russ_shmring *self) {
+	if (self) {
+#ifdef __RUSS_LINUX__
+		if (self->hdr) {
+			russ_shmring_close(self);
+			munmap(self->hdr, self->mapsize);
+		}
+#endif /* __RUSS_LINUX__ */
+		russ_fds_close(self->fds, RUSS_SHMRING_NFDS);
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+/**
+* Create new ring.
+*
+* Only supported on Linux (memfd, eventfd).
+*
+* @param cap		data capacity (rounded up to a power of 2;
+*			<= 0 for RUSS_SHMRING_CAP_DEFAULT)
+* @return		russ_shmring object; NULL on failure
+*/
+struct russ_shmring *
+russ_shmring_new(int cap) {
+#ifdef __RUSS_LINUX__
+	struct russ_shmring	*self = NULL;
+	uint32_t		rcap;
+
+	cap = (cap <= 0) ? RUSS_SHMRING_CAP_DEFAULT : cap;
+	for (rcap = RUSS_SHMRING_HDRSIZE; (rcap < (uint32_t)cap) && (rcap < (1U<<30)); rcap <<= 1);
+
+	if ((self = __russ_shmring_new()) == NULL) {
+		return NULL;
+	}
+	if (((self->fds[0] = memfd_create("russ_shmring", MFD_CLOEXEC|MFD_ALLOW_SEALING)) < 0)
+		|| ((self->fds[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0)
+		|| ((self->fds[2] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0)
+		|| (ftruncate(self->fds[0], RUSS_SHMRING_HDRSIZE+rcap) < 0)
+		|| (fcntl(self->fds[0], F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW) < 0)
+		|| (__russ_shmring_map(self, RUSS_SHMRING_HDRSIZE+rcap) < 0)) {
+		return russ_shmring_free(self);
+	}
+	/* mapping is zero filled */
+	self->cap = rcap;
+	self->hdr->cap = rcap;
+	self->hdr->magic = RUSS_SHMRING_MAGIC;
+	return self;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif /* __RUSS_LINUX__ */
+}
+
+/**
+* Attach to a ring created by the peer.
+*
+* The memfd must be sealed against resizing (so that the mapping
+* cannot be truncated under us) and the header must match its size.
+*
+* On success, the ring takes over the fds and the entries in fds
+* are set to -1; on failure, fds are left alone.
+*
+* @param fds		array of RUSS_SHMRING_NFDS fds (memfd, data
+*			eventfd, space eventfd)
+* @return		russ_shmring object; NULL on failure
+*/
+struct russ_shmring *
+russ_shmring_attach(int *fds) {
+#ifdef __RUSS_LINUX__
+	struct russ_shmring	*self = NULL;
+	struct stat		st;
+	int			i, seals;
+
+	for (i = 0; i < RUSS_SHMRING_NFDS; i++) {
+		if (fds[i] < 0) {
+			return NULL;
+		}
+	}
+	if ((fstat(fds[0], &st) < 0)
+		|| (st.st_size <= RUSS_SHMRING_HDRSIZE)
+		|| ((seals = fcntl(fds[0], F_GET_SEALS)) < 0)
+		|| ((seals & (F_SEAL_SHRINK|F_SEAL_GROW)) != (F_SEAL_SHRINK|F_SEAL_GROW))
+		|| ((self = __russ_shmring_new()) == NULL)) {
+		return NULL;
+	}
+	self->fds[0] = fds[0];
+	if ((__russ_shmring_map(self, st.st_size) < 0)
+		|| (self->hdr->magic != RUSS_SHMRING_MAGIC)
+		|| ((self->cap = self->hdr->cap) == 0)
+		|| ((self->cap & (self->cap-1)) != 0)
+		|| (RUSS_SHMRING_HDRSIZE+(off_t)self->cap != st.st_size)) {
+		self->fds[0] = -1;
+		if (self->hdr) {
+			munmap(self->hdr, self->mapsize);
+			self->hdr = NULL;
+		}
+		return russ_shmring_free(self);
+	}
+	for (i = 0; i < RUSS_SHMRING_NFDS; i++) {
+		self->fds[i] = fds[i];
+		fds[i] = -1;
+	}
+	return self;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif /* __RUSS_LINUX__ */
+}
+
+/**
+* Close ring side.
+*
+* A producer close is seen as EOF by the consumer once the data is
+* read; a consumer close fails further writes (EPIPE). A side that
+* has not used the ring yet closes both ways. The peer is woken up.
+*
+* @param self		russ_shmring object
+*/
+void
+russ_shmring_close(struct russ_shmring *self) {
+#ifdef __RUSS_LINUX__
+	uint32_t	flags;
+
+	if (self->role == RUSS_SHMRING_ROLE_PRODUCER) {
+		flags = RUSS_SHMRING_CLOSED_PRODUCER;
+	} else if (self->role == RUSS_SHMRING_ROLE_CONSUMER) {
+		flags = RUSS_SHMRING_CLOSED_CONSUMER;
+	} else {
+		flags = RUSS_SHMRING_CLOSED_PRODUCER|RUSS_SHMRING_CLOSED_CONSUMER;
+	}
+	if ((self->hdr->closed & flags) != flags) {
+		__sync_fetch_and_or(&self->hdr->closed, flags);
+		__russ_shmring_signal(self->fds[1]);
+		__russ_shmring_signal(self->fds[2]);
+	}
+#endif /* __RUSS_LINUX__ */
+}
+
+/**
+* Duplicate ring fds, e.g., to pass them to the peer.
+*
+* @param self		russ_shmring object
+* @param fds		array of RUSS_SHMRING_NFDS fds (output)
+* @return		0 on success; -1 on failure
+*/
+int
+russ_shmring_dupfds(struct russ_shmring *self, int *fds) {
+	int	i;
+
+	russ_fds_init(fds, RUSS_SHMRING_NFDS, -1);
+	for (i = 0; i < RUSS_SHMRING_NFDS; i++) {
+		if ((fds[i] = dup(self->fds[i])) < 0) {
+			russ_fds_close(fds, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+* Read from ring.
+*
+* Returns as soon as some data is available.
+*
+* @param self		russ_shmring object
+* @param buf		buffer
+* @param count		max # of bytes to read
+* @param deadline	deadline to wait for data
+* @return		# of bytes read; 0 on EOF; -1 on failure (errno
+*			ETIMEDOUT if deadline passed; EPROTO if the
+*			ring state is invalid)
+*/
+ssize_t
+russ_shmring_read(struct russ_shmring *self, void *buf, size_t count, russ_deadline deadline) {
+#ifdef __RUSS_LINUX__
+	struct russ_shmringhdr	*hdr = self->hdr;
+	uint64_t		head, tail;
+	size_t			n, off, n0;
+
+	self->role = RUSS_SHMRING_ROLE_CONSUMER;
+	tail = hdr->tail;
+	while ((head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE)) == tail) {
+		if (hdr->closed & RUSS_SHMRING_CLOSED_PRODUCER) {
+			/* recheck after close: data may have come first */
+			if (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) == tail) {
+				return 0;
+			}
+			continue;
+		}
+		hdr->cwaiting = 1;
+		__sync_synchronize();
+		if ((hdr->head == tail) && (!(hdr->closed & RUSS_SHMRING_CLOSED_PRODUCER))
+			&& (__russ_shmring_wait(deadline, self->fds[1]) < 0)) {
+			hdr->cwaiting = 0;
+			return -1;
+		}
+		hdr->cwaiting = 0;
+	}
+
+	if ((n = (size_t)(head-tail)) > self->cap) {
+		errno = EPROTO;
+		return -1;
+	}
+	n = (n < count) ? n : count;
+	off = tail & (self->cap-1);
+	n0 = (n < self->cap-off) ? n : self->cap-off;
+	memcpy(buf, self->data+off, n0);
+	memcpy((char *)buf+n0, self->data, n-n0);
+	__atomic_store_n(&hdr->tail, tail+n, __ATOMIC_RELEASE);
+
+	__sync_synchronize();
+	if (hdr->pwaiting) {
+		__russ_shmring_signal(self->fds[2]);
+	}
+	return (ssize_t)n;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif /* __RUSS_LINUX__ */
+}
+
+/**
+* Write to ring.
+*
+* Waits for space until all of buf is written.
+*
+* @param self		russ_shmring object
+* @param buf		buffer
+* @param count		# of bytes to write
+* @param deadline	deadline to wait for space
+* @return		# of bytes written (< count if the deadline
+*			passed or the consumer closed); -1 on failure
+*			with nothing written (errno EPIPE if consumer
+*			closed; ETIMEDOUT if deadline passed; EPROTO if
+*			the ring state is invalid)
+*/
+ssize_t
+russ_shmring_write(struct russ_shmring *self, const void *buf, size_t count, russ_deadline deadline) {
+#ifdef __RUSS_LINUX__
+	struct russ_shmringhdr	*hdr = self->hdr;
+	uint64_t		head, tail;
+	size_t			n, off, n0, nwritten;
+
+	self->role = RUSS_SHMRING_ROLE_PRODUCER;
+	head = hdr->head;
+	for (nwritten = 0; nwritten < count; ) {
+		if (hdr->closed & RUSS_SHMRING_CLOSED_CONSUMER) {
+			errno = EPIPE;
+			break;
+		}
+		tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+		if ((head-tail) > self->cap) {
+			errno = EPROTO;
+			break;
+		}
+		if ((n = self->cap-(size_t)(head-tail)) == 0) {
+			hdr->pwaiting = 1;
+			__sync_synchronize();
+			if ((hdr->tail == tail) && (!(hdr->closed & RUSS_SHMRING_CLOSED_CONSUMER))
+				&& (__russ_shmring_wait(deadline, self->fds[2]) < 0)) {
+				hdr->pwaiting = 0;
+				break;
+			}
+			hdr->pwaiting = 0;
+			continue;
+		}
+
+		n = (n < count-nwritten) ? n : count-nwritten;
+		off = head & (self->cap-1);
+		n0 = (n < self->cap-off) ? n : self->cap-off;
+		memcpy(self->data+off, (char *)buf+nwritten, n0);
+		memcpy(self->data, (char *)buf+nwritten+n0, n-n0);
+		head += n;
+		nwritten += n;
+		__atomic_store_n(&hdr->head, head, __ATOMIC_RELEASE);
+
+		__sync_synchronize();
+		if (hdr->cwaiting) {
+			__russ_shmring_signal(self->fds[1]);
+		}
+	}
+	return ((nwritten == 0) && (count > 0)) ? -1 : (ssize_t)nwritten;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif /* __RUSS_LINUX__ */
+}
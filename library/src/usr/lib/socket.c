@@ -388,6 +388,124 @@ russ_recv_fd(int sd, int *fd) {
 	return 0;
 }
 
+/**
+* Receive message and descriptors over socket in one recvmsg().
+*
+* Up to nbuf bytes of message are received. Descriptors arrive
+* with the first byte of the message, so a short read must be
+* completed (e.g., with russ_readn_deadline()) by the caller.
+*
+* @param sd		socket descriptor
+* @param buf		message buffer
+* @param nbuf		size of buf
+* @param fds		array for received descriptors
+* @param nfds		size of fds array
+* @param[out] nrecvfds	number of descriptors received
+* @return		number of bytes received; -1 on error
+*/
+int
+russ_recv_fds(int sd, char *buf, int nbuf, int *fds, int nfds, int *nrecvfds) {
+	struct msghdr	msgh;
+	struct iovec	iov[1];
+	struct cmsghdr	*cmsgh = NULL;
+	char		cbuf[CMSG_SPACE(sizeof(int)*RUSS_CONN_MAX_NFDS*2)];
+	int		rv, n;
+
+	if (nfds > RUSS_CONN_MAX_NFDS*2) {
+		return -1;
+	}
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = nbuf;
+
+	msgh.msg_name = NULL;
+	msgh.msg_namelen = 0;
+	msgh.msg_iov = iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_control = cbuf;
+	msgh.msg_controllen = CMSG_SPACE(sizeof(int)*nfds);
+	msgh.msg_flags = 0;
+
+	while (((rv = recvmsg(sd, &msgh, 0)) < 0) && (errno == EINTR));
+	if (rv < 0) {
+		return -1;
+	}
+
+	*nrecvfds = 0;
+	for (cmsgh = CMSG_FIRSTHDR(&msgh); cmsgh != NULL; cmsgh = CMSG_NXTHDR(&msgh, cmsgh)) {
+		if ((cmsgh->cmsg_level != SOL_SOCKET) || (cmsgh->cmsg_type != SCM_RIGHTS)) {
+			continue;
+		}
+		n = (cmsgh->cmsg_len-CMSG_LEN(0))/sizeof(int);
+		if (*nrecvfds+n > nfds) {
+			n = nfds-*nrecvfds;
+		}
+		memcpy(&fds[*nrecvfds], CMSG_DATA(cmsgh), sizeof(int)*n);
+		*nrecvfds += n;
+	}
+	if (msgh.msg_flags & MSG_CTRUNC) {
+		russ_fds_close(fds, *nrecvfds);
+		*nrecvfds = 0;
+		return -1;
+	}
+	return rv;
+}
+
+/**
+* Send message and descriptors over socket in one sendmsg().
+*
+* The message must be at least 1 byte. A short write must be
+* completed by the caller.
+*
+* @param sd		socket descriptor
+* @param buf		message buffer
+* @param nbuf		number of bytes in buf (> 0)
+* @param fds		array of descriptors to send
+* @param nfds		number of descriptors in fds
+* @return		number of bytes sent; -1 on error
+*/
+int
+russ_send_fds(int sd, char *buf, int nbuf, int *fds, int nfds) {
+	struct msghdr	msgh;
+	struct iovec	iov[1];
+	struct cmsghdr	*cmsgh = NULL;
+	char		cbuf[CMSG_SPACE(sizeof(int)*RUSS_CONN_MAX_NFDS*2)];
+	int		rv;
+
+	if ((nbuf < 1) || (nfds > RUSS_CONN_MAX_NFDS*2)) {
+		return -1;
+	}
+
+	memset(&msgh, 0, sizeof(struct msghdr));
+	memset(cbuf, 0, sizeof(cbuf));
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = nbuf;
+
+	msgh.msg_name = NULL;
+	msgh.msg_namelen = 0;
+	msgh.msg_iov = iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_flags = 0;
+
+	if (nfds > 0) {
+		msgh.msg_control = cbuf;
+		msgh.msg_controllen = CMSG_SPACE(sizeof(int)*nfds);
+
+		cmsgh = CMSG_FIRSTHDR(&msgh);
+		cmsgh->cmsg_len = CMSG_LEN(sizeof(int)*nfds);
+		cmsgh->cmsg_level = SOL_SOCKET;
+		cmsgh->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsgh), fds, sizeof(int)*nfds);
+	} else {
+		msgh.msg_control = NULL;
+		msgh.msg_controllen = 0;
+	}
+
+	while (((rv = sendmsg(sd, &msgh, 0)) < 0) && (errno == EINTR));
+	return rv;
+}
+
 /**
 * Send descriptor over socket.
 *
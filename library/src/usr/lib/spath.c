@@ -22,7 +22,9 @@
 # license--end
 */
 
+#include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -32,10 +34,289 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __RUSS_LINUX__
+#include <sys/inotify.h>
+#endif
+
 #include "russ/priv.h"
 
 #define RUSS_SPATH_RESOLVE_SYMLINKS_MAX	32
 
+#define RUSS_SPATHCACHE_NBUCKETS	256
+#define RUSS_SPATHCACHE_MAX		1024
+
+/**
+* Resolved spath cache entry.
+*/
+struct russ_spathcache_entry {
+	struct russ_spathcache_entry	*next;
+	char				*spath;		/**< spath as given */
+	char				*saddr;
+	char				*spath2;
+	russ_deadline			expires;
+};
+
+/**
+* Per-process cache of russ_spath_split() results.
+*
+* Entries expire after ttl msec. On Linux, the directories along
+* the spath and saddr are also watched with inotify and any change
+* flushes the cache. The cache is reset in a child process (after
+* fork) and after a user switch.
+*
+* Only spaths which resolve to themselves are cached: a watch on a
+* symlink does not see changes to its target.
+*/
+static struct {
+	pthread_mutex_t			lock;
+	int				init;
+	pid_t				pid;
+	uid_t				uid;
+	int				ttl;
+	int				infd;		/**< inotify fd */
+	int				nentries;
+	struct russ_spathcache_entry	*buckets[RUSS_SPATHCACHE_NBUCKETS];
+} russ_spathcache = { PTHREAD_MUTEX_INITIALIZER, 0, -1, -1, RUSS_SPATHCACHE_TTL, -1, 0, { NULL } };
+
+/**
+* Hash spath to bucket index.
+*
+* @param spath		service path
+* @return		bucket index
+*/
+static unsigned int
+__russ_spathcache_hash(const char *spath) {
+	unsigned int	h = 5381;
+
+	for (; *spath != '\0'; spath++) {
+		h = ((h<<5)+h)+(unsigned char)*spath;
+	}
+	return h%RUSS_SPATHCACHE_NBUCKETS;
+}
+
+/**
+* Free cache entry.
+*
+* @param self		cache entry
+* @return		NULL
+*/
+static struct russ_spathcache_entry *
+__russ_spathcache_entry_free(struct russ_spathcache_entry *self) {
+	if (self) {
+		self->spath = russ_free(self->spath);
+		self->saddr = russ_free(self->saddr);
+		self->spath2 = russ_free(self->spath2);
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+/**
+* Drop all entries and watches. Lock must be held.
+*/
+static void
+__russ_spathcache_flush(void) {
+	struct russ_spathcache_entry	*entry = NULL;
+	int				i;
+
+	for (i = 0; i < RUSS_SPATHCACHE_NBUCKETS; i++) {
+		while ((entry = russ_spathcache.buckets[i]) != NULL) {
+			russ_spathcache.buckets[i] = entry->next;
+			__russ_spathcache_entry_free(entry);
+		}
+	}
+	russ_spathcache.nentries = 0;
+	/* closing the inotify fd removes all watches */
+	russ_fds_close(&russ_spathcache.infd, 1);
+}
+
+/**
+* Validate cache state before use. Lock must be held.
+*
+* Initializes on first use (RUSS_SPATHCACHE_TTL environment
+* variable overrides the ttl), resets after fork/user switch, and
+* flushes if any watched directory changed.
+*/
+static void
+__russ_spathcache_check(void) {
+	char	*s = NULL;
+#ifdef __RUSS_LINUX__
+	char	buf[4096];
+	int	changed;
+#endif
+
+	if (!russ_spathcache.init) {
+		if ((s = getenv("RUSS_SPATHCACHE_TTL")) != NULL) {
+			russ_spathcache.ttl = atoi(s);
+		}
+		russ_spathcache.init = 1;
+		russ_spathcache.pid = getpid();
+		russ_spathcache.uid = getuid();
+	}
+	if ((russ_spathcache.pid != getpid()) || (russ_spathcache.uid != getuid())) {
+		__russ_spathcache_flush();
+		russ_spathcache.pid = getpid();
+		russ_spathcache.uid = getuid();
+	}
+#ifdef __RUSS_LINUX__
+	if (russ_spathcache.infd >= 0) {
+		changed = 0;
+		while ((read(russ_spathcache.infd, buf, sizeof(buf)) > 0) || (errno == EINTR)) {
+			changed = 1;
+		}
+		if (changed) {
+			__russ_spathcache_flush();
+		}
+	}
+#endif
+}
+
+/**
+* Watch the directories along a path. Lock must be held.
+*
+* @param path		absolute path
+*/
+static void
+__russ_spathcache_watch(const char *path) {
+#ifdef __RUSS_LINUX__
+	char	buf[RUSS_REQ_SPATH_MAX];
+	char	*p = NULL;
+
+	if ((russ_spathcache.infd < 0)
+		&& ((russ_spathcache.infd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0)) {
+		return;
+	}
+	if (russ_snprintf(buf, sizeof(buf), "%s", path) < 0) {
+		return;
+	}
+	for (p = buf; p != NULL; ) {
+		if ((p = strchr(p+1, '/')) != NULL) {
+			*p = '\0';
+		}
+		if (inotify_add_watch(russ_spathcache.infd, (buf[0] == '\0') ? "/" : buf,
+			IN_ONLYDIR|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF) < 0) {
+			/* not a (accessible) directory */
+			break;
+		}
+		if (p != NULL) {
+			*p = '/';
+		}
+	}
+#endif
+}
+
+/**
+* Look up cached split of spath.
+*
+* @param spath		service path
+* @param[out] saddr	socket address (malloc'ed)
+* @param[out] spath2	remaining service path (malloc'ed)
+* @return		0 on hit; -1 on miss
+*/
+static int
+russ_spathcache_get(const char *spath, char **saddr, char **spath2) {
+	struct russ_spathcache_entry	*entry = NULL, **pentry = NULL;
+	int				rv = -1;
+
+	pthread_mutex_lock(&russ_spathcache.lock);
+	__russ_spathcache_check();
+	if (russ_spathcache.ttl > 0) {
+		pentry = &russ_spathcache.buckets[__russ_spathcache_hash(spath)];
+		for (; (entry = *pentry) != NULL; pentry = &entry->next) {
+			if (strcmp(entry->spath, spath) != 0) {
+				continue;
+			}
+			if (russ_gettime() >= entry->expires) {
+				*pentry = entry->next;
+				__russ_spathcache_entry_free(entry);
+				russ_spathcache.nentries--;
+			} else if (((*saddr = strdup(entry->saddr)) == NULL)
+				|| ((*spath2 = strdup(entry->spath2)) == NULL)) {
+				*saddr = russ_free(*saddr);
+			} else {
+				rv = 0;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&russ_spathcache.lock);
+	return rv;
+}
+
+/**
+* Add split of spath to cache.
+*
+* @param spath		service path
+* @param saddr		socket address
+* @param spath2		remaining service path
+*/
+static void
+russ_spathcache_put(const char *spath, const char *saddr, const char *spath2) {
+	struct russ_spathcache_entry	*entry = NULL;
+	unsigned int			h;
+
+	pthread_mutex_lock(&russ_spathcache.lock);
+	__russ_spathcache_check();
+	if (russ_spathcache.ttl <= 0) {
+		goto unlock;
+	}
+	if (russ_spathcache.nentries >= RUSS_SPATHCACHE_MAX) {
+		__russ_spathcache_flush();
+	}
+	if ((entry = russ_malloc(sizeof(struct russ_spathcache_entry))) == NULL) {
+		goto unlock;
+	}
+	entry->spath = strdup(spath);
+	entry->saddr = strdup(saddr);
+	entry->spath2 = strdup(spath2);
+	if ((entry->spath == NULL) || (entry->saddr == NULL) || (entry->spath2 == NULL)) {
+		entry = __russ_spathcache_entry_free(entry);
+		goto unlock;
+	}
+	entry->expires = russ_to_deadline(russ_spathcache.ttl);
+
+	__russ_spathcache_watch(spath);
+	__russ_spathcache_watch(saddr);
+
+	h = __russ_spathcache_hash(spath);
+	entry->next = russ_spathcache.buckets[h];
+	russ_spathcache.buckets[h] = entry;
+	russ_spathcache.nentries++;
+unlock:
+	pthread_mutex_unlock(&russ_spathcache.lock);
+}
+
+/**
+* Drop all entries from the spath cache.
+*/
+void
+russ_spathcache_clear(void) {
+	pthread_mutex_lock(&russ_spathcache.lock);
+	__russ_spathcache_flush();
+	pthread_mutex_unlock(&russ_spathcache.lock);
+}
+
+/**
+* Set time-to-live of spath cache entries.
+*
+* @param ttl		time-to-live (msec); 0 to disable the cache
+* @return		0 on success; -1 on failure
+*/
+int
+russ_spathcache_set_ttl(int ttl) {
+	if (ttl < 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&russ_spathcache.lock);
+	__russ_spathcache_check();
+	russ_spathcache.ttl = ttl;
+	if (ttl == 0) {
+		__russ_spathcache_flush();
+	}
+	pthread_mutex_unlock(&russ_spathcache.lock);
+	return 0;
+}
+
 /**
 * Test for option (look for "?").
 *
@@ -281,25 +562,15 @@ russ_get_plusserver_path(void) {
 }
 
 /**
-* Split spath into saddr and remaing spath.
+* Split spath (uncached). See russ_spath_split().
 *
-* A service path may be composed of a socket address (saddr) and a
-* (remaining) service path (spath). The saddr is local, the spath is
-* passed to the service server. Depending on the service server, the
-* spath may also be a service target and need to be resolved and
-* followed.
-*
-* Special handling: "/+", "+". Stops searching for saddr.
-*
-* @param spath		service path
-* @param[out] saddr	socket address
-* @param[out] spath2	remaining service path
-* @return		0 on succes; -1 on failure
+* @param[out] resolved	set if resolving spath changed it (e.g., a
+*			symlink was followed)
 */
-int
-russ_spath_split(const char *spath, char **saddr, char **spath2) {
-	struct russ_target	*targ = NULL;
+static int
+__russ_spath_split(const char *spath, char **saddr, char **spath2, int *resolved) {
 	struct stat		st;
+	const char		*spath0 = spath;
 	char			*p = NULL;
 	char			_spath2[RUSS_REQ_SPATH_MAX];
 
@@ -312,6 +583,7 @@ russ_spath_split(const char *spath, char **saddr, char **spath2) {
 		|| (spath[0] == '\0')) {
 		goto free_spath;
 	}
+	*resolved = (strcmp(spath, spath0) != 0);
 
 	/* special case */
 	if (spath[0] == '+') {
@@ -381,6 +653,99 @@ free_spath:
 	return -1;
 }
 
+/**
+* Split spath into saddr and remaing spath.
+*
+* A service path may be composed of a socket address (saddr) and a
+* (remaining) service path (spath). The saddr is local, the spath is
+* passed to the service server. Depending on the service server, the
+* spath may also be a service target and need to be resolved and
+* followed.
+*
+* Special handling: "/+", "+". Stops searching for saddr.
+*
+* Results for absolute spaths which do not resolve through a
+* symlink are cached (see russ_spathcache_*).
+*
+* @param spath		service path
+* @param[out] saddr	socket address
+* @param[out] spath2	remaining service path
+* @return		0 on succes; -1 on failure
+*/
+int
+russ_spath_split(const char *spath, char **saddr, char **spath2) {
+	int	resolved = 0;
+
+	if ((spath != NULL) && (spath[0] == '/')
+		&& (russ_spathcache_get(spath, saddr, spath2) == 0)) {
+		return 0;
+	}
+	if (__russ_spath_split(spath, saddr, spath2, &resolved) < 0) {
+		return -1;
+	}
+	if ((!resolved) && (spath[0] == '/') && (strlen(spath) < RUSS_REQ_SPATH_MAX)) {
+		russ_spathcache_put(spath, *saddr, *spath2);
+	}
+	return 0;
+}
+
+/**
+* Free target object.
+*
+* @param self		target object
+* @return		NULL
+*/
+struct russ_target *
+russ_target_free(struct russ_target *self) {
+	if (self) {
+		self->saddr = russ_free(self->saddr);
+		self->spath = russ_free(self->spath);
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+/**
+* Pre-resolve spath into a target object which can be dialed
+* repeatedly (see russ_dialv_target()) without resolving again.
+*
+* If the saddr refers to a configuration file, the server is
+* spawned once, here.
+*
+* @param spath		service path
+* @return		target object; NULL on failure
+*/
+struct russ_target *
+russ_target_new(const char *spath) {
+	struct russ_target	*self = NULL;
+	char			*caddr = NULL;
+
+	if ((self = russ_malloc(sizeof(struct russ_target))) == NULL) {
+		return NULL;
+	}
+	self->saddr = NULL;
+	self->spath = NULL;
+
+	if (russ_spath_split(spath, &self->saddr, &self->spath) < 0) {
+		goto free_target;
+	}
+	if (russ_is_conffile(self->saddr)) {
+		/* saddr points to configuration; use spawned socket */
+		caddr = realpath(self->saddr, NULL);
+		self->saddr = russ_free(self->saddr);
+		self->saddr = russ_ruspawn(caddr);
+		caddr = russ_free(caddr);
+		if (self->saddr == NULL) {
+			goto free_target;
+		}
+	}
+	return self;
+
+free_target:
+	russ_target_free(self);
+	return NULL;
+}
+
 /**
 * Return copy of service path without options.
 *
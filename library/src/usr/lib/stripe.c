@@ -0,0 +1,507 @@
+/*
+* lib/stripe.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Striped transfer.
+*
+* One logical byte stream is carried over several fds ("lanes"),
+* typically the extra connection fds answered by
+* russ_sconn_answerstripes(). The stream is cut into chunks which are
+* framed with a sequence number and length (RUSS_STRIPE_HDRSIZE) and
+* sent round-robin over the lanes: chunk seq goes to lane
+* seq % nlanes. Each lane has a thread doing the I/O so that the
+* lanes are moved by several cores; the caller only copies data to
+* or from the lane queues. The receiving side reassembles the chunks
+* in sequence order. The stream ends when every lane ends right
+* after its last chunk; lanes ending unevenly (a chunk missing or
+* left over) are an error.
+*
+* A stripe object is either for writing or for reading.
+*
+* Servers only answer as many lanes as the service allows (see
+* russ_sconn_answerstripes()).
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <russ/priv.h>
+
+#define RUSS_STRIPE_QUEUEMAX	4
+
+/**
+* Lane: fd, worker thread and queue of frames.
+*
+* Frames are queued at the tail and taken at the head. The slot at
+* the tail is only touched by the producing side and the slot at the
+* head only by the consuming side, so frame data is copied without
+* holding the lock.
+*/
+struct russ_stripelane {
+	struct russ_stripe	*stripe;
+	int			fd;
+	pthread_t		thread;
+	int			started;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	char			*bufs[RUSS_STRIPE_QUEUEMAX];	/**< header + data */
+	int			lens[RUSS_STRIPE_QUEUEMAX];	/**< data lengths */
+	int			qhead;
+	int			qlen;
+	int			eof;		/**< no more frames (reader) */
+	uint64_t		eofseq;		/**< seq expected when the lane ended */
+	int			err;		/**< errno of failure; 0 if none */
+	int			closing;	/**< worker should finish */
+};
+
+struct russ_stripe {
+	int			mode;		/**< RUSS_STRIPE_READ or RUSS_STRIPE_WRITE */
+	int			chunksize;
+	int			nlanes;
+	uint64_t		seq;		/**< next chunk to write or read */
+	int			off;		/**< offset in chunk being read */
+	int			quitfds[2];	/**< wakes reader workers on free */
+	struct russ_stripelane	lanes[RUSS_STRIPE_MAX];
+};
+
+/**
+* Read exactly count bytes from a lane fd, unless EOF.
+*
+* @param lane		russ_stripelane object
+* @param buf		buffer
+* @param count		# of bytes to read
+* @return		# of bytes read (< count on EOF); -1 on
+*			failure or when the stripe is freed
+*/
+static int
+__russ_stripe_readn(struct russ_stripelane *lane, char *buf, int count) {
+	struct pollfd	pollfds[2];
+	ssize_t		n;
+	int		nread;
+
+	pollfds[0].fd = lane->fd;
+	pollfds[0].events = POLLIN;
+	pollfds[1].fd = lane->stripe->quitfds[0];
+	pollfds[1].events = POLLIN;
+	for (nread = 0; nread < count; nread += n) {
+		if (russ_poll_deadline(RUSS_DEADLINE_NEVER, pollfds, 2) < 0) {
+			return -1;
+		}
+		if (pollfds[1].revents) {
+			errno = ECANCELED;
+			return -1;
+		}
+		while (((n = read(lane->fd, buf+nread, count-nread)) < 0) && (errno == EINTR));
+		if (n < 0) {
+			return -1;
+		} else if (n == 0) {
+			break;
+		}
+	}
+	return nread;
+}
+
+/**
+* Reader worker: read frames from the lane fd and queue them.
+*
+* @param arg		russ_stripelane object
+* @return		NULL
+*/
+static void *
+__russ_stripe_reader(void *arg) {
+	struct russ_stripelane	*lane = arg;
+	struct russ_stripe	*stripe = lane->stripe;
+	uint64_t		seq, nextseq;
+	int32_t			len;
+	char			*buf = NULL, *bp = NULL;
+	int			n, closing, err = 0;
+
+	nextseq = lane-stripe->lanes;
+	while (1) {
+		pthread_mutex_lock(&lane->lock);
+		while ((lane->qlen == RUSS_STRIPE_QUEUEMAX) && (!lane->closing)) {
+			pthread_cond_wait(&lane->cond, &lane->lock);
+		}
+		buf = lane->bufs[(lane->qhead+lane->qlen) % RUSS_STRIPE_QUEUEMAX];
+		closing = lane->closing;
+		pthread_mutex_unlock(&lane->lock);
+		if (closing) {
+			break;
+		}
+
+		if ((n = __russ_stripe_readn(lane, buf, RUSS_STRIPE_HDRSIZE)) == 0) {
+			/* clean end of lane */
+			break;
+		}
+		if (n != RUSS_STRIPE_HDRSIZE) {
+			err = (n < 0) ? errno : EPROTO;
+			break;
+		}
+		bp = russ_dec_uint64(buf, &seq);
+		bp = russ_dec_int32(bp, &len);
+		if ((seq != nextseq) || (len <= 0) || (len > stripe->chunksize)) {
+			err = EPROTO;
+			break;
+		}
+		if ((n = __russ_stripe_readn(lane, buf+RUSS_STRIPE_HDRSIZE, len)) != len) {
+			err = (n < 0) ? errno : EPROTO;
+			break;
+		}
+		nextseq += stripe->nlanes;
+
+		pthread_mutex_lock(&lane->lock);
+		lane->lens[(lane->qhead+lane->qlen) % RUSS_STRIPE_QUEUEMAX] = len;
+		lane->qlen++;
+		pthread_cond_broadcast(&lane->cond);
+		pthread_mutex_unlock(&lane->lock);
+	}
+
+	pthread_mutex_lock(&lane->lock);
+	lane->eof = 1;
+	lane->eofseq = nextseq;
+	lane->err = err;
+	pthread_cond_broadcast(&lane->cond);
+	pthread_mutex_unlock(&lane->lock);
+	return NULL;
+}
+
+/**
+* Writer worker: write queued frames to the lane fd. Queued frames
+* are flushed before the worker finishes.
+*
+* @param arg		russ_stripelane object
+* @return		NULL
+*/
+static void *
+__russ_stripe_writer(void *arg) {
+	struct russ_stripelane	*lane = arg;
+	char			*buf = NULL;
+	int			len;
+
+	while (1) {
+		pthread_mutex_lock(&lane->lock);
+		while ((lane->qlen == 0) && (!lane->closing)) {
+			pthread_cond_wait(&lane->cond, &lane->lock);
+		}
+		if (lane->qlen == 0) {
+			pthread_mutex_unlock(&lane->lock);
+			break;
+		}
+		buf = lane->bufs[lane->qhead];
+		len = lane->lens[lane->qhead];
+		pthread_mutex_unlock(&lane->lock);
+
+		if (russ_writen(lane->fd, buf, RUSS_STRIPE_HDRSIZE+len) != RUSS_STRIPE_HDRSIZE+len) {
+			pthread_mutex_lock(&lane->lock);
+			lane->err = (errno) ? errno : EIO;
+			pthread_cond_broadcast(&lane->cond);
+			pthread_mutex_unlock(&lane->lock);
+			break;
+		}
+
+		pthread_mutex_lock(&lane->lock);
+		lane->qhead = (lane->qhead+1) % RUSS_STRIPE_QUEUEMAX;
+		lane->qlen--;
+		pthread_cond_broadcast(&lane->cond);
+		pthread_mutex_unlock(&lane->lock);
+	}
+	return NULL;
+}
+
+/**
+* Free stripe.
+*
+* A writing stripe flushes queued chunks first; a reading stripe
+* drops unread chunks. Lane fds are closed, which the peer sees as
+* the end of the stream.
+*
+* @param self		russ_stripe object
+* @return		NULL
+*/
+struct russ_stripe *
+russ_stripe_free(struct russ_stripe *self) {
+	struct russ_stripelane	*lane = NULL;
+	int			i, j;
+
+	if (self == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < self->nlanes; i++) {
+		lane = &self->lanes[i];
+		pthread_mutex_lock(&lane->lock);
+		lane->closing = 1;
+		pthread_cond_broadcast(&lane->cond);
+		pthread_mutex_unlock(&lane->lock);
+	}
+	russ_fds_close(&self->quitfds[1], 1);
+	for (i = 0; i < self->nlanes; i++) {
+		lane = &self->lanes[i];
+		if (lane->started) {
+			pthread_join(lane->thread, NULL);
+		}
+		russ_fds_close(&lane->fd, 1);
+		for (j = 0; j < RUSS_STRIPE_QUEUEMAX; j++) {
+			lane->bufs[j] = russ_free(lane->bufs[j]);
+		}
+		pthread_cond_destroy(&lane->cond);
+		pthread_mutex_destroy(&lane->lock);
+	}
+	russ_fds_close(self->quitfds, 2);
+	self = russ_free(self);
+	return NULL;
+}
+
+/**
+* Create new stripe over lane fds.
+*
+* The stripe takes over the fds; the entries in fds are set to -1.
+* Both sides must use the same chunk size.
+*
+* @param mode		RUSS_STRIPE_READ or RUSS_STRIPE_WRITE
+* @param nfds		# of fds (1 to RUSS_STRIPE_MAX)
+* @param fds		array of lane fds
+* @param chunksize	chunk size (<= 0 for RUSS_STRIPE_CHUNKSIZE)
+* @return		russ_stripe object; NULL on failure
+*/
+struct russ_stripe *
+russ_stripe_new(int mode, int nfds, int *fds, int chunksize) {
+	struct russ_stripe	*self = NULL;
+	struct russ_stripelane	*lane = NULL;
+	int			i, j;
+
+	if ((nfds < 1) || (nfds > RUSS_STRIPE_MAX)
+		|| ((mode != RUSS_STRIPE_READ) && (mode != RUSS_STRIPE_WRITE))
+		|| ((self = russ_malloc(sizeof(struct russ_stripe))) == NULL)) {
+		return NULL;
+	}
+	self->mode = mode;
+	self->chunksize = (chunksize <= 0) ? RUSS_STRIPE_CHUNKSIZE : chunksize;
+	self->nlanes = nfds;
+	self->seq = 0;
+	self->off = 0;
+	russ_fds_init(self->quitfds, 2, -1);
+	for (i = 0; i < nfds; i++) {
+		lane = &self->lanes[i];
+		lane->stripe = self;
+		lane->fd = fds[i];
+		fds[i] = -1;
+		lane->started = 0;
+		pthread_mutex_init(&lane->lock, NULL);
+		pthread_cond_init(&lane->cond, NULL);
+		lane->qhead = 0;
+		lane->qlen = 0;
+		lane->eof = 0;
+		lane->eofseq = 0;
+		lane->err = 0;
+		lane->closing = 0;
+		for (j = 0; j < RUSS_STRIPE_QUEUEMAX; j++) {
+			lane->bufs[j] = NULL;
+			lane->lens[j] = 0;
+		}
+	}
+
+	if ((mode == RUSS_STRIPE_READ) && (pipe(self->quitfds) < 0)) {
+		goto fail;
+	}
+	for (i = 0; i < nfds; i++) {
+		lane = &self->lanes[i];
+		if (lane->fd < 0) {
+			goto fail;
+		}
+		for (j = 0; j < RUSS_STRIPE_QUEUEMAX; j++) {
+			if ((lane->bufs[j] = russ_malloc(RUSS_STRIPE_HDRSIZE+self->chunksize)) == NULL) {
+				goto fail;
+			}
+		}
+		if (pthread_create(&lane->thread, NULL,
+			(mode == RUSS_STRIPE_READ) ? __russ_stripe_reader : __russ_stripe_writer, lane) != 0) {
+			goto fail;
+		}
+		lane->started = 1;
+	}
+	return self;
+
+fail:
+	return russ_stripe_free(self);
+}
+
+/**
+* Check that the stream ends evenly at the current chunk: every lane
+* must end, with nothing queued, just before its next chunk would
+* be.
+*
+* @param self		russ_stripe object
+* @return		0 on success; -1 on failure (errno EPROTO if
+*			lanes ended unevenly)
+*/
+static int
+__russ_stripe_checkend(struct russ_stripe *self) {
+	struct russ_stripelane	*lane = NULL;
+	uint64_t		eofseq;
+	int			i, err;
+
+	for (i = 0; i < self->nlanes; i++) {
+		lane = &self->lanes[i];
+		/* first seq >= self->seq for lane i */
+		eofseq = self->seq+(i-(int)(self->seq % self->nlanes)+self->nlanes) % self->nlanes;
+		pthread_mutex_lock(&lane->lock);
+		while ((lane->qlen == 0) && (!lane->eof)) {
+			pthread_cond_wait(&lane->cond, &lane->lock);
+		}
+		err = lane->err;
+		if ((!err) && ((lane->qlen > 0) || (lane->eofseq != eofseq))) {
+			err = EPROTO;
+		}
+		pthread_mutex_unlock(&lane->lock);
+		if (err) {
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+* Read from stripe.
+*
+* Waits for the next chunk, then returns as much data as is
+* available in order, up to count.
+*
+* @param self		russ_stripe object
+* @param buf		buffer
+* @param count		max # of bytes to read
+* @return		# of bytes read; 0 on end of stream; -1 on
+*			failure (errno EPROTO if lanes ended unevenly)
+*/
+ssize_t
+russ_stripe_read(struct russ_stripe *self, void *buf, size_t count) {
+	struct russ_stripelane	*lane = NULL;
+	char			*p = NULL;
+	size_t			nread, n;
+	int			len;
+
+	if (self->mode != RUSS_STRIPE_READ) {
+		errno = EBADF;
+		return -1;
+	}
+	for (nread = 0; nread < count; ) {
+		lane = &self->lanes[self->seq % self->nlanes];
+		pthread_mutex_lock(&lane->lock);
+		while ((nread == 0) && (lane->qlen == 0) && (!lane->eof)) {
+			pthread_cond_wait(&lane->cond, &lane->lock);
+		}
+		if (lane->qlen == 0) {
+			/* done for now, end of stream, or failure */
+			if ((nread == 0) && (lane->err)) {
+				errno = lane->err;
+				pthread_mutex_unlock(&lane->lock);
+				return -1;
+			}
+			pthread_mutex_unlock(&lane->lock);
+			if ((nread == 0) && (__russ_stripe_checkend(self) < 0)) {
+				return -1;
+			}
+			break;
+		}
+		p = lane->bufs[lane->qhead]+RUSS_STRIPE_HDRSIZE;
+		len = lane->lens[lane->qhead];
+		pthread_mutex_unlock(&lane->lock);
+
+		n = len-self->off;
+		n = (n < count-nread) ? n : count-nread;
+		memcpy((char *)buf+nread, p+self->off, n);
+		nread += n;
+		if ((self->off += n) < len) {
+			break;
+		}
+
+		pthread_mutex_lock(&lane->lock);
+		lane->qhead = (lane->qhead+1) % RUSS_STRIPE_QUEUEMAX;
+		lane->qlen--;
+		pthread_cond_broadcast(&lane->cond);
+		pthread_mutex_unlock(&lane->lock);
+		self->off = 0;
+		self->seq++;
+	}
+	return (ssize_t)nread;
+}
+
+/**
+* Write to stripe.
+*
+* Data is cut into chunks and queued on the lanes; this waits only
+* when the lane for the next chunk has a full queue. Use
+* russ_stripe_free() to flush.
+*
+* @param self		russ_stripe object
+* @param buf		buffer
+* @param count		# of bytes to write
+* @return		# of bytes written; -1 on failure with nothing
+*			written
+*/
+ssize_t
+russ_stripe_write(struct russ_stripe *self, const void *buf, size_t count) {
+	struct russ_stripelane	*lane = NULL;
+	char			*p = NULL, *bp = NULL;
+	size_t			nwritten, n;
+	int			err;
+
+	if (self->mode != RUSS_STRIPE_WRITE) {
+		errno = EBADF;
+		return -1;
+	}
+	for (nwritten = 0; nwritten < count; nwritten += n) {
+		lane = &self->lanes[self->seq % self->nlanes];
+		pthread_mutex_lock(&lane->lock);
+		while ((lane->qlen == RUSS_STRIPE_QUEUEMAX) && (!lane->err)) {
+			pthread_cond_wait(&lane->cond, &lane->lock);
+		}
+		if ((err = lane->err) == 0) {
+			p = lane->bufs[(lane->qhead+lane->qlen) % RUSS_STRIPE_QUEUEMAX];
+		}
+		pthread_mutex_unlock(&lane->lock);
+		if (err) {
+			errno = err;
+			break;
+		}
+
+		n = count-nwritten;
+		n = (n < (size_t)self->chunksize) ? n : (size_t)self->chunksize;
+		bp = russ_enc_uint64(p, p+RUSS_STRIPE_HDRSIZE, self->seq);
+		bp = russ_enc_int32(bp, p+RUSS_STRIPE_HDRSIZE, (int32_t)n);
+		memcpy(p+RUSS_STRIPE_HDRSIZE, (char *)buf+nwritten, n);
+
+		pthread_mutex_lock(&lane->lock);
+		lane->lens[(lane->qhead+lane->qlen) % RUSS_STRIPE_QUEUEMAX] = n;
+		lane->qlen++;
+		pthread_cond_broadcast(&lane->cond);
+		pthread_mutex_unlock(&lane->lock);
+		self->seq++;
+	}
+	return ((nwritten == 0) && (count > 0)) ? -1 : (ssize_t)nwritten;
+}
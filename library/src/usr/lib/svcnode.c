@@ -128,29 +128,42 @@ russ_svcnode_add(struct russ_svcnode *self, const char *name, russ_svchandler ha
 }
 
 /**
-* Find node matching path starting at a node.
-*
-* spath options are ignored. A wildcard svcnode always matches.
+* Append "/" and path component to mpath (if there is room).
 *
-* See russ_svcnode_add() for ordering of child nodes.
+* @param mpath		path matched
+* @param mpath_cap	size of mpath buffer
+* @param mpathlen	current length of mpath
+* @param comp		path component
+* @param complen	length of comp
+* @return		new length of mpath
+*/
+static int
+__russ_svcnode_mpath_append(char *mpath, int mpath_cap, int mpathlen, const char *comp, int complen) {
+	if ((mpath != NULL) && (mpathlen+1+complen+1 <= mpath_cap)) {
+		mpath[mpathlen] = '/';
+		memcpy(&mpath[mpathlen+1], comp, complen);
+		mpathlen += 1+complen;
+		mpath[mpathlen] = '\0';
+	}
+	return mpathlen;
+}
+
+/**
+* Find node matching path (see russ_svcnode_find()).
 *
 * @param self		service node object starting point
 * @param path		path to match (relative to self)
 * @param mpath		path matched
 * @param mpath_cap	size of mpath buffer
+* @param mpathlen	current length of mpath
 * @return		matching service node object; NULL on failure
 */
-struct russ_svcnode *
-russ_svcnode_find(struct russ_svcnode *self, const char *path, char *mpath, int mpath_cap) {
+static struct russ_svcnode *
+__russ_svcnode_find(struct russ_svcnode *self, const char *path, char *mpath, int mpath_cap, int mpathlen) {
 	struct russ_svcnode	*node = NULL;
 	const char		*nsep = NULL, *qsep = NULL, *ssep = NULL;
-	char			*mpathend = NULL;
-	int			cmp, nlen, qlen, slen;
+	int			cmp, nlen, slen;
 
-	//russ_lprintf("/tmp/svcfind.log", NULL, "*** mpath (%s) mpath_cap (%d)\n", mpath, mpath_cap);
-	if (self == NULL) {
-		return NULL;
-	}
 	/* skip leading / */
 	if (path[0] == '/') {
 		path++;
@@ -163,57 +176,322 @@ russ_svcnode_find(struct russ_svcnode *self, const char *path, char *mpath, int
 	}
 
 	for (qsep = path; (qsep < ssep) && (*qsep != '?'); qsep++);
-	qlen = qsep-path;
 	slen = ssep-path;
 	nsep = (qsep < ssep) ? qsep : ssep;
 	nlen = nsep-path;
 
-	/* force initialize */
-	mpath[0] = '\0';
-
-	//russ_lprintf("/tmp/svcfind.log", NULL, "name (%s) path (%s) qlen (%d) slen (%d) nlen (%d)\n", self->name, path, qlen, slen, nlen);
 	for (node = self->children; node != NULL; node = node->next) {
 		/* strcmp() ordering */
 		cmp = strncmp(node->name, path, nlen);
-		//russ_lprintf("/tmp/svcfind.log", NULL, "node->name (%s) cmp (%d) wildcard (%d) name[nlen] (%c)\n", node->name, cmp, node->wildcard, node->name[nlen]);
 
 		/* matching component name? */
 		if ((!node->wildcard) && (cmp > 0)) {
-			if (mpath != NULL) {
-				mpath[0] = '\0';
-			}
 			node = NULL;
 			break;
 		} else if (node->wildcard || ((cmp == 0) && (node->name[nlen] == '\0'))) {
 			/* wildcard or full match and matching component and *name* length */
-			if (mpath != NULL) {
-				//russ_lprintf("/tmp/svcfind.log", NULL, "updating mpath from (%s)\n", mpath);
-				mpathend = strchr(mpath, '\0');
-				if ((mpathend-mpath+1+slen+1) < mpath_cap) {
-					mpathend[0] = '/';
-					mpathend++;
-					if (strncat(mpathend, path, slen) < 0) {
-						/* do not exceed mpath buffer */
-						mpath[0] = '\0';
-						node = NULL;
-						break;
-					}
-				}
-				//russ_lprintf("/tmp/svcfind.log", NULL, "updated mpath to (%s)\n", mpath);
-			}
+			mpathlen = __russ_svcnode_mpath_append(mpath, mpath_cap, mpathlen, path, slen);
 			if (*ssep != '\0') {
-				node = russ_svcnode_find(node, &path[slen+1], mpath, mpath_cap);
+				node = __russ_svcnode_find(node, &path[slen+1], mpath, mpath_cap, mpathlen);
 			}
 			break;
 		}
 	}
-	//russ_lprintf("/tmp/svcfind.log", NULL, "node (%p) mpath (%s)\n", node, mpath);
-	//if (node) {
-		//russ_lprintf("/tmp/svcfind.log", NULL, "node->name (%s)\n", node->name);
-	//}
 	return node;
 }
 
+/**
+* Find node matching path starting at a node.
+*
+* spath options are ignored. A wildcard svcnode always matches.
+* The matched path components (with options) are joined into mpath.
+*
+* See russ_svcnode_add() for ordering of child nodes. For repeated
+* lookups, see russ_svcnode_freeze().
+*
+* @param self		service node object starting point
+* @param path		path to match (relative to self)
+* @param mpath		path matched
+* @param mpath_cap	size of mpath buffer
+* @return		matching service node object; NULL on failure
+*/
+struct russ_svcnode *
+russ_svcnode_find(struct russ_svcnode *self, const char *path, char *mpath, int mpath_cap) {
+	struct russ_svcnode	*node = NULL;
+
+	if (self == NULL) {
+		return NULL;
+	}
+	if ((mpath != NULL) && (mpath_cap > 0)) {
+		mpath[0] = '\0';
+	}
+	if (((node = __russ_svcnode_find(self, path, mpath, mpath_cap, 0)) == NULL)
+		&& (mpath != NULL) && (mpath_cap > 0)) {
+		mpath[0] = '\0';
+	}
+	return node;
+}
+
+/**
+* Hash name (FNV-1a).
+*
+* @param name		name
+* @param len		length of name
+* @return		hash value
+*/
+static unsigned int
+__russ_svcindex_hash(const char *name, int len) {
+	unsigned int	h = 2166136261u;
+	int		i;
+
+	for (i = 0; i < len; i++) {
+		h = (h^(unsigned char)name[i])*16777619u;
+	}
+	return h;
+}
+
+/**
+* Count nodes in tree.
+*
+* @param node		service node object
+* @return		number of nodes
+*/
+static int
+__russ_svcindex_count(struct russ_svcnode *node) {
+	struct russ_svcnode	*child = NULL;
+	int			n = 1;
+
+	for (child = node->children; child != NULL; child = child->next) {
+		n += __russ_svcindex_count(child);
+	}
+	return n;
+}
+
+/**
+* Count child table slots needed for tree.
+*
+* @param node		service node object
+* @return		number of slots
+*/
+static int
+__russ_svcindex_nslots(struct russ_svcnode *node) {
+	struct russ_svcnode	*child = NULL;
+	int			nchildren = 0, size = 0, n = 0;
+
+	for (child = node->children; child != NULL; child = child->next) {
+		nchildren++;
+		n += __russ_svcindex_nslots(child);
+	}
+	if (nchildren > 0) {
+		for (size = 1; size < 2*nchildren; size <<= 1);
+	}
+	return n+size;
+}
+
+/**
+* Load node (at index) and its subtree into index.
+*
+* @param self		service index object
+* @param node		service node object
+* @param index		position of node in self->nodes
+* @param[in,out] nextnode	next free position in self->nodes
+* @param[in,out] nextslot	next free position in self->slots
+*/
+static void
+__russ_svcindex_load(struct russ_svcindex *self, struct russ_svcnode *node, int index, int *nextnode, int *nextslot) {
+	struct russ_svcindexnode	*inode = &self->nodes[index], *ichild = NULL;
+	struct russ_svcnode		*child = NULL;
+	int				first, i, rank, size, h;
+
+	inode->node = node;
+	inode->namelen = strlen(node->name);
+	inode->hash = __russ_svcindex_hash(node->name, inode->namelen);
+	inode->wildcard = -1;
+	inode->prewildcard = NULL;
+	inode->nchildren = 0;
+	inode->slot0 = 0;
+	inode->slotmask = -1;
+
+	for (child = node->children; child != NULL; child = child->next) {
+		inode->nchildren++;
+	}
+	if (inode->nchildren == 0) {
+		return;
+	}
+
+	/* reserve children (contiguous) and table */
+	first = *nextnode;
+	*nextnode += inode->nchildren;
+	for (size = 1; size < 2*inode->nchildren; size <<= 1);
+	inode->slot0 = *nextslot;
+	inode->slotmask = size-1;
+	*nextslot += size;
+	for (i = 0; i < size; i++) {
+		self->slots[inode->slot0+i] = -1;
+	}
+
+	for (child = node->children, rank = 0; child != NULL; child = child->next, rank++) {
+		__russ_svcindex_load(self, child, first+rank, nextnode, nextslot);
+		ichild = &self->nodes[first+rank];
+		ichild->rank = rank;
+
+		if (child->wildcard) {
+			if (inode->wildcard < 0) {
+				inode->wildcard = first+rank;
+			}
+			continue;
+		}
+		if (inode->wildcard < 0) {
+			/* last non-wildcard before the first wildcard */
+			inode->prewildcard = child->name;
+		}
+		for (h = ichild->hash&inode->slotmask;
+			self->slots[inode->slot0+h] >= 0;
+			h = (h+1)&inode->slotmask);
+		self->slots[inode->slot0+h] = first+rank;
+	}
+}
+
+/**
+* Free service index object. The service nodes are not affected.
+*
+* @param self		service index object
+* @return		NULL
+*/
+struct russ_svcindex *
+russ_svcindex_free(struct russ_svcindex *self) {
+	if (self) {
+		self->nodes = russ_free(self->nodes);
+		self->slots = russ_free(self->slots);
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+/**
+* Find node matching path in a frozen tree.
+*
+* Same matching as russ_svcnode_find() from the root node: children
+* are found by hash, wildcard fallbacks are precomputed, and mpath
+* is built as components are matched.
+*
+* @param self		service index object
+* @param path		path to match
+* @param mpath		path matched
+* @param mpath_cap	size of mpath buffer
+* @return		matching service node object; NULL on failure
+*/
+struct russ_svcnode *
+russ_svcindex_find(struct russ_svcindex *self, const char *path, char *mpath, int mpath_cap) {
+	struct russ_svcindexnode	*inode = NULL, *ichild = NULL;
+	const char			*ssep = NULL, *nsep = NULL;
+	unsigned int			hash;
+	int				mpathlen = 0, nlen, slen, h, k;
+
+	if ((self == NULL) || (self->nnodes == 0)) {
+		return NULL;
+	}
+	if ((mpath != NULL) && (mpath_cap > 0)) {
+		mpath[0] = '\0';
+	}
+
+	inode = &self->nodes[0];
+	while (1) {
+		/* skip leading / */
+		if (path[0] == '/') {
+			path++;
+		}
+		if ((inode->node->virtual) || (path[0] == '\0')) {
+			return inode->node;
+		}
+
+		for (ssep = path, nsep = NULL; (*ssep != '\0') && (*ssep != '/'); ssep++) {
+			if ((*ssep == '?') && (nsep == NULL)) {
+				nsep = ssep;
+			}
+		}
+		slen = ssep-path;
+		nlen = (nsep != NULL) ? nsep-path : slen;
+
+		/* exact match */
+		ichild = NULL;
+		if (inode->nchildren > 0) {
+			hash = __russ_svcindex_hash(path, nlen);
+			for (h = hash&inode->slotmask; (k = self->slots[inode->slot0+h]) >= 0; h = (h+1)&inode->slotmask) {
+				if ((self->nodes[k].hash == hash)
+					&& (self->nodes[k].namelen == nlen)
+					&& (strncmp(self->nodes[k].node->name, path, nlen) == 0)) {
+					ichild = &self->nodes[k];
+					break;
+				}
+			}
+		}
+
+		/* wildcard (in strcmp() order, as russ_svcnode_find()) */
+		if ((inode->wildcard >= 0)
+			&& ((ichild == NULL) || (self->nodes[inode->wildcard].rank < ichild->rank))) {
+			if ((inode->prewildcard != NULL)
+				&& (strncmp(inode->prewildcard, path, nlen) > 0)) {
+				ichild = NULL;
+			} else {
+				ichild = &self->nodes[inode->wildcard];
+			}
+		}
+
+		if (ichild == NULL) {
+			if ((mpath != NULL) && (mpath_cap > 0)) {
+				mpath[0] = '\0';
+			}
+			return NULL;
+		}
+		mpathlen = __russ_svcnode_mpath_append(mpath, mpath_cap, mpathlen, path, slen);
+		if (*ssep == '\0') {
+			return ichild->node;
+		}
+		path = ssep+1;
+		inode = ichild;
+	}
+}
+
+/**
+* Freeze service node tree into a service index for fast lookups
+* (see russ_svcindex_find()).
+*
+* The index refers to the service nodes, which must not be changed
+* or freed while the index is in use.
+*
+* @param self		root service node object
+* @return		service index object; NULL on failure
+*/
+struct russ_svcindex *
+russ_svcnode_freeze(struct russ_svcnode *self) {
+	struct russ_svcindex	*index = NULL;
+	int			nextnode, nextslot;
+
+	if ((self == NULL)
+		|| ((index = russ_malloc(sizeof(struct russ_svcindex))) == NULL)) {
+		return NULL;
+	}
+	index->nnodes = __russ_svcindex_count(self);
+	index->nslots = __russ_svcindex_nslots(self);
+	index->slots = NULL;
+	if (((index->nodes = russ_malloc(sizeof(struct russ_svcindexnode)*index->nnodes)) == NULL)
+		|| ((index->nslots > 0)
+			&& ((index->slots = russ_malloc(sizeof(int)*index->nslots)) == NULL))) {
+		goto free_index;
+	}
+
+	nextnode = 1;
+	nextslot = 0;
+	__russ_svcindex_load(index, self, 0, &nextnode, &nextslot);
+	index->nodes[0].rank = 0;
+	return index;
+
+free_index:
+	russ_svcindex_free(index);
+	return NULL;
+}
+
 int
 russ_svcnode_set_autoanswer(struct russ_svcnode *self, int value) {
 	if (self == NULL) {
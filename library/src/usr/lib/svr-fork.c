@@ -22,6 +22,8 @@
 # license--end
 */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,10 +38,15 @@ typedef void (*sighandler_t)(int);
 /**
 * Server loop for forking servers.
 *
+* Unless disabled (see russ_svr_set_intake()), requests are read by
+* the intake stage so that only connections with a complete request
+* are forked for.
+*
 * @param self		server object
 */
 void
 russ_svr_loop_fork(struct russ_svr *self) {
+	struct russ_svr_intake	*intake = NULL;
 	struct russ_sconn	*sconn = NULL;
 	sighandler_t		sigh;
 	pid_t			pid, wpid;
@@ -49,8 +56,16 @@ russ_svr_loop_fork(struct russ_svr *self) {
 		return;
 	}
 
+	if ((self->intake) && (self->closeonaccept == 0)) {
+		intake = russ_svr_intake_new(self);
+	}
+
 	while (self->lisd >= 0) {
-		sconn = self->accepthandler(russ_to_deadline(self->accepttimeout), self->lisd);
+		if (intake) {
+			sconn = russ_svr_intake_next(intake);
+		} else {
+			sconn = self->accepthandler(russ_to_deadline(self->accepttimeout), self->lisd);
+		}
 		if (self->closeonaccept) {
 			russ_fds_close(&self->lisd, 1);
 		}
@@ -65,6 +80,7 @@ russ_svr_loop_fork(struct russ_svr *self) {
 			sigh = signal(SIGHUP, SIG_IGN);
 
 			russ_fds_close(&self->lisd, 1);
+			intake = russ_svr_intake_free(intake);
 			if (fork() == 0) {
 				setsid();
 				signal(SIGHUP, sigh);
@@ -82,6 +98,210 @@ russ_svr_loop_fork(struct russ_svr *self) {
 		sconn = russ_sconn_free(sconn);
 		wpid = waitpid(pid, &wst, 0);
 	}
+	intake = russ_svr_intake_free(intake);
+}
+
+/**
+* Prefork worker.
+*
+* Accepts on the shared listen socket and runs russ_svr_handler()
+* in-process. The worker exits (to be replaced by the master) once
+* it has served the maximum number of sessions, when the session
+* switched the process user (the worker cannot serve other
+* clients), or when the master has gone away. Service handlers
+* which call exit() simply end the worker early.
+*
+* The master is watched through the read end of a pipe whose write
+* end only the master holds (and never writes to): it becomes
+* readable (EOF) when the master exits, however it exits. It is
+* polled with the listen socket so that an idle worker does not
+* outlive its master.
+*
+* @param self		server object
+* @param watchfd	read end of the master watch pipe
+*/
+static void
+russ_svr_prefork_worker(struct russ_svr *self, int watchfd) {
+	struct russ_sconn	*sconn = NULL;
+	struct pollfd		pollfds[2];
+	uid_t			uid;
+	gid_t			gid;
+	int			nsessions;
+
+	setsid();
+	uid = getuid();
+	gid = getgid();
+
+	pollfds[0].fd = watchfd;
+	pollfds[0].events = POLLIN;
+	pollfds[1].fd = self->lisd;
+	pollfds[1].events = POLLIN;
+
+	nsessions = 0;
+	while ((self->preforkmaxsessions <= 0) || (nsessions < self->preforkmaxsessions)) {
+		if ((russ_poll_deadline(RUSS_DEADLINE_NEVER, pollfds, 2) < 0)
+			|| (pollfds[0].revents)
+			|| (pollfds[1].revents & (POLLERR|POLLHUP|POLLNVAL))) {
+			/* master gone or listen socket unusable */
+			break;
+		}
+		if (!(pollfds[1].revents & POLLIN)) {
+			continue;
+		}
+		if ((sconn = self->accepthandler(russ_to_deadline(self->accepttimeout), self->lisd)) == NULL) {
+			fprintf(stderr, "error: cannot accept connection\n");
+			sleep(1);
+			continue;
+		}
+		nsessions++;
+
+		russ_svr_handler(self, sconn);
+
+		/* failsafe exit info (if not provided) */
+		russ_sconn_fatal(sconn, RUSS_MSG_NOEXIT, RUSS_EXIT_SYSFAILURE);
+		russ_sconn_close(sconn);
+		sconn = russ_sconn_free(sconn);
+
+		if ((getuid() != uid) || (getgid() != gid)) {
+			break;
+		}
+	}
+	exit(0);
+}
+
+/**
+* Return the number of prefork workers to use.
+*
+* @param self		server object
+* @return		# of workers
+*/
+static int
+russ_svr_prefork_nworkers(struct russ_svr *self) {
+	long	n;
+
+	if (self->preforknworkers > 0) {
+		return self->preforknworkers;
+	}
+	/* auto: one per online cpu */
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+		return RUSS_SVR_PREFORK_NWORKERS;
+	}
+	return (int)n;
+}
+
+/**
+* Server loop for preforking servers.
+*
+* A fixed number of workers is forked up front; each accepts
+* connections on the shared listen socket (see
+* russ_svr_prefork_worker()). The master only reaps and, depending
+* on the respawn policy, replaces exited workers. Workers which exit
+* abnormally are replaced after a delay to avoid a fork storm. Slots
+* for which fork() fails are retried with an increasing delay (up
+* to RUSS_SVR_PREFORK_RETRYMAX seconds). Workers exit when the
+* master does (see russ_svr_prefork_worker()).
+*
+* Servers with closeonaccept set are served by the fork loop.
+*
+* @param self		server object
+*/
+void
+russ_svr_loop_prefork(struct russ_svr *self) {
+	pid_t	*pids = NULL;
+	pid_t	pid;
+	int	watchfds[2];
+	int	nworkers, nalive, nfailed, delay;
+	int	i, wst;
+
+	if (self == NULL) {
+		return;
+	}
+	if (self->closeonaccept) {
+		russ_svr_loop_fork(self);
+		return;
+	}
+
+	nworkers = russ_svr_prefork_nworkers(self);
+	if ((pids = russ_malloc(sizeof(pid_t)*nworkers)) == NULL) {
+		fprintf(stderr, "error: cannot allocate worker table\n");
+		return;
+	}
+	/* -1: free slot; 0: retired slot; > 0: worker pid */
+	for (i = 0; i < nworkers; i++) {
+		pids[i] = -1;
+	}
+
+	/* master watch pipe: held open until the master exits */
+	if (pipe(watchfds) < 0) {
+		fprintf(stderr, "error: cannot create watch pipe\n");
+		pids = russ_free(pids);
+		return;
+	}
+	fcntl(watchfds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(watchfds[1], F_SETFD, FD_CLOEXEC);
+
+	nalive = 0;
+	delay = 0;
+	while (self->lisd >= 0) {
+		/* (re)spawn into free slots */
+		nfailed = 0;
+		for (i = 0; i < nworkers; i++) {
+			if (pids[i] != -1) {
+				continue;
+			}
+			if ((pid = fork()) == 0) {
+				pids = russ_free(pids);
+				close(watchfds[1]);
+				russ_svr_prefork_worker(self, watchfds[0]);
+			} else if (pid < 0) {
+				nfailed++;
+				continue;
+			}
+			pids[i] = pid;
+			nalive++;
+		}
+		if (nfailed > 0) {
+			fprintf(stderr, "error: cannot fork %d worker(s)\n", nfailed);
+			delay = (delay == 0) ? 1 : RUSS__MIN(delay*2, RUSS_SVR_PREFORK_RETRYMAX);
+		} else {
+			delay = 0;
+		}
+		if ((nalive == 0) && (nfailed == 0)) {
+			break;
+		}
+
+		/* wait for an exit; poll while fork retries are pending */
+		if (delay > 0) {
+			sleep(delay);
+			pid = waitpid(-1, &wst, WNOHANG);
+		} else {
+			pid = waitpid(-1, &wst, 0);
+		}
+		if (pid <= 0) {
+			if ((pid < 0) && (errno != EINTR) && (delay == 0)) {
+				break;
+			}
+			continue;
+		}
+		for (i = 0; (i < nworkers) && (pids[i] != pid); i++);
+		if (i == nworkers) {
+			/* not a worker */
+			continue;
+		}
+		nalive--;
+
+		if (self->preforkrespawn == RUSS_SVR_PREFORK_RESPAWN_NEVER) {
+			pids[i] = 0;
+		} else {
+			pids[i] = -1;
+			if ((!WIFEXITED(wst)) || (WEXITSTATUS(wst) != 0)) {
+				sleep(1);
+			}
+		}
+	}
+	close(watchfds[0]);
+	close(watchfds[1]);
+	pids = russ_free(pids);
 }
 
 /**
@@ -0,0 +1,461 @@
+/*
+* lib/svr-intake.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Request intake stage for server loops.
+*
+* Connections are accepted and their requests read without blocking
+* under a single epoll set. Only connections with a complete,
+* decoded request are returned to the server loop for dispatch, so
+* slow or stalled clients cost a descriptor rather than a process or
+* thread.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __RUSS_LINUX__
+#include <sys/epoll.h>
+#endif
+
+#include "russ/priv.h"
+
+#define RUSS_SVR_INTAKE_NEVENTS	64
+#define RUSS_SVR_INTAKE_REARMDELAY	250
+
+/**
+* Connection being read by the intake stage.
+*/
+struct russ_svr_intakeconn {
+	struct russ_svr_intakeconn	*next;
+	struct russ_svr_intakeconn	*prev;
+	struct russ_sconn		*sconn;
+	russ_deadline			deadline;	/**< deadline to complete request */
+	int				flags;		/**< original fd flags */
+	char				hbuf[4];	/**< size header */
+	char				*buf;		/**< header and request */
+	int				size;		/**< request size (after header) */
+	int				nbuf;		/**< bytes read (including header) */
+};
+
+/**
+* Intake stage object.
+*/
+struct russ_svr_intake {
+	struct russ_svr			*svr;
+	int				epfd;
+	struct russ_svr_intakeconn	*pending;	/**< oldest first */
+	struct russ_svr_intakeconn	*pendingtail;
+	struct russ_svr_intakeconn	*ready;		/**< complete requests */
+	struct russ_svr_intakeconn	*readytail;
+	russ_deadline			rearmdeadline;	/**< rearm listen fd; RUSS_DEADLINE_NEVER if armed */
+};
+
+/**
+* Append to list.
+*
+* @param head		list head
+* @param tail		list tail
+* @param iconn		intake connection object
+*/
+static void
+__russ_svr_intake_append(struct russ_svr_intakeconn **head, struct russ_svr_intakeconn **tail,
+	struct russ_svr_intakeconn *iconn) {
+	iconn->next = NULL;
+	iconn->prev = *tail;
+	if (*tail) {
+		(*tail)->next = iconn;
+	} else {
+		*head = iconn;
+	}
+	*tail = iconn;
+}
+
+/**
+* Remove from list.
+*
+* @param head		list head
+* @param tail		list tail
+* @param iconn		intake connection object
+*/
+static void
+__russ_svr_intake_remove(struct russ_svr_intakeconn **head, struct russ_svr_intakeconn **tail,
+	struct russ_svr_intakeconn *iconn) {
+	if (iconn->prev) {
+		iconn->prev->next = iconn->next;
+	} else {
+		*head = iconn->next;
+	}
+	if (iconn->next) {
+		iconn->next->prev = iconn->prev;
+	} else {
+		*tail = iconn->prev;
+	}
+	iconn->next = NULL;
+	iconn->prev = NULL;
+}
+
+/**
+* Free intake connection object. The server connection is closed
+* and freed, too, unless it has been taken.
+*
+* @param self		intake connection object
+* @return		NULL
+*/
+static struct russ_svr_intakeconn *
+russ_svr_intakeconn_free(struct russ_svr_intakeconn *self) {
+	if (self) {
+		if (self->sconn) {
+			russ_sconn_close(self->sconn);
+			self->sconn = russ_sconn_free(self->sconn);
+		}
+		self->buf = russ_free(self->buf);
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+#ifdef __RUSS_LINUX__
+
+/**
+* Drop a pending connection.
+*
+* @param self		intake object
+* @param iconn		intake connection object
+*/
+static void
+russ_svr_intake_drop(struct russ_svr_intake *self, struct russ_svr_intakeconn *iconn) {
+	epoll_ctl(self->epfd, EPOLL_CTL_DEL, iconn->sconn->sd, NULL);
+	__russ_svr_intake_remove(&self->pending, &self->pendingtail, iconn);
+	russ_svr_intakeconn_free(iconn);
+}
+
+/**
+* Arm/disarm the listen fd.
+*
+* While out of descriptors, the listen fd is disarmed (so that
+* epoll does not report it ready over and over) and rearmed after
+* a delay; pending connections continue to be served meanwhile.
+*
+* @param self		intake object
+* @param arm		1 to arm; 0 to disarm
+* @return		0 on success; -1 on failure
+*/
+static int
+russ_svr_intake_arm(struct russ_svr_intake *self, int arm) {
+	struct epoll_event	ev;
+
+	ev.events = arm ? EPOLLIN : 0;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(self->epfd, EPOLL_CTL_MOD, self->svr->lisd, &ev) < 0) {
+		return -1;
+	}
+	self->rearmdeadline = arm ? RUSS_DEADLINE_NEVER : russ_to_deadline(RUSS_SVR_INTAKE_REARMDELAY);
+	return 0;
+}
+
+/**
+* Accept a new connection and add it to the pending set.
+*
+* @param self		intake object
+* @return		0 on success; -1 on failure
+*/
+static int
+russ_svr_intake_accept(struct russ_svr_intake *self) {
+	struct russ_svr_intakeconn	*iconn = NULL;
+	struct russ_sconn		*sconn = NULL;
+	struct epoll_event		ev;
+
+	/* listen socket is ready; accept does not wait */
+	if ((sconn = self->svr->accepthandler(russ_to_deadline(self->svr->accepttimeout), self->svr->lisd)) == NULL) {
+		if ((errno == EMFILE) || (errno == ENFILE)) {
+			/* let pending connections drain/expire */
+			russ_svr_intake_arm(self, 0);
+		}
+		return -1;
+	}
+	if ((iconn = russ_malloc(sizeof(struct russ_svr_intakeconn))) == NULL) {
+		goto close_sconn;
+	}
+	iconn->next = NULL;
+	iconn->prev = NULL;
+	iconn->sconn = sconn;
+	iconn->deadline = russ_to_deadline(self->svr->awaittimeout);
+	iconn->buf = NULL;
+	iconn->size = 0;
+	iconn->nbuf = 0;
+
+	if (((iconn->flags = fcntl(sconn->sd, F_GETFL)) < 0)
+		|| (fcntl(sconn->sd, F_SETFL, iconn->flags|O_NONBLOCK) < 0)) {
+		goto free_iconn;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = iconn;
+	if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, sconn->sd, &ev) < 0) {
+		goto free_iconn;
+	}
+	__russ_svr_intake_append(&self->pending, &self->pendingtail, iconn);
+	return 0;
+
+free_iconn:
+	iconn = russ_svr_intakeconn_free(iconn);
+	return -1;
+close_sconn:
+	russ_sconn_close(sconn);
+	sconn = russ_sconn_free(sconn);
+	return -1;
+}
+
+/**
+* Read available request data for a pending connection. A complete
+* request is decoded and the connection moved to the ready list.
+*
+* @param self		intake object
+* @param iconn		intake connection object
+*/
+static void
+russ_svr_intake_read(struct russ_svr_intake *self, struct russ_svr_intakeconn *iconn) {
+	struct russ_sconn	*sconn = iconn->sconn;
+	struct russ_req		*req = NULL;
+	ssize_t			n;
+
+	while (1) {
+		if (iconn->buf == NULL) {
+			n = read(sconn->sd, iconn->hbuf+iconn->nbuf, 4-iconn->nbuf);
+		} else {
+			n = read(sconn->sd, iconn->buf+iconn->nbuf, 4+iconn->size-iconn->nbuf);
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return;
+			}
+			goto drop;
+		} else if (n == 0) {
+			/* client went away */
+			goto drop;
+		}
+		iconn->nbuf += n;
+
+		if (iconn->buf == NULL) {
+			if (iconn->nbuf < 4) {
+				continue;
+			}
+			if ((russ_dec_int32(iconn->hbuf, &iconn->size) == NULL)
+				|| (iconn->size < 0)
+				|| (iconn->size > RUSS_REQ_BUF_MAX-4)
+				|| ((iconn->buf = russ_malloc(4+iconn->size)) == NULL)) {
+				goto drop;
+			}
+			memcpy(iconn->buf, iconn->hbuf, 4);
+		}
+		if (iconn->nbuf == 4+iconn->size) {
+			break;
+		}
+	}
+
+	/* complete request */
+	epoll_ctl(self->epfd, EPOLL_CTL_DEL, sconn->sd, NULL);
+	__russ_svr_intake_remove(&self->pending, &self->pendingtail, iconn);
+	if ((russ_dec_req(iconn->buf, &req) == NULL)
+		|| (fcntl(sconn->sd, F_SETFL, iconn->flags) < 0)) {
+		req = russ_req_free(req);
+		russ_svr_intakeconn_free(iconn);
+		return;
+	}
+	sconn->req = req;
+	sconn->awaitdeadline = iconn->deadline;
+	russ_sconn_set_protocol(sconn, req);
+	__russ_svr_intake_append(&self->ready, &self->readytail, iconn);
+	return;
+
+drop:
+	russ_svr_intake_drop(self, iconn);
+}
+
+/**
+* Drop pending connections whose deadline has passed.
+*
+* Pending connections are ordered by deadline.
+*
+* @param self		intake object
+* @return		timeout (msec) until the next deadline; -1 if none
+*/
+static int
+russ_svr_intake_expire(struct russ_svr_intake *self) {
+	int	timeout;
+
+	while (self->pending) {
+		if ((timeout = russ_to_timeout(self->pending->deadline)) > 0) {
+			return timeout;
+		}
+		russ_svr_intake_drop(self, self->pending);
+	}
+	return -1;
+}
+
+/**
+* Free intake object. Pending and undispatched connections are
+* closed.
+*
+* @param self		intake object
+* @return		NULL
+*/
+struct russ_svr_intake *
+russ_svr_intake_free(struct russ_svr_intake *self) {
+	struct russ_svr_intakeconn	*iconn = NULL;
+
+	if (self) {
+		while ((iconn = self->pending) != NULL) {
+			__russ_svr_intake_remove(&self->pending, &self->pendingtail, iconn);
+			russ_svr_intakeconn_free(iconn);
+		}
+		while ((iconn = self->ready) != NULL) {
+			__russ_svr_intake_remove(&self->ready, &self->readytail, iconn);
+			russ_svr_intakeconn_free(iconn);
+		}
+		russ_fds_close(&self->epfd, 1);
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+/**
+* Create intake object for server.
+*
+* @param svr		server object
+* @return		intake object; NULL on failure
+*/
+struct russ_svr_intake *
+russ_svr_intake_new(struct russ_svr *svr) {
+	struct russ_svr_intake	*self = NULL;
+	struct epoll_event	ev;
+
+	if ((svr == NULL)
+		|| (svr->lisd < 0)
+		|| ((self = russ_malloc(sizeof(struct russ_svr_intake))) == NULL)) {
+		return NULL;
+	}
+	self->svr = svr;
+	self->pending = NULL;
+	self->pendingtail = NULL;
+	self->ready = NULL;
+	self->readytail = NULL;
+	self->rearmdeadline = RUSS_DEADLINE_NEVER;
+
+	if ((self->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		goto free_intake;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, svr->lisd, &ev) < 0) {
+		goto free_intake;
+	}
+	return self;
+
+free_intake:
+	russ_svr_intake_free(self);
+	return NULL;
+}
+
+/**
+* Get next connection with a complete request.
+*
+* New connections are accepted and requests read as data arrives.
+* Connections which do not provide a request within the server
+* awaittimeout are dropped. The returned server connection has its
+* req member set for russ_svr_handler().
+*
+* @param self		intake object
+* @return		server connection object; NULL on failure
+*/
+struct russ_sconn *
+russ_svr_intake_next(struct russ_svr_intake *self) {
+	struct russ_svr_intakeconn	*iconn = NULL;
+	struct russ_sconn		*sconn = NULL;
+	struct epoll_event		evs[RUSS_SVR_INTAKE_NEVENTS];
+	int				i, nevs, timeout, rearmtimeout;
+
+	while (self->ready == NULL) {
+		if (self->svr->lisd < 0) {
+			return NULL;
+		}
+		timeout = russ_svr_intake_expire(self);
+		if (self->rearmdeadline != RUSS_DEADLINE_NEVER) {
+			if ((rearmtimeout = russ_to_timeout(self->rearmdeadline)) <= 0) {
+				russ_svr_intake_arm(self, 1);
+			} else if ((timeout < 0) || (rearmtimeout < timeout)) {
+				timeout = rearmtimeout;
+			}
+		}
+		if ((nevs = epoll_wait(self->epfd, evs, RUSS_SVR_INTAKE_NEVENTS, timeout)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return NULL;
+		}
+		for (i = 0; i < nevs; i++) {
+			if (evs[i].data.ptr == NULL) {
+				if (russ_svr_intake_accept(self) < 0) {
+					fprintf(stderr, "error: cannot accept connection\n");
+				}
+			} else {
+				russ_svr_intake_read(self, (struct russ_svr_intakeconn *)evs[i].data.ptr);
+			}
+		}
+	}
+
+	iconn = self->ready;
+	__russ_svr_intake_remove(&self->ready, &self->readytail, iconn);
+	sconn = iconn->sconn;
+	iconn->sconn = NULL;
+	russ_svr_intakeconn_free(iconn);
+	return sconn;
+}
+
+#else /* __RUSS_LINUX__ */
+
+/* no intake stage; server loops accept directly */
+
+struct russ_svr_intake *
+russ_svr_intake_free(struct russ_svr_intake *self) {
+	return NULL;
+}
+
+struct russ_svr_intake *
+russ_svr_intake_new(struct russ_svr *svr) {
+	return NULL;
+}
+
+struct russ_sconn *
+russ_svr_intake_next(struct russ_svr_intake *self) {
+	return NULL;
+}
+
+#endif /* __RUSS_LINUX__ */
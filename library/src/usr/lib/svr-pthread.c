@@ -26,6 +26,7 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,37 +39,319 @@
 
 #include "russ/priv.h"
 
-struct helper_data {
+/**
+* Connection queue owned by one pool worker. Implemented as a ring;
+* the owner takes from the head, thieves take from the tail.
+*/
+struct russ_svr_workq {
+	pthread_mutex_t		lock;
+	struct russ_sconn	**sconns;
+	int			head;
+	int			len;
+	int			cap;
+};
+
+/**
+* Worker thread pool for threaded servers.
+*/
+struct russ_svr_pool {
 	struct russ_svr		*svr;
-	struct russ_sconn 	*sconn;
+	struct russ_svr_workq	*queues;
+	int			nworkers;
+	int			next;		/**< next queue for dispatch */
+	pthread_mutex_t		lock;		/**< protects npending */
+	pthread_cond_t		cond;		/**< signalled on dispatch */
+	int			npending;	/**< queued, unclaimed connections */
 };
 
 /**
-* Helper for threaded servers.
+* Per-worker state.
+*/
+struct russ_svr_worker {
+	struct russ_svr_pool	*pool;
+	int			index;
+	struct russ_sconn	*sconn;		/**< connection being served */
+};
+
+static void *russ_svr_pool_worker(void *);
+
+/**
+* Push connection to the tail of a queue.
 *
-* Takes care of calling the russ_svr_handler, failsafe exit, and
-* freeing objects as needed.
+* @param self		queue object
+* @param sconn		server connection object
+* @return		0 on success; -1 if full
+*/
+static int
+russ_svr_workq_push(struct russ_svr_workq *self, struct russ_sconn *sconn) {
+	int	rv = -1;
+
+	pthread_mutex_lock(&self->lock);
+	if (self->len < self->cap) {
+		self->sconns[(self->head+self->len)%self->cap] = sconn;
+		self->len++;
+		rv = 0;
+	}
+	pthread_mutex_unlock(&self->lock);
+	return rv;
+}
+
+/**
+* Take connection from the head (owner) or tail (thief) of a queue.
 *
-* @param data		helper_data object
+* @param self		queue object
+* @param steal		0 to take from head; 1 to take from tail
+* @return		server connection object; NULL if empty
 */
-static void
-russ_svr_handler_helper(void *data) {
-	struct russ_svr		*svr = NULL;
+static struct russ_sconn *
+russ_svr_workq_take(struct russ_svr_workq *self, int steal) {
+	struct russ_sconn	*sconn = NULL;
+
+	pthread_mutex_lock(&self->lock);
+	if (self->len > 0) {
+		if (steal) {
+			sconn = self->sconns[(self->head+self->len-1)%self->cap];
+		} else {
+			sconn = self->sconns[self->head];
+			self->head = (self->head+1)%self->cap;
+		}
+		self->len--;
+	}
+	pthread_mutex_unlock(&self->lock);
+	return sconn;
+}
+
+/**
+* Free pool object. Worker threads must not be running.
+*
+* @param self		pool object
+* @return		NULL
+*/
+static struct russ_svr_pool *
+russ_svr_pool_free(struct russ_svr_pool *self) {
+	int	i;
+
+	if (self) {
+		if (self->queues) {
+			for (i = 0; i < self->nworkers; i++) {
+				self->queues[i].sconns = russ_free(self->queues[i].sconns);
+				pthread_mutex_destroy(&self->queues[i].lock);
+			}
+			self->queues = russ_free(self->queues);
+		}
+		pthread_mutex_destroy(&self->lock);
+		pthread_cond_destroy(&self->cond);
+		self = russ_free(self);
+	}
+	return NULL;
+}
+
+/**
+* Create pool object according to server settings.
+*
+* @param svr		server object
+* @return		pool object; NULL on failure
+*/
+static struct russ_svr_pool *
+russ_svr_pool_new(struct russ_svr *svr) {
+	struct russ_svr_pool	*self = NULL;
+	int			i;
+
+	if ((self = russ_malloc(sizeof(struct russ_svr_pool))) == NULL) {
+		return NULL;
+	}
+	self->svr = svr;
+	self->nworkers = 0;
+	self->next = 0;
+	self->npending = 0;
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+
+	if ((self->queues = russ_malloc(sizeof(struct russ_svr_workq)*svr->threadpoolsize)) == NULL) {
+		goto free_pool;
+	}
+	for (i = 0; i < svr->threadpoolsize; i++) {
+		if ((self->queues[i].sconns = russ_malloc(sizeof(struct russ_sconn *)*svr->threadqueuemax)) == NULL) {
+			goto free_pool;
+		}
+		pthread_mutex_init(&self->queues[i].lock, NULL);
+		self->queues[i].head = 0;
+		self->queues[i].len = 0;
+		self->queues[i].cap = svr->threadqueuemax;
+		self->nworkers++;
+	}
+	return self;
+
+free_pool:
+	russ_svr_pool_free(self);
+	return NULL;
+}
+
+/**
+* Queue connection to a worker (round robin, skipping full queues).
+*
+* @param self		pool object
+* @param sconn		server connection object
+* @return		0 on success; -1 if all queues are full
+*/
+static int
+russ_svr_pool_dispatch(struct russ_svr_pool *self, struct russ_sconn *sconn) {
+	int	i, qi;
+
+	for (i = 0; i < self->nworkers; i++) {
+		qi = (self->next+i)%self->nworkers;
+		if (russ_svr_workq_push(&self->queues[qi], sconn) == 0) {
+			self->next = (qi+1)%self->nworkers;
+
+			pthread_mutex_lock(&self->lock);
+			self->npending++;
+			pthread_cond_signal(&self->cond);
+			pthread_mutex_unlock(&self->lock);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+* Get next connection for a worker: from its own queue first, then
+* stolen from the others. Blocks while nothing is pending.
+*
+* A pending connection is claimed (npending, under the pool lock)
+* before it is taken. Connections are queued before they are
+* counted, so a claim is always backed by a queued connection.
+*
+* @param self		pool object
+* @param index		worker index
+* @return		server connection object
+*/
+static struct russ_sconn *
+russ_svr_pool_next(struct russ_svr_pool *self, int index) {
 	struct russ_sconn	*sconn = NULL;
+	int			i;
+
+	pthread_mutex_lock(&self->lock);
+	while (self->npending == 0) {
+		pthread_cond_wait(&self->cond, &self->lock);
+	}
+	self->npending--;
+	pthread_mutex_unlock(&self->lock);
+
+	while (1) {
+		if ((sconn = russ_svr_workq_take(&self->queues[index], 0)) != NULL) {
+			return sconn;
+		}
+		for (i = 1; i < self->nworkers; i++) {
+			if ((sconn = russ_svr_workq_take(&self->queues[(index+i)%self->nworkers], 1)) != NULL) {
+				return sconn;
+			}
+		}
+		/* claimed connection moved under the scan; rescan */
+		sched_yield();
+	}
+}
 
-	svr = ((struct helper_data *)data)->svr;
-	sconn = ((struct helper_data *)data)->sconn;
+/**
+* Start a (detached) worker thread.
+*
+* @param self		pool object
+* @param index		worker index
+* @return		0 on success; -1 on failure
+*/
+static int
+russ_svr_pool_start_worker(struct russ_svr_pool *self, int index) {
+	struct russ_svr_worker	*worker = NULL;
+	pthread_attr_t		attr;
+	pthread_t		th;
+	int			rv;
 
-	russ_svr_handler(svr, sconn);
+	if ((worker = russ_malloc(sizeof(struct russ_svr_worker))) == NULL) {
+		return -1;
+	}
+	worker->pool = self;
+	worker->index = index;
+	worker->sconn = NULL;
 
-	/* failsafe exit info (if not provided) */
-	russ_sconn_fatal(sconn, RUSS_MSG_NOEXIT, RUSS_EXIT_SYSFAILURE);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rv = pthread_create(&th, &attr, russ_svr_pool_worker, (void *)worker);
+	pthread_attr_destroy(&attr);
+	if (rv != 0) {
+		worker = russ_free(worker);
+		return -1;
+	}
+	return 0;
+}
 
-	/* free objects */
-	sconn = russ_sconn_free(sconn);
-	data = russ_free(data);
+/**
+* Finish the current connection of a worker: failsafe exit and free.
+*
+* Also used as the cleanup handler when a service handler calls
+* pthread_exit(); in that case a replacement worker is started so
+* the pool size is maintained.
+*
+* @param data		worker object
+*/
+static void
+russ_svr_worker_cleanup(void *data) {
+	struct russ_svr_worker	*worker = NULL;
+
+	worker = (struct russ_svr_worker *)data;
+	if (worker->sconn) {
+		/* failsafe exit info (if not provided) */
+		russ_sconn_fatal(worker->sconn, RUSS_MSG_NOEXIT, RUSS_EXIT_SYSFAILURE);
+		russ_sconn_close(worker->sconn);
+		worker->sconn = russ_sconn_free(worker->sconn);
 
-	pthread_exit(NULL);
+		if (russ_svr_pool_start_worker(worker->pool, worker->index) < 0) {
+			fprintf(stderr, "error: cannot spawn thread\n");
+		}
+	}
+	worker = russ_free(worker);
+}
+
+/**
+* Pool worker thread.
+*
+* Serves connections from the pool until the process exits.
+*
+* @param data		worker object
+* @return		NULL
+*/
+static void *
+russ_svr_pool_worker(void *data) {
+	struct russ_svr_worker	*worker = NULL;
+	struct russ_svr		*svr = NULL;
+
+	worker = (struct russ_svr_worker *)data;
+	svr = worker->pool->svr;
+
+	pthread_cleanup_push(russ_svr_worker_cleanup, data);
+	while (1) {
+		worker->sconn = russ_svr_pool_next(worker->pool, worker->index);
+		russ_svr_handler(svr, worker->sconn);
+
+		/* failsafe exit info (if not provided) */
+		russ_sconn_fatal(worker->sconn, RUSS_MSG_NOEXIT, RUSS_EXIT_SYSFAILURE);
+		worker->sconn = russ_sconn_free(worker->sconn);
+	}
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/**
+* Refuse connection: answer with standard fds, report busy, and
+* close.
+*
+* @param sconn		server connection object
+*/
+static void
+russ_svr_refuse(struct russ_sconn *sconn) {
+	if (russ_sconn_answerhandler(sconn) == 0) {
+		russ_sconn_fatal(sconn, RUSS_MSG_BUSY, RUSS_EXIT_SYSFAILURE);
+	}
+	russ_sconn_close(sconn);
+	russ_sconn_free(sconn);
 }
 
 /**
@@ -82,22 +365,64 @@ russ_svr_loop_fork(struct russ_svr *self) {
 	exit(1);
 }
 
+/**
+* Dummy function for non-forking russ library
+*
+* @param self		server object
+*/
+void
+russ_svr_loop_prefork(struct russ_svr *self) {
+	fprintf(stderr, "error: use forking libruss\n");
+	exit(1);
+}
+
 /**
 * Server loop for threaded servers.
 *
-* Calls helper to simplify argument passing, object creation (data
-* and sconn here) and freeing (in helper) and closing (in helper).
+* Accepted connections are queued to a fixed pool of worker threads
+* (see threadpoolsize); each worker has its own queue (see
+* threadqueuemax) and idle workers steal from the others. When all
+* queues are full, new connections are refused. Unless disabled (see
+* russ_svr_set_intake()), only connections with a complete request
+* are queued.
+*
+* With closeonaccept set, the single connection is served directly.
 *
 * @param self		server object
 */
 void
 russ_svr_loop_thread(struct russ_svr *self) {
+	struct russ_svr_intake	*intake = NULL;
+	struct russ_svr_pool	*pool = NULL;
 	struct russ_sconn	*sconn = NULL;
-	struct helper_data	*data = NULL;
-	pthread_t		th;
+	int			i;
+
+	if (self == NULL) {
+		return;
+	}
+
+	if (self->closeonaccept == 0) {
+		if (self->intake) {
+			intake = russ_svr_intake_new(self);
+		}
+		if ((pool = russ_svr_pool_new(self)) == NULL) {
+			fprintf(stderr, "error: cannot allocate thread pool\n");
+			return;
+		}
+		for (i = 0; i < pool->nworkers; i++) {
+			if (russ_svr_pool_start_worker(pool, i) < 0) {
+				fprintf(stderr, "error: cannot spawn thread\n");
+				exit(1);
+			}
+		}
+	}
 
 	while (self->lisd >= 0) {
-		sconn = self->accepthandler(russ_to_deadline(self->accepttimeout), self->lisd);
+		if (intake) {
+			sconn = russ_svr_intake_next(intake);
+		} else {
+			sconn = self->accepthandler(russ_to_deadline(self->accepttimeout), self->lisd);
+		}
 		if (self->closeonaccept) {
 			russ_fds_close(&self->lisd, 1);
 		}
@@ -105,23 +430,18 @@ russ_svr_loop_thread(struct russ_svr *self) {
 			fprintf(stderr, "error: cannot accept connection\n");
 			sleep(1);
 			continue;
-		} else if ((data = russ_malloc(sizeof(struct helper_data))) == NULL) {
-			/* successfull accept but no memory */
-			russ_sconn_fatal(sconn, RUSS_MSG_NOEXIT, RUSS_EXIT_SYSFAILURE);
-			russ_sconn_free(sconn);
-			fprintf(stderr, "error: cannot allocate helper_data\n");
-			sleep(1);
-			continue;
 		}
 
-		data->svr = self;
-		data->sconn = sconn;
 		if (self->closeonaccept == 1) {
-			russ_svr_handler_helper((void *)data);
-		} else {
-			if (pthread_create(&th, NULL, (void *)russ_svr_handler_helper, (void *)data) < 0) {
-				fprintf(stderr, "error: cannot spawn thread\n");
-			}
+			russ_svr_handler(self, sconn);
+
+			/* failsafe exit info (if not provided) */
+			russ_sconn_fatal(sconn, RUSS_MSG_NOEXIT, RUSS_EXIT_SYSFAILURE);
+			sconn = russ_sconn_free(sconn);
+		} else if (russ_svr_pool_dispatch(pool, sconn) < 0) {
+			russ_svr_refuse(sconn);
 		}
 	}
+	intake = russ_svr_intake_free(intake);
+	/* workers are left to finish queued connections */
 }
@@ -52,6 +52,7 @@
 struct russ_svr *
 russ_svr_new(struct russ_svcnode *root, int type, int lisd) {
 	struct russ_svr	*self = NULL;
+	int		i;
 
 	if ((self = russ_malloc(sizeof(struct russ_svr))) == NULL) {
 		return NULL;
@@ -71,6 +72,19 @@ russ_svr_new(struct russ_svcnode *root, int type, int lisd) {
 	self->autoswitchuser = 1;
 	self->matchclientuser = 0;
 	self->help = NULL;
+	self->preforknworkers = RUSS_SVR_PREFORK_NWORKERS;
+	self->preforkmaxsessions = RUSS_SVR_PREFORK_MAXSESSIONS;
+	self->preforkrespawn = RUSS_SVR_PREFORK_RESPAWN_ALWAYS;
+	self->threadpoolsize = RUSS_SVR_THREAD_POOLSIZE;
+	self->threadqueuemax = RUSS_SVR_THREAD_QUEUEMAX;
+	self->intake = 0;
+	self->svcindex = NULL;
+	self->sessiontimeout = RUSS_SVR_TIMEOUT_SESSION;
+	for (i = 0; i < RUSS_CONN_STD_NFDS; i++) {
+		self->relaydefaults[i].rate = 0;
+		self->relaydefaults[i].burst = 0;
+		self->relaydefaults[i].weight = 0;
+	}
 
 	return self;
 }
@@ -86,6 +100,7 @@ russ_svr_free(struct russ_svr *self) {
 	if (self) {
 		/* own copy */
 		/* TODO: only the root node is freed */
+		self->svcindex = russ_svcindex_free(self->svcindex);
 		self->root = russ_svcnode_free(self->root);
 		self->saddr = russ_free(self->saddr);
 		self->help = russ_free(self->help);
@@ -226,6 +241,26 @@ russ_svr_set_help(struct russ_svr *self, const char *help) {
 	return 0;
 }
 
+/**
+* Set to read requests in an event-driven intake stage before
+* dispatching connections (forking and threaded servers, Linux only).
+*
+* With intake enabled, stalled or slow clients cost only a
+* descriptor until their request is complete. Disabled by default.
+*
+* @param self		russ server object
+* @param value		0 to disable; 1 to enable
+* @return		0 on success; -1 on failure
+*/
+int
+russ_svr_set_intake(struct russ_svr *self, int value) {
+	if (self == NULL) {
+		return -1;
+	}
+	self->intake = value;
+	return 0;
+}
+
 /**
 * Set flag for check that getuid() matches client.
 *
@@ -245,6 +280,58 @@ russ_svr_set_matchclientuser(struct russ_svr *self, int value) {
 	return 0;
 }
 
+/**
+* Set the maximum number of sessions served by a prefork worker
+* before it is recycled.
+*
+* @param self		russ server object
+* @param value		maximum sessions; <= 0 for no limit
+* @return		0 on success; -1 on failure
+*/
+int
+russ_svr_set_preforkmaxsessions(struct russ_svr *self, int value) {
+	if (self == NULL) {
+		return -1;
+	}
+	self->preforkmaxsessions = value;
+	return 0;
+}
+
+/**
+* Set the number of prefork workers.
+*
+* @param self		russ server object
+* @param value		number of workers; 0 for one per online cpu
+* @return		0 on success; -1 on failure
+*/
+int
+russ_svr_set_preforknworkers(struct russ_svr *self, int value) {
+	if ((self == NULL) || (value < 0)) {
+		return -1;
+	}
+	self->preforknworkers = value;
+	return 0;
+}
+
+/**
+* Set the respawn policy for exited prefork workers.
+*
+* @param self		russ server object
+* @param value		RUSS_SVR_PREFORK_RESPAWN_ALWAYS or
+*			RUSS_SVR_PREFORK_RESPAWN_NEVER
+* @return		0 on success; -1 on failure
+*/
+int
+russ_svr_set_preforkrespawn(struct russ_svr *self, int value) {
+	if ((self == NULL)
+		|| ((value != RUSS_SVR_PREFORK_RESPAWN_ALWAYS)
+			&& (value != RUSS_SVR_PREFORK_RESPAWN_NEVER))) {
+		return -1;
+	}
+	self->preforkrespawn = value;
+	return 0;
+}
+
 /**
 * Set the service tree root node.
 *
@@ -254,6 +341,7 @@ russ_svr_set_matchclientuser(struct russ_svr *self, int value) {
 */
 int
 russ_svr_set_root(struct russ_svr *self, struct russ_svcnode *root) {
+	self->svcindex = russ_svcindex_free(self->svcindex);
 	self->root = root;
 	return 0;
 }
@@ -271,6 +359,79 @@ russ_svr_set_lisd(struct russ_svr *self, int lisd) {
 	return 0;
 }
 
+/**
+* Set the number of worker threads for threaded servers.
+*
+* @param self		server object
+* @param value		number of worker threads (> 0)
+* @return		0 on success; -1 on failure
+*/
+int
+russ_svr_set_threadpoolsize(struct russ_svr *self, int value) {
+	if ((self == NULL) || (value < 1)) {
+		return -1;
+	}
+	self->threadpoolsize = value;
+	return 0;
+}
+
+/**
+* Set the per-worker queue limit for threaded servers. Connections
+* arriving while all queues are full are refused.
+*
+* @param self		server object
+* @param value		maximum queued connections per worker (> 0)
+* @return		0 on success; -1 on failure
+*/
+int
+russ_svr_set_threadqueuemax(struct russ_svr *self, int value) {
+	if ((self == NULL) || (value < 1)) {
+		return -1;
+	}
+	self->threadqueuemax = value;
+	return 0;
+}
+
+/**
+* Set the idle timeout for client sessions (keep-alive connections).
+*
+* @param self		server object
+* @param value		timeout (msec); 0 to disable sessions (default)
+* @return		0 on success; -1 on failure
+*/
+int
+russ_svr_set_sessiontimeout(struct russ_svr *self, int value) {
+	if ((self == NULL) || (value < 0)) {
+		return -1;
+	}
+	self->sessiontimeout = value;
+	return 0;
+}
+
+/**
+* Set the relay stream settings for a stream index (e.g., 0, 1, 2
+* for the stdin, stdout, stderr relays of a service); see
+* russ_svr_apply_relaydefaults(). Usually loaded from the [relay]
+* section of the server conf (see russ_init()).
+*
+* @param self		server object
+* @param idx		stream index (< RUSS_CONN_STD_NFDS)
+* @param rate		max bytes/sec; <= 0 for no limit
+* @param burst		token bucket size (bytes); <= 0 for default
+* @param weight		scheduling weight; <= 0 for unweighted
+* @return		0 on success; -1 on failure
+*/
+int
+russ_svr_set_relaydefaults(struct russ_svr *self, int idx, int rate, int burst, int weight) {
+	if ((self == NULL) || (idx < 0) || (idx >= RUSS_CONN_STD_NFDS)) {
+		return -1;
+	}
+	self->relaydefaults[idx].rate = (rate > 0) ? rate : 0;
+	self->relaydefaults[idx].burst = (burst > 0) ? burst : 0;
+	self->relaydefaults[idx].weight = (weight > 0) ? weight : 0;
+	return 0;
+}
+
 /**
 * Set server type.
 *
@@ -285,48 +446,52 @@ russ_svr_set_type(struct russ_svr *self, int type) {
 }
 
 /**
-* Find service handler and it invoke it.
-*
-* Special cases:
-* opnum == RUSS_OPNUM_HELP - fallback to spath == "/" if available
-* opnum == RUSS_OPNUM_LIST - list node->children if found
-*
-* Service handlers are expected to call russ_sconn_exit() before
-* returning. As a failsafe procedure, exit codes are sent back
-* if the exit fd is open, all connection fds are closed.
+* Handle one request on a server connection (see
+* russ_svr_handler()).
 *
 * @param self		server object
 * @param sconn		server connection object
+* @param deadline	deadline to receive request
 */
-void
-russ_svr_handler(struct russ_svr *self, struct russ_sconn *sconn) {
+static void
+__russ_svr_handle_req(struct russ_svr *self, struct russ_sconn *sconn, russ_deadline deadline) {
 	struct russ_sess	*sess = NULL;
 	struct russ_req		*req = NULL;
 	struct russ_svcnode	*node = NULL;
 	char			mpath[RUSS_REQ_SPATH_MAX] = "";
 
-	if (self == NULL) {
-		return;
-	}
-
-	if ((req = russ_sconn_await_req(sconn, russ_to_deadline(self->awaittimeout))) == NULL) {
+	if (sconn->req != NULL) {
+		/* already read by intake stage */
+		req = sconn->req;
+		sconn->req = NULL;
+	} else if ((req = russ_sconn_await_req(sconn, deadline)) == NULL) {
 		/* failure */
 		goto cleanup;
 	}
+	if (self->sessiontimeout <= 0) {
+		/* sessions not supported; close control socket on answer */
+		sconn->keepalive = 0;
+	}
 
 	/* validate opnum */
 	if (req->opnum == RUSS_OPNUM_NOTSET) {
 		/* invalid opnum */
-		russ_sconn_fatal(sconn, RUSS_MSG_BADOP, RUSS_EXIT_SYSFAILURE);
+		russ_sconn_refuse(sconn);
 		goto cleanup;
 	}
 	/* validate spath: must be absolute or empty */
 	if ((req->spath[0] != '/') && (req->spath[0] != '\0')) {
 		/* invalid spath */
+		russ_sconn_refuse(sconn);
 		goto cleanup;
 	}
 
-	if ((node = russ_svcnode_find(self->root, req->spath, mpath, sizeof(mpath))) == NULL) {
+	if (self->svcindex != NULL) {
+		node = russ_svcindex_find(self->svcindex, req->spath, mpath, sizeof(mpath));
+	} else {
+		node = russ_svcnode_find(self->root, req->spath, mpath, sizeof(mpath));
+	}
+	if (node == NULL) {
 		/* we need standard fds */
 		russ_sconn_answerhandler(sconn);
 		russ_sconn_fatal(sconn, RUSS_MSG_NOSERVICE, RUSS_EXIT_FAILURE);
@@ -338,7 +503,10 @@ russ_svr_handler(struct russ_svr *self, struct russ_sconn *sconn) {
 		goto cleanup;
 	}
 
-	/* auto switch user if requested */
+	/*
+	* auto switch user if requested; cwd and environment are reset
+	* for every request of a session (switching is then a noop)
+	*/
 	if (self->autoswitchuser) {
 		if ((chdir("/") < 0)
 			|| (russ_env_clear() < 0)
@@ -435,6 +603,54 @@ cleanup:
 		req = russ_req_free(req);
 	}
 	russ_sconn_fatal(sconn, RUSS_MSG_NOSERVICE, RUSS_EXIT_FAILURE);
+
+	/* close all but a control socket kept for the session */
+	russ_fds_close(sconn->sysfds, RUSS_CONN_NSYSFDS);
+	russ_fds_close(sconn->fds, RUSS_CONN_NFDS);
+	russ_fds_close(&sconn->sd, 1);
+}
+
+/**
+* Find service handler and it invoke it.
+*
+* Special cases:
+* opnum == RUSS_OPNUM_HELP - fallback to spath == "/" if available
+* opnum == RUSS_OPNUM_LIST - list node->children if found
+*
+* If the client requested a session (keep-alive) and the request was
+* answered, the control socket is kept and further requests on it
+* are served here, in turn, until the client closes it or it is
+* idle for sessiontimeout. Sessions end early if a service handler
+* does not return (e.g., calls exit()).
+*
+* Service handlers are expected to call russ_sconn_exit() before
+* returning. As a failsafe procedure, exit codes are sent back
+* if the exit fd is open, all connection fds are closed.
+*
+* @param self		server object
+* @param sconn		server connection object
+*/
+void
+russ_svr_handler(struct russ_svr *self, struct russ_sconn *sconn) {
+	russ_deadline	deadline;
+
+	if (self == NULL) {
+		return;
+	}
+
+	deadline = russ_to_deadline(self->awaittimeout);
+	while (1) {
+		__russ_svr_handle_req(self, sconn, deadline);
+		if ((sconn->keepsd < 0) || (self->sessiontimeout <= 0)) {
+			break;
+		}
+
+		/* next request on the kept control socket */
+		sconn->sd = sconn->keepsd;
+		sconn->keepsd = -1;
+		sconn->keepalive = 0;
+		deadline = russ_to_deadline(self->sessiontimeout);
+	}
 	russ_sconn_close(sconn);
 }
 
@@ -449,9 +665,45 @@ russ_svr_loop(struct russ_svr *self) {
 		return;
 	}
 
+	/* service tree is complete; freeze for lookups */
+	if ((self->svcindex == NULL)
+		&& ((self->svcindex = russ_svcnode_freeze(self->root)) == NULL)) {
+		fprintf(stderr, "warning: cannot freeze service tree\n");
+	}
+
 	if (self->type == RUSS_SVR_TYPE_FORK) {
 		russ_svr_loop_fork(self);
 	} else if (self->type == RUSS_SVR_TYPE_THREAD) {
 		russ_svr_loop_thread(self);
+	} else if (self->type == RUSS_SVR_TYPE_PREFORK) {
+		russ_svr_loop_prefork(self);
+	}
+}
+
+/**
+* Apply the server's relay stream settings (see
+* russ_svr_set_relaydefaults()) to a relay; they take effect for
+* streams added afterward.
+*
+* @param self		server object
+* @param relay		relay object
+* @return		0 on success; -1 on failure (e.g., rate limits
+*			without the epoll engine)
+*/
+int
+russ_svr_apply_relaydefaults(struct russ_svr *self, struct russ_relay *relay) {
+	struct russ_relaydefaults	*defaults = NULL;
+	int				i, rv;
+
+	if ((self == NULL) || (relay == NULL)) {
+		return -1;
+	}
+	rv = 0;
+	for (i = 0; i < RUSS_CONN_STD_NFDS; i++) {
+		defaults = &self->relaydefaults[i];
+		if (russ_relay_set_defaults(relay, i, defaults->rate, defaults->burst, defaults->weight) < 0) {
+			rv = -1;
+		}
 	}
+	return rv;
 }
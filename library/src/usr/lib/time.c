@@ -55,6 +55,28 @@ russ_gettime(void) {
 #endif /* _POSIX_TIMERS */
 }
 
+/**
+* Get current (monotonic) time in microseconds. Meant for internal
+* use where russ_gettime() is too coarse.
+*
+* @return		time (usec)
+*/
+int64_t
+russ_gettime_us(void) {
+#if (_POSIX_TIMERS > 0)
+	struct timespec	tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (int64_t)tp.tv_sec*1000000 + (tp.tv_nsec/1000);
+#else
+	/* fallback */
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec*1000000 + tv.tv_usec;
+#endif /* _POSIX_TIMERS */
+}
+
 /**
 * Compute deadline from timeout relative to the current time.
 *
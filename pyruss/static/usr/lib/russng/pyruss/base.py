@@ -231,6 +231,64 @@ class Relay:
         c_closeonexits = (ctypes.c_int * nfds)(*[x[3] and 1 or 0 for x in self.relayinfo])
         return libruss.russ_relay_loop(to_timeout(deadline), nfds, c_infds, c_outfds, c_bufsizes, c_closeonexits, exitfd)
 
+class Reactor:
+    """Wrapper for russ_reactor object to serve Relays of many
+    sessions from one or a few threads.
+    """
+
+    def __init__(self, _ptr):
+        self._ptr = _ptr
+        self.pending = {}
+        self._cb = REACTOR_CALLBACK_FUNC(self._callback)
+
+    @classmethod
+    def new(cls):
+        _ptr = libruss.russ_reactor_new()
+        if not bool(_ptr):
+            raise Exception("could not create Reactor")
+        return cls(_ptr)
+
+    def _callback(self, relay_ptr, rv, cbarg):
+        callback = self.pending.pop(relay_ptr, None)
+        libruss.russ_relay_free(relay_ptr)
+        if callback:
+            callback(rv)
+
+    def add(self, relay, exitfd, callback=None):
+        """Serve Relay until completed, then call callback with the
+        return value (see Relay.loop()).
+        """
+        relay_ptr = libruss.russ_relay_new(len(relay.relayinfo))
+        if not bool(relay_ptr):
+            return -1
+        for infd, outfd, bufsize, closeonexit in relay.relayinfo:
+            if libruss.russ_relay_add(relay_ptr, infd, outfd, bufsize, closeonexit and 1 or 0) < 0:
+                libruss.russ_relay_free(relay_ptr)
+                return -1
+        self.pending[relay_ptr] = callback
+        if libruss.russ_reactor_add(self._ptr, relay_ptr, exitfd, self._cb, None) < 0:
+            del self.pending[relay_ptr]
+            libruss.russ_relay_free(relay_ptr)
+            return -1
+        return 0
+
+    def count(self):
+        """Return number of Relays being served.
+        """
+        return libruss.russ_reactor_count(self._ptr)
+
+    def free(self):
+        """Free underlying object.
+        """
+        libruss.russ_reactor_free(self._ptr)
+        self._ptr = None
+
+    def serve(self, timeout):
+        """Serve Relays until idle for timeout (ms; -1 for no limit).
+        May be called from several threads.
+        """
+        return libruss.russ_reactor_serve(self._ptr, timeout)
+
 class Request:
     """Wrapper for russ_req object.
     """
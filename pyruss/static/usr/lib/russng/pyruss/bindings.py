@@ -75,6 +75,7 @@ RUSS_MSG_NOSERVICE = "error: no service"
 RUSS_MSG_NOSWITCHUSER = "error: cannot switch user"
 RUSS_MSG_UNDEFSERVICE = "warning: undefined service"
 RUSS_MSG_BADUSER = "error: bad user"
+RUSS_MSG_BUSY = "error: server busy"
 
 RUSS_OPNUM_NOTSET = 0
 RUSS_OPNUM_EXTENSION = 1
@@ -87,13 +88,25 @@ RUSS_OPNUM_LIST = 6
 RUSS_REQ_ARGS_MAX = 1024
 RUSS_REQ_ATTRS_MAX = 1024
 RUSS_REQ_SPATH_MAX = 8192
-RUSS_REQ_PROTOCOLSTRING = "0010"
+RUSS_REQ_PROTOCOLSTRING = "0011"
+RUSS_REQ_PROTOCOLSTRING_0010 = "0010"
+RUSS_REQ_PROTOCOLSTRING_SESSION = "0012"
 
 RUSS_SVR_LIS_SD_DEFAULT = 3
 RUSS_SVR_TIMEOUT_ACCEPT = (1<<31)-1 # INT32_MAX
 RUSS_SVR_TIMEOUT_AWAIT = 15000
+RUSS_SVR_TIMEOUT_SESSION = 0
 RUSS_SVR_TYPE_FORK = 1
 RUSS_SVR_TYPE_THREAD = 2
+RUSS_SVR_TYPE_PREFORK = 3
+
+RUSS_SVR_PREFORK_NWORKERS = 4
+RUSS_SVR_PREFORK_MAXSESSIONS = 1000
+RUSS_SVR_PREFORK_RESPAWN_NEVER = 0
+RUSS_SVR_PREFORK_RESPAWN_ALWAYS = 1
+
+RUSS_SVR_THREAD_POOLSIZE = 16
+RUSS_SVR_THREAD_QUEUEMAX = 64
 
 RUSS_WAIT_UNSET = 1
 RUSS_WAIT_OK = 0
@@ -172,6 +185,12 @@ class russ_sconn_Structure(ctypes.Structure):
         ("sd", ctypes.c_int),
         ("fds", ctypes.c_int*RUSS_CONN_NFDS),
         ("sysfds", ctypes.c_int*RUSS_CONN_NSYSFDS),
+        ("req", ctypes.POINTER(russ_req_Structure)),
+        ("fdbatch", ctypes.c_int),
+        ("keepalive", ctypes.c_int),
+        ("keepsd", ctypes.c_int),
+        ("nhandoff", ctypes.c_int),
+        ("awaitdeadline", russ_deadline),
     ]
 
 class russ_sess_Structure(ctypes.Structure):
@@ -207,6 +226,15 @@ class russ_svr_Structure(ctypes.Structure):
         ("autoswitchuser", ctypes.c_int),
         ("matchclientuser", ctypes.c_int),
         ("help", ctypes.c_char_p),
+        ("preforknworkers", ctypes.c_int),
+        ("preforkmaxsessions", ctypes.c_int),
+        ("preforkrespawn", ctypes.c_int),
+        ("threadpoolsize", ctypes.c_int),
+        ("threadqueuemax", ctypes.c_int),
+        ("intake", ctypes.c_int),
+        ("svcindex", ctypes.c_void_p),
+        ("sessiontimeout", ctypes.c_int),
+        ("relaydefaults", (ctypes.c_int*3)*RUSS_CONN_STD_NFDS),
     ]
 
 russ_sess_Structure._fields_ = [
@@ -330,9 +358,61 @@ libruss.russ_optable_find_opnum.argtypes = [
 ]
 libruss.russ_optable_find_opnum.restype = russ_opnum
 
+#
+# from reactor.c
+#
+REACTOR_CALLBACK_FUNC = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p)
+
+libruss.russ_reactor_new.argtypes = []
+libruss.russ_reactor_new.restype = ctypes.c_void_p
+
+libruss.russ_reactor_free.argtypes = [
+    ctypes.c_void_p,
+]
+libruss.russ_reactor_free.restype = ctypes.c_void_p
+
+libruss.russ_reactor_add.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_void_p,
+    ctypes.c_int,
+    REACTOR_CALLBACK_FUNC,
+    ctypes.c_void_p,
+]
+libruss.russ_reactor_add.restype = ctypes.c_int
+
+libruss.russ_reactor_count.argtypes = [
+    ctypes.c_void_p,
+]
+libruss.russ_reactor_count.restype = ctypes.c_int
+
+libruss.russ_reactor_serve.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int,
+]
+libruss.russ_reactor_serve.restype = ctypes.c_int
+
 #
 # from relay.c
 #
+libruss.russ_relay_new.argtypes = [
+    ctypes.c_int,
+]
+libruss.russ_relay_new.restype = ctypes.c_void_p
+
+libruss.russ_relay_free.argtypes = [
+    ctypes.c_void_p,
+]
+libruss.russ_relay_free.restype = ctypes.c_void_p
+
+libruss.russ_relay_add.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+]
+libruss.russ_relay_add.restype = ctypes.c_int
+
 libruss.russ_relay_loop.argtypes = [
     ctypes.c_int,
     ctypes.c_int,
@@ -532,18 +612,60 @@ libruss.russ_svr_set_lisd.argtypes = [
 ]
 libruss.russ_svr_set_lisd.restype = ctypes.c_int
 
+libruss.russ_svr_set_intake.argtypes = [
+    ctypes.POINTER(russ_svr_Structure),
+    ctypes.c_int,
+]
+libruss.russ_svr_set_intake.restype = ctypes.c_int
+
 libruss.russ_svr_set_matchclientuser.argtypes = [
     ctypes.POINTER(russ_svr_Structure),
     ctypes.c_int,
 ]
 libruss.russ_svr_set_matchclientuser.restype = ctypes.c_int
 
+libruss.russ_svr_set_preforkmaxsessions.argtypes = [
+    ctypes.POINTER(russ_svr_Structure),
+    ctypes.c_int,
+]
+libruss.russ_svr_set_preforkmaxsessions.restype = ctypes.c_int
+
+libruss.russ_svr_set_preforknworkers.argtypes = [
+    ctypes.POINTER(russ_svr_Structure),
+    ctypes.c_int,
+]
+libruss.russ_svr_set_preforknworkers.restype = ctypes.c_int
+
+libruss.russ_svr_set_preforkrespawn.argtypes = [
+    ctypes.POINTER(russ_svr_Structure),
+    ctypes.c_int,
+]
+libruss.russ_svr_set_preforkrespawn.restype = ctypes.c_int
+
 libruss.russ_svr_set_root.argtypes = [
     ctypes.POINTER(russ_svr_Structure),
     ctypes.POINTER(russ_svcnode_Structure),
 ]
 libruss.russ_svr_set_root.restype = ctypes.c_int
 
+libruss.russ_svr_set_sessiontimeout.argtypes = [
+    ctypes.POINTER(russ_svr_Structure),
+    ctypes.c_int,
+]
+libruss.russ_svr_set_sessiontimeout.restype = ctypes.c_int
+
+libruss.russ_svr_set_threadpoolsize.argtypes = [
+    ctypes.POINTER(russ_svr_Structure),
+    ctypes.c_int,
+]
+libruss.russ_svr_set_threadpoolsize.restype = ctypes.c_int
+
+libruss.russ_svr_set_threadqueuemax.argtypes = [
+    ctypes.POINTER(russ_svr_Structure),
+    ctypes.c_int,
+]
+libruss.russ_svr_set_threadqueuemax.restype = ctypes.c_int
+
 libruss.russ_svr_set_type.argtypes = [
     ctypes.POINTER(russ_svr_Structure),
     ctypes.c_int,
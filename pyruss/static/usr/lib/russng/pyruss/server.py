@@ -219,6 +219,11 @@ class Server:
         """
         return libruss.russ_svr_set_help(self._ptr, strtobytes(value))
 
+    def set_intake(self, value):
+        """Set intake flag.
+        """
+        return libruss.russ_svr_set_intake(self._ptr, value)
+
     def set_lisd(self, lisd):
         """Set socket descriptor.
         """
@@ -229,11 +234,41 @@ class Server:
         """
         return libruss.russ_svr_set_matchclientuser(self._ptr, value)
 
+    def set_preforkmaxsessions(self, value):
+        """Set maximum sessions per prefork worker.
+        """
+        return libruss.russ_svr_set_preforkmaxsessions(self._ptr, value)
+
+    def set_preforknworkers(self, value):
+        """Set number of prefork workers.
+        """
+        return libruss.russ_svr_set_preforknworkers(self._ptr, value)
+
+    def set_preforkrespawn(self, value):
+        """Set prefork worker respawn policy.
+        """
+        return libruss.russ_svr_set_preforkrespawn(self._ptr, value)
+
     def set_root(self, root):
         """Set root ServiceNode.
         """
         return libruss.russ_svr_set_root(self._ptr, root._ptr)
 
+    def set_sessiontimeout(self, value):
+        """Set session idle timeout.
+        """
+        return libruss.russ_svr_set_sessiontimeout(self._ptr, value)
+
+    def set_threadpoolsize(self, value):
+        """Set number of pool threads.
+        """
+        return libruss.russ_svr_set_threadpoolsize(self._ptr, value)
+
+    def set_threadqueuemax(self, value):
+        """Set maximum queued connections per pool thread.
+        """
+        return libruss.russ_svr_set_threadqueuemax(self._ptr, value)
+
     def set_type(self, stype):
         """Set server type.
         """
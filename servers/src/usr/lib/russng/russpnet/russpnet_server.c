@@ -23,12 +23,21 @@
 */
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -39,35 +48,183 @@ extern char **environ;
 #include <russ/russ.h>
 
 #define DEFAULT_DIAL_TIMEOUT	(30000)
+#define DEFAULT_MULTI_CONCURRENCY	(16)
+#define DEFAULT_MULTI_TIMEOUT	(0)
 #define DEFAULT_RELAY_ADDR	"+/sshr"
+#define DEFAULT_SELECT_BACKOFF	(5000)
+#define DEFAULT_SELECT_BACKOFFMAX	(300000)
+#define DEFAULT_SELECT_EWMAALPHA	(0.3)
+#define DEFAULT_SELECT_POLICY	"p2c"
+#define MULTI_LINE_INIT		(4096)
+#define MULTI_LINE_MAX		(1<<20)
+#define MULTI_STATUS_FDIDX	(3)
+#define MAX_LOCALADDRS		(64)
+#define MAX_DIALSLOTS		(1024)
 #define MAX_TARGETS		(32768)
 
+#define SELECT_POLICY_LEASTOUT	1
+#define SELECT_POLICY_P2C	2
+#define SELECT_POLICY_EWMA	3
+
+#define TARGETSINDEX_MAGIC	"RUSSPNX"
+#define TARGETSINDEX_VERSION	1
+
 struct target {
 	char	*userhost;
 	char	*cgroup;
 };
 
-struct targetslist {
-	struct russ_conf	*targetconfs[MAX_TARGETS];
-	int			n;
+/*
+* Compiled targets index (image in a file or memory).
+*
+* Layout:
+*	header
+*	entries[ntargets]
+*	buckets[nbuckets] (userhost hash -> entry index+1; 0 for empty)
+*	strs[strsize] (strs[0] is '\0': offset 0 is the empty string)
+*
+* The image is in host byte order; it is a cache of the source
+* targets file and is rebuilt whenever the source changes.
+*/
+struct targetsindex_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	ntargets;
+	uint32_t	nbuckets;
+	uint32_t	strsize;
+	int64_t		srcmtime;	/**< source st_mtime */
+	int64_t		srcsize;	/**< source st_size */
+};
+
+struct targetsindex_entry {
+	uint32_t	id;		/**< offset in strs */
+	uint32_t	userhost;	/**< offset in strs */
+	uint32_t	cgroup;		/**< offset in strs */
+	uint32_t	hash;		/**< userhost hash */
+};
+
+/*
+* Per target local host check result, shared by all session
+* processes (see is_target_localhost()).
+*/
+struct localhosttarget {
+	int32_t	gen;		/**< generation of local; 0 for unresolved */
+	int32_t	local;		/**< 1 if target is the local host */
+};
+
+struct localhostshared {
+	int32_t			gen;		/**< current generation (>= 1) */
+	struct localhosttarget	targets[];
+};
+
+/*
+* Local host names and addresses, and whether each target is the
+* local host.
+*
+* Nothing is resolved on the accept path: names/addresses and
+* targets are resolved lazily by the (forked) session processes
+* which need them (see is_target_localhost()). Target results are
+* cached in shared memory. The server process only starts a new
+* generation, invalidating all results, on SIGHUP or after ttl
+* seconds (see invalidate_localhost()).
+*/
+struct localhost {
+	int			enabled;
+	int			ttl;		/**< seconds; <= 0 for no ttl */
+	time_t			gentime;	/**< time generation was started */
+	struct localhostshared	*shared;
+	int			ntargets;
+	int32_t			namesgen;	/**< generation of names/addrs; 0 for unresolved */
+	char			hostname[256];
+	struct sockaddr_storage	addrs[MAX_LOCALADDRS];
+	int			naddrs;
+};
+
+/*
+* /multi target and fan-out state.
+*/
+struct multitarget {
+	int		idx;
+	char		*userhost;
+	char		spath[RUSS_REQ_SPATH_MAX];
+	struct russ_buf	*lbufs[3];	/**< partial lines (prefix mode) */
+	int		midline[3];	/**< line started but not ended (prefix mode) */
+};
+
+struct multi {
+	struct russ_sconn	*sconn;
+	int			prefix;		/**< prefix lines with userhost */
+	int			nok;
+	int			nfailed;
+};
+
+struct targetsindex {
+	void				*base;		/**< image */
+	size_t				size;		/**< image size */
+	int				mapped;		/**< image is mmapped */
+	struct targetsindex_header	*hdr;
+	struct targetsindex_entry	*entries;
+	uint32_t			*buckets;
+	char				*strs;
+};
+
+/*
+* Per-target health/load, shared by all session processes (the
+* server forks): counters are updated atomically; the latency
+* estimate is updated without locking (a lost update is harmless).
+*/
+struct targetstats {
+	int32_t		outstanding;	/**< # of dials in progress */
+	int32_t		failures;	/**< # of consecutive dial failures */
+	int64_t		backoffuntil;	/**< skip target until (russ_gettime()) */
+	int64_t		latency;	/**< dial latency EWMA (us); 0 if unknown */
+	int64_t		ndials;		/**< # of dials completed */
+};
+
+/*
+* Dial in progress, held by a session process (shared). If the
+* process dies before the dial ends, the server process reclaims
+* the slot and its outstanding count (see sweep_dialslots()).
+*/
+struct dialslot {
+	int32_t		pid;		/**< session process; 0 for free; -1 while released */
+	int32_t		idx;		/**< target index; -1 for none */
+};
+
+struct selection {
+	int			policy;		/**< SELECT_POLICY_* */
+	int			backoff;	/**< initial backoff (ms); 0 to disable */
+	int			backoffmax;	/**< max backoff (ms) */
+	double			alpha;		/**< EWMA weight of new sample */
+	struct targetstats	*stats;		/**< shared, per target */
+	struct dialslot		*dialslots;	/**< shared, MAX_DIALSLOTS */
+	time_t			sweeptime;	/**< time of last sweep_dialslots() */
+	unsigned int		seed;
 };
 
 /* global */
 struct russ_conf	*conf = NULL;
 struct russ_conf	*targetsconf = NULL;
 char			*targetsfilename = NULL;
-struct targetslist	targetslist;
+struct targetsindex	targetsindex;
 char			fqlocalhostname[1024] = "";
+struct localhost	localhost;
+volatile sig_atomic_t	localhost_refresh = 0;
+struct selection	selection;
 
 const char		*HELP = 
 "Provides access to local/remote targets (e.g., user@host) using a\n"
 "relay (e.g., sshr service).\n"
 "\n"
-"/count\n"
-"    Output the number of targets registered.\n"
+"/count [healthy]\n"
+"    Output the number of targets registered; with healthy, only\n"
+"    count targets not in backoff (see /run).\n"
 "\n"
-"/gettargets\n"
+"/gettargets [stats]\n"
 "    Get the targets file information (configuration file format).\n"
+"    With stats, include the health/load of each target (state,\n"
+"    outstanding dials, dial latency EWMA in ms, consecutive\n"
+"    failures, dials).\n"
 "\n"
 "/host/<user@host>/... <args>\n"
 "    Connect to service ... at target (i.e., user@host) verified\n"
@@ -78,7 +235,27 @@ const char		*HELP =
 "    Connect to service ... at target (host only) identified by a\n"
 "    lookup into the targetsfile list at <index>. A negative index\n"
 "    starts at the last entry (-1 is the last entry). An index\n"
-"    starting with : loops around to continue the lookup.\n"
+"    starting with : loops around to continue the lookup. An index\n"
+"    of \"any\" selects a target by the selection policy (see\n"
+"    /run).\n"
+"\n"
+"/multi/<selector>[<options>]/... <args>\n"
+"    Connect to service ... at each target selected (as for /id)\n"
+"    concurrently, and merge their stdout and stderr. <selector> is\n"
+"    a comma separated list of <a> (index), <a>:<b> (range, b not\n"
+"    included, defaults to the # of targets), or <a>:<b>:<c> (range\n"
+"    with step c; a negative step goes down from the last target).\n"
+"    A negative index starts at the last entry. The status of each\n"
+"    target and a summary are output to fd 3; the exit status is 0\n"
+"    if all targets succeed.\n"
+"\n"
+"    Options:\n"
+"    ?n=<concurrency>\n"
+"        Max # of targets in progress (default multi:concurrency).\n"
+"    ?prefix\n"
+"        Prefix output lines with \"<userhost>: \".\n"
+"    ?timeout=<ms>\n"
+"        Per target timeout (default multi:timeout, 0 for none).\n"
 "\n"
 "/net/<user@host>/... <args>\n"
 "    Connect to service ... at unregistered target (i.e.,\n"
@@ -91,40 +268,1031 @@ const char		*HELP =
 "    <index>. A negative index starts at the last entry (1 is the\n"
 "    last entry). An index starting with : loops around to continue\n"
 "    the lookup. If a cgroup is defined in targetsfile, it is used\n"
-"    in the call.\n";
+"    in the call.\n"
+"\n"
+"    An index of \"any\" selects a target by the selection policy\n"
+"    (select:policy): leastout (fewest outstanding dials), p2c\n"
+"    (better of two distinct random targets), or ewma (lowest dial latency\n"
+"    EWMA weighted by outstanding dials). Targets in backoff are\n"
+"    skipped.\n"
+"\n"
+"    Dial outcomes and latencies are tracked per target. A target\n"
+"    which fails to connect is put in backoff (select:backoff ms,\n"
+"    doubling with each consecutive failure up to\n"
+"    select:backoffmax ms); dials to a target in backoff fail\n"
+"    immediately.\n";
+
+/**
+* Hash a string (FNV-1a).
+*
+* @param s		string
+* @return		hash value
+*/
+uint32_t
+targetsindex_hash(const char *s) {
+	uint32_t	h = 2166136261u;
+
+	for (; *s != '\0'; s++) {
+		h = (h^(unsigned char)*s)*16777619u;
+	}
+	return h;
+}
+
+/**
+* Set up targets index from an image. The image is validated: the
+* sizes must match, string offsets must be in range, and buckets
+* must hold valid entry references with at least one empty bucket.
+*
+* @param self		targets index object
+* @param base		image
+* @param size		image size
+* @param mapped		image is mmapped
+* @return		0 on success; -1 on failure
+*/
+int
+targetsindex_attach(struct targetsindex *self, void *base, size_t size, int mapped) {
+	struct targetsindex_header	*hdr = base;
+	struct targetsindex_entry	*entries = NULL;
+	uint32_t			*buckets = NULL;
+	char				*strs = NULL;
+	size_t				esize;
+	uint32_t			i;
+
+	if ((size < sizeof(struct targetsindex_header))
+		|| (memcmp(hdr->magic, TARGETSINDEX_MAGIC, sizeof(TARGETSINDEX_MAGIC)) != 0)
+		|| (hdr->version != TARGETSINDEX_VERSION)
+		|| (hdr->nbuckets == 0)
+		|| ((hdr->nbuckets & (hdr->nbuckets-1)) != 0)
+		|| (hdr->nbuckets <= hdr->ntargets)
+		|| (hdr->strsize == 0)) {
+		return -1;
+	}
+	esize = sizeof(struct targetsindex_header)
+		+ (size_t)hdr->ntargets*sizeof(struct targetsindex_entry)
+		+ (size_t)hdr->nbuckets*sizeof(uint32_t)
+		+ hdr->strsize;
+	if (esize != size) {
+		return -1;
+	}
+	entries = (struct targetsindex_entry *)(hdr+1);
+	strs = (char *)base+size-hdr->strsize;
+	if (strs[hdr->strsize-1] != '\0') {
+		return -1;
+	}
+	for (i = 0; i < hdr->ntargets; i++) {
+		if ((entries[i].id >= hdr->strsize)
+			|| (entries[i].userhost >= hdr->strsize)
+			|| (entries[i].cgroup >= hdr->strsize)) {
+			return -1;
+		}
+	}
+	buckets = (uint32_t *)(entries+hdr->ntargets);
+	for (i = 0; i < hdr->nbuckets; i++) {
+		if (buckets[i] > hdr->ntargets) {
+			return -1;
+		}
+	}
+
+	self->base = base;
+	self->size = size;
+	self->mapped = mapped;
+	self->hdr = hdr;
+	self->entries = entries;
+	self->buckets = buckets;
+	self->strs = strs;
+	return 0;
+}
+
+/**
+* Release targets index image.
+*
+* @param self		targets index object
+*/
+void
+targetsindex_release(struct targetsindex *self) {
+	if (self->base != NULL) {
+		if (self->mapped) {
+			munmap(self->base, self->size);
+		} else {
+			russ_free(self->base);
+		}
+	}
+	memset(self, 0, sizeof(struct targetsindex));
+}
+
+/**
+* Build targets index image in memory from the "target.<idx>"
+* sections of a targets conf (see load_targetsfile()).
+*
+* @param self		targets index object
+* @param tconf		targets conf object
+* @param st		source file stat
+* @return		0 on success; -1 on failure
+*/
+int
+targetsindex_build(struct targetsindex *self, struct russ_conf *tconf, struct stat *st) {
+	struct targetsindex_header	*hdr = NULL;
+	struct targetsindex_entry	*entries = NULL, *entry = NULL;
+	uint32_t			*buckets = NULL;
+	char				secname[128];
+	char				*base = NULL, *strs = NULL, *p = NULL;
+	char				*vals[3];
+	uint32_t			*offs[3];
+	size_t				size, strsize, len;
+	uint32_t			nbuckets, j;
+	int				i, k, n;
+
+	/* count and size strings */
+	strsize = 1;
+	for (n = 0; n < MAX_TARGETS; n++) {
+		if ((russ_snprintf(secname, sizeof(secname), "target.%d", n) < 0)
+			|| ((p = russ_conf_getref(tconf, secname, "id")) == NULL)) {
+			break;
+		}
+		strsize += strlen(p)+1;
+		if ((p = russ_conf_getref(tconf, secname, "userhost")) != NULL) {
+			strsize += strlen(p)+1;
+		}
+		if ((p = russ_conf_getref(tconf, secname, "cgroup")) != NULL) {
+			strsize += strlen(p)+1;
+		}
+	}
+	for (nbuckets = 16; nbuckets < 2*(uint32_t)n; nbuckets <<= 1);
+
+	size = sizeof(struct targetsindex_header)
+		+ n*sizeof(struct targetsindex_entry)
+		+ nbuckets*sizeof(uint32_t)
+		+ strsize;
+	if ((strsize > UINT32_MAX)
+		|| ((base = russ_malloc(size)) == NULL)) {
+		return -1;
+	}
+	memset(base, 0, size);
+	hdr = (struct targetsindex_header *)base;
+	memcpy(hdr->magic, TARGETSINDEX_MAGIC, sizeof(TARGETSINDEX_MAGIC));
+	hdr->version = TARGETSINDEX_VERSION;
+	hdr->ntargets = n;
+	hdr->nbuckets = nbuckets;
+	hdr->strsize = strsize;
+	hdr->srcmtime = st->st_mtime;
+	hdr->srcsize = st->st_size;
+	entries = (struct targetsindex_entry *)(hdr+1);
+	buckets = (uint32_t *)(entries+n);
+	strs = (char *)(buckets+nbuckets);
+
+	/* fill entries, strings, buckets */
+	p = strs+1;
+	for (i = 0; i < n; i++) {
+		entry = &entries[i];
+		russ_snprintf(secname, sizeof(secname), "target.%d", i);
+		vals[0] = russ_conf_getref(tconf, secname, "id");
+		vals[1] = russ_conf_getref(tconf, secname, "userhost");
+		vals[2] = russ_conf_getref(tconf, secname, "cgroup");
+		offs[0] = &entry->id;
+		offs[1] = &entry->userhost;
+		offs[2] = &entry->cgroup;
+		for (k = 0; k < 3; k++) {
+			if ((vals[k] == NULL) || (vals[k][0] == '\0')) {
+				continue;
+			}
+			len = strlen(vals[k])+1;
+			memcpy(p, vals[k], len);
+			*offs[k] = p-strs;
+			p += len;
+		}
+		if (entry->userhost == 0) {
+			continue;
+		}
+		entry->hash = targetsindex_hash(strs+entry->userhost);
+		for (j = entry->hash & (nbuckets-1); buckets[j] != 0; j = (j+1) & (nbuckets-1));
+		buckets[j] = i+1;
+	}
+
+	targetsindex_release(self);
+	if (targetsindex_attach(self, base, size, 0) < 0) {
+		base = russ_free(base);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+* Write targets index image to file (atomically).
+*
+* @param self		targets index object
+* @param filename	index filename
+* @return		0 on success; -1 on failure
+*/
+int
+targetsindex_write(struct targetsindex *self, char *filename) {
+	char	tmpfilename[1024];
+	int	fd;
+
+	if (russ_snprintf(tmpfilename, sizeof(tmpfilename), "%s.%d", filename, getpid()) < 0) {
+		return -1;
+	}
+	if ((fd = open(tmpfilename, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		return -1;
+	}
+	if (russ_writen(fd, self->base, self->size) < self->size) {
+		goto fail;
+	}
+	if (close(fd) < 0) {
+		fd = -1;
+		goto fail;
+	}
+	fd = -1;
+	if (rename(tmpfilename, filename) < 0) {
+		goto fail;
+	}
+	return 0;
+
+fail:
+	if (fd >= 0) {
+		close(fd);
+	}
+	unlink(tmpfilename);
+	return -1;
+}
+
+/**
+* Map targets index file. The pages are shared by all (forked)
+* server processes.
+*
+* The index is rejected (for a rebuild) if the source file is newer
+* or was changed.
+*
+* @param self		targets index object
+* @param filename	index filename
+* @param st		source file stat
+* @return		0 on success; -1 on failure
+*/
+int
+targetsindex_map(struct targetsindex *self, char *filename, struct stat *st) {
+	struct stat	ist;
+	void		*base = NULL;
+	int		fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if ((fstat(fd, &ist) < 0)
+		|| (ist.st_mtime < st->st_mtime)
+		|| (ist.st_size < sizeof(struct targetsindex_header))
+		|| ((base = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	targetsindex_release(self);
+	if ((targetsindex_attach(self, base, ist.st_size, 1) < 0)
+		|| (self->hdr->srcmtime != st->st_mtime)
+		|| (self->hdr->srcsize != st->st_size)) {
+		munmap(base, ist.st_size);
+		memset(self, 0, sizeof(struct targetsindex));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+* Return number of targets.
+*
+* @return		# of targets
+*/
+int
+get_ntargets(void) {
+	return (targetsindex.hdr == NULL) ? 0 : targetsindex.hdr->ntargets;
+}
+
+/**
+* Return target id, userhost, cgroup by index (0 <= idx <
+* get_ntargets()).
+*
+* @param idx		target index
+* @return		reference to value; NULL if not set
+*/
+char *
+get_target_id(int idx) {
+	uint32_t	off = targetsindex.entries[idx].id;
+
+	return (off == 0) ? NULL : targetsindex.strs+off;
+}
+
+char *
+get_target_userhost(int idx) {
+	uint32_t	off = targetsindex.entries[idx].userhost;
+
+	return (off == 0) ? NULL : targetsindex.strs+off;
+}
+
+char *
+get_target_cgroup(int idx) {
+	uint32_t	off = targetsindex.entries[idx].cgroup;
+
+	return (off == 0) ? NULL : targetsindex.strs+off;
+}
+
+/**
+* Find target index by userhost.
+*
+* @param userhost	target userhost
+* @return		target index; -1 if not found
+*/
+int
+find_target_userhost(char *userhost) {
+	struct targetsindex_entry	*entry = NULL;
+	uint32_t			hash, mask, i, j, n;
+
+	if (targetsindex.hdr == NULL) {
+		return -1;
+	}
+	hash = targetsindex_hash(userhost);
+	mask = targetsindex.hdr->nbuckets-1;
+	/* bounded: do not rely on an empty bucket */
+	for (j = hash & mask, n = 0;
+		(n < targetsindex.hdr->nbuckets) && ((i = targetsindex.buckets[j]) != 0);
+		j = (j+1) & mask, n++) {
+		if ((i > targetsindex.hdr->ntargets)
+			|| ((entry = &targetsindex.entries[i-1])->hash != hash)) {
+			continue;
+		}
+		if (strcmp(targetsindex.strs+entry->userhost, userhost) == 0) {
+			return i-1;
+		}
+	}
+	return -1;
+}
+
+/**
+* Set up shared target stats (must be called before serving).
+*
+* @param ntargets	# of targets
+* @return		0 on success; -1 on failure
+*/
+int
+init_targetstats(int ntargets) {
+	size_t	size;
+	int	i;
+
+	size = sizeof(struct targetstats)*RUSS__MAX(ntargets, 1);
+	if ((selection.stats = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		selection.stats = NULL;
+		return -1;
+	}
+	/* anonymous map is zero filled */
+	size = sizeof(struct dialslot)*MAX_DIALSLOTS;
+	if ((selection.dialslots = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		selection.dialslots = NULL;
+		return -1;
+	}
+	for (i = 0; i < MAX_DIALSLOTS; i++) {
+		selection.dialslots[i].idx = -1;
+	}
+	return 0;
+}
+
+/**
+* Check if target is in backoff.
+*
+* @param idx		target index
+* @param now		current time (russ_gettime())
+* @return		1 if in backoff; 0 otherwise
+*/
+int
+is_target_backoff(int idx, russ_deadline now) {
+	if (selection.stats == NULL) {
+		return 0;
+	}
+	return (__atomic_load_n(&selection.stats[idx].backoffuntil, __ATOMIC_RELAXED) > now) ? 1 : 0;
+}
+
+/**
+* Record start of dial to target. The dial is held in a dial slot
+* so that it is accounted for even if this process dies before
+* target_dial_end().
+*
+* @param idx		target index
+* @param[out] slotp	dial slot; -1 if none was free
+* @return		start time (russ_gettime_us())
+*/
+int64_t
+target_dial_begin(int idx, int *slotp) {
+	int32_t	pid, mypid;
+	int	i, j;
+
+	*slotp = -1;
+	if (selection.stats != NULL) {
+		mypid = getpid();
+		for (i = 0; (selection.dialslots != NULL) && (i < MAX_DIALSLOTS); i++) {
+			j = (mypid+i) % MAX_DIALSLOTS;
+			pid = 0;
+			if (__atomic_compare_exchange_n(&selection.dialslots[j].pid, &pid, mypid, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				*slotp = j;
+				break;
+			}
+		}
+		__atomic_add_fetch(&selection.stats[idx].outstanding, 1, __ATOMIC_RELAXED);
+		if (*slotp >= 0) {
+			__atomic_store_n(&selection.dialslots[*slotp].idx, idx, __ATOMIC_RELEASE);
+		}
+	}
+	return russ_gettime_us();
+}
+
+/**
+* Release dial slot and its outstanding count.
+*
+* The slot owner and sweep_dialslots() may race: only the one which
+* moves the slot pid from the holder to -1 releases it, and the slot
+* is only free (pid 0) again once released. A slot no longer held
+* by pid (e.g., released and claimed anew) is not touched.
+*
+* @param slot		dial slot; -1 for none
+* @param pid		slot holder
+* @param idx		target index (for no dial slot)
+* @return		0 on success; -1 if the slot is not held by pid
+*/
+int
+release_dialslot(int slot, int32_t pid, int idx) {
+	struct dialslot	*ds = NULL;
+
+	if (slot < 0) {
+		__atomic_sub_fetch(&selection.stats[idx].outstanding, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	ds = &selection.dialslots[slot];
+	if (!__atomic_compare_exchange_n(&ds->pid, &pid, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		return -1;
+	}
+	if ((idx = __atomic_exchange_n(&ds->idx, -1, __ATOMIC_ACQ_REL)) >= 0) {
+		__atomic_sub_fetch(&selection.stats[idx].outstanding, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&ds->pid, 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+* Reclaim dial slots of session processes which died during a dial
+* (e.g., killed), so that their targets do not look busy forever.
+* Called by the server process.
+*/
+void
+sweep_dialslots(void) {
+	int32_t	pid;
+	int	i;
+
+	if ((selection.stats == NULL) || (selection.dialslots == NULL)) {
+		return;
+	}
+	for (i = 0; i < MAX_DIALSLOTS; i++) {
+		if (((pid = __atomic_load_n(&selection.dialslots[i].pid, __ATOMIC_ACQUIRE)) <= 0)
+			|| (kill(pid, 0) == 0)
+			|| (errno != ESRCH)) {
+			continue;
+		}
+		release_dialslot(i, pid, -1);
+	}
+}
+
+/**
+* Record outcome of dial to target: update the latency EWMA on
+* success; set up/extend the backoff on failure.
+*
+* @param idx		target index
+* @param t0		start time (from target_dial_begin())
+* @param slot		dial slot (from target_dial_begin())
+* @param ok		1 for success; 0 for failure
+*/
+void
+target_dial_end(int idx, int64_t t0, int slot, int ok) {
+	struct targetstats	*ts = NULL;
+	int64_t			sample, latency, backoff;
+	int			failures;
+
+	if (selection.stats == NULL) {
+		return;
+	}
+	ts = &selection.stats[idx];
+	release_dialslot(slot, getpid(), idx);
+	__atomic_add_fetch(&ts->ndials, 1, __ATOMIC_RELAXED);
+
+	if (ok) {
+		sample = RUSS__MAX(russ_gettime_us()-t0, 1);
+		latency = __atomic_load_n(&ts->latency, __ATOMIC_RELAXED);
+		latency = (latency == 0) ? sample : latency+(int64_t)(selection.alpha*(sample-latency));
+		__atomic_store_n(&ts->latency, RUSS__MAX(latency, 1), __ATOMIC_RELAXED);
+		__atomic_store_n(&ts->failures, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&ts->backoffuntil, 0, __ATOMIC_RELAXED);
+	} else {
+		failures = __atomic_add_fetch(&ts->failures, 1, __ATOMIC_RELAXED);
+		if (selection.backoff > 0) {
+			backoff = selection.backoff;
+			while ((--failures > 0) && (backoff < selection.backoffmax)) {
+				backoff *= 2;
+			}
+			backoff = RUSS__MIN(backoff, selection.backoffmax);
+			__atomic_store_n(&ts->backoffuntil, russ_gettime()+backoff, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+* Compare load of targets a and b for the selection policy.
+*
+* @param a		target index
+* @param b		target index
+* @return		< 0 if a is preferred; >= 0 otherwise
+*/
+int64_t
+compare_targets(int a, int b) {
+	struct targetstats	*ta = &selection.stats[a], *tb = &selection.stats[b];
+	int64_t			la, lb;
+	int32_t			oa, ob;
+
+	oa = __atomic_load_n(&ta->outstanding, __ATOMIC_RELAXED);
+	ob = __atomic_load_n(&tb->outstanding, __ATOMIC_RELAXED);
+	la = __atomic_load_n(&ta->latency, __ATOMIC_RELAXED);
+	lb = __atomic_load_n(&tb->latency, __ATOMIC_RELAXED);
+	if (selection.policy == SELECT_POLICY_EWMA) {
+		/* unknown latency (0) is preferred, to get a sample */
+		return la*(oa+1)-lb*(ob+1);
+	} else if (selection.policy == SELECT_POLICY_LEASTOUT) {
+		/* ties are spread by the (random) scan order */
+		return (int64_t)(oa-ob);
+	}
+	return (oa != ob) ? (int64_t)(oa-ob) : la-lb;
+}
+
+/**
+* Select a target by the selection policy, skipping targets in
+* backoff. If all targets are in backoff, the one whose backoff ends
+* first is selected.
+*
+* @return		target index; -1 if no targets
+*/
+int
+select_target(void) {
+	russ_deadline	now, until, minuntil;
+	int64_t		cmp;
+	int		ntargets, navail, nties, a, b, i, j, idx;
+
+	if ((ntargets = get_ntargets()) < 1) {
+		return -1;
+	}
+	if (selection.stats == NULL) {
+		return 0;
+	}
+	if (selection.seed == 0) {
+		/* differs for each session process */
+		selection.seed = (unsigned int)(getpid()^russ_gettime_us());
+	}
+
+	now = russ_gettime();
+	idx = -1;
+	navail = 0;
+	if ((selection.policy == SELECT_POLICY_P2C) && (ntargets > 1)) {
+		/* random pairs (second pick from the other n-1); fall back to a scan */
+		for (i = 0; (i < 4) && (navail == 0); i++) {
+			a = rand_r(&selection.seed) % ntargets;
+			b = rand_r(&selection.seed) % (ntargets-1);
+			if (b >= a) {
+				b++;
+			}
+			if ((is_target_backoff(a, now)) || (is_target_backoff(b, now))) {
+				continue;
+			}
+			idx = (compare_targets(b, a) < 0) ? b : a;
+			navail = 2;
+		}
+	}
+	if (navail == 0) {
+		/* scan from random offset; ties are picked at random */
+		b = rand_r(&selection.seed) % ntargets;
+		for (j = 0, nties = 0; j < ntargets; j++) {
+			i = (b+j) % ntargets;
+			if (is_target_backoff(i, now)) {
+				continue;
+			}
+			if ((idx < 0) || ((cmp = compare_targets(i, idx)) < 0)) {
+				idx = i;
+				nties = 1;
+			} else if ((cmp == 0) && ((rand_r(&selection.seed) % ++nties) == 0)) {
+				idx = i;
+			}
+			if ((selection.policy == SELECT_POLICY_P2C) && (++navail == 2)) {
+				break;
+			}
+		}
+	}
+	if (idx < 0) {
+		/* all in backoff */
+		minuntil = RUSS_DEADLINE_NEVER;
+		for (i = 0; i < ntargets; i++) {
+			if ((until = __atomic_load_n(&selection.stats[i].backoffuntil, __ATOMIC_RELAXED)) < minuntil) {
+				minuntil = until;
+				idx = i;
+			}
+		}
+	}
+	return idx;
+}
+
+/**
+* Dial service (req->spath) at target, tracking the dial outcome
+* for the target.
+*
+* Only connect/transport failures count against the target (see
+* target_dial_end()); a bad service path or request is the
+* client's, and fails without being tracked.
+*
+* @param deadline	response deadline
+* @param req		request object
+* @param idx		target index
+* @return		client connection object; NULL on failure
+*/
+struct russ_cconn *
+dial_target(russ_deadline deadline, struct russ_req *req, int idx) {
+	struct russ_target	*targ = NULL;
+	struct russ_dial	*dial = NULL;
+	struct russ_cconn	*cconn = NULL;
+	struct pollfd		pollfds[1];
+	int64_t			t0;
+	int			events, slot, timeout, rv;
+
+	/* resolve path, set up request */
+	if (((targ = russ_target_new(req->spath)) == NULL)
+		|| ((dial = russ_dial_start_target(deadline, req->op, targ, req->attrv, req->argv)) == NULL)) {
+		targ = russ_target_free(targ);
+		return NULL;
+	}
+
+	/* connect, send request, get fds */
+	t0 = target_dial_begin(idx, &slot);
+	while (russ_dial_advance(dial) == 0) {
+		pollfds[0].fd = russ_dial_pollfd(dial, &events);
+		pollfds[0].events = events;
+		if ((timeout = russ_dial_timeout(dial)) < 0) {
+			timeout = russ_to_timeout(deadline);
+		}
+		if (((rv = poll(pollfds, 1, timeout)) < 0) && (errno == EINTR)) {
+			continue;
+		} else if ((rv < 0) || ((rv == 0) && (russ_to_timeout(deadline) == 0))) {
+			break;
+		}
+	}
+	cconn = russ_dial_finish(dial);
+	targ = russ_target_free(targ);
+	target_dial_end(idx, t0, slot, (cconn != NULL) ? 1 : 0);
+	return cconn;
+}
+
+/**
+* Dial service (req->spath) at target (see dial_target()) and
+* splice its connection into the server connection (as for
+* russ_sconn_redialandsplice()). Dials to a target in backoff fail
+* immediately.
+*
+* @param sconn		server connection object
+* @param deadline	response deadline
+* @param req		request object
+* @param idx		target index
+* @return		0 on success; -1 on failure
+*/
+int
+redialandsplice_target(struct russ_sconn *sconn, russ_deadline deadline, struct russ_req *req, int idx) {
+	struct russ_cconn	*cconn = NULL;
+
+	if (is_target_backoff(idx, russ_gettime())) {
+		russ_sconn_answerhandler(sconn);
+		russ_sconn_fatal(sconn, "error: target in backoff", RUSS_EXIT_FAILURE);
+		return -1;
+	}
+
+	/* switch user */
+	if ((russ_switch_userinitgroups(sconn->creds.uid, sconn->creds.gid) < 0)
+		|| (russ_env_reset() < 0)
+		|| (chdir("/") < 0)) {
+		russ_sconn_answerhandler(sconn);
+		russ_sconn_fatal(sconn, RUSS_MSG_NOSWITCHUSER, RUSS_EXIT_FAILURE);
+		return -1;
+	}
+
+	/* dial next service, and splice */
+	cconn = dial_target(deadline, req, idx);
+	if ((cconn == NULL) || (russ_sconn_splice(sconn, cconn) < 0)) {
+		if (cconn != NULL) {
+			russ_cconn_close(cconn);
+			cconn = russ_cconn_free(cconn);
+		}
+		russ_sconn_answerhandler(sconn);
+		russ_sconn_fatal(sconn, RUSS_MSG_NOSERVICE, RUSS_EXIT_FAILURE);
+		return -1;
+	}
+	return 0;
+}
 
 /**
-* Check if given hostname resolves to the local host.
+* Write targets information (configuration file format).
+*
+* @param fd		output fd
+* @param withstats	include target health/load
+* @return		0 on success; -1 on failure
+*/
+int
+write_targets(int fd, int withstats) {
+	struct targetstats	*ts = NULL;
+	char			*value = NULL;
+	russ_deadline		now;
+	int			i;
+
+	now = russ_gettime();
+	for (i = 0; i < get_ntargets(); i++) {
+		if (russ_dprintf(fd, "[target.%d]\n", i) < 0) {
+			return -1;
+		}
+		if (((value = get_target_id(i)) != NULL)
+			&& (russ_dprintf(fd, "id=%s\n", value) < 0)) {
+			return -1;
+		}
+		if (((value = get_target_userhost(i)) != NULL)
+			&& (russ_dprintf(fd, "userhost=%s\n", value) < 0)) {
+			return -1;
+		}
+		if (((value = get_target_cgroup(i)) != NULL)
+			&& (russ_dprintf(fd, "cgroup=%s\n", value) < 0)) {
+			return -1;
+		}
+		if ((withstats) && (selection.stats != NULL)) {
+			ts = &selection.stats[i];
+			if (russ_dprintf(fd, "state=%s\noutstanding=%d\nlatency=%.3f\nfailures=%d\ndials=%lld\n",
+				is_target_backoff(i, now) ? "backoff" : "ok",
+				__atomic_load_n(&ts->outstanding, __ATOMIC_RELAXED),
+				__atomic_load_n(&ts->latency, __ATOMIC_RELAXED)/1000.0,
+				__atomic_load_n(&ts->failures, __ATOMIC_RELAXED),
+				(long long)__atomic_load_n(&ts->ndials, __ATOMIC_RELAXED)) < 0) {
+				return -1;
+			}
+		}
+		if (russ_dprintf(fd, "\n") < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+* Check if address is one of the local host addresses.
+*
+* @param sa		socket address
+* @return		1 for match; 0 for no match
+*/
+int
+is_localaddr(struct sockaddr *sa) {
+	struct sockaddr	*lsa = NULL;
+	int		i;
+
+	for (i = 0; i < localhost.naddrs; i++) {
+		lsa = (struct sockaddr *)&localhost.addrs[i];
+		if (lsa->sa_family != sa->sa_family) {
+			continue;
+		}
+		if ((sa->sa_family == AF_INET)
+			&& (memcmp(&((struct sockaddr_in *)sa)->sin_addr,
+				&((struct sockaddr_in *)lsa)->sin_addr, sizeof(struct in_addr)) == 0)) {
+			return 1;
+		}
+		if ((sa->sa_family == AF_INET6)
+			&& (memcmp(&((struct sockaddr_in6 *)sa)->sin6_addr,
+				&((struct sockaddr_in6 *)lsa)->sin6_addr, sizeof(struct in6_addr)) == 0)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+* Resolve hostname and check if it is the local host: its canonical
+* name is that of the local host or it has a local address.
+*
+* Note: this does a (blocking) name service lookup.
 *
 * @param hostname	name to check
 * @return		1 for match; 0 for no match
 */
 int
-is_localhost(char *hostname) {
-	struct hostent	*hent = NULL;
+resolve_is_localhost(char *hostname) {
+	struct addrinfo	hints, *res = NULL, *ai = NULL;
+	int		rv = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_CANONNAME;
+	if (getaddrinfo(hostname, NULL, &hints, &res) != 0) {
+		return 0;
+	}
+	if ((res->ai_canonname != NULL)
+		&& (fqlocalhostname[0] != '\0')
+		&& (strcmp(res->ai_canonname, fqlocalhostname) == 0)) {
+		rv = 1;
+	}
+	for (ai = res; (rv == 0) && (ai != NULL); ai = ai->ai_next) {
+		rv = is_localaddr(ai->ai_addr);
+	}
+	freeaddrinfo(res);
+	return rv;
+}
+
+/**
+* Resolve local host names (fqlocalhostname) and addresses for the
+* current generation.
+*
+* Note: this does a (blocking) name service lookup; it is only
+* called by session processes.
+*/
+void
+resolve_localnames(void) {
+	struct addrinfo	hints, *res = NULL;
+	struct ifaddrs	*ifas = NULL, *ifa = NULL;
+	size_t		salen;
+
+	localhost.namesgen = __atomic_load_n(&localhost.shared->gen, __ATOMIC_ACQUIRE);
+
+	/* names */
+	localhost.hostname[sizeof(localhost.hostname)-1] = '\0';
+	fqlocalhostname[0] = '\0';
+	if (gethostname(localhost.hostname, sizeof(localhost.hostname)-1) < 0) {
+		localhost.hostname[0] = '\0';
+	} else {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_flags = AI_CANONNAME;
+		if (getaddrinfo(localhost.hostname, NULL, &hints, &res) == 0) {
+			if ((res->ai_canonname != NULL)
+				&& (strlen(res->ai_canonname) < sizeof(fqlocalhostname))) {
+				strcpy(fqlocalhostname, res->ai_canonname);
+			}
+			freeaddrinfo(res);
+		}
+	}
+
+	/* addresses */
+	localhost.naddrs = 0;
+	if (getifaddrs(&ifas) == 0) {
+		for (ifa = ifas; (ifa != NULL) && (localhost.naddrs < MAX_LOCALADDRS); ifa = ifa->ifa_next) {
+			if (ifa->ifa_addr == NULL) {
+				continue;
+			} else if (ifa->ifa_addr->sa_family == AF_INET) {
+				salen = sizeof(struct sockaddr_in);
+			} else if (ifa->ifa_addr->sa_family == AF_INET6) {
+				salen = sizeof(struct sockaddr_in6);
+			} else {
+				continue;
+			}
+			memcpy(&localhost.addrs[localhost.naddrs++], ifa->ifa_addr, salen);
+		}
+		freeifaddrs(ifas);
+	}
+}
+
+/**
+* Check if given hostname is the local host.
+*
+* Names of the local host are answered from memory (resolved, if
+* needed, for the current generation); others are resolved.
+*
+* @param hostname	name to check
+* @return		1 for match; 0 for no match
+*/
+int
+is_localhost(char *hostname) {
+	if ((!localhost.enabled) || (localhost.shared == NULL)) {
+		return 0;
+	}
+	if (localhost.namesgen != __atomic_load_n(&localhost.shared->gen, __ATOMIC_ACQUIRE)) {
+		resolve_localnames();
+	}
+	if ((strcmp(hostname, "localhost") == 0)
+		|| (strcmp(hostname, localhost.hostname) == 0)
+		|| (strcmp(hostname, fqlocalhostname) == 0)) {
+		return 1;
+	}
+	return resolve_is_localhost(hostname);
+}
+
+/**
+* Check if target (host only) is the local host.
+*
+* The result is resolved on first use in a generation and cached
+* for all session processes; concurrent resolutions of the same
+* target are harmless (the last one wins).
+*
+* @param idx		target index
+* @return		1 for match; 0 for no match
+*/
+int
+is_target_localhost(int idx) {
+	struct localhosttarget	*lt = NULL;
+	char			*userhost = NULL;
+	int32_t			gen;
+	int			local;
+
+	if ((!localhost.enabled)
+		|| (localhost.shared == NULL)
+		|| (idx < 0)
+		|| (idx >= localhost.ntargets)) {
+		return 0;
+	}
+	lt = &localhost.shared->targets[idx];
+	gen = __atomic_load_n(&localhost.shared->gen, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&lt->gen, __ATOMIC_ACQUIRE) == gen) {
+		return __atomic_load_n(&lt->local, __ATOMIC_RELAXED);
+	}
+	userhost = get_target_userhost(idx);
+	local = (userhost != NULL)
+		&& (strchr(userhost, '@') == NULL)
+		&& is_localhost(userhost);
+	__atomic_store_n(&lt->local, local, __ATOMIC_RELAXED);
+	__atomic_store_n(&lt->gen, gen, __ATOMIC_RELEASE);
+	return local;
+}
+
+/**
+* Set up shared local host state (must be called before serving).
+* Nothing is resolved here.
+*
+* @param ntargets	# of targets
+* @return		0 on success; -1 on failure
+*/
+int
+init_localhost(int ntargets) {
+	size_t	size;
 
-	if (((hent = gethostbyname(hostname)) != NULL)
-		&& (strcmp(fqlocalhostname, hent->h_name) == 0)) {
-		return 1;
+	size = sizeof(struct localhostshared)+sizeof(struct localhosttarget)*RUSS__MAX(ntargets, 1);
+	if ((localhost.shared = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		localhost.shared = NULL;
+		return -1;
 	}
+	/* anonymous map is zero filled: all targets unresolved */
+	localhost.shared->gen = 1;
+	localhost.ntargets = ntargets;
+	localhost.namesgen = 0;
+	localhost.gentime = time(NULL);
 	return 0;
 }
 
 /**
-* Set the fqlocalhostname to the fq hostname for the local host.
+* Invalidate local host information: start a new generation. Does
+* not block.
 */
 void
-set_fqlocalhostname(void) {
-	struct hostent	*hent = NULL;
-
-	fqlocalhostname[sizeof(fqlocalhostname)-1] = '\0';
-	if ((gethostname(fqlocalhostname, sizeof(fqlocalhostname)-1) < 0)
-		|| ((hent = gethostbyname(fqlocalhostname)) == NULL)
-		|| (strlen(hent->h_name) >= sizeof(fqlocalhostname))) {
-		fqlocalhostname[0] = '\0';
-	} else {
-		strncpy(fqlocalhostname, hent->h_name, sizeof(fqlocalhostname));
+invalidate_localhost(void) {
+	if (localhost.shared == NULL) {
+		return;
+	}
+	__atomic_add_fetch(&localhost.shared->gen, 1, __ATOMIC_RELEASE);
+	localhost.gentime = time(NULL);
+}
+
+/**
+* SIGHUP handler: request a refresh of the local host information.
+*
+* @param signum		signal number
+*/
+void
+sighup_handler(int signum) {
+	localhost_refresh = 1;
+}
+
+/**
+* Accept handler which invalidates the local host information, if
+* requested or stale (resolution is left to the session processes),
+* and reclaims dial slots of dead session processes (at most once a
+* second).
+*
+* @param deadline	deadline to complete operation
+* @param lisd		listen() socket descriptor
+* @return		new server connection object
+*/
+struct russ_sconn *
+accepthandler(russ_deadline deadline, int lisd) {
+	struct russ_sconn	*sconn = NULL;
+
+	sconn = russ_sconn_accepthandler(deadline, lisd);
+	if (time(NULL) != selection.sweeptime) {
+		selection.sweeptime = time(NULL);
+		sweep_dialslots();
 	}
+	if ((localhost.enabled)
+		&& ((localhost_refresh)
+			|| ((localhost.ttl > 0) && (time(NULL)-localhost.gentime >= localhost.ttl)))) {
+		localhost_refresh = 0;
+		invalidate_localhost();
+	}
+	return sconn;
 }
 
 /**
@@ -138,12 +1306,22 @@ void
 svc_count_handler(struct russ_sess *sess) {
 	struct russ_sconn	*sconn = NULL;
 	struct russ_req		*req = NULL;
+	russ_deadline		now;
+	int			i, n;
 
 	sconn = sess->sconn;
 	req = sess->req;
 
 	if (req->opnum == RUSS_OPNUM_EXECUTE) {
-		russ_dprintf(sconn->fds[1], "%d", targetslist.n);
+		n = get_ntargets();
+		if ((req->argv != NULL) && (req->argv[0] != NULL)
+			&& (strcmp(req->argv[0], "healthy") == 0)) {
+			now = russ_gettime();
+			for (i = 0; i < get_ntargets(); i++) {
+				n -= is_target_backoff(i, now);
+			}
+		}
+		russ_dprintf(sconn->fds[1], "%d", n);
 		russ_sconn_exit(sconn, RUSS_EXIT_SUCCESS);
 		exit(0);
 	}
@@ -165,7 +1343,8 @@ svc_gettargets_handler(struct russ_sess *sess) {
 	req = sess->req;
 
 	if (req->opnum == RUSS_OPNUM_EXECUTE) {
-		if (russ_conf_writefd(targetsconf, sconn->fds[1]) < 0) {
+		if (write_targets(sconn->fds[1], (req->argv != NULL) && (req->argv[0] != NULL)
+			&& (strcmp(req->argv[0], "stats") == 0)) < 0) {
 			russ_sconn_fatal(sconn, "error: failed do output targets info", RUSS_EXIT_FAILURE);
 		} else {
 			russ_sconn_exit(sconn, RUSS_EXIT_SUCCESS);
@@ -178,7 +1357,6 @@ void
 svc_host_handler(struct russ_sess *sess) {
 	struct russ_sconn	*sconn = NULL;
 	struct russ_req		*req = NULL;
-	struct russ_conf	*targetconf = NULL;
 	char			*ref;
 	int			i;
 
@@ -186,12 +1364,11 @@ svc_host_handler(struct russ_sess *sess) {
 	req = sess->req;
 
 	if (req->opnum == RUSS_OPNUM_LIST) {
-		if (targetslist.n == 0) {
+		if (get_ntargets() == 0) {
 			russ_sconn_fatal(sconn, RUSS_MSG_NOSERVICE, RUSS_EXIT_FAILURE);
 		} else {
-			for (i = 0; i < targetslist.n; i++) {
-				if (((targetconf = targetslist.targetconfs[i]) == NULL)
-					|| ((ref = russ_conf_getref(targetconf, "target", "userhost")) == NULL)) {
+			for (i = 0; i < get_ntargets(); i++) {
+				if ((ref = get_target_userhost(i)) == NULL) {
 					continue;
 				}
 				russ_dprintf(sconn->fds[1], "%s\n", ref);
@@ -212,21 +1389,10 @@ get_userhost(char *spath) {
 
 char *
 get_valid_userhost(char *spath) {
-	struct russ_conf	*targetconf = NULL;
-	char			*ref = NULL;
-	char			*userhost = NULL;
-	int			i;
+	char	*userhost = NULL;
 
-	if ((userhost = get_userhost(spath)) != NULL) {
-		for (i = 0; i < targetslist.n; i++) {
-			if (((targetconf = targetslist.targetconfs[i]) == NULL)
-				|| ((ref = russ_conf_getref(targetconf, "target", "userhost")) == NULL)) {
-				continue;
-			}
-			if (strcmp(userhost, ref) == 0) {
-				return userhost;
-			}
-		}
+	if (((userhost = get_userhost(spath)) != NULL)
+		&& (find_target_userhost(userhost) < 0)) {
 		userhost = russ_free(userhost);
 	}
 	return userhost;
@@ -302,10 +1468,10 @@ svc_id_handler(struct russ_sess *sess) {
 	req = sess->req;
 
 	if (req->opnum == RUSS_OPNUM_LIST) {
-		if (targetslist.n == 0) {
+		if (get_ntargets() == 0) {
 			russ_sconn_fatal(sconn, RUSS_MSG_NOSERVICE, RUSS_EXIT_FAILURE);
 		} else {
-			for (i = 0; i < targetslist.n; i++) {
+			for (i = 0; i < get_ntargets(); i++) {
 				russ_dprintf(sconn->fds[1], "%d\n", i);
 			}
 			russ_sconn_exit(sconn, RUSS_EXIT_SUCCESS);
@@ -329,7 +1495,11 @@ get_valid_id_index(char *spath, int *idx, int *oidx, int *wrap, int ntargets) {
 		return -1;
 	}
 
-	if (sscanf(buf, ":%d", oidx) == 1) {
+	if (strcmp(buf, "any") == 0) {
+		*idx = select_target();
+		*wrap = 0;
+		return (*idx < 0) ? -1 : 0;
+	} else if (sscanf(buf, ":%d", oidx) == 1) {
 		*wrap = 1;
 	} else if (sscanf(buf, "%d", oidx) == 1) {
 		*wrap = 0;
@@ -361,7 +1531,7 @@ svc_id_index_handler(struct russ_sess *sess) {
 	sconn = sess->sconn;
 	req = sess->req;
 
-	if (get_valid_id_index(req->spath, &idx, &oidx, &wrap, targetslist.n) < 0) {
+	if (get_valid_id_index(req->spath, &idx, &oidx, &wrap, get_ntargets()) < 0) {
 		russ_sconn_fatal(sconn, RUSS_MSG_NOSERVICE, RUSS_EXIT_FAILURE);
 		exit(0);
 	}
@@ -372,6 +1542,33 @@ svc_id_index_handler(struct russ_sess *sess) {
 	}
 }
 
+/**
+* Set up spath to service tail at target: tail itself for the local
+* host (see is_target_localhost()); <relay_addr>/<userhost>/<tail>
+* otherwise.
+*
+* @param idx		target index
+* @param tail		service path at target
+* @param buf		output buffer
+* @param bufsize	size of buf
+* @return		0 on success; -1 on failure
+*/
+int
+get_target_spath(int idx, char *tail, char *buf, int bufsize) {
+	char	*relay_addr = NULL, *userhost = NULL;
+
+	if ((userhost = get_target_userhost(idx)) == NULL) {
+		return -1;
+	}
+	if (is_target_localhost(idx)) {
+		return (russ_snprintf(buf, bufsize, "%s", tail) < 0) ? -1 : 0;
+	}
+	if ((relay_addr = russ_conf_getref(conf, "net", "relay_addr")) == NULL) {
+		relay_addr = DEFAULT_RELAY_ADDR;
+	}
+	return (russ_snprintf(buf, bufsize, "%s/%s/%s", relay_addr, userhost, tail) < 0) ? -1 : 0;
+}
+
 /**
 * Handler for the /run/<index>/... service.
 *
@@ -384,15 +1581,15 @@ void
 svc_id_index_other_handler(struct russ_sess *sess) {
 	struct russ_sconn	*sconn = NULL;
 	struct russ_req		*req = NULL;
-	struct russ_conf	*targetconf = NULL;
 	char			new_spath[RUSS_REQ_SPATH_MAX];
-	char			*relay_addr = NULL, *tail = NULL, *userhost = NULL;
-	int			i, idx, n, oidx, wrap = 0;
+	char			*tail = NULL;
+	int			idx, oidx, wrap = 0;
 
 	sconn = sess->sconn;
 	req = sess->req;
 
-	if (get_valid_id_index(req->spath, &idx, &oidx, &wrap, targetslist.n) < 0) {
+	if ((get_valid_id_index(req->spath, &idx, &oidx, &wrap, get_ntargets()) < 0)
+		|| (get_target_userhost(idx) == NULL)) {
 		russ_sconn_fatal(sconn, RUSS_MSG_NOSERVICE, RUSS_EXIT_FAILURE);
 		exit(0);
 	}
@@ -400,25 +1597,396 @@ svc_id_index_other_handler(struct russ_sess *sess) {
 	/* set up new spath */
 	tail = strchr(req->spath+1, '/');
 	tail = strchr(tail+1, '/')+1;
-	targetconf = targetslist.targetconfs[idx];
-	userhost = russ_conf_get(targetconf, "target", "userhost", NULL);
-	if ((strchr(userhost, '@') == NULL) && (is_localhost(userhost))) {
-		if (russ_snprintf(new_spath, sizeof(new_spath), "%s", tail) < 0) {
-			russ_sconn_fatal(sconn, "error: cannot patch spath", RUSS_EXIT_FAILURE);
-			exit(0);
+	if (get_target_spath(idx, tail, new_spath, sizeof(new_spath)) < 0) {
+		russ_sconn_fatal(sconn, "error: cannot patch spath", RUSS_EXIT_FAILURE);
+		exit(0);
+	}
+	req->spath = russ_free(req->spath);
+	req->spath = strdup(new_spath);
+
+	redialandsplice_target(sconn, russ_to_deadline(DEFAULT_DIAL_TIMEOUT), req, idx);
+}
+
+void
+svc_multi_handler(struct russ_sess *sess) {
+	struct russ_sconn	*sconn = NULL;
+	struct russ_req		*req = NULL;
+
+	sconn = sess->sconn;
+	req = sess->req;
+
+	if (req->opnum == RUSS_OPNUM_LIST) {
+		russ_sconn_fatal(sconn, RUSS_MSG_NOLIST, RUSS_EXIT_SUCCESS);
+		exit(0);
+	}
+}
+
+/**
+* Get target indexes for a selector (as for rurun target specs):
+* a comma separated list of items
+*	a - target a
+*	a:b - targets a to b (not included) with step 1; b defaults
+*	to the number of targets
+*	a:b:c - targets a to b (not included) with step c (may be
+*	negative; a and b then default to the last target and
+*	before the first)
+*
+* As for /id, a negative index starts at the last target (-1 is
+* the last target).
+*
+* Targets selected more than once are only included once (the
+* first time), so there are at most ntargets indexes.
+*
+* The selector component may be followed by options (?...); these
+* are set to *optionsp (if not NULL).
+*
+* @param spath		service path (/multi/<selector>...)
+* @param ntargets	# of targets
+* @param[out] idxsp	array of target indexes (malloc'ed)
+* @param[out] optionsp	NULL-terminated options list (may be NULL)
+* @return		# of target indexes; -1 on failure
+*/
+int
+get_valid_selector(char *spath, int ntargets, int **idxsp, char ***optionsp) {
+	char	**options = NULL;
+	char	*comp = NULL, *item = NULL, *p = NULL, *q = NULL, *saveptr = NULL;
+	char	*selected = NULL;
+	int	*idxs = NULL;
+	int64_t	i;
+	int	a, b, c, n;
+
+	*idxsp = NULL;
+	if ((ntargets < 1)
+		|| ((comp = russ_str_dup_comp(spath, '/', 2)) == NULL)
+		|| ((options = russ_sarray0_new_split(comp, "?", 0)) == NULL)
+		|| (options[0] == NULL)
+		|| ((selected = russ_malloc(ntargets)) == NULL)
+		|| ((idxs = russ_malloc(sizeof(int)*ntargets)) == NULL)) {
+		goto fail;
+	}
+	memset(selected, 0, ntargets);
+
+	n = 0;
+	for (item = strtok_r(options[0], ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		c = 1;
+		if ((p = strchr(item, ':')) == NULL) {
+			if (sscanf(item, "%d", &a) != 1) {
+				goto fail;
+			}
+			a = (a < 0) ? a+ntargets : a;
+			b = a+1;
+		} else {
+			if (((q = strchr(p+1, ':')) != NULL)
+				&& ((sscanf(q+1, "%d", &c) != 1) || (c == 0))) {
+				goto fail;
+			}
+			a = (c > 0) ? 0 : ntargets-1;
+			b = (c > 0) ? ntargets : -1;
+			if (item[0] != ':') {
+				if (sscanf(item, "%d", &a) != 1) {
+					goto fail;
+				}
+				a = (a < 0) ? a+ntargets : a;
+			}
+			if ((p[1] != ':') && (p[1] != '\0')) {
+				if (sscanf(p+1, "%d", &b) != 1) {
+					goto fail;
+				}
+				b = (b < 0) ? b+ntargets : b;
+			}
+		}
+		for (i = a; (c > 0) ? (i < b) : (i > b); i += c) {
+			if ((i < 0) || (i >= ntargets)) {
+				goto fail;
+			}
+			if (!selected[i]) {
+				selected[i] = 1;
+				idxs[n++] = i;
+			}
+		}
+	}
+	if (n == 0) {
+		goto fail;
+	}
+
+	comp = russ_free(comp);
+	selected = russ_free(selected);
+	if (optionsp != NULL) {
+		*optionsp = options;
+	} else {
+		options = russ_sarray0_free(options);
+	}
+	*idxsp = idxs;
+	return n;
+
+fail:
+	comp = russ_free(comp);
+	options = russ_sarray0_free(options);
+	selected = russ_free(selected);
+	idxs = russ_free(idxs);
+	return -1;
+}
+
+void
+svc_multi_selector_handler(struct russ_sess *sess) {
+	struct russ_sconn	*sconn = NULL;
+	struct russ_req		*req = NULL;
+	int			*idxs = NULL;
+
+	sconn = sess->sconn;
+	req = sess->req;
+
+	if (get_valid_selector(req->spath, get_ntargets(), &idxs, NULL) < 0) {
+		russ_sconn_fatal(sconn, RUSS_MSG_NOSERVICE, RUSS_EXIT_FAILURE);
+		exit(0);
+	}
+	idxs = russ_free(idxs);
+
+	if (req->opnum == RUSS_OPNUM_LIST) {
+		russ_sconn_fatal(sconn, RUSS_MSG_NOLIST, RUSS_EXIT_SUCCESS);
+		exit(0);
+	}
+}
+
+/**
+* Write complete lines of a target stream with the target prefix.
+*
+* A partial line is kept (the line buffer grows as needed) until it
+* is complete. Only a line longer than MULTI_LINE_MAX is written in
+* pieces: the prefix goes before the first piece and no newline is
+* added between pieces.
+*
+* @param mt		multi target object
+* @param fd		output fd
+* @param index		stream index (1 or 2)
+* @param flush		write (and end) partial line too
+*/
+void
+multi_write_lines(struct multitarget *mt, int fd, int index, int flush) {
+	struct russ_buf	*lbuf = mt->lbufs[index];
+	char		*line = NULL, *nl = NULL, *data = NULL;
+	int		cap, n;
+
+	while (lbuf->off < lbuf->len) {
+		line = &lbuf->data[lbuf->off];
+		n = lbuf->len-lbuf->off;
+		if ((nl = memchr(line, '\n', n)) != NULL) {
+			n = nl-line+1;
+		} else if (!flush) {
+			break;
+		}
+		if (!mt->midline[index]) {
+			russ_dprintf(fd, "%s: ", mt->userhost);
+		}
+		russ_writen(fd, line, n);
+		mt->midline[index] = (nl == NULL);
+		lbuf->off += n;
+	}
+	if ((flush) && (mt->midline[index])) {
+		russ_writen(fd, "\n", 1);
+		mt->midline[index] = 0;
+	}
+	/* move partial line to front */
+	memmove(lbuf->data, &lbuf->data[lbuf->off], lbuf->len-lbuf->off);
+	lbuf->len -= lbuf->off;
+	lbuf->off = 0;
+
+	/* full buffer (no newline): grow it, or write a piece */
+	if (lbuf->len == lbuf->cap) {
+		cap = RUSS__MIN(2*lbuf->cap, MULTI_LINE_MAX);
+		if ((cap > lbuf->cap) && ((data = realloc(lbuf->data, cap)) != NULL)) {
+			lbuf->data = data;
+			lbuf->cap = cap;
+		} else {
+			if (!mt->midline[index]) {
+				russ_dprintf(fd, "%s: ", mt->userhost);
+			}
+			russ_writen(fd, lbuf->data, lbuf->len);
+			mt->midline[index] = 1;
+			lbuf->len = 0;
+		}
+	}
+}
+
+/**
+* Output callback: merge target stdout/stderr data into the client
+* stdout/stderr, optionally prefixed by line.
+*/
+void
+multi_outcb(struct russ_dialreq *dreq, int index, char *buf, int n, void *cbarg) {
+	struct multi		*multi = cbarg;
+	struct multitarget	*mt = dreq->data;
+	struct russ_buf		*lbuf = NULL;
+	int			fd, m;
+
+	fd = multi->sconn->fds[index];
+	if (!multi->prefix) {
+		russ_writen(fd, buf, n);
+		return;
+	}
+	if ((mt->lbufs[index] == NULL)
+		&& ((mt->lbufs[index] = russ_buf_new(MULTI_LINE_INIT)) == NULL)) {
+		russ_writen(fd, buf, n);
+		return;
+	}
+	lbuf = mt->lbufs[index];
+	while (n > 0) {
+		m = RUSS__MIN(n, lbuf->cap-lbuf->len);
+		memcpy(&lbuf->data[lbuf->len], buf, m);
+		lbuf->len += m;
+		buf += m;
+		n -= m;
+		multi_write_lines(mt, fd, index, 0);
+	}
+}
+
+/**
+* Completion callback: flush partial lines and report target status
+* on the status fd.
+*/
+void
+multi_cb(struct russ_dialreq *dreq, void *cbarg) {
+	struct multi		*multi = cbarg;
+	struct multitarget	*mt = dreq->data;
+	int			i, fd;
+
+	for (i = 1; i < 3; i++) {
+		if (mt->lbufs[i] != NULL) {
+			multi_write_lines(mt, multi->sconn->fds[i], i, 1);
+			mt->lbufs[i] = russ_buf_free(mt->lbufs[i]);
 		}
+	}
+
+	fd = multi->sconn->fds[MULTI_STATUS_FDIDX];
+	if (dreq->wrv == RUSS_WAIT_OK) {
+		russ_dprintf(fd, "%d %s exit=%d\n", mt->idx, mt->userhost, dreq->exitst);
+	} else {
+		russ_dprintf(fd, "%d %s exit=none (%s)\n", mt->idx, mt->userhost,
+			(dreq->wrv == RUSS_WAIT_TIMEOUT) ? "timeout" : "failure");
+	}
+	if ((dreq->wrv == RUSS_WAIT_OK) && (dreq->exitst == 0)) {
+		multi->nok++;
 	} else {
-		relay_addr = russ_conf_get(conf, "net", "relay_addr", DEFAULT_RELAY_ADDR);
-		if (russ_snprintf(new_spath, sizeof(new_spath), "%s/%s/%s", relay_addr, userhost, tail) < 0) {
+		multi->nfailed++;
+	}
+}
+
+/**
+* Handler for the /multi/<selector>/... service.
+*
+* Dials ... at each selected target (as for /id/<index>/...)
+* concurrently, from this process, and merges their stdout and
+* stderr. Target stdin is closed. The status of each target and a
+* summary are output to the status fd (at MULTI_STATUS_FDIDX); the
+* exit status is 0 if all targets exit with 0.
+*
+* Options (after the selector):
+*	?n=<concurrency> - max # of targets in progress
+*	?prefix - prefix output lines with "<userhost>: "
+*	?timeout=<ms> - per target timeout (<= 0 for none)
+*
+* @param sess		session object
+*/
+void
+svc_multi_selector_other_handler(struct russ_sess *sess) {
+	struct russ_sconn	*sconn = NULL;
+	struct russ_req		*req = NULL;
+	struct russ_dialreq	*dreqs = NULL;
+	struct multitarget	*mts = NULL;
+	struct multi		multi;
+	char			**options = NULL;
+	char			*tail = NULL;
+	int			cfds[RUSS_CONN_NFDS], pfds[2];
+	int			*idxs = NULL;
+	int			concurrency, timeout, i, n;
+
+	sconn = sess->sconn;
+	req = sess->req;
+
+	/* answer: std fds and status fd (client stdin is at pfds[1]) */
+	for (i = 0; i < MULTI_STATUS_FDIDX+1; i++) {
+		if (pipe(pfds) < 0) {
+			fprintf(stderr, "error: cannot create pipes\n");
+			exit(0);
+		}
+		cfds[i] = (i == 0) ? pfds[1] : pfds[0];
+		sconn->fds[i] = (i == 0) ? pfds[0] : pfds[1];
+	}
+	if (russ_sconn_answer(sconn, MULTI_STATUS_FDIDX+1, cfds) < 0) {
+		exit(0);
+	}
+
+	if ((n = get_valid_selector(req->spath, get_ntargets(), &idxs, &options)) < 0) {
+		russ_sconn_fatal(sconn, RUSS_MSG_NOSERVICE, RUSS_EXIT_FAILURE);
+		exit(0);
+	}
+	concurrency = russ_conf_getint(conf, "multi", "concurrency", DEFAULT_MULTI_CONCURRENCY);
+	timeout = russ_conf_getint(conf, "multi", "timeout", DEFAULT_MULTI_TIMEOUT);
+	multi.sconn = sconn;
+	multi.prefix = 0;
+	multi.nok = 0;
+	multi.nfailed = 0;
+	for (i = 1; options[i] != NULL; i++) {
+		if (strncmp(options[i], "n=", 2) == 0) {
+			concurrency = atoi(options[i]+2);
+		} else if (strncmp(options[i], "timeout=", 8) == 0) {
+			timeout = atoi(options[i]+8);
+		} else if (strcmp(options[i], "prefix") == 0) {
+			multi.prefix = 1;
+		} else {
+			russ_sconn_fatal(sconn, "error: bad option", RUSS_EXIT_FAILURE);
+			exit(0);
+		}
+	}
+	concurrency = RUSS__MAX(concurrency, 1);
+
+	/* switch user (as for redial) */
+	if ((russ_switch_userinitgroups(sconn->creds.uid, sconn->creds.gid) < 0)
+		|| (russ_env_reset() < 0)
+		|| (chdir("/") < 0)) {
+		russ_sconn_fatal(sconn, RUSS_MSG_NOSWITCHUSER, RUSS_EXIT_FAILURE);
+		exit(0);
+	}
+
+	/* set up requests */
+	tail = strchr(req->spath+1, '/');
+	tail = strchr(tail+1, '/')+1;
+	if (((dreqs = russ_malloc(sizeof(struct russ_dialreq)*n)) == NULL)
+		|| ((mts = russ_malloc(sizeof(struct multitarget)*n)) == NULL)) {
+		russ_sconn_fatal(sconn, "error: cannot allocate memory", RUSS_EXIT_FAILURE);
+		exit(0);
+	}
+	for (i = 0; i < n; i++) {
+		mts[i].idx = idxs[i];
+		mts[i].userhost = get_target_userhost(idxs[i]);
+		mts[i].lbufs[1] = NULL;
+		mts[i].lbufs[2] = NULL;
+		mts[i].midline[1] = 0;
+		mts[i].midline[2] = 0;
+		if ((mts[i].userhost == NULL)
+			|| (get_target_spath(idxs[i], tail, mts[i].spath, sizeof(mts[i].spath)) < 0)) {
 			russ_sconn_fatal(sconn, "error: cannot patch spath", RUSS_EXIT_FAILURE);
 			exit(0);
 		}
-		relay_addr = russ_free(relay_addr);
+		dreqs[i].op = req->op;
+		dreqs[i].spath = mts[i].spath;
+		dreqs[i].attrv = req->attrv;
+		dreqs[i].argv = req->argv;
+		dreqs[i].rbufs[0] = NULL;
+		dreqs[i].rbufs[1] = NULL;
+		dreqs[i].rbufs[2] = NULL;
+		dreqs[i].timeout = timeout;
+		dreqs[i].outcb = multi_outcb;
+		dreqs[i].data = &mts[i];
 	}
-	req->spath = russ_free(req->spath);
-	req->spath = strdup(new_spath);
 
-	russ_sconn_redialandsplice(sconn, russ_to_deadline(DEFAULT_DIAL_TIMEOUT), req);
+	if (russ_dialv_many(RUSS_DEADLINE_NEVER, dreqs, n, concurrency, multi_cb, &multi) < 0) {
+		russ_sconn_fatal(sconn, RUSS_MSG_NODIAL, RUSS_EXIT_FAILURE);
+		exit(0);
+	}
+	russ_dprintf(sconn->fds[MULTI_STATUS_FDIDX], "total=%d ok=%d failed=%d\n", n, multi.nok, multi.nfailed);
+	russ_sconn_exit(sconn, (multi.nfailed == 0) ? RUSS_EXIT_SUCCESS : RUSS_EXIT_FAILURE);
+	exit(0);
 }
 
 void
@@ -508,7 +2076,6 @@ void
 svc_run_index_other_handler(struct russ_sess *sess) {
 	struct russ_sconn	*sconn = NULL;
 	struct russ_req		*req = NULL;
-	struct russ_conf	*targetconf = NULL;
 	char			new_spath[RUSS_REQ_SPATH_MAX];
 	char			*relay_addr = NULL, *tail = NULL;
 	char			*userhost = NULL, *cgname = NULL, *exec_spath = NULL;
@@ -517,7 +2084,8 @@ svc_run_index_other_handler(struct russ_sess *sess) {
 	sconn = sess->sconn;
 	req = sess->req;
 
-	if (get_valid_id_index(req->spath, &idx, &oidx, &wrap, targetslist.n) < 0) {
+	if ((get_valid_id_index(req->spath, &idx, &oidx, &wrap, get_ntargets()) < 0)
+		|| ((userhost = get_target_userhost(idx)) == NULL)) {
 		russ_sconn_fatal(sconn, RUSS_MSG_NOSERVICE, RUSS_EXIT_FAILURE);
 		exit(0);
 	}
@@ -527,10 +2095,11 @@ svc_run_index_other_handler(struct russ_sess *sess) {
 	tail = strchr(tail+1, '/')+1;
 	relay_addr = russ_conf_get(conf, "net", "relay_addr", DEFAULT_RELAY_ADDR);
 	exec_spath = "+/exec";
-	targetconf = targetslist.targetconfs[idx];
-	userhost = russ_conf_get(targetconf, "target", "userhost", NULL);
-	cgname = russ_conf_get(targetconf, "target", "cgroup", NULL);
-	russ_str_replace_char(cgname, '/', ':');
+	if ((cgname = get_target_cgroup(idx)) != NULL) {
+		/* copy: index is read-only */
+		cgname = strdup(cgname);
+		russ_str_replace_char(cgname, '/', ':');
+	}
 
 	if ((cgname == NULL) || (strcmp(cgname, "") == 0)) {
 		n = russ_snprintf(new_spath, sizeof(new_spath), "%s/%s/%s/%s", relay_addr, userhost, exec_spath, tail);
@@ -544,59 +2113,22 @@ svc_run_index_other_handler(struct russ_sess *sess) {
 	req->spath = russ_free(req->spath);
 	req->spath = strdup(new_spath);
 
-	russ_sconn_redialandsplice(sconn, russ_to_deadline(DEFAULT_DIAL_TIMEOUT), req);
-}
-
-/**
-* Copy targetsconf info to targetslist.targetconfs.
-*
-* @return       0 on success; -1 on failure
-*/
-int
-load_targetslist(void) {
-    struct russ_conf    *targetconf = NULL;
-    char            secname[128];
-    int         i;
-
-    targetslist.n = 0;
-
-    for (i = 0; i < MAX_TARGETS; i++) {
-        if ((russ_snprintf(secname, sizeof(secname), "target.%d", i) < 0)
-            || ((targetconf = russ_conf_new()) == NULL)
-            || (russ_conf_update_section(targetconf, "target", targetsconf, secname) < 0)) {
-            targetconf = russ_free(targetconf);
-            return -1;
-        }
-        if (!russ_conf_has_option(targetconf, "target", "id")) {
-            targetconf = russ_free(targetconf);
-            break;
-        }
-        targetslist.targetconfs[i] = targetconf;
-        targetslist.n++;
-
-    }
-    return 0;
+	redialandsplice_target(sconn, russ_to_deadline(DEFAULT_DIAL_TIMEOUT), req, idx);
 }
 
 /**
 * Load conf-style targetsfile.
 *
-* targetlist:
-* * targetslist.targetconfs holds all target conf info
-* * each targetconf has a single section named "target"
-* * each target holds: id, userhost, cgroup
-* 
 * targetsconf:
-* * all targets have info like targetlist
 * * there is a "target.<idx>" section for each target
+* * each target holds: id, userhost, cgroup
 *
 * @param filename	targets filename
 * @return		0 on success; -1 on failure
 */
 int
 load_targetsfile(char *filename) {
-	if ((russ_conf_read(targetsconf, filename) < 0)
-		|| (load_targetslist() < 0)) {
+	if (russ_conf_read(targetsconf, filename) < 0) {
 		return -1;
 	}
 	return 0;
@@ -605,37 +2137,27 @@ load_targetsfile(char *filename) {
 /**
 * Load legacy format targets list from file.
 *
-* Both targetsconf and targetslist are set up.
-*
-* See load_targetsfile().
+* targetsconf is set up as for load_targetsfile().
 *
 * @param filename	targets filename
 * @return		0 on success; -1 on failure
 */
 int
 load_targetsfile_legacy(char *filename) {
-	struct russ_conf	*targetconf = NULL;
 	FILE			*f = NULL;
 	size_t			line_size;
 	ssize_t			nbytes;
 	char			targetid[128];
 	char			secname[128];
 	char			*line = NULL, *p = NULL;
-	int			i;
+	int			i, rv = -1;
 
 	if ((f = fopen(filename, "r")) == NULL) {
 		return -1;
 	}
 
-	/* initialize */
-	targetslist.n = 0;
-	for (i = 0; i < MAX_TARGETS; i++) {
-		targetslist.targetconfs[i] = NULL;
-	}
-
 	/* set */
-	for (i = 0; i < MAX_TARGETS; i++) {
-		line = NULL;
+	for (i = 0; i < MAX_TARGETS; ) {
 		if ((nbytes = getline(&line, &line_size, f)) < 0) {
 			break;
 		}
@@ -644,39 +2166,81 @@ load_targetsfile_legacy(char *filename) {
 		}
 		if ((line[0] == '\0') || (line[0] == '#')) {
 			/* ignore empty and comment lines */
-			line = russ_free(line);
 			continue;
 		}
 		for (p = line; (!isblank(*p)) && (*p != '\0'); p++);
 		if (*p != '\0') {
 			*p = '\0';
 			for (p++; isblank(*p); p++);
-			if ((p != NULL) && ((p = strdup(p)) == NULL)) {
-				/* fatal: OOM */
-				return -1;
-			}
 		}
 
-		/* add target conf
-		*
-		* note: updating a targetsconf section from a targetconf
-		* is more efficient than updating targetsconf for each item.
-		*/
+		/* add target section */
 		if ((russ_snprintf(secname, sizeof(secname), "target.%d", i) < 0)
 			|| (russ_snprintf(targetid, sizeof(targetid), "%d", i) < 0)
-			|| ((targetconf = russ_conf_new()) == NULL)) {
-			return -1;
+			|| (russ_conf_set2(targetsconf, secname, "id", targetid) < 0)
+			|| (russ_conf_set2(targetsconf, secname, "userhost", line) < 0)
+			|| (russ_conf_set2(targetsconf, secname, "cgroup", p) < 0)) {
+			goto cleanup;
 		}
-		if ((russ_conf_set2(targetconf, "target", "id", targetid) < 0)
-			|| (russ_conf_set2(targetconf, "target", "userhost", line) < 0)
-			|| (russ_conf_set2(targetconf, "target", "cgroup", p) < 0)
-			|| (russ_conf_update_section(targetsconf, secname, targetconf, "target") < 0)) {
-			return -1;
+		i++;
+	}
+	rv = 0;
+cleanup:
+	line = russ_free(line);
+	fclose(f);
+	return rv;
+}
+
+/**
+* Load targets: map the compiled targets index if it is up to date;
+* otherwise, load the targets file and (re)build the index.
+*
+* The targets index is only written to a file if indexfilename is
+* given.
+*
+* @param filename	targets filename
+* @param filetype	targets file type ("conf" or "legacy")
+* @param indexfilename	targets index filename (may be NULL)
+* @return		0 on success; -1 on failure
+*/
+int
+load_targets(char *filename, char *filetype, char *indexfilename) {
+	struct stat	st;
+
+	if (stat(filename, &st) < 0) {
+		return -1;
+	}
+	if ((indexfilename != NULL) && (targetsindex_map(&targetsindex, indexfilename, &st) == 0)) {
+		return 0;
+	}
+
+	if ((targetsconf = russ_conf_new()) == NULL) {
+		return -1;
+	}
+	if (strcmp(filetype, "conf") == 0) {
+		if (load_targetsfile(filename) < 0) {
+			goto fail;
+		}
+	} else if (strcmp(filetype, "legacy") == 0) {
+		if (load_targetsfile_legacy(filename) < 0) {
+			goto fail;
 		}
-		targetslist.targetconfs[i] = targetconf;
-		targetslist.n++;
+	} else {
+		goto fail;
+	}
+	if (targetsindex_build(&targetsindex, targetsconf, &st) < 0) {
+		goto fail;
+	}
+	targetsconf = russ_conf_free(targetsconf);
+
+	if ((indexfilename != NULL) && (targetsindex_write(&targetsindex, indexfilename) < 0)) {
+		fprintf(stderr, "warning: cannot write targets index file (%s)\n", indexfilename);
 	}
 	return 0;
+
+fail:
+	targetsconf = russ_conf_free(targetsconf);
+	return -1;
 }
 
 void
@@ -689,6 +2253,23 @@ print_usage(char **argv) {
 "\n"
 "The targets file is set in the newtargets:filename configuration\n"
 "setting or the targets:filename setting for legacy target files.\n"
+"\n"
+"If targets:indexfilename is set, a compiled targets index is kept\n"
+"in that file and mapped at startup; it is rebuilt when the targets\n"
+"file changes.\n"
+"\n"
+"If targets:fastlocalhost is 1, targets (host only) which are the\n"
+"local host are dialed directly. The local host names/addresses and\n"
+"targets are resolved on first use by the session and cached; the\n"
+"cache is invalidated on SIGHUP or every targets:localhostttl\n"
+"seconds (if > 0).\n"
+"\n"
+"Targets for /run/any (and /id/any) are selected by the\n"
+"select:policy setting (leastout, p2c (default), or ewma) using\n"
+"per-target dial outcomes and latencies (EWMA weight\n"
+"select:ewmaalpha). Targets failing to connect are skipped/failed\n"
+"fast for select:backoff ms (0 to disable), doubling up to\n"
+"select:backoffmax ms.\n"
 );
 }
 
@@ -697,6 +2278,7 @@ main(int argc, char **argv) {
 	struct russ_svcnode	*node = NULL;
 	struct russ_svr		*svr = NULL;
 	char			*targetsfilename = NULL, *targetsfiletype = NULL;
+	char			*targetsindexfilename = NULL, *policy = NULL;
 
 	signal(SIGPIPE, SIG_IGN);
 
@@ -708,9 +2290,6 @@ main(int argc, char **argv) {
 		exit(1);
 	}
 
-	targetslist.n = 0;
-	targetsconf = russ_conf_new();
-
 	if ((targetsfilename = russ_conf_get(conf, "targets", "filename", NULL)) == NULL) {
 		fprintf(stderr, "error: targets file not specified\n");
 		exit(1);
@@ -720,23 +2299,50 @@ main(int argc, char **argv) {
 		exit(1);
 	}
 
-	if (strcmp(targetsfiletype, "conf") == 0) {
-		if (load_targetsfile(targetsfilename) < 0) {
-			fprintf(stderr, "error: bad/missing targets file\n");
-			exit(1);
-		}
-	} else if (strcmp(targetsfiletype, "legacy") == 0) {
-		if (load_targetsfile_legacy(targetsfilename) < 0) {
-			fprintf(stderr, "error: bad/missing targets file\n");
-			exit(1);
-		}
-	} else {
+	if ((strcmp(targetsfiletype, "conf") != 0) && (strcmp(targetsfiletype, "legacy") != 0)) {
 		fprintf(stderr, "error: targets file type not supported\n");
 		exit(1);
 	}
+	targetsindexfilename = russ_conf_get(conf, "targets", "indexfilename", NULL);
+	if (load_targets(targetsfilename, targetsfiletype, targetsindexfilename) < 0) {
+		fprintf(stderr, "error: bad/missing targets file\n");
+		exit(1);
+	}
 
 	if (russ_conf_getint(conf, "targets", "fastlocalhost", 0) == 1) {
-		set_fqlocalhostname();
+		localhost.enabled = 1;
+		localhost.ttl = russ_conf_getint(conf, "targets", "localhostttl", 0);
+		if (init_localhost(get_ntargets()) < 0) {
+			fprintf(stderr, "error: cannot set up localhost cache\n");
+			exit(1);
+		}
+		signal(SIGHUP, sighup_handler);
+	}
+
+	if ((policy = russ_conf_get(conf, "select", "policy", DEFAULT_SELECT_POLICY)) == NULL) {
+		fprintf(stderr, "error: cannot get selection policy\n");
+		exit(1);
+	}
+	if (strcmp(policy, "leastout") == 0) {
+		selection.policy = SELECT_POLICY_LEASTOUT;
+	} else if (strcmp(policy, "p2c") == 0) {
+		selection.policy = SELECT_POLICY_P2C;
+	} else if (strcmp(policy, "ewma") == 0) {
+		selection.policy = SELECT_POLICY_EWMA;
+	} else {
+		fprintf(stderr, "error: selection policy not supported\n");
+		exit(1);
+	}
+	policy = russ_free(policy);
+	selection.backoff = russ_conf_getint(conf, "select", "backoff", DEFAULT_SELECT_BACKOFF);
+	selection.backoffmax = russ_conf_getint(conf, "select", "backoffmax", DEFAULT_SELECT_BACKOFFMAX);
+	selection.alpha = russ_conf_getfloat(conf, "select", "ewmaalpha", DEFAULT_SELECT_EWMAALPHA);
+	if ((selection.alpha <= 0.0) || (selection.alpha > 1.0)) {
+		selection.alpha = DEFAULT_SELECT_EWMAALPHA;
+	}
+	if (init_targetstats(get_ntargets()) < 0) {
+		fprintf(stderr, "error: cannot set up target stats\n");
+		exit(1);
 	}
 
 	if (((svr = russ_init(conf)) == NULL)
@@ -744,6 +2350,7 @@ main(int argc, char **argv) {
 		|| (russ_svr_set_autoswitchuser(svr, 1) < 0)
 		|| (russ_svr_set_matchclientuser(svr, 1) < 0)
 		|| (russ_svr_set_help(svr, HELP) < 0)
+		|| (russ_svr_set_accepthandler(svr, accepthandler) < 0)
 
 		|| ((node = russ_svcnode_add(svr->root, "count", svc_count_handler)) == NULL)
 		|| ((node = russ_svcnode_add(svr->root, "gettargets", svc_gettargets_handler)) == NULL)
@@ -764,6 +2371,14 @@ main(int argc, char **argv) {
 		|| (russ_svcnode_set_virtual(node, 1) < 0)
 		|| (russ_svcnode_set_autoanswer(node, 0) < 0)
 
+		|| ((node = russ_svcnode_add(svr->root, "multi", svc_multi_handler)) == NULL)
+		|| ((node = russ_svcnode_add(node, "*", svc_multi_selector_handler)) == NULL)
+		|| (russ_svcnode_set_wildcard(node, 1) < 0)
+		|| ((node = russ_svcnode_add(node, "*", svc_multi_selector_other_handler)) == NULL)
+		|| (russ_svcnode_set_wildcard(node, 1) < 0)
+		|| (russ_svcnode_set_virtual(node, 1) < 0)
+		|| (russ_svcnode_set_autoanswer(node, 0) < 0)
+
 		|| ((node = russ_svcnode_add(svr->root, "net", svc_net_handler)) == NULL)
 		|| ((node = russ_svcnode_add(node, "*", svc_net_userhost_handler)) == NULL)
 		|| (russ_svcnode_set_wildcard(node, 1) < 0)
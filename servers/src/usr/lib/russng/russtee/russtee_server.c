@@ -22,13 +22,16 @@
 # license--end
 */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -41,9 +44,54 @@ extern char **environ;
 #define BUFSIZE		(1<<15)
 #define BUFSIZE_MAX	(1<<20)
 
+#define CAPTURE_RINGSIZE	(1<<20)
+#define CAPTURE_SPILLMAX	(1<<26)
+
+#define CAPTURE_OVERFLOW_DROP	0
+#define CAPTURE_OVERFLOW_BLOCK	1
+#define CAPTURE_OVERFLOW_SPILL	2
+
+/**
+* Capture of one connection fd.
+*
+* Captured data is copied into a ring and written to the capture
+* file by a writer thread so that a slow file does not stall the
+* relay. When the ring is full, the overflow policy applies: drop
+* the data, block the relay until there is room, or spill (grow the
+* ring, up to maxcap, then drop).
+*/
+struct capture {
+	int		fd;		/**< capture file; -1 if none */
+	char		*path;		/**< capture file path */
+	char		*data;		/**< ring */
+	int		cap;		/**< ring capacity */
+	int		maxcap;		/**< ring capacity limit (spill) */
+	int		head;		/**< offset of first unwritten byte */
+	int		len;		/**< # of unwritten bytes */
+	int		overflow;	/**< overflow policy */
+	int		done;		/**< no more data; writer to finish */
+	int		failed;		/**< capture file write failed */
+	char		*inuse;		/**< ring being written (outside lock) */
+	char		*retired;	/**< replaced ring to free after write */
+	unsigned long	nseen;		/**< stream nrbytes already captured */
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;		/**< data or room available */
+
+	/* stats */
+	unsigned long	ncaptured;	/**< bytes accepted */
+	unsigned long	nwritten;	/**< bytes written */
+	unsigned long	ndropped;	/**< bytes lost */
+	unsigned long	nwrites;	/**< writev calls */
+	int		maxlen;		/**< high-water mark of ring */
+};
+
 /* global */
 struct russ_conf	*conf = NULL;
-int			fds[RUSS_CONN_NFDS];
+struct capture		captures[RUSS_CONN_NFDS];
+int			capture_ringsize = CAPTURE_RINGSIZE;
+int			capture_spillmax = CAPTURE_SPILLMAX;
+int			capture_overflow = CAPTURE_OVERFLOW_DROP;
 const char		*HELP = 
 "Captures data transferred between client and server.\n"
 "\n"
@@ -55,36 +103,239 @@ const char		*HELP =
 "The attribute value must take one of the following forms:\n"
 "fixed:<path0>:...\n"
 "    Specifies fixed paths for connection fds, where path0\n"
-"    corresponds to fd 0, etc. Specify empty paths to not capture.\n";
+"    corresponds to fd 0, etc. Specify empty paths to not capture.\n"
+"\n"
+"Capture files are written in the background. Statistics for each\n"
+"capture are saved to <path>.stats; lost=1 if data was dropped.\n";
 
 char			*FUTURE_HELP = "dir:<path>\n"
 "    Specifies a directory path under which files are created and\n"
 "    to which data is saved. Filenames are <timestamp>-<fd>.\n";
 
+/**
+* Writer thread: drain ring to capture file with writev().
+*
+* @param arg		capture object
+* @return		NULL
+*/
+void *
+capture_writer(void *arg) {
+	struct capture	*self = arg;
+	struct iovec	iov[2];
+	ssize_t		n;
+
+	pthread_mutex_lock(&self->lock);
+	while (1) {
+		while ((self->len == 0) && (!self->done)) {
+			pthread_cond_wait(&self->cond, &self->lock);
+		}
+		if (self->len == 0) {
+			break;
+		}
+
+		/* everything held, in one call */
+		iov[0].iov_base = self->data+self->head;
+		iov[0].iov_len = RUSS__MIN(self->len, self->cap-self->head);
+		iov[1].iov_base = self->data;
+		iov[1].iov_len = self->len-iov[0].iov_len;
+		self->inuse = self->data;
+		pthread_mutex_unlock(&self->lock);
+
+		while (((n = writev(self->fd, iov, (iov[1].iov_len > 0) ? 2 : 1)) < 0) && (errno == EINTR));
+
+		pthread_mutex_lock(&self->lock);
+		self->inuse = NULL;
+		self->retired = russ_free(self->retired);
+		if (n < 0) {
+			/* give up on the file; lose what is held */
+			self->failed = 1;
+			self->ndropped += self->len;
+			self->len = 0;
+			self->head = 0;
+		} else {
+			self->head = (self->head+n) % self->cap;
+			self->len -= n;
+			self->nwritten += n;
+			self->nwrites++;
+		}
+		pthread_cond_broadcast(&self->cond);
+	}
+	pthread_mutex_unlock(&self->lock);
+	return NULL;
+}
+
+/**
+* Grow ring to hold at least n more bytes (spill). Held data is
+* moved to the start of the new ring.
+*
+* @param self		capture object
+* @param n		# of bytes to make room for
+* @return		0 on success; -1 on failure
+*/
+int
+capture_grow(struct capture *self, int n) {
+	char	*data = NULL;
+	int	cap, n0;
+
+	for (cap = self->cap; (cap-self->len < n) && (cap < self->maxcap); cap *= 2);
+	if ((cap-self->len < n) || ((data = russ_malloc(cap)) == NULL)) {
+		return -1;
+	}
+	n0 = RUSS__MIN(self->len, self->cap-self->head);
+	memcpy(data, self->data+self->head, n0);
+	memcpy(data+n0, self->data, self->len-n0);
+	if (self->data == self->inuse) {
+		/* writer still using it */
+		self->retired = self->data;
+	} else {
+		free(self->data);
+	}
+	self->data = data;
+	self->cap = cap;
+	self->head = 0;
+	return 0;
+}
+
+/**
+* Add data to ring, applying the overflow policy.
+*
+* @param self		capture object
+* @param p		data
+* @param n		# of bytes
+*/
+void
+capture_put(struct capture *self, char *p, int n) {
+	int	tail, room, n0;
+
+	pthread_mutex_lock(&self->lock);
+	while (n > 0) {
+		if (self->failed) {
+			self->ndropped += n;
+			break;
+		}
+		if ((room = self->cap-self->len) < n) {
+			if (self->overflow == CAPTURE_OVERFLOW_BLOCK) {
+				if (room == 0) {
+					pthread_cond_wait(&self->cond, &self->lock);
+					continue;
+				}
+			} else if ((self->overflow != CAPTURE_OVERFLOW_SPILL) || (capture_grow(self, n) < 0)) {
+				self->ndropped += n;
+				break;
+			}
+			room = self->cap-self->len;
+		}
+		n0 = RUSS__MIN(n, room);
+		tail = (self->head+self->len) % self->cap;
+		memcpy(self->data+tail, p, RUSS__MIN(n0, self->cap-tail));
+		if (n0 > self->cap-tail) {
+			memcpy(self->data, p+(self->cap-tail), n0-(self->cap-tail));
+		}
+		self->len += n0;
+		self->maxlen = RUSS__MAX(self->maxlen, self->len);
+		self->ncaptured += n0;
+		p += n0;
+		n -= n0;
+		pthread_cond_broadcast(&self->cond);
+	}
+	pthread_mutex_unlock(&self->lock);
+}
+
+/**
+* Open capture file and start its writer.
+*
+* @param self		capture object
+* @param path		capture file path
+* @return		0 on success; -1 on failure
+*/
+int
+capture_open(struct capture *self, char *path) {
+	if ((self->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		return -1;
+	}
+	if (((self->path = strdup(path)) == NULL)
+		|| ((self->data = russ_malloc(capture_ringsize)) == NULL)) {
+		goto fail;
+	}
+	self->cap = capture_ringsize;
+	self->maxcap = RUSS__MAX(capture_spillmax, capture_ringsize);
+	self->overflow = capture_overflow;
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+	if (pthread_create(&self->thread, NULL, capture_writer, self) != 0) {
+		pthread_cond_destroy(&self->cond);
+		pthread_mutex_destroy(&self->lock);
+		goto fail;
+	}
+	return 0;
+fail:
+	close(self->fd);
+	self->fd = -1;
+	self->path = russ_free(self->path);
+	self->data = russ_free(self->data);
+	return -1;
+}
+
+/**
+* Flush and close capture; stats are saved to <path>.stats.
+*
+* @param self		capture object
+*/
+void
+capture_close(struct capture *self) {
+	FILE	*f = NULL;
+	char	spath[1024];
+
+	if (self->fd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&self->lock);
+	self->done = 1;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+	pthread_join(self->thread, NULL);
+	close(self->fd);
+	self->fd = -1;
+
+	if ((snprintf(spath, sizeof(spath), "%s.stats", self->path) < sizeof(spath))
+		&& ((f = fopen(spath, "w")) != NULL)) {
+		fprintf(f, "captured=%lu\nwritten=%lu\ndropped=%lu\nwrites=%lu\nmaxheld=%d\nfailed=%d\nlost=%d\n",
+			self->ncaptured, self->nwritten, self->ndropped, self->nwrites, self->maxlen, self->failed,
+			(self->ndropped > 0) ? 1 : 0);
+		fclose(f);
+	}
+
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	self->path = russ_free(self->path);
+	self->data = russ_free(self->data);
+	self->retired = russ_free(self->retired);
+}
+
 void
 init_fds(void) {
 	int	i;
 
+	memset(captures, 0, sizeof(captures));
 	for (i = 0; i < RUSS_CONN_NFDS; i++) {
-		fds[i] = -1;
+		captures[i].fd = -1;
 	}
 }
 
 int
 open_fds(char *value) {
 	char	path[1024];
-	int	i, fd;
+	int	i;
 
 	for (i = 0; i < RUSS_CONN_NFDS; i++) {
 		if (russ_str_get_comp(value, ':', i+1, path, sizeof(path)) < 0) {
 			/* no more */
 			break;
 		} else if (path[0] != '\0') {
-			if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+			if (capture_open(&captures[i], path) < 0) {
 				/* failed */
 				break;
 			}
-			fds[i] = fd;
 		}
 	}
 	return i;
@@ -95,26 +346,29 @@ close_fds(void) {
 	int	i;
 
 	for (i = 0; i < RUSS_CONN_NFDS; i++) {
-		if (fds[i] >= 0) {
-			close(fds[i]);
-			fds[i] = -1;
-		}
+		capture_close(&captures[i]);
 	}
 }
 
 void
 tee_callback(struct russ_relaystream *self, int dir, void *cbarg) {
-	russ_deadline	last;
-	int		i;
+	struct capture	*capture = NULL;
+	char		*p = NULL;
+	int		cnt, start, n0;
 
 	if (dir == 0) {
-		/* only capture on input */
-		i = (int)((intptr_t)cbarg);
-		if (russ_writen(fds[i], self->rbuf->data, self->rbuf->len) < 0) {
-			/* problem */
-			/* remove from fds */
-			close(fds[i]);
-			fds[i] = -1;
+		/* only capture on input; only the bytes just read */
+		capture = &captures[(int)((intptr_t)cbarg)];
+		cnt = (int)(self->nrbytes-capture->nseen);
+		capture->nseen = self->nrbytes;
+		if (self->ring) {
+			start = (self->rhead+self->nheld-cnt) % self->rbuf->cap;
+			n0 = RUSS__MIN(cnt, self->rbuf->cap-start);
+			capture_put(capture, self->rbuf->data+start, n0);
+			capture_put(capture, self->rbuf->data, cnt-n0);
+		} else {
+			p = self->rbuf->data+self->rbuf->len-cnt;
+			capture_put(capture, p, cnt);
 		}
 	}
 }
@@ -186,12 +440,13 @@ svc_attr_handler(struct russ_sess *sess) {
 			int			x;
 
 			relay = russ_relay_new(3);
+			russ_svr_apply_relaydefaults(sess->svr, relay);
 			x = russ_relay_addwithcallback(relay, sconn->fds[0], cconn->fds[0], bufsize, 1,
-				(fds[0] >= 0) ? tee_callback : NULL, (void *)0);
+				(captures[0].fd >= 0) ? tee_callback : NULL, (void *)0);
 			russ_relay_addwithcallback(relay, cconn->fds[1], sconn->fds[1], bufsize, 0,
-				(fds[1] >= 0) ? tee_callback : NULL, (void *)1);
+				(captures[1].fd >= 0) ? tee_callback : NULL, (void *)1);
 			russ_relay_addwithcallback(relay, cconn->fds[2], sconn->fds[2], bufsize, 0,
-				(fds[2] >= 0) ? tee_callback : NULL, (void *)2);
+				(captures[2].fd >= 0) ? tee_callback : NULL, (void *)2);
 
 			cconn->fds[0] = -1;
 			cconn->fds[1] = -1;
@@ -203,14 +458,15 @@ svc_attr_handler(struct russ_sess *sess) {
 			}
 		}
 
-		close_fds();
-
 		russ_cconn_close(cconn);
 		cconn = russ_cconn_free(cconn);
 
 		russ_sconn_exit(sconn, exitst);
 		russ_sconn_close(sconn);
 		sconn = russ_sconn_free(sconn);
+
+		/* after the client is done; flush captures */
+		close_fds();
 	}
 
 	exit(0);
@@ -225,6 +481,16 @@ print_usage(char **argv) {
 "usage: russtee_server [<conf options>]\n"
 "\n"
 "Captures data transfer between client and server.\n"
+"\n"
+"Capture settings (conf section tee):\n"
+"ringsize=<bytes>\n"
+"    Size of each capture's buffer (default 1MB).\n"
+"overflow=drop|block|spill\n"
+"    When the buffer is full: drop the data (default), block the\n"
+"    relay until there is room, or grow the buffer up to spillmax\n"
+"    and then drop.\n"
+"spillmax=<bytes>\n"
+"    Largest buffer size for overflow=spill (default 64MB).\n"
 );
 }
 
@@ -232,6 +498,7 @@ int
 main(int argc, char **argv) {
 	struct russ_svcnode	*node = NULL;
 	struct russ_svr		*svr = NULL;
+	char			*overflow = NULL;
 
 	signal(SIGPIPE, SIG_IGN);
 
@@ -245,6 +512,25 @@ main(int argc, char **argv) {
 
 	init_fds();
 
+	/* capture ring and overflow policy */
+	capture_ringsize = (int)russ_conf_getint(conf, "tee", "ringsize", CAPTURE_RINGSIZE);
+	capture_spillmax = (int)russ_conf_getint(conf, "tee", "spillmax", CAPTURE_SPILLMAX);
+	if ((overflow = russ_conf_get(conf, "tee", "overflow", "drop")) != NULL) {
+		if (strcmp(overflow, "block") == 0) {
+			capture_overflow = CAPTURE_OVERFLOW_BLOCK;
+		} else if (strcmp(overflow, "spill") == 0) {
+			capture_overflow = CAPTURE_OVERFLOW_SPILL;
+		} else if (strcmp(overflow, "drop") != 0) {
+			fprintf(stderr, "error: bad tee:overflow value\n");
+			exit(1);
+		}
+		overflow = russ_free(overflow);
+	}
+	if (capture_ringsize <= 0) {
+		fprintf(stderr, "error: bad tee:ringsize value\n");
+		exit(1);
+	}
+
 	if (((svr = russ_init(conf)) == NULL)
 		|| (russ_svr_set_type(svr, RUSS_SVR_TYPE_FORK) < 0)
 		|| (russ_svr_set_autoswitchuser(svr, 1) < 0)
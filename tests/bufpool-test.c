@@ -0,0 +1,107 @@
+/*
+* tests/bufpool-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Buffer pool: capacities are rounded to classes, free buffers are
+* bounded per class and released by trim, and threads can share a
+* pool.
+*/
+
+#include <pthread.h>
+
+#include "test.h"
+
+#define NTHREADS	4
+#define NROUNDS		10000
+
+struct russ_bufpool	*pool = NULL;
+
+void *
+churn(void *arg) {
+	struct russ_buf	*bufs[4];
+	int		i, j;
+
+	for (i = 0; i < NROUNDS; i++) {
+		for (j = 0; j < 4; j++) {
+			if ((bufs[j] = russ_bufpool_get(pool, (1000*(i+j)) % (1<<16)+1)) == NULL) {
+				return (void *)1;
+			}
+			bufs[j]->data[0] = (char)j;
+		}
+		for (j = 0; j < 4; j++) {
+			russ_bufpool_put(pool, bufs[j]);
+		}
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_buf	*bufs[RUSS_BUFPOOL_MAXFREE+8];
+	struct russ_buf	*buf = NULL;
+	pthread_t	threads[NTHREADS];
+	void		*rv;
+	int		i, nfailed;
+
+	pool = russ_bufpool_new(RUSS_BUFPOOL_MAXCAP, RUSS_BUFPOOL_MAXFREE);
+	TEST_CHECK(pool != NULL);
+
+	/* rounded up to a class; reused once put back */
+	buf = russ_bufpool_get(pool, 3000);
+	TEST_CHECK((buf != NULL) && (buf->cap == 4096));
+	russ_bufpool_put(pool, buf);
+	TEST_CHECK(russ_bufpool_get(pool, 4096) == buf);
+	russ_bufpool_put(pool, buf);
+
+	/* too large to pool; only the 4096 buffer is held */
+	buf = russ_bufpool_get(pool, RUSS_BUFPOOL_MAXCAP+1);
+	TEST_CHECK((buf != NULL) && (buf->cap == RUSS_BUFPOOL_MAXCAP+1));
+	russ_bufpool_put(pool, buf);
+	TEST_CHECK(russ_bufpool_trim(pool, 0) == 1);
+
+	/* at most MAXFREE kept per class; trim keeps the requested # */
+	for (i = 0; i < RUSS_BUFPOOL_MAXFREE+8; i++) {
+		bufs[i] = russ_bufpool_get(pool, 1<<16);
+	}
+	for (i = 0; i < RUSS_BUFPOOL_MAXFREE+8; i++) {
+		russ_bufpool_put(pool, bufs[i]);
+	}
+	TEST_CHECK(russ_bufpool_trim(pool, 2) == RUSS_BUFPOOL_MAXFREE-2);
+	TEST_CHECK(russ_bufpool_trim(pool, 0) == 2);
+
+	/* shared by threads */
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_create(&threads[i], NULL, churn, NULL);
+	}
+	nfailed = 0;
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i], &rv);
+		nfailed += (rv != NULL);
+	}
+	TEST_CHECK(nfailed == 0);
+	TEST_CHECK(russ_bufpool_trim(pool, 0) <= RUSS_BUFPOOL_MAXFREE*RUSS_BUFPOOL_NCLASSES);
+
+	pool = russ_bufpool_free(pool);
+	return TEST_DONE();
+}
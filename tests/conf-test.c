@@ -0,0 +1,145 @@
+/*
+* tests/conf-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* conf hash index: lookups below and above the indexing threshold,
+* after removals (which move entries), and on copies.
+*/
+
+#include "test.h"
+
+#define NSECTIONS	100
+#define NOPTIONS	50
+
+/**
+* Check that every section/option set by fill() is found, except
+* those at multiples of skip (if skip > 0), which must be absent.
+*/
+int
+check_all(struct russ_conf *conf, int nsections, int noptions, int skip) {
+	char	section[64], option[64];
+	int	i, j, want;
+
+	for (i = 0; i < nsections; i++) {
+		snprintf(section, sizeof(section), "s%d", i);
+		want = (skip <= 0) || (i%skip != 0);
+		if (russ_conf_has_section(conf, section) != want) {
+			return 0;
+		}
+		if (!want) {
+			continue;
+		}
+		for (j = 0; j < noptions; j++) {
+			snprintf(option, sizeof(option), "o%d", j);
+			if (russ_conf_getint(conf, section, option, -1) != i*1000+j) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/**
+* Add nsections sections with noptions options each.
+*/
+void
+fill(struct russ_conf *conf, int nsections, int noptions) {
+	char	section[64], option[64], value[64];
+	int	i, j;
+
+	for (i = 0; i < nsections; i++) {
+		snprintf(section, sizeof(section), "s%d", i);
+		for (j = 0; j < noptions; j++) {
+			snprintf(option, sizeof(option), "o%d", j);
+			snprintf(value, sizeof(value), "%d", i*1000+j);
+			russ_conf_set2(conf, section, option, value);
+		}
+	}
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_conf	*conf = NULL, *copy = NULL, *other = NULL;
+	char			section[64];
+	char			*s = NULL;
+	int			i;
+
+	/* short (unindexed) and long (indexed) arrays */
+	conf = russ_conf_new();
+	fill(conf, 4, 4);
+	TEST_CHECK(check_all(conf, 4, 4, 0));
+	fill(conf, NSECTIONS, NOPTIONS);
+	TEST_CHECK(check_all(conf, NSECTIONS, NOPTIONS, 0));
+	TEST_CHECK(russ_conf_has_section(conf, "missing") == 0);
+	TEST_CHECK(russ_conf_has_option(conf, "s1", "missing") == 0);
+	TEST_CHECK(russ_conf_add_section(conf, "s1") < 0);
+
+	/* replace keeps one entry */
+	russ_conf_set2(conf, "s1", "o1", "x");
+	TEST_CHECK(((s = russ_conf_get(conf, "s1", "o1", NULL)) != NULL) && (strcmp(s, "x") == 0));
+	free(s);
+	TEST_CHECK(russ_conf_getint(conf, "s1", "o1", -7) == -7);
+	russ_conf_set2(conf, "s1", "o1", "1001");
+
+	/* parsed values */
+	russ_conf_set2(conf, "v", "hex", "0x10");
+	russ_conf_set2(conf, "v", "float", "2.5");
+	russ_conf_set2(conf, "v", "empty", "");
+	TEST_CHECK(russ_conf_getint(conf, "v", "hex", 0) == 16);
+	TEST_CHECK(russ_conf_getfloat(conf, "v", "float", 0) == 2.5);
+	TEST_CHECK(russ_conf_getint(conf, "v", "empty", 3) == 3);
+	TEST_CHECK(russ_conf_getfloat(conf, "v", "empty", 1.5) == 1.5);
+	russ_conf_remove_section(conf, "v");
+
+	/* removals move the last entry */
+	for (i = 0; i < NSECTIONS; i += 3) {
+		snprintf(section, sizeof(section), "s%d", i);
+		TEST_CHECK(russ_conf_remove_section(conf, section) == 0);
+	}
+	TEST_CHECK(check_all(conf, NSECTIONS, NOPTIONS, 3));
+	TEST_CHECK(russ_conf_remove_option(conf, "s1", "o0") == 0);
+	TEST_CHECK(russ_conf_has_option(conf, "s1", "o0") == 0);
+	TEST_CHECK(russ_conf_getint(conf, "s1", "o49", -1) == 1049);
+	russ_conf_set2(conf, "s1", "o0", "1000");
+
+	/* copies */
+	copy = russ_conf_dup(conf);
+	TEST_CHECK((copy != NULL) && check_all(copy, NSECTIONS, NOPTIONS, 3));
+	other = russ_conf_new();
+	fill(other, NSECTIONS, NOPTIONS);
+	TEST_CHECK(russ_conf_update(copy, other) == 0);
+	TEST_CHECK(check_all(copy, NSECTIONS, NOPTIONS, 0));
+	copy = russ_conf_free(copy);
+	other = russ_conf_free(other);
+
+	/* reserve ahead of (and below) the current size */
+	TEST_CHECK(russ_conf_reserve(conf, 4*NSECTIONS) == 0);
+	TEST_CHECK(check_all(conf, NSECTIONS, NOPTIONS, 3));
+	TEST_CHECK(russ_conf_reserve(conf, 1) == 0);
+	fill(conf, NSECTIONS, NOPTIONS);
+	TEST_CHECK(check_all(conf, NSECTIONS, NOPTIONS, 0));
+	conf = russ_conf_free(conf);
+
+	return TEST_DONE();
+}
@@ -0,0 +1,258 @@
+/*
+* tests/dial-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Dial protocol fallback: an explicit refusal is not redialed;
+* a server which hangs up on protocol 0011 (as old servers do) is
+* redialed with protocol 0010. A listen queue which stays full
+* fails the dial early, and russ_dial_advance() never sleeps while
+* waiting to retry.
+*/
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "test.h"
+#include "russ/priv.h"
+
+int	*naccepts = NULL;	/* shared with server */
+
+void
+svc_root_handler(struct russ_sess *sess) {
+	struct russ_sconn	*sconn = sess->sconn;
+
+	if (sess->req->opnum == RUSS_OPNUM_EXECUTE) {
+		russ_dprintf(sconn->fds[1], "%s", sess->req->protocolstring);
+		russ_sconn_exit(sconn, RUSS_EXIT_SUCCESS);
+	}
+}
+
+/**
+* Count accepted connections.
+*/
+struct russ_sconn *
+counting_accepthandler(russ_deadline deadline, int lisd) {
+	struct russ_sconn	*sconn = NULL;
+
+	if ((sconn = russ_sconn_accepthandler(deadline, lisd)) != NULL) {
+		__sync_fetch_and_add(naccepts, 1);
+	}
+	return sconn;
+}
+
+/**
+* Count accepted connections; refuse every request.
+*/
+struct russ_sconn *
+refusing_accepthandler(russ_deadline deadline, int lisd) {
+	struct russ_sconn	*sconn = NULL;
+	struct russ_req		*req = NULL;
+
+	while ((sconn = counting_accepthandler(deadline, lisd)) != NULL) {
+		if ((req = russ_sconn_await_req(sconn, russ_to_deadline(5000))) != NULL) {
+			russ_sconn_refuse(sconn);
+			req = russ_req_free(req);
+		}
+		russ_sconn_close(sconn);
+		sconn = russ_sconn_free(sconn);
+	}
+	return NULL;
+}
+
+/**
+* Count accepted connections; hang up on requests which are not
+* protocol 0010 (as servers without protocol 0011 support do).
+*/
+struct russ_sconn *
+old_accepthandler(russ_deadline deadline, int lisd) {
+	struct russ_sconn	*sconn = NULL;
+	struct russ_req		*req = NULL;
+
+	while ((sconn = counting_accepthandler(deadline, lisd)) != NULL) {
+		if ((req = russ_sconn_await_req(sconn, russ_to_deadline(5000))) != NULL) {
+			if (strcmp(req->protocolstring, RUSS_REQ_PROTOCOLSTRING_0010) == 0) {
+				sconn->req = req;
+				return sconn;
+			}
+			req = russ_req_free(req);
+		}
+		russ_sconn_close(sconn);
+		sconn = russ_sconn_free(sconn);
+	}
+	return NULL;
+}
+
+pid_t
+start(struct russ_conf *conf, char *path, russ_accepthandler accepthandler) {
+	struct russ_svr	*svr = NULL;
+
+	if ((svr = russ_init(conf)) == NULL) {
+		return -1;
+	}
+	russ_svr_set_type(svr, RUSS_SVR_TYPE_FORK);
+	russ_svr_set_autoswitchuser(svr, 0);
+	russ_svr_set_accepthandler(svr, accepthandler);
+	russ_svcnode_set_handler(svr->root, svc_root_handler);
+	russ_svcnode_set_virtual(svr->root, 1);
+	return test_svr_start(svr, path);
+}
+
+/**
+* Step a non-blocking dial of a socket whose listen queue is full.
+*
+* @return		0 if no step slept, waits were bounded by
+*			russ_dial_timeout(), and the dial failed
+*/
+int
+step_full(char *path) {
+	struct russ_target	*targ = NULL;
+	struct russ_dial	*dial = NULL;
+	russ_deadline		t0;
+	int			events, timeout, nsteps, rv;
+
+	if ((targ = russ_target_new(path)) == NULL) {
+		return -1;
+	}
+	dial = russ_dial_start_target(russ_to_deadline(10000), "execute", targ, NULL, NULL);
+	for (nsteps = 0; nsteps < 100; nsteps++) {
+		t0 = russ_gettime();
+		if ((rv = russ_dial_advance(dial)) != 0) {
+			break;
+		}
+		if ((russ_gettime()-t0 > 10)
+			|| (russ_dial_pollfd(dial, &events) != -1)
+			|| ((timeout = russ_dial_timeout(dial)) < 0)
+			|| (timeout > 64)) {
+			rv = -2;
+			break;
+		}
+		poll(NULL, 0, timeout);
+	}
+	if (russ_dial_finish(dial) != NULL) {
+		rv = -2;
+	}
+	targ = russ_target_free(targ);
+	return ((rv == -1) && (nsteps > 1)) ? 0 : -1;
+}
+
+/**
+* Dial a socket whose listen queue is full.
+*
+* @return		0 if the dial failed well before its deadline
+*/
+int
+dial_full(char *path) {
+	struct sockaddr_un	servaddr;
+	russ_deadline		t0;
+	int			lisd, sds[256];
+	int			i, nsds, rv = -1;
+
+	unlink(path);
+	if ((lisd = russ_announce(path, 0600, getuid(), getgid())) < 0) {
+		return -1;
+	}
+	listen(lisd, 0);
+	bzero(&servaddr, sizeof(servaddr));
+	servaddr.sun_family = AF_UNIX;
+	strcpy(servaddr.sun_path, path);
+	for (nsds = 0; nsds < 256; nsds++) {
+		if ((sds[nsds] = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0)) < 0) {
+			break;
+		}
+		if (connect(sds[nsds], (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+			rv = errno;
+			close(sds[nsds]);
+			break;
+		}
+	}
+
+	t0 = russ_gettime();
+	if ((nsds < 256) && (rv == EAGAIN)
+		&& (russ_dialv(russ_to_deadline(10000), "execute", path, NULL, NULL) == NULL)
+		&& (russ_gettime()-t0 < 2000)
+		&& (step_full(path) == 0)) {
+		rv = 0;
+	} else {
+		rv = -1;
+	}
+	for (i = 0; i < nsds; i++) {
+		close(sds[i]);
+	}
+	close(lisd);
+	unlink(path);
+	return rv;
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_conf	*conf = NULL;
+	struct russ_buf		*rbufs[3];
+	char			path[256];
+	pid_t			pid;
+	int			exitst;
+
+	naccepts = mmap(NULL, sizeof(int), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	conf = russ_conf_new();
+	rbufs[0] = russ_buf_new(0);
+	rbufs[1] = russ_buf_new(64);
+	rbufs[2] = russ_buf_new(64);
+
+	/* new server: served with 0011 */
+	pid = start(conf, test_sockpath(path, sizeof(path), "dial"), counting_accepthandler);
+	*naccepts = 0;
+	TEST_CHECK(russ_dialv_wait_inouterr(russ_to_deadline(5000), "execute", path, NULL, NULL, &exitst, rbufs) == 0);
+	TEST_CHECK((rbufs[1]->len == 4) && (strncmp(rbufs[1]->data, RUSS_REQ_PROTOCOLSTRING, 4) == 0));
+	TEST_CHECK(*naccepts == 1);
+	test_svr_stop(pid, path);
+
+	/* refusal is not redialed */
+	pid = start(conf, test_sockpath(path, sizeof(path), "dial-refuse"), refusing_accepthandler);
+	*naccepts = 0;
+	TEST_CHECK(russ_dialv(russ_to_deadline(5000), "execute", path, NULL, NULL) == NULL);
+	TEST_CHECK(errno == ECONNREFUSED);
+	usleep(100000);
+	TEST_CHECK(*naccepts == 1);
+	test_svr_stop(pid, path);
+
+	/* old server: hang up is redialed with 0010 */
+	pid = start(conf, test_sockpath(path, sizeof(path), "dial-old"), old_accepthandler);
+	*naccepts = 0;
+	rbufs[1]->len = 0;
+	TEST_CHECK(russ_dialv_wait_inouterr(russ_to_deadline(5000), "execute", path, NULL, NULL, &exitst, rbufs) == 0);
+	TEST_CHECK((rbufs[1]->len == 4) && (strncmp(rbufs[1]->data, RUSS_REQ_PROTOCOLSTRING_0010, 4) == 0));
+	TEST_CHECK(*naccepts == 2);
+	test_svr_stop(pid, path);
+
+	/* full listen queue (never accepted) */
+	test_sockpath(path, sizeof(path), "dial-full");
+	TEST_CHECK(dial_full(path) == 0);
+
+	rbufs[0] = russ_buf_free(rbufs[0]);
+	rbufs[1] = russ_buf_free(rbufs[1]);
+	rbufs[2] = russ_buf_free(rbufs[2]);
+	conf = russ_conf_free(conf);
+	return TEST_DONE();
+}
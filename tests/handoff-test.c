@@ -0,0 +1,98 @@
+/*
+* tests/handoff-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Fd handoff: the service writes to the client's own fds; the
+* server waits for handed off fds only until the given deadline.
+*/
+
+#include <sys/socket.h>
+
+#include "test.h"
+#include "russ/priv.h"
+
+void
+svc_root_handler(struct russ_sess *sess) {
+	struct russ_sconn	*sconn = sess->sconn;
+
+	if (sess->req->opnum == RUSS_OPNUM_EXECUTE) {
+		russ_dprintf(sconn->fds[1], "handoff");
+		russ_sconn_exit(sconn, RUSS_EXIT_SUCCESS);
+	}
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_svr		*svr = NULL;
+	struct russ_cconn	*cconn = NULL;
+	struct russ_sconn	*sconn = NULL;
+	russ_deadline		t0;
+	char			path[256], buf[32];
+	int			hfds[RUSS_CONN_STD_NFDS], pfds[2], sds[2];
+	pid_t			pid;
+	int			n, exitst;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	svr = russ_init(russ_conf_new());
+	russ_svr_set_type(svr, RUSS_SVR_TYPE_FORK);
+	russ_svr_set_autoswitchuser(svr, 0);
+	russ_svcnode_set_handler(svr->root, svc_root_handler);
+	russ_svcnode_set_virtual(svr->root, 1);
+	pid = test_svr_start(svr, test_sockpath(path, sizeof(path), "handoff"));
+	TEST_CHECK(pid > 0);
+
+	/* service output goes straight to the handed off pipe */
+	pipe(pfds);
+	hfds[0] = dup(0);
+	hfds[1] = pfds[1];
+	hfds[2] = dup(2);
+	cconn = russ_dialv_handoff(russ_to_deadline(5000), "execute", path, NULL, NULL, RUSS_CONN_STD_NFDS, hfds);
+	TEST_CHECK(cconn != NULL);
+	if (cconn) {
+		TEST_CHECK(cconn->fds[1] < 0);
+		TEST_CHECK((russ_cconn_wait(cconn, russ_to_deadline(5000), &exitst) == 0) && (exitst == 0));
+		cconn = russ_cconn_free(cconn);
+	}
+	close(pfds[1]);
+	n = russ_read(pfds[0], buf, sizeof(buf));
+	TEST_CHECK((n == 7) && (strncmp(buf, "handoff", 7) == 0));
+	close(pfds[0]);
+
+	test_svr_stop(pid, path);
+
+	/* fds that never come are waited for until the deadline only */
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sds);
+	sconn = russ_sconn_new();
+	sconn->sd = sds[0];
+	sconn->nhandoff = RUSS_CONN_STD_NFDS;
+	t0 = russ_gettime();
+	TEST_CHECK(russ_sconn_recv_handoff(sconn, russ_to_deadline(200)) < 0);
+	TEST_CHECK(russ_gettime()-t0 < 2000);
+	russ_sconn_close(sconn);
+	sconn = russ_sconn_free(sconn);
+	close(sds[1]);
+
+	return TEST_DONE();
+}
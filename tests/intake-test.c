@@ -0,0 +1,121 @@
+/*
+* tests/intake-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Intake stage: off by default; with a server out of descriptors,
+* idle connections expire and real requests are still served.
+*/
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "test.h"
+
+#define NIDLE		40
+
+void
+svc_root_handler(struct russ_sess *sess) {
+	struct russ_sconn	*sconn = sess->sconn;
+
+	if (sess->req->opnum == RUSS_OPNUM_EXECUTE) {
+		russ_sconn_exit(sconn, RUSS_EXIT_SUCCESS);
+	}
+}
+
+/**
+* Connect without sending a request.
+*/
+int
+connect_idle(char *path) {
+	struct sockaddr_un	addr;
+	int			sd;
+
+	if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+	if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sd);
+		return -1;
+	}
+	return sd;
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_conf	*conf = NULL;
+	struct russ_svr		*svr = NULL;
+	struct rlimit		rlim;
+	char			path[256];
+	pid_t			pid;
+	int			sds[NIDLE];
+	int			i, lisd, exitst, wst;
+
+	conf = russ_conf_new();
+	svr = russ_init(conf);
+	TEST_CHECK((svr != NULL) && (svr->intake == 0));
+	russ_svr_set_intake(svr, 1);
+	svr->awaittimeout = 200;
+	russ_svr_set_type(svr, RUSS_SVR_TYPE_FORK);
+	russ_svr_set_autoswitchuser(svr, 0);
+	russ_svcnode_set_handler(svr->root, svc_root_handler);
+	russ_svcnode_set_virtual(svr->root, 1);
+
+	/* server with few descriptors */
+	test_sockpath(path, sizeof(path), "intake");
+	unlink(path);
+	lisd = russ_announce(path, 0600, getuid(), getgid());
+	TEST_CHECK(lisd >= 0);
+	if ((pid = fork()) == 0) {
+		rlim.rlim_cur = 16;
+		rlim.rlim_max = 16;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+		russ_svr_set_lisd(svr, lisd);
+		russ_svr_loop(svr);
+		exit(0);
+	}
+	close(lisd);
+
+	/* exhaust server descriptors */
+	for (i = 0; i < NIDLE; i++) {
+		sds[i] = connect_idle(path);
+	}
+	usleep(100000);
+	TEST_CHECK(russ_dialv_wait(russ_to_deadline(10000), "execute", path, NULL, NULL, &exitst) == 0);
+	TEST_CHECK(exitst == 0);
+	for (i = 0; i < NIDLE; i++) {
+		if (sds[i] >= 0) {
+			close(sds[i]);
+		}
+	}
+	TEST_CHECK(russ_dialv_wait(russ_to_deadline(5000), "execute", path, NULL, NULL, &exitst) == 0);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, &wst, 0);
+	unlink(path);
+	return TEST_DONE();
+}
@@ -0,0 +1,100 @@
+/*
+* tests/pool-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Threaded server pool: concurrent clients are all served (no lost
+* or double-claimed connections).
+*/
+
+#include "test.h"
+
+#define NCLIENTS	8
+#define NDIALS		50
+
+void
+svc_root_handler(struct russ_sess *sess) {
+	struct russ_sconn	*sconn = sess->sconn;
+
+	if (sess->req->opnum == RUSS_OPNUM_EXECUTE) {
+		usleep(200);
+		russ_sconn_exit(sconn, RUSS_EXIT_SUCCESS);
+	}
+}
+
+/**
+* Dial NDIALS times; exit status is # of failed dials.
+*/
+int
+client(char *path) {
+	int	i, exitst, nfailed = 0;
+
+	for (i = 0; i < NDIALS; i++) {
+		if ((russ_dialv_wait(russ_to_deadline(10000), "execute", path, NULL, NULL, &exitst) != 0)
+			|| (exitst != 0)) {
+			nfailed++;
+		}
+	}
+	return nfailed;
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_conf	*conf = NULL;
+	struct russ_svr		*svr = NULL;
+	char			path[256];
+	pid_t			pid, pids[NCLIENTS];
+	int			i, wst, nfailed;
+
+	conf = russ_conf_new();
+	russ_conf_set2(conf, "main", "threadpoolsize", "4");
+	russ_conf_set2(conf, "main", "threadqueuemax", "64");
+	if ((svr = russ_init(conf)) == NULL) {
+		TEST_CHECK(svr != NULL);
+		return TEST_DONE();
+	}
+	russ_svr_set_type(svr, RUSS_SVR_TYPE_THREAD);
+	russ_svr_set_autoswitchuser(svr, 0);
+	russ_svcnode_set_handler(svr->root, svc_root_handler);
+	russ_svcnode_set_virtual(svr->root, 1);
+	pid = test_svr_start(svr, test_sockpath(path, sizeof(path), "pool"));
+	TEST_CHECK(pid > 0);
+
+	for (i = 0; i < NCLIENTS; i++) {
+		if ((pids[i] = fork()) == 0) {
+			exit(client(path));
+		}
+	}
+	nfailed = 0;
+	for (i = 0; i < NCLIENTS; i++) {
+		if ((waitpid(pids[i], &wst, 0) < 0) || (!WIFEXITED(wst))) {
+			nfailed += NDIALS;
+		} else {
+			nfailed += WEXITSTATUS(wst);
+		}
+	}
+	TEST_CHECK(nfailed == 0);
+
+	test_svr_stop(pid, path);
+	return TEST_DONE();
+}
@@ -0,0 +1,105 @@
+/*
+* tests/prefork-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Prefork server: configuration (0 workers is "auto"), serving
+* with recycled workers, and workers exiting with their master.
+*/
+
+#include "test.h"
+
+void
+svc_root_handler(struct russ_sess *sess) {
+	struct russ_sconn	*sconn = sess->sconn;
+
+	if (sess->req->opnum == RUSS_OPNUM_EXECUTE) {
+		russ_dprintf(sconn->fds[1], "%d", (int)getpid());
+		russ_sconn_exit(sconn, RUSS_EXIT_SUCCESS);
+	}
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_conf	*conf = NULL;
+	struct russ_svr		*svr = NULL;
+	struct russ_cconn	*cconn = NULL;
+	struct russ_buf		*rbufs[3];
+	char			path[256];
+	pid_t			pid;
+	int			i, exitst, nok;
+
+	/* 0 workers is accepted ("auto"); negative is not */
+	conf = russ_conf_new();
+	russ_conf_set2(conf, "main", "preforknworkers", "0");
+	russ_conf_set2(conf, "main", "preforkmaxsessions", "2");
+	svr = russ_init(conf);
+	TEST_CHECK(svr != NULL);
+	if (svr == NULL) {
+		return TEST_DONE();
+	}
+	TEST_CHECK(svr->preforknworkers == 0);
+	TEST_CHECK(russ_svr_set_preforknworkers(svr, -1) < 0);
+	TEST_CHECK(svr->preforknworkers == 0);
+
+	/* serve: workers are recycled every 2 sessions */
+	russ_svr_set_type(svr, RUSS_SVR_TYPE_PREFORK);
+	russ_svr_set_autoswitchuser(svr, 0);
+	russ_svcnode_set_handler(svr->root, svc_root_handler);
+	russ_svcnode_set_virtual(svr->root, 1);
+	pid = test_svr_start(svr, test_sockpath(path, sizeof(path), "prefork"));
+	TEST_CHECK(pid > 0);
+
+	nok = 0;
+	for (i = 0; i < 10; i++) {
+		rbufs[0] = russ_buf_new(0);
+		rbufs[1] = russ_buf_new(64);
+		rbufs[2] = russ_buf_new(64);
+		if ((russ_dialv_wait_inouterr(russ_to_deadline(5000), "execute", path, NULL, NULL, &exitst, rbufs) == 0)
+			&& (exitst == 0) && (rbufs[1]->len > 0)) {
+			nok++;
+		}
+		rbufs[0] = russ_buf_free(rbufs[0]);
+		rbufs[1] = russ_buf_free(rbufs[1]);
+		rbufs[2] = russ_buf_free(rbufs[2]);
+	}
+	TEST_CHECK(nok == 10);
+
+	/* master killed: workers (own sessions) exit; nothing accepts */
+	kill(pid, SIGKILL);
+	waitpid(pid, &exitst, 0);
+	for (i = 0; i < 50; i++) {
+		if ((cconn = russ_dialv(russ_to_deadline(1000), "execute", path, NULL, NULL)) == NULL) {
+			break;
+		}
+		russ_cconn_close(cconn);
+		cconn = russ_cconn_free(cconn);
+		usleep(100000);
+	}
+	TEST_CHECK(i < 50);
+
+	test_svr_stop(pid, path);
+	svr = russ_svr_free(svr);
+	conf = russ_conf_free(conf);
+	return TEST_DONE();
+}
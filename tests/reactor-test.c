@@ -0,0 +1,218 @@
+/*
+* tests/reactor-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Relay reactor: many relays served by a few threads pass their
+* data intact, each completes once (callback, then unregistered),
+* timed work (coalescing) is done without fd activity, and an idle
+* reactor times out.
+*/
+
+#include <pthread.h>
+
+#include "test.h"
+#include "russ/priv.h"
+
+#define NBYTES		(1<<20)
+#define NRELAYS		8
+#define NTHREADS	2
+
+struct russ_reactor	*reactor = NULL;
+int			ndone = 0;
+int			nfailed = 0;
+
+void
+done_callback(struct russ_relay *relay, int rv, void *arg) {
+	if (rv != RUSS_WAIT_OK) {
+		__sync_fetch_and_add(&nfailed, 1);
+	}
+	__sync_fetch_and_add(&ndone, 1);
+	russ_relay_free(relay);
+}
+
+void *
+serve_thread(void *arg) {
+	while (russ_reactor_count(reactor) > 0) {
+		if (russ_reactor_serve(reactor, 100) == RUSS_WAIT_FAILURE) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/**
+* Write NBYTES of a pattern to fd (in a child).
+*
+* @param fd		write fd
+* @param cfd		fd to close in the child
+*/
+pid_t
+start_writer(int fd, int cfd) {
+	char	buf[1<<14];
+	pid_t	pid;
+	int	i, n;
+
+	if ((pid = fork()) == 0) {
+		close(cfd);
+		for (n = 0; n < NBYTES; n += sizeof(buf)) {
+			for (i = 0; i < sizeof(buf); i++) {
+				buf[i] = (char)(n+i);
+			}
+			if (russ_writen(fd, buf, sizeof(buf)) < sizeof(buf)) {
+				exit(1);
+			}
+		}
+		exit(0);
+	}
+	return pid;
+}
+
+/**
+* Read and check NBYTES of the pattern from fd (in a child).
+*
+* @param fd		read fd
+* @param cfd		fd to close in the child
+*/
+pid_t
+start_reader(int fd, int cfd) {
+	char	buf[1<<14];
+	pid_t	pid;
+	int	i, n, cnt;
+
+	if ((pid = fork()) == 0) {
+		close(cfd);
+		for (n = 0; (cnt = russ_read(fd, buf, sizeof(buf))) > 0; n += cnt) {
+			for (i = 0; i < cnt; i++) {
+				if (buf[i] != (char)(n+i)) {
+					exit(1);
+				}
+			}
+		}
+		exit((n == NBYTES) ? 0 : 1);
+	}
+	return pid;
+}
+
+/**
+* Start a relay of 10 bytes written long before EOF, with
+* coalescing, and a reader which expects them well before EOF.
+*
+* @param[out] pids	writer and reader pids
+* @return		relay object; NULL on failure
+*/
+struct russ_relay *
+start_coalesced(pid_t *pids) {
+	struct russ_relay	*relay = NULL;
+	russ_deadline		t0;
+	char			buf[10];
+	int			infds[2], outfds[2];
+
+	if ((pipe(infds) < 0) || (pipe(outfds) < 0)) {
+		return NULL;
+	}
+	if ((pids[0] = fork()) == 0) {
+		close(infds[0]);
+		memset(buf, 'x', sizeof(buf));
+		russ_writen(infds[1], buf, sizeof(buf));
+		usleep(1000000);
+		exit(0);
+	}
+	close(infds[1]);
+	if ((pids[1] = fork()) == 0) {
+		close(outfds[1]);
+		t0 = russ_gettime();
+		exit(((russ_readn(outfds[0], buf, sizeof(buf)) == sizeof(buf))
+			&& (russ_gettime()-t0 < 500)) ? 0 : 1);
+	}
+	close(outfds[0]);
+
+	relay = russ_relay_new(1);
+	russ_relay_add(relay, infds[0], outfds[1], 1<<16, 1);
+	russ_relay_set_coalesce(relay, 0, 1024, 50000);
+	return relay;
+}
+
+/**
+* Check that all children exited with 0.
+*
+* @param pids		child pids
+* @param npids		# of pids
+* @return		1 if all succeeded; 0 otherwise
+*/
+int
+all_ok(pid_t *pids, int npids) {
+	int	i, st, ok = 1;
+
+	for (i = 0; i < npids; i++) {
+		waitpid(pids[i], &st, 0);
+		ok = ok && WIFEXITED(st) && (WEXITSTATUS(st) == 0);
+	}
+	return ok;
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_relay	*relay = NULL;
+	pthread_t		threads[NTHREADS];
+	pid_t			pids[2*(NRELAYS+1)];
+	int			infds[2], outfds[2];
+	int			i, nadded;
+
+	signal(SIGPIPE, SIG_IGN);
+	reactor = russ_reactor_new();
+	TEST_CHECK(reactor != NULL);
+
+	/* idle */
+	TEST_CHECK(russ_reactor_serve(reactor, 10) == RUSS_WAIT_TIMEOUT);
+
+	/* many relays, few threads */
+	for (i = 0, nadded = 0; i < NRELAYS; i++) {
+		pipe(infds);
+		pipe(outfds);
+		pids[2*i] = start_writer(infds[1], infds[0]);
+		close(infds[1]);
+		pids[2*i+1] = start_reader(outfds[0], outfds[1]);
+		close(outfds[0]);
+		relay = russ_relay_new(1);
+		russ_relay_add(relay, infds[0], outfds[1], 1<<14, 1);
+		nadded += (russ_reactor_add(reactor, relay, -1, done_callback, NULL) == 0);
+	}
+	relay = start_coalesced(&pids[2*NRELAYS]);
+	nadded += (russ_reactor_add(reactor, relay, -1, done_callback, NULL) == 0);
+	TEST_CHECK((nadded == NRELAYS+1) && (russ_reactor_count(reactor) == NRELAYS+1));
+
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_create(&threads[i], NULL, serve_thread, NULL);
+	}
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	TEST_CHECK(all_ok(pids, 2*(NRELAYS+1)));
+	TEST_CHECK((ndone == NRELAYS+1) && (nfailed == 0));
+	TEST_CHECK(russ_reactor_count(reactor) == 0);
+	TEST_CHECK(russ_reactor_serve(reactor, 10) == RUSS_WAIT_TIMEOUT);
+
+	reactor = russ_reactor_free(reactor);
+	return TEST_DONE();
+}
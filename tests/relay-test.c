@@ -0,0 +1,411 @@
+/*
+* tests/relay-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Relay: zero-copy is opt-in and not available with callbacks; data
+* passes intact either way. The stdio fds are relayed without being
+* made nonblocking. Rate limits hold and survive long idle periods;
+* stream defaults are per relay. Ring buffers pass data intact
+* across wraps; coalescing batches small reads into fewer writes
+* and holds data no longer than its max hold time.
+*/
+
+#include <fcntl.h>
+
+#include "test.h"
+#include "russ/priv.h"
+
+#define NBYTES	(4<<20)
+
+int	ncallbacks = 0;
+int	nnonblock = 0;
+
+/* stream I/O seen by io_callback() */
+struct iocounts {
+	int	nreads;
+	int	nwrites;
+	int64_t	tread;		/**< time (usec) of first read */
+	int64_t	twrite;		/**< time (usec) of first write */
+};
+
+void
+count_callback(struct russ_relaystream *stream, int dir, void *arg) {
+	ncallbacks++;
+}
+
+void
+nonblock_callback(struct russ_relaystream *stream, int dir, void *arg) {
+	if ((fcntl(stream->rfd, F_GETFL) & O_NONBLOCK) || (fcntl(stream->wfd, F_GETFL) & O_NONBLOCK)) {
+		nnonblock++;
+	}
+}
+
+void
+io_callback(struct russ_relaystream *stream, int dir, void *arg) {
+	struct iocounts	*counts = arg;
+
+	if (dir == 0) {
+		if (counts->nreads++ == 0) {
+			counts->tread = russ_gettime_us();
+		}
+	} else {
+		if (counts->nwrites++ == 0) {
+			counts->twrite = russ_gettime_us();
+		}
+	}
+}
+
+/**
+* Write NBYTES of a pattern to fd (in a child).
+*
+* @param fd		write fd
+* @param cfd		fd to close in the child
+*/
+pid_t
+start_writer(int fd, int cfd) {
+	char	buf[1<<16];
+	pid_t	pid;
+	int	i, n;
+
+	if ((pid = fork()) == 0) {
+		close(cfd);
+		for (n = 0; n < NBYTES; n += sizeof(buf)) {
+			for (i = 0; i < sizeof(buf); i++) {
+				buf[i] = (char)(n+i);
+			}
+			if (russ_writen(fd, buf, sizeof(buf)) < sizeof(buf)) {
+				exit(1);
+			}
+		}
+		exit(0);
+	}
+	return pid;
+}
+
+/**
+* Read and check NBYTES of the pattern from fd (in a child).
+*
+* @param fd		read fd
+* @param cfd		fd to close in the child
+*/
+pid_t
+start_reader(int fd, int cfd) {
+	char	buf[1<<16];
+	pid_t	pid;
+	int	i, n, cnt;
+
+	if ((pid = fork()) == 0) {
+		close(cfd);
+		for (n = 0; (cnt = russ_read(fd, buf, sizeof(buf))) > 0; n += cnt) {
+			for (i = 0; i < cnt; i++) {
+				if (buf[i] != (char)(n+i)) {
+					exit(1);
+				}
+			}
+		}
+		exit((n == NBYTES) ? 0 : 1);
+	}
+	return pid;
+}
+
+/**
+* Relay NBYTES from one pipe to another.
+*
+* @param zerocopy	zero-copy setting
+* @param cb		callback
+* @return		0 if the data was relayed intact; -1 otherwise
+*/
+int
+relay_pipes(int zerocopy, russ_relaystream_callback cb) {
+	struct russ_relay	*relay = NULL;
+	int			infds[2], outfds[2];
+	pid_t			wpid, rpid;
+	int			wst, rst;
+
+	if ((pipe(infds) < 0) || (pipe(outfds) < 0)) {
+		return -1;
+	}
+	wpid = start_writer(infds[1], infds[0]);
+	close(infds[1]);
+	rpid = start_reader(outfds[0], outfds[1]);
+	close(outfds[0]);
+
+	relay = russ_relay_new(1);
+	russ_relay_addwithcallback(relay, infds[0], outfds[1], 1<<16, 1, cb, NULL);
+	TEST_CHECK(relay->streams[0]->zerocopy == 0);
+	TEST_CHECK(russ_relay_set_zerocopy(relay, 0, zerocopy) == ((zerocopy && cb) ? -1 : 0));
+	russ_relay_serve(relay, -1, -1);
+	relay = russ_relay_free(relay);
+
+	waitpid(wpid, &wst, 0);
+	waitpid(rpid, &rst, 0);
+	return (WIFEXITED(wst) && (WEXITSTATUS(wst) == 0) && WIFEXITED(rst) && (WEXITSTATUS(rst) == 0)) ? 0 : -1;
+}
+
+/**
+* Relay NBYTES from one pipe to another through a ring buffer. A
+* high-water mark which is not a divisor of the buffer size makes
+* held data wrap.
+*
+* @param bufsize	buffer size
+* @param highwater	ring high-water mark
+* @return		0 if the data was relayed intact; -1 otherwise
+*/
+int
+relay_ring(int bufsize, int highwater) {
+	struct russ_relay	*relay = NULL;
+	struct iocounts		counts;
+	int			infds[2], outfds[2];
+	pid_t			wpid, rpid;
+	int			wst, rst;
+
+	if ((pipe(infds) < 0) || (pipe(outfds) < 0)) {
+		return -1;
+	}
+	wpid = start_writer(infds[1], infds[0]);
+	close(infds[1]);
+	rpid = start_reader(outfds[0], outfds[1]);
+	close(outfds[0]);
+
+	memset(&counts, 0, sizeof(counts));
+	relay = russ_relay_new(1);
+	russ_relay_addwithcallback(relay, infds[0], outfds[1], bufsize, 1, io_callback, &counts);
+	TEST_CHECK(russ_relay_set_ring(relay, 0, highwater) == 0);
+	russ_relay_serve(relay, -1, -1);
+	relay = russ_relay_free(relay);
+
+	waitpid(wpid, &wst, 0);
+	waitpid(rpid, &rst, 0);
+	return ((counts.nreads >= NBYTES/bufsize) && (counts.nwrites > 0)
+		&& WIFEXITED(wst) && (WEXITSTATUS(wst) == 0) && WIFEXITED(rst) && (WEXITSTATUS(rst) == 0)) ? 0 : -1;
+}
+
+/**
+* Relay small, spaced writes with coalescing.
+*
+* @param npieces	# of 10 byte pieces written
+* @param minbatch	min bytes per write
+* @param maxhold	max hold time (usec)
+* @param[out] counts	stream I/O seen
+* @return		0 if the data was relayed intact; -1 otherwise
+*/
+int
+relay_coalesce(int npieces, int minbatch, int maxhold, struct iocounts *counts) {
+	struct russ_relay	*relay = NULL;
+	char			buf[10];
+	int			infds[2], outfds[2];
+	pid_t			wpid;
+	int			n, cnt, wst, rv = 0;
+
+	if ((pipe(infds) < 0) || (pipe(outfds) < 0)) {
+		return -1;
+	}
+	if ((wpid = fork()) == 0) {
+		close(infds[0]);
+		for (n = 0; n < npieces; n++) {
+			memset(buf, (char)n, sizeof(buf));
+			russ_writen(infds[1], buf, sizeof(buf));
+			usleep(500);
+		}
+		usleep(300000);
+		exit(0);
+	}
+	close(infds[1]);
+
+	memset(counts, 0, sizeof(struct iocounts));
+	relay = russ_relay_new(1);
+	russ_relay_addwithcallback(relay, infds[0], outfds[1], 1<<16, 1, io_callback, counts);
+	TEST_CHECK(russ_relay_set_coalesce(relay, 0, minbatch, maxhold) == 0);
+	russ_relay_serve(relay, -1, -1);
+	relay = russ_relay_free(relay);
+	waitpid(wpid, &wst, 0);
+
+	/* all output is in the pipe; check it */
+	for (n = 0; (cnt = russ_read(outfds[0], buf, 1)) > 0; n++) {
+		if (buf[0] != (char)(n/10)) {
+			rv = -1;
+		}
+	}
+	close(outfds[0]);
+	return ((rv == 0) && (n == npieces*10)) ? 0 : -1;
+}
+
+/**
+* Relay NBYTES from stdin to stdout (pipes, in a child).
+*
+* @return		0 if the data was relayed intact and the fds
+*			stayed blocking; -1 otherwise
+*/
+int
+relay_stdio(void) {
+	struct russ_relay	*relay = NULL;
+	int			infds[2], outfds[2];
+	pid_t			wpid, rpid, pid;
+	int			wst, rst, st;
+
+	if ((pipe(infds) < 0) || (pipe(outfds) < 0)) {
+		return -1;
+	}
+	wpid = start_writer(infds[1], infds[0]);
+	close(infds[1]);
+	rpid = start_reader(outfds[0], outfds[1]);
+	close(outfds[0]);
+
+	if ((pid = fork()) == 0) {
+		dup2(infds[0], 0);
+		dup2(outfds[1], 1);
+		close(infds[0]);
+		close(outfds[1]);
+		relay = russ_relay_new(1);
+		russ_relay_addwithcallback(relay, 0, 1, 1<<16, 1, nonblock_callback, NULL);
+		russ_relay_serve(relay, -1, -1);
+		exit(((nnonblock == 0) && (relay->streams[0] == NULL)) ? 0 : 1);
+	}
+	close(infds[0]);
+	close(outfds[1]);
+
+	waitpid(pid, &st, 0);
+	waitpid(wpid, &wst, 0);
+	waitpid(rpid, &rst, 0);
+	return (WIFEXITED(st) && (WEXITSTATUS(st) == 0)
+		&& WIFEXITED(wst) && (WEXITSTATUS(wst) == 0)
+		&& WIFEXITED(rst) && (WEXITSTATUS(rst) == 0)) ? 0 : -1;
+}
+
+/**
+* Relay NBYTES at a limited rate, starting from an empty bucket
+* last refilled long ago.
+*
+* @param rate		max bytes/sec
+* @return		elapsed time (ms); -1 if the data was not
+*			relayed intact
+*/
+int
+relay_rate(int rate) {
+	struct russ_relay	*relay = NULL;
+	int			infds[2], outfds[2];
+	pid_t			wpid, rpid;
+	russ_deadline		t0;
+	int			wst, rst;
+
+	if ((pipe(infds) < 0) || (pipe(outfds) < 0)) {
+		return -1;
+	}
+	wpid = start_writer(infds[1], infds[0]);
+	close(infds[1]);
+	rpid = start_reader(outfds[0], outfds[1]);
+	close(outfds[0]);
+
+	relay = russ_relay_new(1);
+	russ_relay_add(relay, infds[0], outfds[1], 1<<16, 1);
+	TEST_CHECK(russ_relay_set_rate(relay, 0, rate, 1<<16) == 0);
+	relay->streams[0]->tokens = 0;
+	relay->streams[0]->tokenstamp = russ_gettime_us()-((int64_t)1<<40);
+	t0 = russ_gettime();
+	russ_relay_serve(relay, -1, -1);
+	t0 = russ_gettime()-t0;
+	relay = russ_relay_free(relay);
+
+	waitpid(wpid, &wst, 0);
+	waitpid(rpid, &rst, 0);
+	return (WIFEXITED(wst) && (WEXITSTATUS(wst) == 0) && WIFEXITED(rst) && (WEXITSTATUS(rst) == 0)) ? (int)t0 : -1;
+}
+
+/**
+* Check that stream defaults apply to the relay they are set on
+* only, and that rate limits are refused without epoll.
+*
+* @return		0 on success; -1 on failure
+*/
+int
+relay_defaults(void) {
+	struct russ_relay	*relay0 = NULL, *relay1 = NULL;
+	int			fds[2];
+	int			rv = -1;
+
+	if (pipe(fds) < 0) {
+		return -1;
+	}
+	relay0 = russ_relay_new(1);
+	relay1 = russ_relay_new(1);
+	if ((russ_relay_set_defaults(relay0, 0, 1<<20, 0, 2) < 0)
+		|| (russ_relay_add(relay0, fds[0], fds[1], 1<<16, 0) != 0)
+		|| (russ_relay_add(relay1, fds[0], fds[1], 1<<16, 0) != 0)
+		|| (relay0->streams[0]->rate != 1<<20)
+		|| (relay0->streams[0]->weight != 2)
+		|| (relay1->streams[0]->rate != 0)
+		|| (relay1->streams[0]->weight != 0)) {
+		goto cleanup;
+	}
+
+	/* poll engine */
+	close(relay1->epfd);
+	relay1->epfd = -1;
+	if ((russ_relay_set_defaults(relay1, 0, 1<<20, 0, 0) == 0)
+		|| (russ_relay_set_rate(relay1, 0, 1<<20, 0) == 0)
+		|| (russ_relay_set_defaults(relay1, 0, 0, 0, 2) < 0)) {
+		goto cleanup;
+	}
+	rv = 0;
+
+cleanup:
+	relay0 = russ_relay_free(relay0);
+	relay1 = russ_relay_free(relay1);
+	russ_fds_close(fds, 2);
+	return rv;
+}
+
+int
+main(int argc, char **argv) {
+	struct iocounts	counts;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	TEST_CHECK(relay_pipes(0, NULL) == 0);
+	TEST_CHECK(relay_pipes(1, NULL) == 0);
+
+	/* callback streams keep data in the buffer */
+	TEST_CHECK(relay_pipes(1, count_callback) == 0);
+	TEST_CHECK(ncallbacks > 0);
+
+	TEST_CHECK(relay_stdio() == 0);
+
+	/* 4MB at 16MB/s with an empty 64KB bucket: >= ~250ms */
+	TEST_CHECK(relay_rate(16<<20) >= 200);
+	TEST_CHECK(relay_defaults() == 0);
+
+	/* ring buffer: wrapping, high-water mark below buffer size */
+	TEST_CHECK(relay_ring(1<<16, 0) == 0);
+	TEST_CHECK(relay_ring(4096, 3000) == 0);
+
+	/* coalescing: many small reads, few writes */
+	TEST_CHECK(relay_coalesce(200, 1024, 100000, &counts) == 0);
+	TEST_CHECK((counts.nreads > 20) && (counts.nwrites*4 < counts.nreads));
+
+	/* a lone small read is held for about maxhold (50ms) */
+	TEST_CHECK(relay_coalesce(1, 1024, 50000, &counts) == 0);
+	TEST_CHECK((counts.twrite-counts.tread >= 40000) && (counts.twrite-counts.tread < 250000));
+
+	return TEST_DONE();
+}
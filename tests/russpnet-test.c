@@ -0,0 +1,465 @@
+/*
+* tests/russpnet-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* russpnet server internals: targets index validation and lookup;
+* lazy, shared local host resolution; /multi selector parsing and
+* prefixed line output; target selection and dial tracking.
+*
+* The server source is included (with its main() renamed) to test
+* its functions directly.
+*/
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "test.h"
+
+#define main russpnet_main
+#include "../servers/src/usr/lib/russng/russpnet/russpnet_server.c"
+#undef main
+
+#define NTARGETS	40
+
+/**
+* Load targets into the global targets index.
+*
+* @param userhosts	target userhosts
+* @param n		# of targets
+* @return		0 on success; -1 on failure
+*/
+int
+setup_targets(char **userhosts, int n) {
+	struct stat	st;
+	char		secname[64], id[64];
+	int		i, rv;
+
+	memset(&st, 0, sizeof(st));
+	targetsconf = russ_conf_new();
+	for (i = 0; i < n; i++) {
+		snprintf(secname, sizeof(secname), "target.%d", i);
+		snprintf(id, sizeof(id), "%d", i);
+		russ_conf_set2(targetsconf, secname, "id", id);
+		russ_conf_set2(targetsconf, secname, "userhost", userhosts[i]);
+	}
+	rv = targetsindex_build(&targetsindex, targetsconf, &st);
+	targetsconf = russ_conf_free(targetsconf);
+	return rv;
+}
+
+/**
+* Attach a (modified) copy of the global targets index image.
+*
+* @param nbuckets	header nbuckets to set; 0 to keep
+* @param bucket		bucket value to set in all buckets; 0 to keep
+* @param self		targets index object to attach to
+* @return		targetsindex_attach() result
+*/
+int
+attach_copy(uint32_t nbuckets, uint32_t bucket, struct targetsindex *self) {
+	struct targetsindex_header	*hdr = NULL;
+	uint32_t			*buckets = NULL;
+	char				*base = NULL;
+	uint32_t			i;
+
+	base = russ_malloc(targetsindex.size);
+	memcpy(base, targetsindex.base, targetsindex.size);
+	hdr = (struct targetsindex_header *)base;
+	buckets = (uint32_t *)(base+((char *)targetsindex.buckets-(char *)targetsindex.base));
+	if (bucket != 0) {
+		for (i = 0; i < hdr->nbuckets; i++) {
+			buckets[i] = bucket;
+		}
+	}
+	if (nbuckets != 0) {
+		hdr->nbuckets = nbuckets;
+	}
+	memset(self, 0, sizeof(struct targetsindex));
+	if (targetsindex_attach(self, base, targetsindex.size, 0) < 0) {
+		russ_free(base);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+* Check targets index lookups and validation.
+*/
+void
+test_targetsindex(void) {
+	struct targetsindex	saved, other;
+	struct stat		st;
+	char			*userhosts[NTARGETS];
+	char			userhost[64], filename[100], tmpfilename[128];
+	int			i, ok;
+
+	for (i = 0; i < NTARGETS; i++) {
+		snprintf(userhost, sizeof(userhost), "u%d@h%d", i, i);
+		userhosts[i] = strdup(userhost);
+	}
+	TEST_CHECK(setup_targets(userhosts, NTARGETS) == 0);
+	TEST_CHECK(get_ntargets() == NTARGETS);
+
+	/* lookup */
+	for (i = 0, ok = 1; i < NTARGETS; i++) {
+		ok = ok && (find_target_userhost(userhosts[i]) == i);
+	}
+	TEST_CHECK(ok);
+	TEST_CHECK(find_target_userhost("nobody@nowhere") == -1);
+
+	/* validation */
+	TEST_CHECK(attach_copy(0, 0, &other) == 0);
+	targetsindex_release(&other);
+	TEST_CHECK(attach_copy(NTARGETS, 0, &other) < 0);
+	TEST_CHECK(attach_copy(0, NTARGETS+1, &other) < 0);
+
+	/* no empty bucket: lookup of a missing userhost terminates */
+	TEST_CHECK(attach_copy(0, 1, &other) == 0);
+	saved = targetsindex;
+	targetsindex = other;
+	TEST_CHECK(find_target_userhost("nobody@nowhere") == -1);
+	TEST_CHECK(find_target_userhost("u0@h0") == 0);
+	targetsindex = saved;
+	targetsindex_release(&other);
+
+	/* write: round trip; failed rename leaves no temp file */
+	test_sockpath(filename, sizeof(filename), "targetsindex");
+	TEST_CHECK(targetsindex_write(&targetsindex, filename) == 0);
+	TEST_CHECK((stat(filename, &st) == 0) && (st.st_size == targetsindex.size));
+	unlink(filename);
+	mkdir(filename, 0700);
+	TEST_CHECK(targetsindex_write(&targetsindex, filename) < 0);
+	snprintf(tmpfilename, sizeof(tmpfilename), "%s.%d", filename, getpid());
+	TEST_CHECK(access(tmpfilename, F_OK) < 0);
+	rmdir(filename);
+
+	targetsindex_release(&targetsindex);
+	for (i = 0; i < NTARGETS; i++) {
+		free(userhosts[i]);
+	}
+}
+
+/**
+* Check local host resolution: nothing at setup or invalidation;
+* targets resolved on first use, in a session process, are cached
+* for all processes.
+*/
+void
+test_localhost(void) {
+	char	hostname[256];
+	char	*userhosts[3];
+	pid_t	pid;
+	int	wst;
+
+	hostname[sizeof(hostname)-1] = '\0';
+	if (gethostname(hostname, sizeof(hostname)-1) < 0) {
+		strcpy(hostname, "localhost");
+	}
+	userhosts[0] = "localhost";
+	userhosts[1] = "user@localhost";
+	userhosts[2] = hostname;
+	TEST_CHECK(setup_targets(userhosts, 3) == 0);
+
+	localhost.enabled = 1;
+	TEST_CHECK(init_localhost(get_ntargets()) == 0);
+	TEST_CHECK(localhost.namesgen == 0);
+	TEST_CHECK(localhost.shared->targets[0].gen == 0);
+
+	/* resolve in a session process */
+	if ((pid = fork()) == 0) {
+		exit((is_target_localhost(0) == 1) ? 0 : 1);
+	}
+	waitpid(pid, &wst, 0);
+	TEST_CHECK(WIFEXITED(wst) && (WEXITSTATUS(wst) == 0));
+	TEST_CHECK(localhost.namesgen == 0);
+	TEST_CHECK(localhost.shared->targets[0].gen == localhost.shared->gen);
+	TEST_CHECK(localhost.shared->targets[0].local == 1);
+	TEST_CHECK(localhost.shared->targets[1].gen == 0);
+
+	TEST_CHECK(is_target_localhost(0) == 1);
+	TEST_CHECK(is_target_localhost(1) == 0);
+	TEST_CHECK(is_target_localhost(2) == 1);
+	TEST_CHECK(is_target_localhost(3) == 0);
+
+	/* invalidation does not resolve */
+	invalidate_localhost();
+	TEST_CHECK(localhost.shared->targets[0].gen != localhost.shared->gen);
+	TEST_CHECK(localhost.namesgen != localhost.shared->gen);
+	TEST_CHECK(is_target_localhost(0) == 1);
+	TEST_CHECK(localhost.namesgen == localhost.shared->gen);
+
+	targetsindex_release(&targetsindex);
+}
+
+/**
+* Parse selector and compare target indexes.
+*
+* @param spath		service path
+* @param ntargets	# of targets
+* @param want		expected indexes (comma separated); NULL for
+*			failure
+* @return		1 for match; 0 otherwise
+*/
+int
+selector_is(char *spath, int ntargets, char *want) {
+	char	buf[1024];
+	int	*idxs = NULL;
+	int	i, n, off;
+
+	if ((n = get_valid_selector(spath, ntargets, &idxs, NULL)) < 0) {
+		return want == NULL;
+	}
+	buf[0] = '\0';
+	for (i = 0, off = 0; i < n; i++) {
+		off += snprintf(buf+off, sizeof(buf)-off, (i == 0) ? "%d" : ",%d", idxs[i]);
+	}
+	free(idxs);
+	return (want != NULL) && (strcmp(buf, want) == 0);
+}
+
+/**
+* Check selector parsing.
+*/
+void
+test_selector(void) {
+	char	**options = NULL;
+	int	*idxs = NULL;
+
+	TEST_CHECK(selector_is("/multi/1/x", 5, "1"));
+	TEST_CHECK(selector_is("/multi/0:3,4/x", 5, "0,1,2,4"));
+	TEST_CHECK(selector_is("/multi/:/x", 5, "0,1,2,3,4"));
+	TEST_CHECK(selector_is("/multi/4:0:-2/x", 5, "4,2"));
+
+	/* negative indexes (as for /id); defaults for negative steps */
+	TEST_CHECK(selector_is("/multi/-1/x", 5, "4"));
+	TEST_CHECK(selector_is("/multi/-2:/x", 5, "3,4"));
+	TEST_CHECK(selector_is("/multi/0:-1/x", 5, "0,1,2,3"));
+	TEST_CHECK(selector_is("/multi/::-1/x", 5, "4,3,2,1,0"));
+	TEST_CHECK(selector_is("/multi/-1:-4:-1/x", 5, "4,3,2"));
+
+	/* overlaps are deduplicated; total is bounded by ntargets */
+	TEST_CHECK(selector_is("/multi/0:3,1,2:0:-1,:,:/x", 5, "0,1,2,3,4"));
+	TEST_CHECK(selector_is("/multi/1:2000000000:2147483647/x", 5, "1"));
+
+	/* bad */
+	TEST_CHECK(selector_is("/multi/5/x", 5, NULL));
+	TEST_CHECK(selector_is("/multi/-6/x", 5, NULL));
+	TEST_CHECK(selector_is("/multi/0:6/x", 5, NULL));
+	TEST_CHECK(selector_is("/multi/0:3:0/x", 5, NULL));
+	TEST_CHECK(selector_is("/multi/a/x", 5, NULL));
+	TEST_CHECK(selector_is("/multi/1/x", 0, NULL));
+
+	/* options */
+	TEST_CHECK(get_valid_selector("/multi/2?prefix?n=2/x", 5, &idxs, &options) == 1);
+	TEST_CHECK((options != NULL) && (options[1] != NULL)
+		&& (strcmp(options[1], "prefix") == 0) && (strcmp(options[2], "n=2") == 0));
+	free(idxs);
+	options = russ_sarray0_free(options);
+}
+
+/**
+* Feed data to the /multi prefixed output of one target, in pieces.
+*/
+void
+feed(struct russ_dialreq *dreq, struct multi *multi, char *buf, int n, int piece) {
+	int	m;
+
+	for (; n > 0; buf += m, n -= m) {
+		m = RUSS__MIN(n, piece);
+		multi_outcb(dreq, 1, buf, m, multi);
+	}
+}
+
+/**
+* Check /multi prefixed output: lines split across reads and lines
+* longer than the line buffer are not split; long lines are written
+* in pieces with one prefix and no added newlines.
+*/
+void
+test_multilines(void) {
+	struct russ_sconn	sconn;
+	struct russ_dialreq	dreq;
+	struct multitarget	mt;
+	struct multi		multi;
+	char			path[256];
+	char			*data = NULL, *out = NULL, *p = NULL;
+	int			fd, len, ok, n;
+
+	test_sockpath(path, sizeof(path), "multilines");
+	if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0) {
+		TEST_CHECK(fd >= 0);
+		return;
+	}
+	unlink(path);
+
+	memset(&sconn, 0, sizeof(sconn));
+	memset(&mt, 0, sizeof(mt));
+	memset(&dreq, 0, sizeof(dreq));
+	sconn.fds[1] = fd;
+	multi.sconn = &sconn;
+	multi.prefix = 1;
+	mt.userhost = "h";
+	dreq.data = &mt;
+
+	/* 10000 and MULTI_LINE_MAX+5000 byte lines, a short line, an unended line */
+	len = MULTI_LINE_MAX+5000;
+	data = russ_malloc(len+1);
+	memset(data, 'x', len);
+	feed(&dreq, &multi, data, 10000, 3000);
+	feed(&dreq, &multi, "\nshort\n", 7, 3);
+	feed(&dreq, &multi, data, len, 65536);
+	feed(&dreq, &multi, "\ntail", 5, 5);
+	multi_write_lines(&mt, fd, 1, 1);
+	mt.lbufs[1] = russ_buf_free(mt.lbufs[1]);
+
+	n = lseek(fd, 0, SEEK_CUR);
+	out = russ_malloc(n+1);
+	TEST_CHECK(pread(fd, out, n, 0) == n);
+	out[n] = '\0';
+	TEST_CHECK(n == (3+10000+1)+(3+6)+(3+len+1)+(3+5));
+	p = out;
+	ok = (strncmp(p, "h: ", 3) == 0) && (strspn(p+3, "x") == 10000) && (p[3+10000] == '\n');
+	p += 3+10000+1;
+	ok = ok && (strncmp(p, "h: short\n", 9) == 0);
+	p += 9;
+	ok = ok && (strncmp(p, "h: ", 3) == 0) && (strspn(p+3, "x") == len) && (p[3+len] == '\n');
+	p += 3+len+1;
+	ok = ok && (strcmp(p, "h: tail\n") == 0);
+	TEST_CHECK(ok);
+
+	free(out);
+	free(data);
+	close(fd);
+}
+
+/**
+* Check that p2c compares two distinct targets: with two targets,
+* the less loaded one is always selected.
+*/
+void
+test_p2c(void) {
+	char	*userhosts[2] = { "u0@h0", "u1@h1" };
+	int	i, ok;
+
+	TEST_CHECK(setup_targets(userhosts, 2) == 0);
+	TEST_CHECK(init_targetstats(get_ntargets()) == 0);
+	selection.policy = SELECT_POLICY_P2C;
+	selection.stats[1].outstanding = 5;
+	for (i = 0, ok = 1; i < 200; i++) {
+		ok = ok && (select_target() == 0);
+	}
+	TEST_CHECK(ok);
+	selection.stats[1].outstanding = 0;
+	selection.stats[0].outstanding = 5;
+	for (i = 0, ok = 1; i < 200; i++) {
+		ok = ok && (select_target() == 1);
+	}
+	TEST_CHECK(ok);
+	selection.stats[0].outstanding = 0;
+	targetsindex_release(&targetsindex);
+}
+
+/**
+* Check dial tracking: a session process dying mid-dial does not
+* leak its outstanding count; only connect failures put a target in
+* backoff.
+*/
+void
+test_dialtracking(void) {
+	struct russ_req		req;
+	struct sockaddr_un	sa;
+	char			*userhosts[1] = { "u0@h0" };
+	char			path[100], spath[512];
+	int64_t			t0;
+	pid_t			pid;
+	int			slot, wst, sd;
+
+	TEST_CHECK(setup_targets(userhosts, 1) == 0);
+	TEST_CHECK(init_targetstats(get_ntargets()) == 0);
+	selection.backoff = 1000;
+	selection.backoffmax = 10000;
+
+	/* normal */
+	t0 = target_dial_begin(0, &slot);
+	TEST_CHECK((slot >= 0) && (selection.stats[0].outstanding == 1));
+	target_dial_end(0, t0, slot, 1);
+	TEST_CHECK((selection.stats[0].outstanding == 0) && (selection.dialslots[slot].pid == 0));
+
+	/* session process dies mid-dial */
+	if ((pid = fork()) == 0) {
+		target_dial_begin(0, &slot);
+		_exit(0);
+	}
+	waitpid(pid, &wst, 0);
+	TEST_CHECK(selection.stats[0].outstanding == 1);
+	sweep_dialslots();
+	TEST_CHECK(selection.stats[0].outstanding == 0);
+	sweep_dialslots();
+	TEST_CHECK(selection.stats[0].outstanding == 0);
+
+	/* stale release of a slot claimed anew is ignored */
+	t0 = target_dial_begin(0, &slot);
+	TEST_CHECK(release_dialslot(slot, pid, -1) < 0);
+	TEST_CHECK((selection.stats[0].outstanding == 1) && (selection.dialslots[slot].pid == getpid()));
+	target_dial_end(0, t0, slot, 1);
+	TEST_CHECK((selection.stats[0].outstanding == 0) && (selection.dialslots[slot].pid == 0));
+
+	/* bad path: not tracked */
+	memset(&req, 0, sizeof(req));
+	req.op = "execute";
+	test_sockpath(path, sizeof(path), "nosuchservice");
+	snprintf(spath, sizeof(spath), "%s/x", path);
+	req.spath = spath;
+	TEST_CHECK(dial_target(russ_to_deadline(5000), &req, 0) == NULL);
+	TEST_CHECK((selection.stats[0].failures == 0) && (selection.stats[0].backoffuntil == 0));
+	TEST_CHECK(selection.stats[0].ndials == 2);
+
+	/* no listener: tracked, backoff */
+	test_sockpath(path, sizeof(path), "nolistener");
+	unlink(path);
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	TEST_CHECK(bind(sd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+	close(sd);
+	snprintf(spath, sizeof(spath), "%s/x", path);
+	TEST_CHECK(dial_target(russ_to_deadline(5000), &req, 0) == NULL);
+	TEST_CHECK((selection.stats[0].failures == 1) && (is_target_backoff(0, russ_gettime())));
+	TEST_CHECK((selection.stats[0].ndials == 3) && (selection.stats[0].outstanding == 0));
+	unlink(path);
+
+	targetsindex_release(&targetsindex);
+}
+
+int
+main(int argc, char **argv) {
+	test_targetsindex();
+	test_localhost();
+	test_selector();
+	test_multilines();
+	test_p2c();
+	test_dialtracking();
+	return TEST_DONE();
+}
@@ -0,0 +1,249 @@
+/*
+* tests/russtee-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* russtee server internals: relayed data is captured exactly once
+* (plain and ring streams); a capture file which does not keep up
+* loses data (drop), stalls the relay (block), or grows the ring up
+* to its limit (spill).
+*
+* The server source is included (with its main() renamed) to test
+* its functions directly.
+*/
+
+#include "test.h"
+
+#define main russtee_main
+#include "../servers/src/usr/lib/russng/russtee/russtee_server.c"
+#undef main
+
+#define NBYTES		(1<<20)
+#define NPUT		(200<<10)
+#define PUTSIZE		1024
+#define RINGSIZE	4096
+#define SPILLMAX	(64<<10)
+
+/*
+* Capture file reader (FIFO), started by a gate so that the
+* capture writer can be kept blocked.
+*/
+struct drain {
+	int	fd;		/**< FIFO read end */
+	int	gatefd;		/**< read one byte before reading fd */
+	int	skip;		/**< # of prefilled bytes */
+	long	n;		/**< # of bytes read */
+	int	intact;		/**< bytes after skip follow the pattern */
+};
+
+void *
+drain_thread(void *arg) {
+	struct drain	*self = arg;
+	char		buf[1<<14];
+	int		i, cnt;
+
+	russ_read(self->gatefd, buf, 1);
+	self->intact = 1;
+	for (self->n = 0; (cnt = russ_read(self->fd, buf, sizeof(buf))) > 0; self->n += cnt) {
+		for (i = 0; i < cnt; i++) {
+			if ((self->n+i >= self->skip) && (buf[i] != (char)(self->n+i-self->skip))) {
+				self->intact = 0;
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+* Capture NPUT bytes of a pattern to a FIFO.
+*
+* @param overflow	overflow policy
+* @param prefill	fill the FIFO first (capture writer blocks)
+* @param early		start reading the FIFO before the data is put
+* @param nput		# of bytes to put
+* @param self		capture object (closed; stats valid)
+* @param drain		drain object (results)
+* @return		0 on success; -1 on failure
+*/
+int
+capture_fifo(int overflow, int prefill, int early, int nput, struct capture *self, struct drain *drain) {
+	pthread_t	thread;
+	char		path[256], buf[PUTSIZE];
+	int		gatefds[2];
+	int		fd, i, n, cnt;
+
+	test_sockpath(path, sizeof(path), "tee-fifo");
+	unlink(path);
+	if ((mkfifo(path, 0600) < 0)
+		|| (pipe(gatefds) < 0)
+		|| ((drain->fd = open(path, O_RDONLY|O_NONBLOCK)) < 0)) {
+		return -1;
+	}
+	fcntl(drain->fd, F_SETFL, fcntl(drain->fd, F_GETFL) & ~O_NONBLOCK);
+	drain->gatefd = gatefds[0];
+
+	/* fill FIFO so that the capture writer blocks */
+	drain->skip = 0;
+	if (prefill) {
+		fd = open(path, O_WRONLY|O_NONBLOCK);
+		memset(buf, 0, sizeof(buf));
+		while ((cnt = write(fd, buf, sizeof(buf))) > 0) {
+			drain->skip += cnt;
+		}
+		close(fd);
+	}
+
+	memset(self, 0, sizeof(struct capture));
+	capture_ringsize = RINGSIZE;
+	capture_spillmax = SPILLMAX;
+	capture_overflow = overflow;
+	if (capture_open(self, path) < 0) {
+		return -1;
+	}
+	unlink(path);
+	pthread_create(&thread, NULL, drain_thread, drain);
+	if (early) {
+		russ_writen(gatefds[1], "x", 1);
+	}
+	for (n = 0; n < nput; n += PUTSIZE) {
+		for (i = 0; i < PUTSIZE; i++) {
+			buf[i] = (char)(n+i);
+		}
+		capture_put(self, buf, PUTSIZE);
+	}
+	if (!early) {
+		russ_writen(gatefds[1], "x", 1);
+	}
+	capture_close(self);
+	pthread_join(thread, NULL);
+	close(drain->fd);
+	close(gatefds[0]);
+	close(gatefds[1]);
+	return 0;
+}
+
+/**
+* Relay NBYTES of a pattern with the tee callback capturing to a
+* file; check the file.
+*
+* @param bufsize	stream buffer size
+* @param highwater	ring high-water mark; -1 for no ring
+* @return		0 if the data was captured intact; -1 otherwise
+*/
+int
+tee_relay(int bufsize, int highwater) {
+	struct russ_relay	*relay = NULL;
+	char			path[256], buf[1<<14];
+	int			infds[2], outfds[2];
+	pid_t			wpid, rpid;
+	int			fd, i, n, cnt, wst, rst, intact;
+
+	if ((pipe(infds) < 0) || (pipe(outfds) < 0)) {
+		return -1;
+	}
+	if ((wpid = fork()) == 0) {
+		close(infds[0]);
+		for (n = 0; n < NBYTES; n += sizeof(buf)) {
+			for (i = 0; i < sizeof(buf); i++) {
+				buf[i] = (char)(n+i);
+			}
+			russ_writen(infds[1], buf, sizeof(buf));
+		}
+		exit(0);
+	}
+	close(infds[1]);
+	if ((rpid = fork()) == 0) {
+		close(outfds[1]);
+		for (n = 0; (cnt = russ_read(outfds[0], buf, sizeof(buf))) > 0; n += cnt);
+		exit((n == NBYTES) ? 0 : 1);
+	}
+	close(outfds[0]);
+
+	init_fds();
+	capture_ringsize = CAPTURE_RINGSIZE;
+	capture_overflow = CAPTURE_OVERFLOW_BLOCK;
+	test_sockpath(path, sizeof(path), "tee-file");
+	if (capture_open(&captures[0], path) < 0) {
+		return -1;
+	}
+	relay = russ_relay_new(1);
+	russ_relay_addwithcallback(relay, infds[0], outfds[1], bufsize, 1, tee_callback, (void *)(intptr_t)0);
+	if (highwater >= 0) {
+		russ_relay_set_ring(relay, 0, highwater);
+	}
+	russ_relay_serve(relay, -1, -1);
+	relay = russ_relay_free(relay);
+	close_fds();
+	waitpid(wpid, &wst, 0);
+	waitpid(rpid, &rst, 0);
+
+	/* capture file has each byte once, in order */
+	intact = (captures[0].ncaptured == NBYTES) && (captures[0].ndropped == 0);
+	fd = open(path, O_RDONLY);
+	for (n = 0; (cnt = russ_read(fd, buf, sizeof(buf))) > 0; n += cnt) {
+		for (i = 0; i < cnt; i++) {
+			intact = intact && (buf[i] == (char)(n+i));
+		}
+	}
+	close(fd);
+	unlink(path);
+	snprintf(buf, sizeof(buf), "%s.stats", path);
+	unlink(buf);
+	return (intact && (n == NBYTES)
+		&& WIFEXITED(wst) && (WEXITSTATUS(wst) == 0) && WIFEXITED(rst) && (WEXITSTATUS(rst) == 0)) ? 0 : -1;
+}
+
+int
+main(int argc, char **argv) {
+	struct capture	capture;
+	struct drain	drain;
+	char		path[256];
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* relay capture: plain and ring (wrapping) streams */
+	TEST_CHECK(tee_relay(1<<16, -1) == 0);
+	TEST_CHECK(tee_relay(4096, 3000) == 0);
+
+	/* drop: blocked file loses data; what is kept is written */
+	TEST_CHECK(capture_fifo(CAPTURE_OVERFLOW_DROP, 1, 0, NPUT, &capture, &drain) == 0);
+	TEST_CHECK((capture.ndropped > 0) && (capture.ncaptured+capture.ndropped == NPUT));
+	TEST_CHECK((capture.nwritten == capture.ncaptured) && (drain.n == drain.skip+capture.ncaptured));
+
+	/* block: slow file loses nothing */
+	TEST_CHECK(capture_fifo(CAPTURE_OVERFLOW_BLOCK, 1, 1, NPUT, &capture, &drain) == 0);
+	TEST_CHECK((capture.ndropped == 0) && (capture.ncaptured == NPUT));
+	TEST_CHECK((drain.n == drain.skip+NPUT) && drain.intact);
+
+	/* spill: ring grows to hold what a blocked file cannot take... */
+	TEST_CHECK(capture_fifo(CAPTURE_OVERFLOW_SPILL, 1, 0, SPILLMAX-PUTSIZE, &capture, &drain) == 0);
+	TEST_CHECK((capture.ndropped == 0) && (capture.maxlen > RINGSIZE));
+	TEST_CHECK((drain.n == drain.skip+SPILLMAX-PUTSIZE) && drain.intact);
+
+	/* ...up to spillmax */
+	TEST_CHECK(capture_fifo(CAPTURE_OVERFLOW_SPILL, 1, 0, NPUT, &capture, &drain) == 0);
+	TEST_CHECK((capture.ndropped > 0) && (capture.maxlen <= SPILLMAX));
+
+	unlink(test_sockpath(path, sizeof(path), "tee-fifo.stats"));
+	return TEST_DONE();
+}
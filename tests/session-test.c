@@ -0,0 +1,116 @@
+/*
+* tests/session-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Client sessions: disabled by default; when enabled, requests reuse
+* the server process and each starts with a reset cwd/environment.
+*/
+
+#include "test.h"
+
+void
+svc_root_handler(struct russ_sess *sess) {
+	struct russ_sconn	*sconn = sess->sconn;
+	char			cwd[256];
+	char			*s = NULL;
+
+	if (sess->req->opnum == RUSS_OPNUM_EXECUTE) {
+		s = getenv("RUSS_TEST_LEAK");
+		if (getcwd(cwd, sizeof(cwd)) == NULL) {
+			cwd[0] = '\0';
+		}
+		russ_dprintf(sconn->fds[1], "%d %s %s", getpid(), (s != NULL) ? s : "-", cwd);
+		/* leave state behind for the next request */
+		setenv("RUSS_TEST_LEAK", "1", 1);
+		if (chdir("/tmp") < 0) {
+			;
+		}
+		russ_sconn_exit(sconn, RUSS_EXIT_SUCCESS);
+	}
+}
+
+/**
+* Dial over session; collect output.
+*/
+int
+session_dial(struct russ_csession *csess, char *buf, int bufsize) {
+	struct russ_cconn	*cconn = NULL;
+	russ_deadline		deadline;
+	int			exitst, n;
+
+	deadline = russ_to_deadline(5000);
+	buf[0] = '\0';
+	if ((cconn = russ_csession_dialv(csess, deadline, "execute", NULL, NULL)) == NULL) {
+		return -1;
+	}
+	if ((n = russ_readn_deadline(deadline, cconn->fds[1], buf, bufsize-1)) >= 0) {
+		buf[n] = '\0';
+	}
+	if (russ_cconn_wait(cconn, deadline, &exitst) != RUSS_WAIT_OK) {
+		exitst = -1;
+	}
+	russ_cconn_close(cconn);
+	cconn = russ_cconn_free(cconn);
+	return exitst;
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_conf	*conf = NULL;
+	struct russ_svr		*svr = NULL;
+	struct russ_csession	*csess = NULL;
+	char			path[256], buf1[512], buf2[512];
+	pid_t			pid;
+
+	conf = russ_conf_new();
+	svr = russ_init(conf);
+	TEST_CHECK(svr->sessiontimeout == 0);
+
+	/* default: no session; each request gets a new server process */
+	russ_svr_set_type(svr, RUSS_SVR_TYPE_FORK);
+	russ_svcnode_set_handler(svr->root, svc_root_handler);
+	russ_svcnode_set_virtual(svr->root, 1);
+	pid = test_svr_start(svr, test_sockpath(path, sizeof(path), "session"));
+	csess = russ_csession_new(path);
+	TEST_CHECK(session_dial(csess, buf1, sizeof(buf1)) == 0);
+	TEST_CHECK(session_dial(csess, buf2, sizeof(buf2)) == 0);
+	TEST_CHECK(strcmp(buf1, buf2) != 0);
+	csess = russ_csession_free(csess);
+	test_svr_stop(pid, path);
+
+	/* enabled: same server process, clean state per request */
+	russ_svr_set_sessiontimeout(svr, 2000);
+	pid = test_svr_start(svr, test_sockpath(path, sizeof(path), "session"));
+	csess = russ_csession_new(path);
+	TEST_CHECK(session_dial(csess, buf1, sizeof(buf1)) == 0);
+	TEST_CHECK(session_dial(csess, buf2, sizeof(buf2)) == 0);
+	TEST_CHECK(strcmp(buf1, buf2) == 0);
+	TEST_CHECK(strstr(buf2, " - /") != NULL);
+	csess = russ_csession_free(csess);
+	test_svr_stop(pid, path);
+
+	svr = russ_svr_free(svr);
+	conf = russ_conf_free(conf);
+	return TEST_DONE();
+}
@@ -0,0 +1,117 @@
+/*
+* tests/shmring-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Shared memory ring: the memfd is sealed, unsealed memfds are not
+* attached, a peer cannot change the capacity in use, and head/tail
+* out of bounds are errors.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "test.h"
+#include "russ/priv.h"
+
+#define CAP		8192
+#define NBYTES		5000
+
+/* header layout (see lib/shmring.c) */
+#define HDR_CAP		4
+#define HDR_HEAD	64
+#define HDR_TAIL	128
+
+/**
+* Write NBYTES through the ring and read them back from the peer.
+*
+* @return		0 on success; -1 on failure
+*/
+int
+roundtrip(struct russ_shmring *ring, struct russ_shmring *peer) {
+	char	wbuf[NBYTES], rbuf[NBYTES];
+	int	i, n, cnt;
+
+	for (i = 0; i < NBYTES; i++) {
+		wbuf[i] = (char)i;
+	}
+	if (russ_shmring_write(ring, wbuf, NBYTES, russ_to_deadline(1000)) != NBYTES) {
+		return -1;
+	}
+	for (n = 0; n < NBYTES; n += cnt) {
+		if ((cnt = russ_shmring_read(peer, rbuf+n, NBYTES-n, russ_to_deadline(1000))) <= 0) {
+			return -1;
+		}
+	}
+	return (memcmp(wbuf, rbuf, NBYTES) == 0) ? 0 : -1;
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_shmring	*ring = NULL, *peer = NULL;
+	char			*hdr = NULL;
+	char			buf[16];
+	int			fds[RUSS_SHMRING_NFDS];
+	int			memfd;
+
+	TEST_CHECK((ring = russ_shmring_new(CAP)) != NULL);
+	TEST_CHECK(russ_shmring_dupfds(ring, fds) == 0);
+	memfd = dup(fds[0]);
+	TEST_CHECK((peer = russ_shmring_attach(fds)) != NULL);
+	TEST_CHECK(roundtrip(ring, peer) == 0);
+
+	/* sealed against resizing */
+	TEST_CHECK(ftruncate(memfd, 4096) < 0);
+
+	/* capacity in use cannot be changed by the peer */
+	hdr = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+	TEST_CHECK(hdr != MAP_FAILED);
+	*(uint32_t *)(hdr+HDR_CAP) = 1U<<30;
+	TEST_CHECK(roundtrip(ring, peer) == 0);
+
+	/* head-tail outside [0, cap] */
+	*(uint64_t *)(hdr+HDR_HEAD) = *(uint64_t *)(hdr+HDR_TAIL)+CAP+1;
+	errno = 0;
+	TEST_CHECK((russ_shmring_read(peer, buf, sizeof(buf), russ_to_deadline(1000)) < 0) && (errno == EPROTO));
+	*(uint64_t *)(hdr+HDR_TAIL) = *(uint64_t *)(hdr+HDR_HEAD)+1;
+	errno = 0;
+	TEST_CHECK((russ_shmring_write(ring, buf, sizeof(buf), russ_to_deadline(1000)) < 0) && (errno == EPROTO));
+
+	munmap(hdr, 4096);
+	close(memfd);
+	ring = russ_shmring_free(ring);
+	peer = russ_shmring_free(peer);
+
+	/* unsealed memfd is not attached */
+	russ_fds_init(fds, RUSS_SHMRING_NFDS, -1);
+	fds[0] = memfd_create("test", 0);
+	fds[1] = dup(0);
+	fds[2] = dup(0);
+	TEST_CHECK(ftruncate(fds[0], 4096+CAP) == 0);
+	TEST_CHECK(russ_shmring_attach(fds) == NULL);
+	russ_fds_close(fds, RUSS_SHMRING_NFDS);
+
+	return TEST_DONE();
+}
@@ -0,0 +1,97 @@
+/*
+* tests/spath-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* spath split cache: results follow changes to symlink targets
+* outside the watched directories.
+*/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "test.h"
+
+/**
+* Split spath and compare results.
+*/
+int
+split_is(const char *spath, const char *saddr, const char *spath2) {
+	char	*_saddr = NULL, *_spath2 = NULL;
+	int	rv;
+
+	if (russ_spath_split(spath, &_saddr, &_spath2) < 0) {
+		return 0;
+	}
+	rv = (strcmp(_saddr, saddr) == 0) && (strcmp(_spath2, spath2) == 0);
+	free(_saddr);
+	free(_spath2);
+	return rv;
+}
+
+int
+main(int argc, char **argv) {
+	char	dir[256], path[512], a[512], b[512], link1[512], link2[512], spath[1024];
+
+	russ_spathcache_set_ttl(60000);
+
+	/* dir/sub1/l -> dir/sub2/t -> dir/sub3/{a,b} */
+	test_sockpath(dir, sizeof(dir), "spath");
+	mkdir(dir, 0700);
+	snprintf(path, sizeof(path), "%s/sub1", dir); mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/sub2", dir); mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/sub3", dir); mkdir(path, 0700);
+	snprintf(a, sizeof(a), "%s/sub3/a", dir);
+	snprintf(b, sizeof(b), "%s/sub3/b", dir);
+	close(open(a, O_CREAT|O_WRONLY, 0600));
+	close(open(b, O_CREAT|O_WRONLY, 0600));
+	snprintf(link1, sizeof(link1), "%s/sub1/l", dir);
+	snprintf(link2, sizeof(link2), "%s/sub2/t", dir);
+	symlink(link2, link1);
+	symlink(a, link2);
+
+	/* plain path */
+	snprintf(spath, sizeof(spath), "%s/x/y", a);
+	TEST_CHECK(split_is(spath, a, "/x/y"));
+	TEST_CHECK(split_is(spath, a, "/x/y"));
+
+	/* through symlinks; retarget the unwatched inner link */
+	snprintf(spath, sizeof(spath), "%s/x", link1);
+	TEST_CHECK(split_is(spath, a, "/x"));
+	unlink(link2);
+	symlink(b, link2);
+	TEST_CHECK(split_is(spath, b, "/x"));
+
+	/* removed target */
+	unlink(b);
+	TEST_CHECK(!split_is(spath, b, "/x"));
+
+	unlink(link1);
+	unlink(link2);
+	unlink(a);
+	snprintf(path, sizeof(path), "%s/sub1", dir); rmdir(path);
+	snprintf(path, sizeof(path), "%s/sub2", dir); rmdir(path);
+	snprintf(path, sizeof(path), "%s/sub3", dir); rmdir(path);
+	rmdir(dir);
+	return TEST_DONE();
+}
@@ -0,0 +1,213 @@
+/*
+* tests/stripe-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Striped transfer: data is reassembled in order, lanes ending
+* unevenly are an error, and shmring fds are not taken as lanes.
+* A server answers lanes to a client which asks for them, unless
+* the service disables them.
+*/
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "test.h"
+#include "russ/priv.h"
+
+#define CHUNKSIZE	1024
+#define NLANES		2
+
+/**
+* Write a frame (see lib/stripe.c) to a lane fd.
+*
+* @param fd		lane fd
+* @param seq		sequence number
+* @param len		data length
+*/
+void
+write_frame(int fd, uint64_t seq, int len) {
+	char	buf[RUSS_STRIPE_HDRSIZE+CHUNKSIZE];
+	char	*bp = NULL;
+
+	bp = russ_enc_uint64(buf, buf+sizeof(buf), seq);
+	bp = russ_enc_int32(bp, buf+sizeof(buf), len);
+	memset(bp, (char)seq, len);
+	russ_writen(fd, buf, RUSS_STRIPE_HDRSIZE+len);
+}
+
+/**
+* Read a stripe to the end.
+*
+* @param stripe		russ_stripe object
+* @return		# of bytes read; -1 on failure
+*/
+ssize_t
+read_all(struct russ_stripe *stripe) {
+	char	buf[CHUNKSIZE*4];
+	ssize_t	n, cnt;
+
+	for (n = 0; (cnt = russ_stripe_read(stripe, buf, sizeof(buf))) > 0; n += cnt);
+	return (cnt < 0) ? -1 : n;
+}
+
+/**
+* Make lanes (socketpairs).
+*
+* @param wfds		write ends
+* @param rfds		read ends
+*/
+void
+make_lanes(int *wfds, int *rfds) {
+	int	i, pfds[2];
+
+	for (i = 0; i < NLANES; i++) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, pfds);
+		wfds[i] = pfds[0];
+		rfds[i] = pfds[1];
+	}
+}
+
+/**
+* Answer lanes (none for "/off") and write a stripe over them.
+*/
+void
+svc_root_handler(struct russ_sess *sess) {
+	struct russ_sconn	*sconn = sess->sconn;
+	struct russ_stripe	*stripe = NULL;
+	char			buf[CHUNKSIZE*5];
+	int			n;
+
+	n = russ_sconn_answerstripes(sconn, sess->req, (strcmp(sess->req->spath, "/off") == 0) ? 0 : NLANES);
+	if (n > 0) {
+		memset(buf, 'x', sizeof(buf));
+		stripe = russ_stripe_new(RUSS_STRIPE_WRITE, n, &sconn->fds[RUSS_STRIPE_FDIDX], CHUNKSIZE);
+		russ_stripe_write(stripe, buf, sizeof(buf));
+		stripe = russ_stripe_free(stripe);
+	}
+	russ_sconn_exit(sconn, (n > 0) ? RUSS_EXIT_SUCCESS : RUSS_EXIT_FAILURE);
+}
+
+/**
+* Dial asking for lanes; read the stripe.
+*
+* @param spath		service path
+* @return		# of bytes read; -1 if no lanes or on failure
+*/
+ssize_t
+dial_lanes(char *spath) {
+	struct russ_cconn	*cconn = NULL;
+	struct russ_stripe	*stripe = NULL;
+	char			*attrv[] = {RUSS_STRIPE_ATTR_PREFIX "2", NULL};
+	ssize_t			n = -1;
+	int			exitst;
+
+	if ((cconn = russ_dialv(russ_to_deadline(5000), "execute", spath, attrv, NULL)) == NULL) {
+		return -1;
+	}
+	if ((stripe = russ_cconn_stripe(cconn, RUSS_STRIPE_READ, CHUNKSIZE)) != NULL) {
+		n = read_all(stripe);
+		stripe = russ_stripe_free(stripe);
+	}
+	if ((russ_cconn_wait(cconn, russ_to_deadline(5000), &exitst) != RUSS_WAIT_OK)
+		|| (exitst != ((n > 0) ? RUSS_EXIT_SUCCESS : RUSS_EXIT_FAILURE))) {
+		n = -1;
+	}
+	russ_cconn_close(cconn);
+	cconn = russ_cconn_free(cconn);
+	return n;
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_stripe	*wstripe = NULL, *rstripe = NULL;
+	struct russ_cconn	*cconn = NULL;
+	struct russ_conf	*conf = NULL;
+	struct russ_svr		*svr = NULL;
+	char			buf[CHUNKSIZE*5];
+	char			path[256], spath[512];
+	int			wfds[NLANES], rfds[NLANES];
+	pid_t			pid;
+	int			i;
+
+	/* round trip */
+	make_lanes(wfds, rfds);
+	rstripe = russ_stripe_new(RUSS_STRIPE_READ, NLANES, rfds, CHUNKSIZE);
+	wstripe = russ_stripe_new(RUSS_STRIPE_WRITE, NLANES, wfds, CHUNKSIZE);
+	memset(buf, 'x', sizeof(buf));
+	TEST_CHECK(russ_stripe_write(wstripe, buf, sizeof(buf)) == sizeof(buf));
+	wstripe = russ_stripe_free(wstripe);
+	TEST_CHECK(read_all(rstripe) == sizeof(buf));
+	rstripe = russ_stripe_free(rstripe);
+
+	/* lane 0 misses chunk 2 while lane 1 has chunk 3 */
+	make_lanes(wfds, rfds);
+	rstripe = russ_stripe_new(RUSS_STRIPE_READ, NLANES, rfds, CHUNKSIZE);
+	write_frame(wfds[0], 0, CHUNKSIZE);
+	write_frame(wfds[1], 1, CHUNKSIZE);
+	write_frame(wfds[1], 3, CHUNKSIZE);
+	russ_fds_close(wfds, NLANES);
+	errno = 0;
+	TEST_CHECK((read_all(rstripe) < 0) && (errno == EPROTO));
+	rstripe = russ_stripe_free(rstripe);
+
+	/* lane 1 still open (no EOF) is waited for; ends evenly */
+	make_lanes(wfds, rfds);
+	rstripe = russ_stripe_new(RUSS_STRIPE_READ, NLANES, rfds, CHUNKSIZE);
+	write_frame(wfds[0], 0, CHUNKSIZE);
+	write_frame(wfds[1], 1, CHUNKSIZE);
+	write_frame(wfds[0], 2, 10);
+	russ_fds_close(&wfds[0], 1);
+	usleep(100000);
+	russ_fds_close(&wfds[1], 1);
+	TEST_CHECK(read_all(rstripe) == CHUNKSIZE*2+10);
+	rstripe = russ_stripe_free(rstripe);
+
+	/* shmring fds are not lanes */
+	TEST_CHECK(RUSS_STRIPE_FDIDX >= RUSS_SHMRING_FDIDX+RUSS_SHMRING_NFDS);
+	cconn = russ_cconn_new();
+	for (i = RUSS_SHMRING_FDIDX; i < RUSS_SHMRING_FDIDX+RUSS_SHMRING_NFDS; i++) {
+		cconn->fds[i] = dup(0);
+	}
+	TEST_CHECK(russ_cconn_stripe(cconn, RUSS_STRIPE_READ, CHUNKSIZE) == NULL);
+	russ_fds_close(cconn->fds, RUSS_CONN_NFDS);
+	cconn = russ_cconn_free(cconn);
+
+	/* lanes answered by a server; disabled by the service */
+	conf = russ_conf_new();
+	svr = russ_init(conf);
+	russ_svr_set_type(svr, RUSS_SVR_TYPE_FORK);
+	russ_svr_set_autoswitchuser(svr, 0);
+	russ_svcnode_set_handler(svr->root, svc_root_handler);
+	russ_svcnode_set_virtual(svr->root, 1);
+	russ_svcnode_set_autoanswer(svr->root, 0);
+	pid = test_svr_start(svr, test_sockpath(path, sizeof(path), "stripe"));
+	snprintf(spath, sizeof(spath), "%s/on", path);
+	TEST_CHECK(dial_lanes(spath) == sizeof(buf));
+	snprintf(spath, sizeof(spath), "%s/off", path);
+	TEST_CHECK(dial_lanes(spath) == -1);
+	test_svr_stop(pid, path);
+	conf = russ_conf_free(conf);
+
+	return TEST_DONE();
+}
@@ -0,0 +1,131 @@
+/*
+* tests/svcindex-test.c
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+/*
+* Frozen service tree: russ_svcindex_find() matches as
+* russ_svcnode_find() (node and mpath) for wildcard nodes, virtual
+* nodes, and nodes hidden behind a wildcard sibling (in strcmp()
+* order), also after the tree is changed and the index rebuilt.
+*/
+
+#include "test.h"
+
+char	*paths[] = {
+	"", "/", "//", "/a", "/a/", "/a?o", "/a?o/k", "/a/k", "/a/k/deep",
+	"/a/w", "/a/x", "/a/y", "/a/zz", "/a/b", "/aa", "/b", "/b/q",
+	"/c", "/c/any/thing", "/c?o/x", "/d", "/e", "/e/f", "/m", "/m/p",
+	"/m/p/q", "/m/z", "/n", "/n/p", "/v", "/v/x", "/z", "/zz/a",
+	NULL,
+};
+
+/**
+* Compare index and tree lookups for all paths.
+*
+* @param root		root service node
+* @param index		service index of root
+* @return		1 if all lookups match; 0 otherwise
+*/
+int
+same_all(struct russ_svcnode *root, struct russ_svcindex *index) {
+	struct russ_svcnode	*node = NULL, *inode = NULL;
+	char			mpath[256], impath[256];
+	int			i, ok = 1;
+
+	for (i = 0; paths[i] != NULL; i++) {
+		node = russ_svcnode_find(root, paths[i], mpath, sizeof(mpath));
+		inode = russ_svcindex_find(index, paths[i], impath, sizeof(impath));
+		if ((node != inode) || (strcmp(mpath, impath) != 0)) {
+			fprintf(stderr, "mismatch: path (%s) node (%s) mpath (%s) index node (%s) mpath (%s)\n",
+				paths[i], node ? node->name : "-", mpath, inode ? inode->name : "-", impath);
+			ok = 0;
+		}
+	}
+	return ok;
+}
+
+int
+main(int argc, char **argv) {
+	struct russ_svcnode	*root = NULL, *a = NULL, *m = NULL, *n = NULL, *e = NULL;
+	struct russ_svcindex	*index = NULL;
+	struct russ_conf	*conf = NULL;
+	struct russ_svr		*svr = NULL;
+	char			mpath[256];
+
+	/*
+	* root: a/{k, w (wildcard), x, y}, b, c (virtual), m (wildcard)/p,
+	* n/p, v (virtual); x, y, n, and v are hidden by wildcards
+	*/
+	root = russ_svcnode_new("", NULL);
+	a = russ_svcnode_add(root, "a", NULL);
+	russ_svcnode_add(a, "k", NULL);
+	russ_svcnode_set_wildcard(russ_svcnode_add(a, "w", NULL), 1);
+	russ_svcnode_add(a, "x", NULL);
+	russ_svcnode_add(a, "y", NULL);
+	russ_svcnode_add(root, "b", NULL);
+	russ_svcnode_set_virtual(russ_svcnode_add(root, "c", NULL), 1);
+	m = russ_svcnode_add(root, "m", NULL);
+	russ_svcnode_set_wildcard(m, 1);
+	russ_svcnode_add(m, "p", NULL);
+	n = russ_svcnode_add(root, "n", NULL);
+	russ_svcnode_add(n, "p", NULL);
+	russ_svcnode_set_virtual(russ_svcnode_add(root, "v", NULL), 1);
+
+	index = russ_svcnode_freeze(root);
+	TEST_CHECK(index != NULL);
+	TEST_CHECK(same_all(root, index));
+	TEST_CHECK(russ_svcindex_find(index, "/m/p?o", mpath, sizeof(mpath)) != NULL);
+	TEST_CHECK(strcmp(mpath, "/m/p?o") == 0);
+	TEST_CHECK(russ_svcindex_find(index, "/aa", mpath, sizeof(mpath)) == NULL);
+	TEST_CHECK(strcmp(mpath, "") == 0);
+
+	/* change tree (unhide n, add e), rebuild index */
+	russ_svcnode_set_wildcard(m, 0);
+	e = russ_svcnode_add(root, "e", NULL);
+	russ_svcnode_add(e, "f", NULL);
+	index = russ_svcindex_free(index);
+	index = russ_svcnode_freeze(root);
+	TEST_CHECK(same_all(root, index));
+	TEST_CHECK(russ_svcindex_find(index, "/n/p", NULL, 0) == n->children);
+	index = russ_svcindex_free(index);
+
+	/* virtual root */
+	russ_svcnode_set_virtual(root, 1);
+	index = russ_svcnode_freeze(root);
+	TEST_CHECK(same_all(root, index));
+	TEST_CHECK(russ_svcindex_find(index, "/a/x", NULL, 0) == root);
+	index = russ_svcindex_free(index);
+	russ_svcnode_set_virtual(root, 0);
+
+	/* server: index built by the loop is invalidated by a new root */
+	conf = russ_conf_new();
+	svr = russ_init(conf);
+	russ_svr_set_root(svr, root);
+	svr->svcindex = russ_svcnode_freeze(svr->root);
+	TEST_CHECK(same_all(svr->root, svr->svcindex));
+	russ_svr_set_root(svr, root);
+	TEST_CHECK(svr->svcindex == NULL);
+	conf = russ_conf_free(conf);
+
+	return TEST_DONE();
+}
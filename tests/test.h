@@ -0,0 +1,119 @@
+/*
+* tests/test.h
+*/
+
+/*
+# license--start
+#
+# Copyright 2012 John Marshall
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# license--end
+*/
+
+#ifndef RUSS_TEST_H
+#define RUSS_TEST_H
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <russ/russ.h>
+
+static int	test_nfailed = 0;
+static int	test_nchecks = 0;
+
+/**
+* Check a condition; report (but continue) on failure.
+*/
+#define TEST_CHECK(cond) \
+	do { \
+		test_nchecks++; \
+		if (!(cond)) { \
+			test_nfailed++; \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		} \
+	} while (0)
+
+/**
+* Report results and return exit status for main().
+*/
+#define TEST_DONE() \
+	(fprintf(stderr, "%s: %d checks, %d failed\n", __FILE__, test_nchecks, test_nfailed), \
+	(test_nfailed == 0) ? 0 : 1)
+
+/**
+* Set up a socket path unique to the test process.
+*
+* @param buf		output buffer
+* @param bufsize	size of buf
+* @param name		name
+* @return		buf
+*/
+static inline char *
+test_sockpath(char *buf, int bufsize, const char *name) {
+	snprintf(buf, bufsize, "/tmp/russ-test-%d-%s", (int)getpid(), name);
+	return buf;
+}
+
+/**
+* Announce server at path and serve it from a child process.
+*
+* @param svr		server object (type, handlers set)
+* @param path		socket path
+* @return		child pid; -1 on failure
+*/
+static inline pid_t
+test_svr_start(struct russ_svr *svr, char *path) {
+	pid_t	pid;
+	int	lisd;
+
+	unlink(path);
+	if ((lisd = russ_announce(path, 0600, getuid(), getgid())) < 0) {
+		return -1;
+	}
+	if ((pid = fork()) == 0) {
+		setpgid(0, 0);
+		signal(SIGPIPE, SIG_IGN);
+		russ_svr_set_lisd(svr, lisd);
+		russ_svr_loop(svr);
+		exit(0);
+	}
+	close(lisd);
+	return pid;
+}
+
+/**
+* Stop server started by test_svr_start().
+*
+* @param pid		child pid
+* @param path		socket path
+*/
+static inline void
+test_svr_stop(pid_t pid, char *path) {
+	int	wst;
+
+	if (pid > 0) {
+		kill(-pid, SIGTERM);
+		kill(pid, SIGTERM);
+		waitpid(pid, &wst, 0);
+	}
+	unlink(path);
+}
+
+#endif /* RUSS_TEST_H */
@@ -37,6 +37,8 @@
 
 #define BUFSIZE		(1<<15)
 #define BUFSIZE_MAX	(1<<20)
+#define BATCH_CONCURRENCY	64
+#define BATCH_LINE_MAX		(1<<16)
 
 int
 print_dir_list(char *spath) {
@@ -87,11 +89,130 @@ stats_callback(struct russ_relaystream *self, int dir, void *cbarg) {
 		self->nreads, self->nwrites, self->nrbytes, self->nwbytes);
 }
 
+struct batch_line {
+	int	lineno;
+	char	*line;
+	char	*argv[RUSS_REQ_ARGS_MAX];
+};
+
+void
+batch_callback(struct russ_dialreq *req, void *cbarg) {
+	struct batch_line	*bline = req->data;
+	int			*exitst = cbarg;
+
+	if (req->wrv == RUSS_WAIT_OK) {
+		printf("### %d %s %s exit=%d\n", bline->lineno, req->op, req->spath, req->exitst);
+		if (req->exitst != 0) {
+			*exitst = RUSS__MAX(*exitst, 1);
+		}
+	} else {
+		printf("### %d %s %s exit=none (wait=%d)\n", bline->lineno, req->op, req->spath, req->wrv);
+		*exitst = RUSS_EXIT_CALLFAILURE;
+	}
+	fwrite(req->rbufs[1]->data, 1, req->rbufs[1]->len, stdout);
+	fflush(stdout);
+	russ_writen(STDERR_FILENO, req->rbufs[2]->data, req->rbufs[2]->len);
+
+	/* done with buffers */
+	req->rbufs[1] = russ_buf_free(req->rbufs[1]);
+	req->rbufs[2] = russ_buf_free(req->rbufs[2]);
+}
+
+/**
+* Dial requests listed in a file (one "<op> <spath> [<arg> ...]"
+* per line) concurrently. Output of each request is written, in
+* full, when it completes.
+*/
+int
+batch_dial(char *path, russ_deadline deadline, char **attrv, int bufsize, int concurrency) {
+	FILE			*f = NULL;
+	struct russ_dialreq	*reqs = NULL;
+	struct batch_line	*blines = NULL;
+	struct russ_dialreq	*req = NULL;
+	struct batch_line	*bline = NULL;
+	char			buf[BATCH_LINE_MAX];
+	char			*p = NULL, *saveptr = NULL;
+	int			nreqs, cap, lineno, argc, exitst, i;
+
+	if ((f = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r")) == NULL) {
+		fprintf(stderr, "error: cannot open batch file\n");
+		return 1;
+	}
+
+	nreqs = 0;
+	cap = 0;
+	for (lineno = 1; fgets(buf, sizeof(buf), f) != NULL; lineno++) {
+		if (nreqs == cap) {
+			cap = (cap == 0) ? 256 : cap*2;
+			if (((reqs = realloc(reqs, sizeof(struct russ_dialreq)*cap)) == NULL)
+				|| ((blines = realloc(blines, sizeof(struct batch_line)*cap)) == NULL)) {
+				fprintf(stderr, "error: cannot allocate memory\n");
+				exit(1);
+			}
+		}
+		bline = &blines[nreqs];
+		if ((bline->line = strdup(buf)) == NULL) {
+			fprintf(stderr, "error: cannot allocate memory\n");
+			exit(1);
+		}
+		argc = 0;
+		for (p = strtok_r(bline->line, " \t\r\n", &saveptr); (p != NULL) && (argc < RUSS_REQ_ARGS_MAX-1);
+			p = strtok_r(NULL, " \t\r\n", &saveptr)) {
+			bline->argv[argc++] = p;
+		}
+		bline->argv[argc] = NULL;
+		if ((argc == 0) || (bline->argv[0][0] == '#')) {
+			free(bline->line);
+			continue;
+		} else if (argc < 2) {
+			fprintf(stderr, "error: bad batch line (%d)\n", lineno);
+			exit(1);
+		}
+		bline->lineno = lineno;
+
+		req = &reqs[nreqs];
+		req->attrv = attrv;
+		req->rbufs[0] = NULL;
+		req->timeout = 0;
+		req->outcb = NULL;
+		if (((req->rbufs[1] = russ_buf_new(bufsize)) == NULL)
+			|| ((req->rbufs[2] = russ_buf_new(bufsize)) == NULL)) {
+			fprintf(stderr, "error: cannot allocate memory\n");
+			exit(1);
+		}
+		nreqs++;
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+	/* set after growth is done */
+	for (i = 0; i < nreqs; i++) {
+		reqs[i].op = blines[i].argv[0];
+		reqs[i].spath = blines[i].argv[1];
+		reqs[i].argv = &blines[i].argv[2];
+		reqs[i].data = &blines[i];
+	}
+
+	exitst = 0;
+	if (russ_dialv_many(deadline, reqs, nreqs, concurrency, batch_callback, &exitst) < 0) {
+		fprintf(stderr, "error: cannot dial batch\n");
+		exitst = RUSS_EXIT_CALLFAILURE;
+	}
+
+	for (i = 0; i < nreqs; i++) {
+		free(blines[i].line);
+	}
+	free(reqs);
+	free(blines);
+	return exitst;
+}
+
 void
 print_usage(char *prog_name) {
 	if (strcmp(prog_name, "rudial") == 0) {
 		printf(
 "usage: rudial [<option>] <op> <spath> [<arg> ...]\n"
+"       rudial [<option>] --batch <path>\n"
 "\n"
 "Dial service at <spath> to perform <op>. A service may support one\n"
 "or more operations (e.g., execute, help, info, list).\n"
@@ -102,6 +223,14 @@ print_usage(char *prog_name) {
 "\n"
 "An exit value of < 0 indicates a failure to connect. Otherwise a 0\n"
 "exit value is returned.\n"
+"\n"
+"With --batch, requests are read from <path> (- for stdin), one\n"
+"\"<op> <spath> [<arg> ...]\" per line, and dialed concurrently\n"
+"(see --concurrency). As each completes, a \"### <lineno> <op>\n"
+"<spath> exit=<status>\" line and its stdout are written to stdout,\n"
+"and its stderr to stderr. Output is captured up to <bufsize>\n"
+"(-b) bytes per stream. The exit value is 0 if all requests exit\n"
+"with 0.\n"
 );
 	} else if (strcmp(prog_name, "ruexec") == 0) {
 		printf( 
@@ -142,6 +271,14 @@ print_usage(char *prog_name) {
 "    Pass an attribute to the service.\n"
 "-b <bufsize>\n" \
 "    Set buffer size for reading/writing.\n"
+"--handoff\n"
+"    Hand off own stdin, stdout, and stderr to the service so that\n"
+"    I/O does not go through rudial; falls back to forwarding if\n"
+"    the service does not support it. Not with --stats.\n"
+"--batch <path>\n"
+"    Dial requests listed in file (rudial only).\n"
+"--concurrency <n>\n"
+"    Maximum number of batch requests in progress (default 64).\n"
 "-i <path>\n" \
 "    Read from file instead of stdin.\n"
 "--stats\n"
@@ -163,13 +300,17 @@ main(int argc, char **argv) {
 	char			*op = NULL, *spath = NULL, *arg = NULL;
 	char			*attrv[RUSS_REQ_ATTRS_MAX];
 	char			*ipath = NULL;
+	char			*bpath = NULL;
+	int			concurrency;
 	int			debug;
+	int			handoff;
 	int			timeout;
 	int			argi, attrc;
 	int			ifd;
 	int			bufsize, exitst;
 	int			show_stats;
 	int			cbfd;
+	int			hfds[RUSS_CONN_STD_NFDS];
 
 	signal(SIGPIPE, SIG_IGN);
 
@@ -178,6 +319,7 @@ main(int argc, char **argv) {
 	/* initialize */
 	bufsize = BUFSIZE;
 	debug = 0;
+	handoff = 0;
 	show_stats = 0;
 	cbfd = -1;
 	deadline = RUSS_DEADLINE_NEVER;
@@ -186,6 +328,8 @@ main(int argc, char **argv) {
 	attrv[0] = NULL;
 	ipath = NULL;
 	ifd = -1;
+	bpath = NULL;
+	concurrency = BATCH_CONCURRENCY;
 
 	/* options */
 	while (argi < argc) {
@@ -218,8 +362,19 @@ main(int argc, char **argv) {
 				fprintf(stderr, "error: bad buffer size value\n");
 				exit(1);
 			}
+		} else if ((strcmp(arg, "--batch") == 0) && (argi < argc)) {
+			bpath = argv[argi++];
+		} else if ((strcmp(arg, "--concurrency") == 0) && (argi < argc)) {
+			arg = argv[argi++];
+			if ((sscanf(arg, "%d", &concurrency) != 1)
+				|| (concurrency < 1)) {
+				fprintf(stderr, "error: bad concurrency value\n");
+				exit(1);
+			}
 		} else if (strcmp(arg, "--debug") == 0) {
 			debug = 1;
+		} else if (strcmp(arg, "--handoff") == 0) {
+			handoff = 1;
 		} else if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0)) {
 			print_usage(prog_name);
 			exit(0);
@@ -255,6 +410,14 @@ main(int argc, char **argv) {
 	/* load debug variables */
 	russ_debug_init();
 
+	if (bpath != NULL) {
+		if ((strcmp(prog_name, "rudial") != 0) || (argi != argc)) {
+			fprintf(stderr, "%s\n", RUSS_MSG_BADARGS);
+			exit(1);
+		}
+		exit(batch_dial(bpath, deadline, attrv, bufsize, concurrency));
+	}
+
 	/* [op], spath and args */
 	if (argi == argc) {
 		fprintf(stderr, "%s\n", RUSS_MSG_BADARGS);
@@ -289,6 +452,11 @@ main(int argc, char **argv) {
 	}
 
 	exitst = 0;
+	if ((handoff) && (show_stats)) {
+		fprintf(stderr, "error: --handoff cannot be used with --stats\n");
+		exit(1);
+	}
+
 	if ((strcmp(op, "list") == 0) && (stat(spath, &st) == 0)
 		&& (!S_ISSOCK(st.st_mode)) && (!russ_is_conffile(spath))) {
 		if (S_ISDIR(st.st_mode)) {
@@ -298,15 +466,29 @@ main(int argc, char **argv) {
 			exitst = 1;
 		}
 	} else {
-		cconn = russ_dialv(deadline, op, spath, attrv, &(argv[argi]));
+		if (handoff) {
+			hfds[0] = (ifd < 0) ? STDIN_FILENO : ifd;
+			hfds[1] = STDOUT_FILENO;
+			hfds[2] = STDERR_FILENO;
+			cconn = russ_dialv_handoff(deadline, op, spath, attrv, &(argv[argi]), RUSS_CONN_STD_NFDS, hfds);
+		} else {
+			cconn = russ_dialv(deadline, op, spath, attrv, &(argv[argi]));
+		}
 		if (cconn == NULL) {
 			fprintf(stderr, "%s\n", RUSS_MSG_NODIAL);
 			exit(RUSS_EXIT_CALLFAILURE);
 		}
 
-		{
+		if ((cconn->fds[0] < 0) && (cconn->fds[1] < 0) && (cconn->fds[2] < 0)) {
+			/* fds handed off; service does the I/O */
+			if (russ_cconn_wait(cconn, RUSS_DEADLINE_NEVER, &exitst) < 0) {
+				fprintf(stderr, "%s\n", RUSS_MSG_BADCONNEVENT);
+				exitst = RUSS_EXIT_SYSFAILURE;
+			}
+		} else {
 			struct russ_relay		*relay;
 			russ_relaystream_callback	cb = NULL;
+			int				i;
 
 			if ((strcmp(op, "execute") == 0) && (show_stats)) {
 				cb = stats_callback;
@@ -321,6 +503,15 @@ main(int argc, char **argv) {
 			russ_relay_addwithcallback(relay, ifd, cconn->fds[0], bufsize, 1, cb, (void *)((intptr_t)cbfd<<16|0));
 			russ_relay_addwithcallback(relay, cconn->fds[1], STDOUT_FILENO, bufsize, 0, cb, (void *)((intptr_t)cbfd<<16|1));
 			russ_relay_addwithcallback(relay, cconn->fds[2], STDERR_FILENO, bufsize, 0, cb, (void *)((intptr_t)cbfd<<16|2));
+			for (i = 0; i < 3; i++) {
+				/* overlap reads and writes; grow busy buffers up to BUFSIZE_MAX */
+				russ_relay_set_ring(relay, i, 0);
+				russ_relay_set_bufsizes(relay, i, bufsize, BUFSIZE_MAX);
+				if (cb == NULL) {
+					/* bypass the buffers (splice) where the fds allow */
+					russ_relay_set_zerocopy(relay, i, 1);
+				}
+			}
 
 			cconn->fds[0] = -1;
 			cconn->fds[1] = -1;
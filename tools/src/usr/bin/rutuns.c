@@ -36,6 +36,10 @@
 #define BUFSIZE		(1<<15)
 #define BUFSIZE_MAX	(1<<20)
 
+/* coalesce small writes back over the tunnel */
+#define COALESCE_MINBATCH	(1<<12)
+#define COALESCE_MAXHOLD	1000
+
 void
 print_usage(char *prog_name) {
 	printf(
@@ -112,11 +116,22 @@ main(int argc, char **argv) {
 	{
 		struct russ_relay		*relay = NULL;
 		russ_relaystream_callback	cb = NULL;
+		int				i;
 
 		relay = russ_relay_new(3);
 		russ_relay_addwithcallback(relay, STDIN_FILENO, cconn->fds[0], bufsize, 1, cb, (void *)((intptr_t)cbfd<<16|0));
 		russ_relay_addwithcallback(relay, cconn->fds[1], STDOUT_FILENO, bufsize, 0, cb, (void *)((intptr_t)cbfd<<16|1));
 		russ_relay_addwithcallback(relay, cconn->fds[2], STDERR_FILENO, bufsize, 0, cb, (void *)((intptr_t)cbfd<<16|2));
+		for (i = 0; i < 3; i++) {
+			/* overlap reads and writes; grow busy buffers up to BUFSIZE_MAX */
+			russ_relay_set_ring(relay, i, 0);
+			russ_relay_set_bufsizes(relay, i, bufsize, BUFSIZE_MAX);
+			/* equal shares so bulk output does not delay stderr */
+			russ_relay_set_weight(relay, i, 1);
+		}
+		/* stdout, stderr */
+		russ_relay_set_coalesce(relay, 1, COALESCE_MINBATCH, COALESCE_MAXHOLD);
+		russ_relay_set_coalesce(relay, 2, COALESCE_MINBATCH, COALESCE_MAXHOLD);
 
 		cconn->fds[0] = -1;
 		cconn->fds[1] = -1;